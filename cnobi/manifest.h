@@ -1,11 +1,15 @@
 #ifndef CNOBI_MANIFEST_H
 #define CNOBI_MANIFEST_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-enum Token {LIT, VAR}; //RAW and SPECIAL
+/* RAW and SPECIAL. A CANON token is a whole path, already evaluated and
+ * canonicalized, with no slashes to restore; the loader uses it as is. */
+enum Token {LIT, VAR, CANON};
 
 struct EvalString_{
   const char* first;
@@ -44,9 +48,18 @@ struct EdgeInfo{
 struct StateInfo{
   const struct Binding* bindings;
   const struct EdgeInfo* edges;
-  const struct StateInfo* include;
-  const struct StateInfo* subninja;
+  /* Compiled manifests (.c files) loaded into this manifest's scope, and
+   * ones loaded into a scope of their own, like ninja's include and
+   * subninja. Paths are evaluated in this scope. NULL-terminated. */
+  const struct EvalString_* const* include;
+  const struct EvalString_* const* subninja;
   const struct EvalString_* const* defaults;
+  /* Edge arrays defined in other translation units (shards), in order.
+   * Loaded after |edges|. NULL-terminated. */
+  const struct EdgeInfo* const* edge_shards;
+  /* Rules declared in this scope, registered before any edge is loaded so
+   * that subninjas can use them by name. NULL-terminated. */
+  const struct RuleInfo* const* rules;
 };
 
 #define LIT(X) {X, LIT},
@@ -65,11 +78,24 @@ struct StateInfo{
 #define EDGES .edges = (const struct EdgeInfo[]){
 #define PATHS (const struct EvalString_* const[]){
 
+/* A pre-evaluated, canonical path, for use in PATHS. */
+#define P(X) EVAL {X, CANON}, END
+
 #define BL(X, Y) {#X, EVAL LIT(Y) END},
 #define BV(X, Y) {#X, EVAL VAR(Y) END},
 
 #define MANIFEST const struct StateInfo manifest
 
+#define SHARD(X) const struct EdgeInfo X[] = {
+#define END_SHARD {0}};
+#define EXTERN_SHARD(X) extern const struct EdgeInfo X[];
+#define EXTERN_RULE(X) extern const struct RuleInfo X;
+#define EXTERN_POOL(X) extern const struct PoolInfo X;
+#define SHARDS .edge_shards = (const struct EdgeInfo* const[]){
+#define RULES .rules = (const struct RuleInfo* const[]){
+#define INCLUDES .include = PATHS
+#define SUBNINJAS .subninja = PATHS
+
 #define RULE(X) const struct RuleInfo X = { \
 .name = #X,
 
@@ -80,9 +106,118 @@ struct StateInfo{
 
 #define END_POOL };
 
-const struct PoolInfo DEFAULT_POOL = {"", 0};
-const struct PoolInfo CONSOLE_POOL = {"console", 1};
-const struct RuleInfo PHONY_RULE = {"phony"};
+/* A rule declared by an enclosing manifest, looked up by name when loaded.
+ * PHONY_RULE is one of these. */
+#define RULE_REF(X, NAME) static const struct RuleInfo X = {NAME};
+
+/* Like RULE and POOL, for names that are not valid C identifiers. */
+#define NAMED_RULE(X, NAME) const struct RuleInfo X = { \
+.name = NAME,
+#define NAMED_POOL(X, NAME) const struct PoolInfo X = { \
+.name = NAME,
+
+/* static, since every shard of a manifest includes this header. */
+static const struct PoolInfo DEFAULT_POOL = {"", 0};
+static const struct PoolInfo CONSOLE_POOL = {"console", 1};
+static const struct RuleInfo PHONY_RULE = {"phony"};
+
+/* Version 2 layout.
+ *
+ * The structures above are built from pointers, each of which needs a
+ * relocation when the shared object is loaded.  A version 2 manifest holds
+ * no pointers: it is made of flat arrays that refer to each other by index,
+ * and a blob of NUL-terminated strings referred to by byte offset, so that
+ * loading it costs only page faults and its pages stay shared between
+ * processes.
+ *
+ * Each translation unit defines its arrays as <unit>_header, _strings,
+ * _tokens, _bindings, _paths and _edges; the unit of the root source is
+ * "cnobi", which also defines cnobi_pools, cnobi_rules and cnobi_nodes.
+ * Edges of every unit refer to those by index.  No array is empty: unused
+ * ones hold a single zero element.
+ *
+ * The root may also define the output index, uint32_t cnobi_producers[],
+ * giving for each node the edge that writes it, or CNOBI_NONE.  Edges are
+ * numbered across units: those of the root, then those of each shard in
+ * order.  It may only be defined if every path of every edge is a node.
+ * With it, a build of some targets loads only the edges they need.
+ *
+ * Any unit may define uint64_t <unit>_command_hashes[], giving for each of
+ * its edges the hash ninja keeps in .ninja_log for the edge's command and
+ * rspfile content once evaluated, or 0 if not known.  Checking an
+ * edge against the log then needs no evaluation of its command. */
+
+#define CNOBI_ABI_VERSION 2
+/* No pool, i.e. the rule's, in CNobiEdge.pool and CNobiRule.pool. */
+#define CNOBI_NONE 0xffffffffu
+/* As the count of a path, makes it the node its begin indexes. */
+#define CNOBI_NODE 0xffffffffu
+
+struct CNobiRange{
+  uint32_t begin;
+  uint32_t count;
+};
+
+/* One LIT, VAR or CANON token; an evaluated string is a range of these. */
+struct CNobiToken{
+  uint32_t str;
+  uint32_t kind;
+};
+
+struct CNobiBinding{
+  uint32_t key;
+  struct CNobiRange value;  /* tokens */
+};
+
+struct CNobiPool{
+  uint32_t name;
+  int32_t depth;
+};
+
+/* Every path that edges name, each once, canonical and with its slash_bits,
+ * so that the loader creates their nodes in one pass and wires edges up by
+ * index. */
+struct CNobiNode{
+  uint32_t path;
+  uint32_t slash_bits;
+};
+
+/* A rule without bindings names a rule of an enclosing scope, as RULE_REF
+ * does. */
+struct CNobiRule{
+  uint32_t name;
+  uint32_t pool;
+  struct CNobiRange bindings;
+};
+
+/* The paths of an edge are consecutive in _paths, each a node or a range of
+ * tokens: inputs, implicit inputs, order-only inputs, outputs, implicit
+ * outputs and validations, with the counts below. */
+struct CNobiEdge{
+  uint32_t rule;
+  uint32_t pool;
+  uint32_t paths;
+  uint32_t in;
+  uint32_t implicit_deps;
+  uint32_t order_only_deps;
+  uint32_t out;
+  uint32_t implicit_outs;
+  uint32_t validations;
+  struct CNobiRange bindings;
+};
+
+struct CNobiHeader{
+  uint32_t version;
+  uint32_t num_edges;
+  uint32_t num_pools;
+  uint32_t num_rules;
+  struct CNobiRange bindings;   /* scope bindings */
+  struct CNobiRange includes;   /* paths, as in StateInfo */
+  struct CNobiRange subninjas;  /* paths */
+  struct CNobiRange defaults;   /* paths */
+  struct CNobiRange shards;     /* tokens: names of units holding more edges */
+  uint32_t num_nodes;           /* only read where cnobi_nodes is defined */
+};
 
 #ifdef __cplusplus
 }
@@ -1,17 +1,168 @@
 #!/usr/bin/env python3
+CNOBI_NONE = 0xffffffff
+CNOBI_NODE = 0xffffffff
+LIT, VAR, CANON = 0, 1, 2
+
+
+class TableWriter:
+    """Builds the arrays of one translation unit of a version 2 manifest,
+    which refer to each other by index and to strings by offset into one
+    blob, so that the compiled object needs no relocations.
+    """
+    
+    def __init__(self, unit, root=None):
+        self.unit = unit
+        self.root = root or self  # the unit holding the node table
+        self.offsets = {}   # string -> offset in the blob
+        self.blob = []      # strings, in offset order
+        self.size = 0
+        self.tokens = []    # (string, kind)
+        self.nodes = []     # (string, slash_bits), in the root only
+        self.node_index = {}  # path -> index in nodes
+        self.producers = []   # edge writing each node, in the root only
+        self.num_edges = 0    # edges of every unit so far, in the root only
+        self.indexed = True   # whether every path of every edge is a node
+        self.bindings = []  # (key, first token, token count)
+        self.paths = []     # (first token, token count)
+        self.edges = []     # tuples laid out as struct CNobiEdge
+    
+    def string(self, s):
+        """Return the offset of s in the blob, adding it if new."""
+        offset = self.offsets.get(s)
+        if offset is None:
+            offset = self.offsets[s] = self.size
+            self.blob.append(s)
+            self.size += len(s.encode('utf-8')) + 1
+        return offset
+    
+    def token_range(self, tokens):
+        """Append (kind, value) tokens and return their range."""
+        begin = len(self.tokens)
+        for kind, value in tokens:
+            self.tokens.append((self.string(value), kind))
+        return (begin, len(tokens))
+    
+    def binding_range(self, tokens_by_key):
+        """Append bindings, given as (key, tokens) pairs, and return their
+        range."""
+        begin = len(self.bindings)
+        for key, tokens in tokens_by_key:
+            self.bindings.append((self.string(key),) + self.token_range(tokens))
+        return (begin, len(self.bindings) - begin)
+    
+    def node(self, path):
+        """Return the index of path in the root's node table, adding it if
+        new."""
+        root = self.root
+        index = root.node_index.get(path)
+        if index is None:
+            index = root.node_index[path] = len(root.nodes)
+            root.nodes.append((root.string(path), 0))
+            root.producers.append('CNOBI_NONE')
+        return index
+    
+    def add_edge(self, row, paths, outputs):
+        """Append an edge, laid out as struct CNobiEdge, whose paths are the
+        range paths, and record it as the producer of the range outputs."""
+        root = self.root
+        begin, count = paths
+        if any(kind != CNOBI_NODE
+               for _, kind in self.paths[begin:begin + count]):
+            root.indexed = False
+        begin, count = outputs
+        for node, kind in self.paths[begin:begin + count]:
+            if kind == CNOBI_NODE:
+                root.producers[node] = root.num_edges
+        root.num_edges += 1
+        self.edges.append(row)
+    
+    def path_range(self, paths, nodes=False):
+        """Append paths, given as token lists, and return their range.
+        With nodes, paths that are a single CANON token refer to the node
+        table instead, which creates each node once.
+        """
+        begin = len(self.paths)
+        for tokens in paths:
+            if nodes and len(tokens) == 1 and tokens[0][0] == CANON:
+                self.paths.append((self.node(tokens[0][1]), CNOBI_NODE))
+            else:
+                self.paths.append(self.token_range(tokens))
+        return (begin, len(paths))
+    
+    @staticmethod
+    def _c_string(s):
+        """Escape s as a C string literal, with octal escapes that cannot
+        run into the next character or form trigraphs."""
+        out = []
+        for c in s.encode('utf-8'):
+            if c in b'"\\?':
+                out.append('\\' + chr(c))
+            elif c < 0x20 or c >= 0x7f:
+                out.append('\\%03o' % c)
+            else:
+                out.append(chr(c))
+        return '"' + ''.join(out) + '"'
+    
+    @staticmethod
+    def _array(c_type, name, rows):
+        """A C array of initializers, with one zero element if empty."""
+        lines = [f"const struct {c_type} {name}[] = {{"]
+        for row in rows or [(0,)]:
+            lines.append("  {" + ", ".join(
+                "{%d, %d}" % field if isinstance(field, tuple) else str(field)
+                for field in row) + "},")
+        lines.append("};")
+        return "\n".join(lines)
+    
+    def generate(self, header, pools=None, rules=None):
+        """Return the C definitions of this unit.  header lists the fields
+        of struct CNobiHeader after the version."""
+        unit = self.unit
+        parts = ["const struct CNobiHeader %s_header = {%s};" % (
+            unit, ", ".join(["CNOBI_ABI_VERSION"] + [
+                "{%d, %d}" % field if isinstance(field, tuple) else str(field)
+                for field in header]))]
+        blob = "\n".join("  " + self._c_string(s + "\0") for s in self.blob)
+        parts.append(f"const char {unit}_strings[] =\n" +
+                     (blob or '  ""') + ";")
+        parts.append(self._array("CNobiToken", f"{unit}_tokens", self.tokens))
+        parts.append(self._array("CNobiBinding", f"{unit}_bindings",
+                                 [(k, (b, c)) for k, b, c in self.bindings]))
+        parts.append(self._array("CNobiRange", f"{unit}_paths", self.paths))
+        parts.append(self._array("CNobiEdge", f"{unit}_edges", self.edges))
+        if pools is not None:
+            parts.append(self._array("CNobiPool", f"{unit}_pools", pools))
+        if rules is not None:
+            parts.append(self._array("CNobiRule", f"{unit}_rules", rules))
+            parts.append(self._array("CNobiNode", f"{unit}_nodes", self.nodes))
+            if self.indexed:
+                parts.append(f"const uint32_t {unit}_producers[] = {{\n" +
+                             "".join(f"  {p},\n"
+                                     for p in self.producers or [0]) + "};")
+        return "\n\n".join(parts) + "\n"
+
+
 class Manifest:
     """Stores the parsed contents of a build.ninja file."""
     
-    def __init__(self):
+    def __init__(self, parent=None):
         self.pools = {}    # name -> {'depth': N}
         self.rules = {}    # name -> {bindings}
         self.bindings = {} # name -> value
         self.edges = []    # list of build edges
         self.defaults = [] # list of default targets
+        self.subninjas = [] # list of (C file path, Manifest)
         self.last_line = None  # Store the last valid line
+        self.parent = parent  # Manifest of the enclosing scope, for subninjas
+        self.build_dir = parent.build_dir if parent else None
         
     def parse_file(self, filepath):
         """Parse a .ninja file and populate the manifest."""
+        import os.path
+        if self.build_dir is None:
+            # Paths in include and subninja are relative to the directory
+            # ninja runs in, which holds the top-level manifest.
+            self.build_dir = os.path.dirname(filepath)
         with open(filepath, 'r', encoding='utf-8') as f:
             self._parse_contents(f, filepath)
     
@@ -77,7 +228,7 @@ class Manifest:
             elif line.startswith('include '):
                 self._handle_include(line[8:].strip(), filepath)
             elif line.startswith('subninja '):
-                raise ValueError("subninja is not supported")
+                self._handle_subninja(line[9:].strip())
             elif '=' in line:  # Only parse as binding if it contains =
                 self._parse_binding(line, self.bindings)
             else:
@@ -213,7 +364,7 @@ class Manifest:
                 self.last_line = line  # Store the line for next read
                 break
             line = line.strip()
-            if line.startswith('pool = '):
+            if line.split('=', 1)[0].strip() == 'pool':
                 edge['pool'] = line.split('=', 1)[1].strip()
             else:
                 self._parse_binding(line, edge['bindings'])
@@ -229,13 +380,43 @@ class Manifest:
             bindings_dict[name] = value
     
     def _handle_include(self, include_path, current_file):
-        """Handle include or subninja statement."""
+        """Handle include statement: parse the file into this scope."""
         import os.path
-        base_dir = os.path.dirname(current_file)
-        full_path = os.path.join(base_dir, include_path)
+        full_path = os.path.join(self.build_dir, self._evaluate(include_path))
         self.parse_file(full_path)
         return 1
     
+    def _handle_subninja(self, subninja_path):
+        """Handle subninja statement: parse the file into a child scope,
+        which is written to a C file of its own, next to the .ninja file.
+        """
+        import os.path
+        path = self._evaluate(subninja_path)
+        child = Manifest(parent=self)
+        child.parse_file(os.path.join(self.build_dir, path))
+        self.subninjas.append((os.path.splitext(path)[0] + '_ninja.c', child))
+    
+    def _lookup_binding(self, name):
+        """Look a variable up in this scope, then the enclosing ones."""
+        if name in self.bindings:
+            return self.bindings[name]
+        if self.parent:
+            return self.parent._lookup_binding(name)
+        return ''
+    
+    def _lookup_pool(self, name):
+        """Find a pool declared in this scope or an enclosing one."""
+        if name in self.pools:
+            return self.pools[name]
+        if self.parent:
+            return self.parent._lookup_pool(name)
+        return None
+    
+    def _evaluate(self, s):
+        """Expand the variables of s using the bindings parsed so far."""
+        return ''.join(value if type_ == 'L' else self._lookup_binding(value)
+                       for type_, value in self._tokenize_string(s))
+    
     def display_manifest(self):
         """Display the manifest data structure."""
         print("Pools:")
@@ -278,10 +459,11 @@ class Manifest:
         print(f"  {self.defaults}")
     
     def _is_var_char(self, c):
-        """Check if a character is valid in a variable name.
-        Variables can contain alphanumeric chars, underscore, dash, and dot.
+        """Check if a character is valid in a $simple variable reference.
+        These can contain alphanumeric chars, underscore and dash; a dot
+        ends the name, as in $out.d, but may appear in ${name.with.dots}.
         """
-        return c.isalnum() or c in '_-.'
+        return c.isalnum() or c in '_-'
     
     def _tokenize_string(self, s):
         """Break a string into literals and variables.
@@ -383,10 +565,24 @@ class Manifest:
         # Handle C/C++ keywords
         return self._escape_cpp_keyword(c_name)
     
+    def _used_pools(self):
+        """Names of the pools that edges and rules of this scope refer to."""
+        names = [edge['pool'] for edge in self.edges]
+        names += [bindings.get('pool') for bindings in self.rules.values()]
+        return [name for name in dict.fromkeys(names)
+                if name and name != 'console']
+    
     def generate_pool_declarations(self):
-        """Generate C code for pool declarations."""
+        """Generate C code for pool declarations.
+        Pools are global, so pools of enclosing scopes that this one uses are
+        declared again; ninja looks them up by name.
+        """
         lines = []
-        for name, info in self.pools.items():
+        pools = dict(self.pools)
+        for name in self._used_pools():
+            if name not in pools and self._lookup_pool(name) is not None:
+                pools[name] = self._lookup_pool(name)
+        for name, info in pools.items():
             c_name = self._to_c_identifier(name)
             lines.append(f"POOL({c_name})")
             if info['depth'] is not None:
@@ -404,18 +600,46 @@ class Manifest:
         tokens = self._tokenize_string(s)
         parts = []
         for type_, value in tokens:
-            if value.endswith('.d'):
-                base_var = value[:-2]  # Remove the .d
-                eval_str = f'VAR("{base_var}") LIT(".d")'
-                parts.append(eval_str)
+            escaped_value = self._escape_c_string(value)
+            if type_ == 'L':
+                parts.append(f'LIT("{escaped_value}")')
             else:
-                escaped_value = self._escape_c_string(value)
-                if type_ == 'L':
-                    parts.append(f'LIT("{escaped_value}")')
-                else:
-                    parts.append(f'VAR("{escaped_value}")')
+                parts.append(f'VAR("{escaped_value}")')
         return f"EVAL {' '.join(parts)} END"
     
+    def _is_canonical(self, path):
+        """Return True if ninja's CanonicalizePath would leave path as is,
+        with no slash_bits: no empty, '.' or inner '..' components, and no
+        backslashes.
+        """
+        if not path or '\\' in path:
+            return False
+        components = path.split('/')
+        if path.startswith('/'):
+            components = components[1:]
+        while len(components) > 1 and components[0] == '..':
+            components = components[1:]
+        return all(c not in ('', '.', '..') for c in components) or \
+            components == ['..']
+    
+    def _evaluate_path(self, path, edge_bindings):
+        """Expand path at generation time, if that gives what the loader
+        would: every variable it uses must come from an enclosing scope,
+        where the loader sees the same final values, and be a plain literal.
+        Returns None when the loader has to evaluate the path itself.
+        """
+        result = []
+        for type_, value in self._tokenize_string(path):
+            if type_ == 'V':
+                if value in edge_bindings:
+                    return None
+                value = self._lookup_binding(value)
+                if any(t != 'L' for t, _ in self._tokenize_string(value)):
+                    return None
+                value = ''.join(v for _, v in self._tokenize_string(value))
+            result.append(value)
+        return ''.join(result)
+    
     def _generate_binding(self, key, value, indent="    "):
         """Generate C code for a binding.
         Returns a string with the binding in either BL or full EVAL format.
@@ -445,14 +669,22 @@ class Manifest:
         lines.append("  END,")
         return "\n".join(lines)
     
-    def _generate_paths_array(self, paths):
-        """Generate a PATHS array of EvalStrings."""
+    def _generate_paths_array(self, paths, edge_bindings={}):
+        """Generate a PATHS array of EvalStrings.
+        Paths that can be expanded here and are canonical already become P()
+        paths, which the loader uses without evaluating them.
+        """
         if not paths:
             return None
         
         lines = []
         lines.append("PATHS")
         for path in paths:
+            evaluated = self._evaluate_path(path, edge_bindings)
+            if evaluated is not None and self._is_canonical(evaluated):
+                escaped = self._escape_c_string(evaluated)
+                lines.append(f'    P("{escaped}"),')
+                continue
             eval_str = self._generate_eval_string(path)
             lines.append(f"    {eval_str},")
         lines.append("END")
@@ -468,6 +700,70 @@ class Manifest:
             return f"  .defaults = {paths},"
         return ""
     
+    def _generate_edge(self, edge):
+        """Generate the C initializer lines for a single build edge."""
+        lines = []
+        lines.append("    {")
+        
+        # Rule reference
+        rule_name = edge['rule']
+        if rule_name == 'phony':
+            lines.append("      .rule = &PHONY_RULE,")
+        else:
+            c_rule_name = self._to_c_identifier(rule_name)
+            lines.append(f"      .rule = &{c_rule_name},")
+        
+        # Pool reference
+        if edge['pool'] == '':
+            lines.append("      .pool = &DEFAULT_POOL,")
+        elif edge['pool'] == 'console':
+            lines.append("      .pool = &CONSOLE_POOL,")
+        elif edge['pool']:
+            c_pool_name = self._to_c_identifier(edge['pool'])
+            lines.append(f"      .pool = &{c_pool_name},")
+        
+        # Input paths
+        if edge['inputs']:
+            paths = self._generate_paths_array(edge['inputs'],
+                                                edge['bindings'])
+            lines.append(f"      .in = {paths},")
+        
+        if edge['implicit_inputs']:
+            paths = self._generate_paths_array(edge['implicit_inputs'],
+                                                edge['bindings'])
+            lines.append(f"      .implicit_deps = {paths},")
+        
+        if edge['order_only']:
+            paths = self._generate_paths_array(edge['order_only'],
+                                                edge['bindings'])
+            lines.append(f"      .order_only_deps = {paths},")
+        
+        # Output paths
+        if edge['outputs']:
+            paths = self._generate_paths_array(edge['outputs'],
+                                                edge['bindings'])
+            lines.append(f"      .out = {paths},")
+        
+        if edge['implicit_outputs']:
+            paths = self._generate_paths_array(edge['implicit_outputs'],
+                                                edge['bindings'])
+            lines.append(f"      .implicit_outs = {paths},")
+        
+        if edge['validation_inputs']:
+            paths = self._generate_paths_array(edge['validation_inputs'],
+                                                edge['bindings'])
+            lines.append(f"      .validations = {paths},")
+        
+        # Bindings
+        if edge['bindings']:
+            lines.append("      BINDINGS")
+            for key, value in edge['bindings'].items():
+                lines.append(self._generate_binding(key, value, indent="        "))
+            lines.append("      END")
+        
+        lines.append("    },")  # Close the edge
+        return lines
+    
     def generate_edges(self):
         """Generate C code for build edges."""
         if not self.edges:
@@ -476,62 +772,108 @@ class Manifest:
         lines = []
         lines.append("  EDGES")
         for edge in self.edges:
-            lines.append("    {")
-            
-            # Rule reference
-            rule_name = edge['rule']
-            if rule_name == 'phony':
-                lines.append("      .rule = &PHONY_RULE,")
-            else:
-                c_rule_name = self._to_c_identifier(rule_name)
-                lines.append(f"      .rule = &{c_rule_name},")
-            
-            # Pool reference
-            if edge['pool'] == '':
-                lines.append("      .pool = &DEFAULT_POOL,")
-            elif edge['pool'] == 'console':
-                lines.append("      .pool = &CONSOLE_POOL,")
-            elif edge['pool']:
-                c_pool_name = self._to_c_identifier(edge['pool'])
-                lines.append(f"      .pool = &{c_pool_name},")
-            
-            # Input paths
-            if edge['inputs']:
-                paths = self._generate_paths_array(edge['inputs'])
-                lines.append(f"      .in = {paths},")
-            
-            if edge['implicit_inputs']:
-                paths = self._generate_paths_array(edge['implicit_inputs'])
-                lines.append(f"      .implicit_deps = {paths},")
-            
-            if edge['order_only']:
-                paths = self._generate_paths_array(edge['order_only'])
-                lines.append(f"      .order_only_deps = {paths},")
-            
-            # Output paths
-            if edge['outputs']:
-                paths = self._generate_paths_array(edge['outputs'])
-                lines.append(f"      .out = {paths},")
-            
-            if edge['implicit_outputs']:
-                paths = self._generate_paths_array(edge['implicit_outputs'])
-                lines.append(f"      .implicit_outs = {paths},")
-            
-            if edge['validation_inputs']:
-                paths = self._generate_paths_array(edge['validation_inputs'])
-                lines.append(f"      .validations = {paths},")
-            
-            # Bindings
-            if edge['bindings']:
-                lines.append("      BINDINGS")
-                for key, value in edge['bindings'].items():
-                    lines.append(self._generate_binding(key, value, indent="        "))
-                lines.append("      END")
-            
-            lines.append("    },")  # Close the edge
+            lines.extend(self._generate_edge(edge))
         lines.append("  END,")  # Close the edges section
         return "\n".join(lines)
     
+    def _edge_fingerprint(self, edge):
+        """Stable hash of an edge's first output, used to place shard cuts."""
+        import zlib
+        outputs = edge['outputs'] or edge['implicit_outputs']
+        return zlib.crc32(outputs[0].encode('utf-8')) if outputs else 0
+    
+    def split_edges(self, num_shards):
+        """Split the edges into roughly num_shards contiguous chunks.
+        Cuts are placed after edges whose fingerprint hits a mask rather than
+        at fixed counts, so adding or removing an edge only changes the chunk
+        containing it and the other shards keep their cached objects.
+        """
+        if num_shards <= 1 or len(self.edges) < 2:
+            return [self.edges] if self.edges else []
+        target = 1
+        while target * 2 <= len(self.edges) // num_shards:
+            target *= 2
+        min_size = max(1, target // 4)
+        max_size = target * 4
+        
+        chunks = []
+        current = []
+        for edge in self.edges:
+            current.append(edge)
+            if len(current) >= max_size or (
+                    len(current) >= min_size and
+                    self._edge_fingerprint(edge) % target == 0):
+                chunks.append(current)
+                current = []
+        if current:
+            chunks.append(current)
+        return chunks
+    
+    def generate_shard(self, name, edges):
+        """Generate a self-contained translation unit holding some edges."""
+        lines = ['#include "manifest.h"\n']
+        for pool_name in self.pools:
+            lines.append(f"EXTERN_POOL({self._to_c_identifier(pool_name)})")
+        for rule_name in self.rules:
+            lines.append(f"EXTERN_RULE({self._to_c_identifier(rule_name)})")
+        lines.append("")
+        lines.append(f"SHARD({name})")
+        for edge in edges:
+            lines.extend(self._generate_edge(edge))
+        lines.append("END_SHARD")
+        return "\n".join(lines) + "\n"
+    
+    def generate_sharded_c_code(self, output_file, num_shards):
+        """Generate the root source and its shards.
+        Returns a list of (path, code) pairs, root first.  The root names
+        every shard in a cnobi-shard directive so that ninja can compile them
+        in parallel and cache each one separately.
+        """
+        import os.path
+        base = os.path.splitext(output_file)[0]
+        shards = []
+        names = set()
+        for edges in self.split_edges(num_shards):
+            name = f"cnobi_edges_{self._edge_fingerprint(edges[0]):08x}"
+            suffix = 0
+            while name in names:
+                suffix += 1
+                name = f"cnobi_edges_{self._edge_fingerprint(edges[0]):08x}_{suffix}"
+            names.add(name)
+            path = f"{base}_{name[len('cnobi_'):]}.c"
+            shards.append((path, name, edges))
+        
+        root_dir = os.path.dirname(os.path.abspath(output_file))
+        parts = ['#include "manifest.h"\n']
+        for path, _, _ in shards:
+            rel = os.path.relpath(os.path.abspath(path), root_dir)
+            parts.append(f"// cnobi-shard: {rel}")
+        parts += [
+            "\n// Pool declarations",
+            self.generate_pool_declarations(),
+            "\n// Rule declarations",
+            self.generate_rule_declarations(),
+            "\n// Shards",
+        ]
+        parts += [f"EXTERN_SHARD({name})" for _, name, _ in shards]
+        parts += [
+            "\n// Main manifest",
+            "MANIFEST = {",
+            self.generate_bindings(),
+            self.generate_scope(),
+        ]
+        if shards:
+            parts.append("  SHARDS " +
+                         ", ".join(name for _, name, _ in shards) + ", 0},")
+        parts += [
+            self.generate_defaults(),
+            "};",
+        ]
+        files = [(output_file, "\n".join(filter(None, parts)))]
+        for path, name, edges in shards:
+            files.append((path, self.generate_shard(name, edges)))
+        return files
+    
     def generate_rule_declarations(self):
         """Generate C code for rule declarations."""
         lines = []
@@ -554,8 +896,169 @@ class Manifest:
                 lines.append("  END")
             lines.append("END_RULE")  # Close the rule
             lines.append("")  # Add a blank line for separation
+        
+        # Rules of enclosing scopes are referred to by name.
+        used = dict.fromkeys(edge['rule'] for edge in self.edges)
+        for name in used:
+            if name != 'phony' and name not in self.rules:
+                c_name = self._to_c_identifier(name)
+                lines.append(f'RULE_REF({c_name}, "{self._escape_c_string(name)}")')
         return "\n".join(lines)
     
+    def generate_scope(self):
+        """Generate C code for the rules and subninjas of this scope."""
+        lines = []
+        if self.rules:
+            names = ", ".join(f"&{self._to_c_identifier(name)}"
+                              for name in self.rules)
+            lines.append(f"  RULES {names}, 0}},")
+        if self.subninjas:
+            lines.append("  SUBNINJAS")
+            for path, _ in self.subninjas:
+                lines.append(f'    EVAL LIT("{self._escape_c_string(path)}") END,')
+            lines.append("  END,")
+        return "\n".join(lines)
+    
+    def generate_subninja_files(self, abi=2):
+        """Return (path, code) pairs for the subninjas, recursively.
+        Each is written next to its .ninja file, under the path the parent
+        names it by, relative to the build directory.
+        """
+        import os.path
+        files = []
+        for path, child in self.subninjas:
+            if abi == 1:
+                code = child.generate_c_code()
+            else:
+                code = child.generate_tables_code()[0][1]
+            files.append((os.path.join(self.build_dir, path), code))
+            files += child.generate_subninja_files(abi)
+        return files
+    
+    def _eval_tokens(self, s):
+        """The LIT and VAR tokens of s, for a version 2 manifest."""
+        return [(LIT if type_ == 'L' else VAR, value)
+                for type_, value in self._tokenize_string(s)]
+    
+    def _path_tokens(self, path, edge_bindings={}):
+        """The tokens of a path, a single CANON token where possible."""
+        evaluated = self._evaluate_path(path, edge_bindings)
+        if evaluated is not None and self._is_canonical(evaluated):
+            return [(CANON, evaluated)]
+        return self._eval_tokens(path)
+    
+    def _binding_tokens(self, bindings):
+        """(key, tokens) pairs of non-empty bindings."""
+        return [(key, self._eval_tokens(value))
+                for key, value in bindings.items() if value]
+    
+    def _table_pools_and_rules(self):
+        """Index the pools and rules edges of this scope may use.  Returns
+        (pool index by name, rule index by name, rules in index order)."""
+        pools = {}
+        for name in list(self.pools) + self._used_pools() + ['console']:
+            if name not in pools:
+                pools[name] = len(pools)
+        # An edge's empty "pool" overrides its rule's pool with the default
+        # one, which the loader knows by its empty name.
+        if any(edge['pool'] == '' for edge in self.edges):
+            pools[''] = len(pools)
+        rules = list(self.rules)
+        for edge in self.edges:
+            if edge['rule'] not in self.rules and edge['rule'] not in rules:
+                rules.append(edge['rule'])
+        return pools, {name: i for i, name in enumerate(rules)}, rules
+    
+    def _table_edges(self, writer, edges, pool_index, rule_index):
+        """Add edges to writer, as rows of struct CNobiEdge."""
+        for edge in edges:
+            lists = [edge['inputs'], edge['implicit_inputs'], edge['order_only'],
+                     edge['outputs'], edge['implicit_outputs'],
+                     edge['validation_inputs']]
+            paths = writer.path_range(
+                [self._path_tokens(path, edge['bindings'])
+                 for paths in lists for path in paths], nodes=True)
+            bindings = writer.binding_range(
+                self._binding_tokens(edge['bindings']))
+            pool = edge['pool']
+            ins = sum(map(len, lists[:3]))
+            outs = len(lists[3]) + len(lists[4])
+            writer.add_edge(
+                (rule_index[edge['rule']],
+                 pool_index[pool] if pool is not None else 'CNOBI_NONE',
+                 paths[0]) + tuple(len(paths) for paths in lists) + (bindings,),
+                paths, (paths[0] + ins, outs))
+    
+    def generate_tables_code(self, output_file=None, num_shards=1):
+        """Generate a version 2 manifest, whose edges may be split over
+        about num_shards further units like generate_sharded_c_code does.
+        Returns a list of (path, code) pairs, root first.
+        """
+        import os.path
+        pool_index, rule_index, rules = self._table_pools_and_rules()
+        root = TableWriter("cnobi")
+        
+        pool_rows = []
+        for name in pool_index:
+            info = self._lookup_pool(name)
+            depth = 1 if name == 'console' else (info or {}).get('depth')
+            if info is None and name not in ('console', ''):
+                raise ValueError(f"unknown pool name '{name}'")
+            pool_rows.append((root.string(name), depth or 0))
+        rule_rows = []
+        for name in rules:
+            bindings = dict(self.rules.get(name, {}))
+            pool = bindings.pop('pool', None)
+            rule_rows.append((root.string(name),
+                              pool_index[pool] if pool else 'CNOBI_NONE',
+                              root.binding_range(
+                                  self._binding_tokens(bindings))))
+        
+        bindings = root.binding_range(self._binding_tokens(self.bindings))
+        includes = root.path_range([])
+        subninjas = root.path_range(
+            [[(LIT, path)] for path, _ in self.subninjas])
+        defaults = root.path_range(
+            [self._path_tokens(path) for path in self.defaults])
+        
+        shards = []
+        if num_shards > 1 and output_file:
+            base = os.path.splitext(output_file)[0]
+            names = set()
+            for edges in self.split_edges(num_shards):
+                name = f"cnobi_edges_{self._edge_fingerprint(edges[0]):08x}"
+                suffix = 0
+                while name in names:
+                    suffix += 1
+                    name = (f"cnobi_edges_"
+                            f"{self._edge_fingerprint(edges[0]):08x}_{suffix}")
+                names.add(name)
+                shards.append((f"{base}_{name[len('cnobi_'):]}.c", name, edges))
+        else:
+            self._table_edges(root, self.edges, pool_index, rule_index)
+        shard_names = root.token_range([(LIT, name) for _, name, _ in shards])
+        
+        parts = ['#include "manifest.h"']
+        if output_file:
+            root_dir = os.path.dirname(os.path.abspath(output_file))
+            for path, _, _ in shards:
+                rel = os.path.relpath(os.path.abspath(path), root_dir)
+                parts.append(f"// cnobi-shard: {rel}")
+        parts.append("")
+        # Shards add to the root's node table, so they are generated first.
+        files = []
+        for path, name, edges in shards:
+            shard = TableWriter(name, root)
+            self._table_edges(shard, edges, pool_index, rule_index)
+            empty = (0, 0)
+            files.append((path, '#include "manifest.h"\n\n' + shard.generate(
+                [len(shard.edges), 0, 0, empty, empty, empty, empty, empty, 0])))
+        parts.append(root.generate(
+            [len(root.edges), len(pool_rows), len(rules), bindings, includes,
+             subninjas, defaults, shard_names, len(root.nodes)],
+            pool_rows, rule_rows))
+        return [(output_file, "\n".join(parts))] + files
+    
     def generate_c_code(self):
         """Generate complete C code representation of the manifest."""
         parts = [
@@ -567,6 +1070,7 @@ class Manifest:
             "\n// Main manifest",
             "MANIFEST = {",
             self.generate_bindings(),
+            self.generate_scope(),
             self.generate_edges(),
             self.generate_defaults(),
             "};",
@@ -585,6 +1089,13 @@ if __name__ == '__main__':
     parser.add_argument('output', nargs='?', help='Output C file (optional)')
     parser.add_argument('-d', '--display', action='store_true', 
                        help='Display parsed manifest structure')
+    parser.add_argument('-s', '--shards', type=int, default=1,
+                       help='Split the edges over about this many C files, '
+                            'compiled in parallel and cached separately')
+    parser.add_argument('--abi', type=int, choices=[1, 2], default=2,
+                       help='Layout of the generated C: 2 (default) writes '
+                            'relocation-free tables, 1 the pointer-based '
+                            'structures')
     
     args = parser.parse_args()
     
@@ -607,18 +1118,38 @@ if __name__ == '__main__':
             output_file = f"{base}_ninja.c"
         
         # Generate and write C code
-        c_code = manifest.generate_c_code()
-        with open(output_file, 'w') as f:
-            f.write(c_code)
+        if args.abi == 2:
+            files = manifest.generate_tables_code(output_file, args.shards)
+        elif args.shards > 1:
+            files = manifest.generate_sharded_c_code(output_file, args.shards)
+        else:
+            files = [(output_file, manifest.generate_c_code())]
+        files += manifest.generate_subninja_files(args.abi)
+        
+        # Drop shards left over from an earlier run with different cuts.
+        import glob
+        written = set(os.path.abspath(path) for path, _ in files)
+        base = os.path.splitext(output_file)[0]
+        for stale in glob.glob(glob.escape(base) + '_edges_*.c'):
+            if os.path.abspath(stale) not in written:
+                os.remove(stale)
+        
+        for path, c_code in files:
+            with open(path, 'w') as f:
+                f.write(c_code)
         
-        # Copy manifest.h to the output directory
+        # Copy manifest.h to every directory that received a C file
         script_dir = os.path.dirname(os.path.abspath(__file__))
         manifest_h = os.path.join(script_dir, 'manifest.h')
-        output_dir = os.path.dirname(os.path.abspath(output_file))
-        shutil.copy2(manifest_h, output_dir)
+        output_dirs = dict.fromkeys(os.path.dirname(os.path.abspath(path))
+                                    for path, _ in files)
+        for output_dir in output_dirs:
+            shutil.copy2(manifest_h, output_dir)
         
-        print(f"Generated {output_file}")
-        print(f"Copied manifest.h to {output_dir}")
+        for path, _ in files:
+            print(f"Generated {path}")
+        for output_dir in output_dirs:
+            print(f"Copied manifest.h to {output_dir}")
         
     except Exception as e:
         print(f"Error: {e}", file=sys.stderr)
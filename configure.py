@@ -381,6 +381,10 @@ else:
     if platform.is_mingw():
         cflags += ['-D_WIN32_WINNT=0x0601', '-D__USE_MINGW_ANSI_STDIO=1']
     ldflags = ['-L$builddir']
+    if not platform.is_windows():
+        # The cnobi loader converts subninja manifests on worker threads.
+        cflags.append('-pthread')
+        ldflags.append('-pthread')
     if platform.uses_usr_local():
         cflags.append('-I/usr/local/include')
         ldflags.append('-L/usr/local/lib')
@@ -481,11 +485,18 @@ n.newline()
 
 objs = []
 
+n.rule('inline',
+       command='"%s"' % src('inline.sh') + ' $varname < $in > $out',
+       description='INLINE $out')
+n.comment('cnobi_manifest_h.h is used to inline cnobi/manifest.h.')
+n.build(built('cnobi_manifest_h.h'), 'inline',
+        os.path.join('$root', 'cnobi', 'manifest.h'),
+        implicit=src('inline.sh'),
+        variables=[('varname', 'kCNobiManifestH')])
+n.newline()
+
 if platform.supports_ninja_browse():
     n.comment('browse_py.h is used to inline browse.py.')
-    n.rule('inline',
-           command='"%s"' % src('inline.sh') + ' $varname < $in > $out',
-           description='INLINE $out')
     n.build(built('browse_py.h'), 'inline', src('browse.py'),
             implicit=src('inline.sh'),
             variables=[('varname', 'kBrowsePy')])
@@ -529,7 +540,8 @@ n.newline()
 
 n.comment('Core source files all build into ninja library.')
 objs.extend(re2c_objs)
-for name in ['build',
+for name in ['arena',
+             'build',
              'build_log',
              'cnobi',
              'clean',
@@ -543,9 +555,12 @@ for name in ['build',
              'elide_middle',
              'eval_env',
              'graph',
+             'graph_fingerprint',
+             'graph_snapshot',
              'graphviz',
              'json',
              'line_printer',
+             'log_writer',
              'manifest_parser',
              'metrics',
              'missing_deps',
@@ -554,9 +569,12 @@ for name in ['build',
              'state',
              'status_printer',
              'string_piece_util',
+             'thread_pool',
              'util',
              'version']:
     objs += cxx(name, variables=cxxvariables)
+objs += cxx('cnobi_gen', order_only=built('cnobi_manifest_h.h'),
+            variables=cxxvariables)
 if platform.is_windows():
     for name in ['subprocess-win32',
                  'includes_normalize-win32',
@@ -632,10 +650,13 @@ if gtest_src_dir:
         test_variables += [('pdb', 'ninja_test.pdb')]
 
     test_names = [
+        'arena_test',
         'build_log_test',
         'build_test',
         'clean_test',
         'clparser_test',
+        'cnobi_gen_test',
+        'cnobi_test',
         'depfile_parser_test',
         'deps_log_test',
         'disk_interface_test',
@@ -643,15 +664,19 @@ if gtest_src_dir:
         'edit_distance_test',
         'elide_middle_test',
         'explanations_test',
+        'graph_fingerprint_test',
+        'graph_snapshot_test',
         'graph_test',
         'json_test',
         'lexer_test',
+        'log_writer_test',
         'manifest_parser_test',
         'ninja_test',
         'state_test',
         'string_piece_util_test',
         'subprocess_test',
         'test',
+        'thread_pool_test',
         'util_test',
     ]
     if platform.is_windows():
@@ -691,7 +716,8 @@ for name in ['build_log_perftest',
              'depfile_parser_perftest',
              'hash_collision_bench',
              'manifest_parser_perftest',
-             'clparser_perftest']:
+             'clparser_perftest',
+             'cnobi_perftest']:
   if platform.is_msvc():
     cxxvariables = [('pdb', name + '.pdb')]
   objs = cxx(name, variables=cxxvariables)
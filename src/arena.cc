@@ -0,0 +1,83 @@
+#include "arena.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <mutex>
+#include <set>
+
+#include "util.h"
+
+using namespace std;
+
+namespace {
+
+/// Blocks are this large, unless one allocation needs more.
+const size_t kBlockSize = 64 * 1024;
+
+/// Every arena alive, for Arena::Totals().
+mutex g_arenas_mutex;
+set<const Arena*>* g_arenas;
+
+}  // namespace
+
+Arena::Arena()
+    : next_(NULL), end_(NULL), reserved_(0), used_(0), objects_(0) {
+  lock_guard<mutex> lock(g_arenas_mutex);
+  if (!g_arenas)
+    g_arenas = new set<const Arena*>;
+  g_arenas->insert(this);
+}
+
+Arena::~Arena() {
+  {
+    lock_guard<mutex> lock(g_arenas_mutex);
+    g_arenas->erase(this);
+  }
+  for (vector<Destructor>::reverse_iterator i = destructors_.rbegin();
+       i != destructors_.rend(); ++i)
+    i->first(i->second);
+  for (vector<char*>::iterator i = blocks_.begin(); i != blocks_.end(); ++i)
+    free(*i);
+}
+
+void* Arena::Allocate(size_t size, size_t align) {
+  assert(align && (align & (align - 1)) == 0);
+  uintptr_t next = (reinterpret_cast<uintptr_t>(next_) + align - 1) &
+                   ~static_cast<uintptr_t>(align - 1);
+  if (!next_ || next + size > reinterpret_cast<uintptr_t>(end_)) {
+    // Start a new block.  What is left of the current one is wasted, which
+    // is at most a small part of it as long as objects are small.
+    size_t block_size = max(kBlockSize, size + align);
+    char* block = static_cast<char*>(malloc(block_size));
+    if (!block)
+      Fatal("out of memory");
+    blocks_.push_back(block);
+    reserved_ += block_size;
+    end_ = block + block_size;
+    next = (reinterpret_cast<uintptr_t>(block) + align - 1) &
+           ~static_cast<uintptr_t>(align - 1);
+  }
+  next_ = reinterpret_cast<char*>(next + size);
+  used_ += size;
+  return reinterpret_cast<void*>(next);
+}
+
+// static
+Arena::Stats Arena::Totals() {
+  Stats stats;
+  lock_guard<mutex> lock(g_arenas_mutex);
+  if (!g_arenas)
+    return stats;
+  for (set<const Arena*>::iterator i = g_arenas->begin();
+       i != g_arenas->end(); ++i) {
+    ++stats.arenas;
+    stats.blocks += (*i)->blocks_.size();
+    stats.reserved += (*i)->reserved_;
+    stats.used += (*i)->used_;
+    stats.objects += (*i)->objects_;
+  }
+  return stats;
+}
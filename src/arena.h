@@ -0,0 +1,69 @@
+#ifndef NINJA_ARENA_H_
+#define NINJA_ARENA_H_
+
+#include <stddef.h>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/// A bump allocator for objects that live as long as the arena, such as the
+/// rules and scopes a manifest loader creates by the million.  Allocation
+/// takes the next bytes of the current block; nothing is freed until the
+/// arena is destroyed, which runs the destructors of the objects it made in
+/// reverse order.  An arena is not thread-safe, but several arenas may be
+/// used on different threads at once.
+struct Arena {
+  Arena();
+  ~Arena();
+
+  /// Allocate \a size bytes aligned to \a align, a power of two.
+  void* Allocate(size_t size, size_t align);
+
+  /// Construct a T in the arena.
+  template <typename T, typename... Args>
+  T* New(Args&&... args) {
+    T* object = new (Allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value)
+      destructors_.push_back(Destructor(&Destroy<T>, object));
+    ++objects_;
+    return object;
+  }
+
+  /// Memory use of the arenas alive, summed.  Meant for -d stats, once
+  /// nothing allocates any more.
+  struct Stats {
+    Stats() : arenas(0), blocks(0), reserved(0), used(0), objects(0) {}
+    size_t arenas;
+    size_t blocks;
+    /// Bytes of the blocks.
+    size_t reserved;
+    /// Bytes handed out.
+    size_t used;
+    size_t objects;
+  };
+  static Stats Totals();
+
+ private:
+  Arena(const Arena&);
+  void operator=(const Arena&);
+
+  template <typename T>
+  static void Destroy(void* object) {
+    static_cast<T*>(object)->~T();
+  }
+
+  typedef std::pair<void (*)(void*), void*> Destructor;
+
+  std::vector<char*> blocks_;
+  char* next_;
+  char* end_;
+  std::vector<Destructor> destructors_;
+  size_t reserved_;
+  size_t used_;
+  size_t objects_;
+};
+
+#endif  // NINJA_ARENA_H_
@@ -0,0 +1,70 @@
+#include "arena.h"
+
+#include <stdint.h>
+
+#include <string>
+
+#include "test.h"
+
+namespace {
+
+struct Counted {
+  Counted(std::vector<int>* destroyed, int id)
+      : destroyed_(destroyed), id_(id) {}
+  ~Counted() { destroyed_->push_back(id_); }
+  std::vector<int>* destroyed_;
+  int id_;
+};
+
+}  // namespace
+
+TEST(Arena, Alignment) {
+  Arena arena;
+  arena.Allocate(1, 1);
+  void* p = arena.Allocate(8, 8);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(p) % 8);
+  arena.Allocate(3, 1);
+  p = arena.Allocate(16, 16);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(p) % 16);
+}
+
+TEST(Arena, LargeAllocations) {
+  Arena arena;
+  char* small = static_cast<char*>(arena.Allocate(10, 1));
+  char* large = static_cast<char*>(arena.Allocate(1 << 20, 8));
+  large[0] = large[(1 << 20) - 1] = 'x';
+  char* next = static_cast<char*>(arena.Allocate(10, 1));
+  EXPECT_NE(small, next);
+  EXPECT_NE(large, next);
+}
+
+TEST(Arena, DestroysInReverse) {
+  std::vector<int> destroyed;
+  {
+    Arena arena;
+    arena.New<Counted>(&destroyed, 1);
+    std::string* str = arena.New<std::string>(100, 'a');
+    arena.New<Counted>(&destroyed, 2);
+    EXPECT_EQ(100u, str->size());
+    EXPECT_TRUE(destroyed.empty());
+  }
+  ASSERT_EQ(2u, destroyed.size());
+  EXPECT_EQ(2, destroyed[0]);
+  EXPECT_EQ(1, destroyed[1]);
+}
+
+TEST(Arena, Totals) {
+  Arena::Stats before = Arena::Totals();
+  {
+    Arena arena;
+    arena.New<int>(1);
+    arena.New<std::string>("two");
+    Arena::Stats stats = Arena::Totals();
+    EXPECT_EQ(before.arenas + 1, stats.arenas);
+    EXPECT_EQ(before.objects + 2, stats.objects);
+    EXPECT_EQ(before.blocks + 1, stats.blocks);
+    EXPECT_GE(stats.used - before.used, sizeof(int) + sizeof(std::string));
+    EXPECT_GE(stats.reserved, stats.used);
+  }
+  EXPECT_EQ(before.arenas, Arena::Totals().arenas);
+}
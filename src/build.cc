@@ -108,8 +108,8 @@ bool Plan::AddSubTarget(const Node* node, const Node* dependent, string* err,
      if (node->dirty() && !node->generated_by_dep_loader()) {
        string referenced;
        if (dependent)
-         referenced = ", needed by '" + dependent->path() + "',";
-       *err = "'" + node->path() + "'" + referenced +
+         referenced = ", needed by '" + dependent->path().AsString() + "',";
+       *err = "'" + node->path().AsString() + "'" + referenced +
               " missing and no known rule to make it";
      }
      return false;
@@ -629,11 +629,12 @@ void Builder::Cleanup() {
         // mentioned in a depfile, and the command touches its depfile
         // but is interrupted before it touches its output file.)
         string err;
-        TimeStamp new_mtime = disk_interface_->Stat((*o)->path(), &err);
+        TimeStamp new_mtime =
+            disk_interface_->Stat((*o)->path().AsString(), &err);
         if (new_mtime == -1)  // Log and ignore Stat() errors.
           status_->Error("%s", err.c_str());
         if (!depfile.empty() || (*o)->mtime() != new_mtime)
-          disk_interface_->RemoveFile((*o)->path());
+          disk_interface_->RemoveFile((*o)->path().AsString());
       }
       if (!depfile.empty())
         disk_interface_->RemoveFile(depfile);
@@ -815,7 +816,7 @@ bool Builder::StartEdge(Edge* edge, string* err) {
   // XXX: this will block; do we care?
   for (vector<Node*>::iterator o = edge->outputs_.begin();
        o != edge->outputs_.end(); ++o) {
-    if (!disk_interface_->MakeDirs((*o)->path()))
+    if (!disk_interface_->MakeDirs((*o)->path().AsString()))
       return false;
     if (build_start == -1) {
       disk_interface_->WriteFile(lock_file_path_, "");
@@ -906,7 +907,8 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
     if (record_mtime == 0 || restat || generator) {
       for (vector<Node*>::iterator o = edge->outputs_.begin();
            o != edge->outputs_.end(); ++o) {
-        TimeStamp new_mtime = disk_interface_->Stat((*o)->path(), err);
+        TimeStamp new_mtime =
+            disk_interface_->Stat((*o)->path().AsString(), err);
         if (new_mtime == -1)
           return false;
         if (new_mtime > record_mtime)
@@ -946,7 +948,8 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
     assert(!edge->outputs_.empty() && "should have been rejected by parser");
     for (std::vector<Node*>::const_iterator o = edge->outputs_.begin();
          o != edge->outputs_.end(); ++o) {
-      TimeStamp deps_mtime = disk_interface_->Stat((*o)->path(), err);
+      TimeStamp deps_mtime =
+          disk_interface_->Stat((*o)->path().AsString(), err);
       if (deps_mtime == -1)
         return false;
       if (!scan_.deps_log()->RecordDeps(*o, deps_mtime, deps_nodes)) {
@@ -985,8 +988,8 @@ bool Builder::ExtractDeps(CommandRunner::Result* result,
     }
 
     // Read depfile content.  Treat a missing depfile as empty.
-    string content;
-    switch (disk_interface_->ReadFile(depfile, &content, err)) {
+    FileContents content;
+    switch (disk_interface_->MapFile(depfile, &content, err)) {
     case DiskInterface::Okay:
       break;
     case DiskInterface::NotFound:
@@ -999,7 +1002,7 @@ bool Builder::ExtractDeps(CommandRunner::Result* result,
       return true;
 
     DepfileParser deps(config_.depfile_parser_options);
-    if (!deps.Parse(&content, err))
+    if (!deps.Parse(content.data(), content.size(), err))
       return false;
 
     // XXX check depfile matches expected output.
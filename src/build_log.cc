@@ -23,10 +23,14 @@
 #include "build_log.h"
 #include "disk_interface.h"
 
+#include <algorithm>
 #include <cassert>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+
+#include <thread>
 
 #ifndef _WIN32
 #include <inttypes.h>
@@ -35,6 +39,7 @@
 
 #include "build.h"
 #include "graph.h"
+#include "hash_map.h"
 #include "metrics.h"
 #include "util.h"
 #if defined(_MSC_VER) && (_MSC_VER < 1800)
@@ -45,68 +50,110 @@ using namespace std;
 
 // Implementation details:
 // Each run's log appends to the log file.
-// To load, we run through all log entries in series, throwing away
-// older runs.
-// Once the number of redundant entries exceeds a threshold, we write
+// To load, we look up the index written at the last recompaction where the
+// file is mapped, and run through the entries appended since, throwing
+// away older runs.
+// Once the appended entries grow large next to the index, we write
 // out a new file and replace the existing one with it.
+//
+// Concretely, a log is:
+// - the signature line, padded with NULs to kSignatureSize bytes;
+// - an IndexHeader, which starts with kByteOrderMark and the sizes of the
+//   record structs as the writer saw them, its entry_count IndexRecords, the string table their
+//   outputs are in, padded to 8 bytes, and a hash table of bucket_count
+//   (a power of two) record numbers plus one, 0 marking an empty bucket,
+//   which is probed linearly from the MurmurHash64A() of the output;
+// - for each command run since, an AppendedRecord followed by its output,
+//   padded to 8 bytes.
+// The records are written in the machine's own byte order and layout, so a
+// log from a machine that disagrees on either is thrown away, not misread.
+// Version 6 and older logs were text, one tab-separated entry per line.
 
 namespace {
 
 const char kFileSignature[] = "# ninja log v%d\n";
 const int kOldestSupportedVersion = 6;
-const int kCurrentVersion = 6;
-
-// 64bit MurmurHash2, by Austin Appleby
-#if defined(_MSC_VER)
-#define BIG_CONSTANT(x) (x)
-#else   // defined(_MSC_VER)
-#define BIG_CONSTANT(x) (x##LLU)
-#endif // !defined(_MSC_VER)
-inline
-uint64_t MurmurHash64A(const void* key, size_t len) {
-  static const uint64_t seed = 0xDECAFBADDECAFBADull;
-  const uint64_t m = BIG_CONSTANT(0xc6a4a7935bd1e995);
-  const int r = 47;
-  uint64_t h = seed ^ (len * m);
-  const unsigned char* data = static_cast<const unsigned char*>(key);
-  while (len >= 8) {
-    uint64_t k;
-    memcpy(&k, data, sizeof k);
-    k *= m;
-    k ^= k >> r;
-    k *= m;
-    h ^= k;
-    h *= m;
-    data += 8;
-    len -= 8;
-  }
-  switch (len & 7)
-  {
-  case 7: h ^= uint64_t(data[6]) << 48;
-          NINJA_FALLTHROUGH;
-  case 6: h ^= uint64_t(data[5]) << 40;
-          NINJA_FALLTHROUGH;
-  case 5: h ^= uint64_t(data[4]) << 32;
-          NINJA_FALLTHROUGH;
-  case 4: h ^= uint64_t(data[3]) << 24;
-          NINJA_FALLTHROUGH;
-  case 3: h ^= uint64_t(data[2]) << 16;
-          NINJA_FALLTHROUGH;
-  case 2: h ^= uint64_t(data[1]) << 8;
-          NINJA_FALLTHROUGH;
-  case 1: h ^= uint64_t(data[0]);
-          h *= m;
-  };
-  h ^= h >> r;
-  h *= m;
-  h ^= h >> r;
-  return h;
+const int kLastTextVersion = 6;
+const int kCurrentVersion = 7;
+
+const size_t kSignatureSize = 16;
+
+const uint32_t kByteOrderMark = 0x01020304;
+
+struct IndexHeader {
+  uint32_t byte_order;
+  uint16_t index_record_size;
+  uint16_t appended_record_size;
+  uint32_t entry_count;
+  uint32_t bucket_count;
+  uint64_t strings_size;
+};
+
+struct IndexRecord {
+  uint64_t command_hash;
+  int64_t mtime;
+  int32_t start_time;
+  int32_t end_time;
+  uint32_t output_offset;
+  uint32_t output_size;
+};
+
+struct AppendedRecord {
+  uint64_t command_hash;
+  int64_t mtime;
+  int32_t start_time;
+  int32_t end_time;
+  uint32_t output_size;
+  uint32_t padding;
+};
+
+uint64_t AlignTo8(uint64_t size) {
+  return (size + 7) & ~(uint64_t)7;
 }
-#undef BIG_CONSTANT
 
+bool OutputLess(const BuildLog::LogEntry* a, const BuildLog::LogEntry* b) {
+  return a->output < b->output;
+}
 
 }  // namespace
 
+struct BuildLog::Index {
+  /// The record for \a output, or NULL.  Records that point outside the
+  /// string table are not found: the index is only checked as it is used.
+  const IndexRecord* Find(StringPiece output) const {
+    if (bucket_count == 0)
+      return NULL;
+    uint32_t mask = bucket_count - 1;
+    uint32_t bucket = MurmurHash64A(output.str_, output.len_) & mask;
+    for (uint32_t probes = 0; probes < bucket_count; ++probes) {
+      uint32_t entry = buckets[bucket];
+      if (entry == 0 || entry > entry_count)
+        return NULL;
+      const IndexRecord* record = &records[entry - 1];
+      if (Output(*record) == output)
+        return record;
+      bucket = (bucket + 1) & mask;
+    }
+    return NULL;
+  }
+
+  /// The output of \a record, or "" if it is out of bounds.
+  StringPiece Output(const IndexRecord& record) const {
+    if (record.output_offset > strings_size ||
+        record.output_size > strings_size - record.output_offset)
+      return StringPiece();
+    return StringPiece(strings + record.output_offset, record.output_size);
+  }
+
+  FileContents contents;
+  const IndexRecord* records;
+  uint32_t entry_count;
+  const char* strings;
+  uint64_t strings_size;
+  const uint32_t* buckets;
+  uint32_t bucket_count;
+};
+
 // static
 uint64_t BuildLog::LogEntry::HashCommand(StringPiece command) {
   return MurmurHash64A(command.str_, command.len_);
@@ -121,8 +168,21 @@ BuildLog::LogEntry::LogEntry(const string& output, uint64_t command_hash,
     start_time(start_time), end_time(end_time), mtime(mtime)
 {}
 
+/// The live entries as of StartRecompact(), which the thread writes to
+/// temp_path, and the log file they were taken from: appended to beyond
+/// size since, if it still has the same inode.
+struct BuildLog::Recompaction {
+  string path;
+  string temp_path;
+  struct stat st;
+  vector<LogEntry> entries;
+  thread writer;
+  bool ok;
+  string err;
+};
+
 BuildLog::BuildLog()
-  : log_file_(NULL), needs_recompaction_(false) {}
+  : needs_recompaction_(false), appendable_(false) {}
 
 BuildLog::~BuildLog() {
   Close();
@@ -131,11 +191,14 @@ BuildLog::~BuildLog() {
 bool BuildLog::OpenForWrite(const string& path, const BuildLogUser& user,
                             string* err) {
   if (needs_recompaction_) {
-    if (!Recompact(path, user, err))
+    // A log that can't be appended to as it is has to be replaced before
+    // anything is recorded.
+    if (!(appendable_ ? StartRecompact(path, user, err)
+                      : Recompact(path, user, err)))
       return false;
   }
 
-  assert(!log_file_);
+  assert(!log_file_.is_open());
   log_file_path_ = path;  // we don't actually open the file right now, but will
                           // do so on the first write attempt
   return true;
@@ -143,67 +206,67 @@ bool BuildLog::OpenForWrite(const string& path, const BuildLogUser& user,
 
 bool BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
                              TimeStamp mtime) {
-  string command = edge->EvaluateCommand(true);
-  uint64_t command_hash = LogEntry::HashCommand(command);
+  uint64_t command_hash = edge->CommandHash();
+  string records;
   for (vector<Node*>::iterator out = edge->outputs_.begin();
        out != edge->outputs_.end(); ++out) {
-    const string& path = (*out)->path();
+    StringPiece path = (*out)->path();
     Entries::iterator i = entries_.find(path);
     LogEntry* log_entry;
     if (i != entries_.end()) {
       log_entry = i->second;
     } else {
-      log_entry = new LogEntry(path);
+      log_entry = new LogEntry(path.AsString());
       entries_.insert(Entries::value_type(log_entry->output, log_entry));
     }
     log_entry->command_hash = command_hash;
     log_entry->start_time = start_time;
     log_entry->end_time = end_time;
     log_entry->mtime = mtime;
+    EncodeEntry(*log_entry, &records);
+  }
 
-    if (!OpenForWriteIfNeeded()) {
-      return false;
-    }
-    if (log_file_) {
-      if (!WriteEntry(log_file_, *log_entry))
-        return false;
-      if (fflush(log_file_) != 0) {
-          return false;
-      }
-    }
+  if (!OpenForWriteIfNeeded()) {
+    return false;
   }
+  if (log_file_.is_open())
+    return log_file_.Append(records.data(), records.size());
   return true;
 }
 
 void BuildLog::Close() {
   OpenForWriteIfNeeded();  // create the file even if nothing has been recorded
-  if (log_file_)
-    fclose(log_file_);
-  log_file_ = NULL;
+  if (!log_file_.Close())
+    Warning("writing build log: %s", strerror(errno));
+
+  string err;
+  if (!FinishRecompact(&err))
+    Warning("failed recompaction: %s", err.c_str());
 }
 
 bool BuildLog::OpenForWriteIfNeeded() {
-  if (log_file_ || log_file_path_.empty()) {
+  if (log_file_.is_open() || log_file_path_.empty()) {
     return true;
   }
-  log_file_ = fopen(log_file_path_.c_str(), "ab");
-  if (!log_file_) {
-    return false;
-  }
-  if (setvbuf(log_file_, NULL, _IOLBF, BUFSIZ) != 0) {
+  FILE* f = fopen(log_file_path_.c_str(), "ab");
+  if (!f) {
     return false;
   }
-  SetCloseOnExec(fileno(log_file_));
+  SetCloseOnExec(fileno(f));
 
   // Opening a file in append mode doesn't set the file pointer to the file's
   // end on Windows. Do that explicitly.
-  fseek(log_file_, 0, SEEK_END);
+  fseek(f, 0, SEEK_END);
 
-  if (ftell(log_file_) == 0) {
-    if (fprintf(log_file_, kFileSignature, kCurrentVersion) < 0) {
+  if (ftell(f) == 0) {
+    if (!WriteIndexed(f, vector<LogEntry*>()) || fflush(f) != 0) {
+      fclose(f);
       return false;
     }
   }
+  // Entries are written on a thread of their own when there is a processor
+  // to spare for it.
+  log_file_.Open(f, GetProcessorCount() > 1);
   return true;
 }
 
@@ -260,6 +323,46 @@ struct LineReader {
 
 LoadStatus BuildLog::Load(const string& path, string* err) {
   METRIC_RECORD(".ninja_log load");
+  LoadStatus status;
+  bool start_over = false;
+  if (prefetched_ && prefetched_->path == path) {
+    status = prefetched_->status;
+    start_over = prefetched_->start_over;
+    *err = prefetched_->err;
+  } else {
+    if (prefetched_) {
+      // The log was prefetched from elsewhere; forget it.
+      for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i)
+        delete i->second;
+      entries_.clear();
+      index_.reset();
+      needs_recompaction_ = false;
+      appendable_ = false;
+    }
+    status = Read(path, &start_over, err);
+  }
+  prefetched_.reset();
+
+  if (start_over) {
+    unlink(path.c_str());
+    // Don't report this as a failure. A missing build log will cause
+    // us to rebuild the outputs anyway.
+    return LOAD_NOT_FOUND;
+  }
+  return status;
+}
+
+void BuildLog::Prefetch(const string& path) {
+  METRIC_RECORD(".ninja_log prefetch");
+  prefetched_.reset(new Prefetched);
+  prefetched_->path = path;
+  prefetched_->start_over = false;
+  prefetched_->status =
+      Read(path, &prefetched_->start_over, &prefetched_->err);
+}
+
+LoadStatus BuildLog::Read(const string& path, bool* start_over,
+                          string* err) {
   FILE* file = fopen(path.c_str(), "r");
   if (!file) {
     if (errno == ENOENT)
@@ -290,11 +393,13 @@ LoadStatus BuildLog::Load(const string& path, string* err) {
       }
       if (invalid_log_version) {
         fclose(file);
-        unlink(path.c_str());
-        // Don't report this as a failure. A missing build log will cause
-        // us to rebuild the outputs anyway.
+        *start_over = true;
         return LOAD_NOT_FOUND;
       }
+      if (log_version > kLastTextVersion) {
+        fclose(file);
+        return ReadIndexed(path, start_over, err);
+      }
     }
 
     // If no newline was found in this chunk, read the next.
@@ -376,61 +481,339 @@ LoadStatus BuildLog::Load(const string& path, string* err) {
   return LOAD_SUCCESS;
 }
 
-BuildLog::LogEntry* BuildLog::LookupByOutput(const string& path) {
+LoadStatus BuildLog::ReadIndexed(const string& path, bool* start_over,
+                                 string* err) {
+  std::unique_ptr<Index> index(new Index);
+  RealDiskInterface disk;
+  switch (disk.MapFile(path, &index->contents, err)) {
+  case FileReader::Okay:
+    break;
+  case FileReader::NotFound:
+    err->clear();
+    return LOAD_NOT_FOUND;
+  default:
+    return LOAD_ERROR;
+  }
+
+  // Check only where the parts of the index are, so that loading does not
+  // depend on its size.
+  const char* data = index->contents.data();
+  const uint64_t size = index->contents.size();
+  IndexHeader header;
+  uint64_t records_begin = kSignatureSize + sizeof(header);
+  if (size >= records_begin)
+    memcpy(&header, data + kSignatureSize, sizeof(header));
+  if (size >= records_begin &&
+      (header.byte_order != kByteOrderMark ||
+       header.index_record_size != sizeof(IndexRecord) ||
+       header.appended_record_size != sizeof(AppendedRecord))) {
+    *err = "build log was written with another byte order or layout; "
+           "starting over";
+    *start_over = true;
+    return LOAD_NOT_FOUND;
+  }
+  uint64_t strings_begin = 0, buckets_begin = 0, appended_begin = 0;
+  if (size >= records_begin) {
+    strings_begin =
+        records_begin + (uint64_t)header.entry_count * sizeof(IndexRecord);
+    buckets_begin = AlignTo8(strings_begin + header.strings_size);
+    appended_begin = AlignTo8(buckets_begin +
+                              (uint64_t)header.bucket_count * sizeof(uint32_t));
+  }
+  if (size < records_begin || header.strings_size > size ||
+      (header.bucket_count & (header.bucket_count - 1)) != 0 ||
+      appended_begin > size) {
+    *err = "build log is damaged; starting over";
+    *start_over = true;
+    return LOAD_NOT_FOUND;
+  }
+  index->records = reinterpret_cast<const IndexRecord*>(data + records_begin);
+  index->entry_count = header.entry_count;
+  index->strings = data + strings_begin;
+  index->strings_size = header.strings_size;
+  index->buckets = reinterpret_cast<const uint32_t*>(data + buckets_begin);
+  index->bucket_count = header.bucket_count;
+
+  int unique_entry_count = 0;
+  int total_entry_count = 0;
+  uint64_t offset = appended_begin;
+  while (offset < size) {
+    AppendedRecord record;
+    if (size - offset < sizeof(record))
+      break;
+    memcpy(&record, data + offset, sizeof(record));
+    if (record.output_size > size - offset - sizeof(record))
+      break;
+    string output(data + offset + sizeof(record), record.output_size);
+    offset += AlignTo8(sizeof(record) + record.output_size);
+
+    LogEntry* entry;
+    Entries::iterator i = entries_.find(output);
+    if (i != entries_.end()) {
+      entry = i->second;
+    } else {
+      entry = new LogEntry(output);
+      entries_.insert(Entries::value_type(entry->output, entry));
+      ++unique_entry_count;
+    }
+    ++total_entry_count;
+
+    entry->start_time = record.start_time;
+    entry->end_time = record.end_time;
+    entry->mtime = record.mtime;
+    entry->command_hash = record.command_hash;
+  }
+  index_.swap(index);
+
+  // Decide whether it's time to rebuild the log:
+  // - if the last record was cut short, so that appending to it would
+  //   not work
+  // - if the appended records are getting large next to the index
+  int kMinCompactionEntryCount = 100;
+  int kCompactionRatio = 3;
+  appendable_ = offset == size;
+  if (offset < size) {
+    needs_recompaction_ = true;
+  } else if (total_entry_count > kMinCompactionEntryCount &&
+             (uint64_t)total_entry_count * kCompactionRatio >
+                 header.entry_count + (uint64_t)unique_entry_count) {
+    needs_recompaction_ = true;
+  }
+
+  return LOAD_SUCCESS;
+}
+
+BuildLog::LogEntry* BuildLog::LookupByOutput(StringPiece path) {
   Entries::iterator i = entries_.find(path);
   if (i != entries_.end())
     return i->second;
-  return NULL;
+  if (!index_)
+    return NULL;
+  const IndexRecord* record = index_->Find(path);
+  if (!record)
+    return NULL;
+  LogEntry* entry =
+      new LogEntry(path.AsString(), record->command_hash, record->start_time,
+                   record->end_time, record->mtime);
+  entries_.insert(Entries::value_type(entry->output, entry));
+  return entry;
 }
 
-bool BuildLog::WriteEntry(FILE* f, const LogEntry& entry) {
-  return fprintf(f, "%d\t%d\t%" PRId64 "\t%s\t%" PRIx64 "\n",
-          entry.start_time, entry.end_time, entry.mtime,
-          entry.output.c_str(), entry.command_hash) > 0;
+const BuildLog::Entries& BuildLog::entries() {
+  ReadIndex();
+  return entries_;
 }
 
-bool BuildLog::Recompact(const string& path, const BuildLogUser& user,
-                         string* err) {
-  METRIC_RECORD(".ninja_log recompact");
+void BuildLog::ReadIndex() {
+  if (!index_)
+    return;
+  for (uint32_t i = 0; i < index_->entry_count; ++i) {
+    const IndexRecord& record = index_->records[i];
+    StringPiece output = index_->Output(record);
+    if (output.len_ == 0 || entries_.find(output) != entries_.end())
+      continue;
+    LogEntry* entry =
+        new LogEntry(output.AsString(), record.command_hash,
+                     record.start_time, record.end_time, record.mtime);
+    entries_.insert(Entries::value_type(entry->output, entry));
+  }
+  index_.reset();
+}
 
-  Close();
-  string temp_path = path + ".recompact";
-  FILE* f = fopen(temp_path.c_str(), "wb");
-  if (!f) {
-    *err = strerror(errno);
+// static
+void BuildLog::EncodeEntry(const LogEntry& entry, string* out) {
+  AppendedRecord record;
+  record.command_hash = entry.command_hash;
+  record.mtime = entry.mtime;
+  record.start_time = entry.start_time;
+  record.end_time = entry.end_time;
+  record.output_size = entry.output.size();
+  record.padding = 0;
+  const char kZeros[8] = {};
+  size_t padding =
+      AlignTo8(sizeof(record) + entry.output.size()) -
+      (sizeof(record) + entry.output.size());
+  out->append(reinterpret_cast<const char*>(&record), sizeof(record));
+  out->append(entry.output);
+  out->append(kZeros, padding);
+}
+
+bool BuildLog::WriteText(FILE* f) {
+  ReadIndex();
+  if (fprintf(f, kFileSignature, kLastTextVersion) < 0)
     return false;
+  // Sort by output, so that the dump does not depend on the hash map.
+  vector<const LogEntry*> entries;
+  entries.reserve(entries_.size());
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i)
+    entries.push_back(i->second);
+  sort(entries.begin(), entries.end(), OutputLess);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const LogEntry& entry = *entries[i];
+    if (fprintf(f, "%d\t%d\t%" PRId64 "\t%s\t%" PRIx64 "\n",
+                entry.start_time, entry.end_time, entry.mtime,
+                entry.output.c_str(), entry.command_hash) < 0)
+      return false;
   }
+  return true;
+}
+
+// static
+bool BuildLog::WriteIndexed(FILE* f, const vector<LogEntry*>& entries) {
+  char signature[kSignatureSize] = {};
+  snprintf(signature, sizeof(signature), kFileSignature, kCurrentVersion);
+
+  uint32_t bucket_count = 0;
+  if (!entries.empty()) {
+    // At most half full, so that probes stay short.
+    bucket_count = 1;
+    while (bucket_count < 2 * entries.size())
+      bucket_count *= 2;
+  }
+  vector<IndexRecord> records(entries.size());
+  vector<uint32_t> buckets(bucket_count, 0);
+  string strings;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const LogEntry& entry = *entries[i];
+    IndexRecord& record = records[i];
+    record.command_hash = entry.command_hash;
+    record.mtime = entry.mtime;
+    record.start_time = entry.start_time;
+    record.end_time = entry.end_time;
+    record.output_offset = strings.size();
+    record.output_size = entry.output.size();
+    strings.append(entry.output);
+
+    uint32_t mask = bucket_count - 1;
+    uint32_t bucket =
+        MurmurHash64A(entry.output.data(), entry.output.size()) & mask;
+    while (buckets[bucket])
+      bucket = (bucket + 1) & mask;
+    buckets[bucket] = i + 1;
+  }
+
+  IndexHeader header;
+  header.byte_order = kByteOrderMark;
+  header.index_record_size = sizeof(IndexRecord);
+  header.appended_record_size = sizeof(AppendedRecord);
+  header.entry_count = entries.size();
+  header.bucket_count = bucket_count;
+  header.strings_size = strings.size();
+  strings.resize(AlignTo8(strings.size()), '\0');
+
+  return fwrite(signature, sizeof(signature), 1, f) == 1 &&
+         fwrite(&header, sizeof(header), 1, f) == 1 &&
+         fwrite(records.data(), sizeof(IndexRecord), records.size(), f) ==
+             records.size() &&
+         fwrite(strings.data(), 1, strings.size(), f) == strings.size() &&
+         fwrite(buckets.data(), sizeof(uint32_t), buckets.size(), f) ==
+             buckets.size() &&
+         fwrite("\0\0\0\0", 1, bucket_count % 2 * 4, f) ==
+             bucket_count % 2 * 4;
+}
+
+bool BuildLog::Recompact(const string& path, const BuildLogUser& user,
+                         string* err) {
+  return StartRecompact(path, user, err) && FinishRecompact(err);
+}
 
-  if (fprintf(f, kFileSignature, kCurrentVersion) < 0) {
+bool BuildLog::StartRecompact(const string& path, const BuildLogUser& user,
+                              string* err) {
+  Close();
+  std::unique_ptr<Recompaction> recompaction(new Recompaction);
+  recompaction->path = path;
+  recompaction->temp_path = path + ".recompact";
+  if (stat(path.c_str(), &recompaction->st) < 0) {
     *err = strerror(errno);
-    fclose(f);
     return false;
   }
 
+  ReadIndex();
   vector<StringPiece> dead_outputs;
   for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
-    if (user.IsPathDead(i->first)) {
+    if (user.IsPathDead(i->first))
       dead_outputs.push_back(i->first);
-      continue;
-    }
+    else
+      recompaction->entries.push_back(*i->second);
+  }
+  for (size_t i = 0; i < dead_outputs.size(); ++i)
+    entries_.erase(dead_outputs[i]);
 
-    if (!WriteEntry(f, *i->second)) {
-      *err = strerror(errno);
-      fclose(f);
-      return false;
+  Recompaction* r = recompaction.get();
+  recompaction->writer = thread([r]() {
+    METRIC_RECORD(".ninja_log recompact");
+    r->ok = false;
+    FILE* f = fopen(r->temp_path.c_str(), "wb");
+    if (!f) {
+      r->err = strerror(errno);
+      return;
     }
+    vector<LogEntry*> entries(r->entries.size());
+    for (size_t i = 0; i < entries.size(); ++i)
+      entries[i] = &r->entries[i];
+    r->ok = WriteIndexed(f, entries);
+    if (!r->ok)
+      r->err = strerror(errno);
+    if (fclose(f) != 0 && r->ok) {
+      r->ok = false;
+      r->err = strerror(errno);
+    }
+  });
+  recompaction_.swap(recompaction);
+  needs_recompaction_ = false;
+  return true;
+}
+
+bool BuildLog::FinishRecompact(string* err) {
+  if (!recompaction_)
+    return true;
+  std::unique_ptr<Recompaction> r;
+  r.swap(recompaction_);
+  r->writer.join();
+  // Entries recorded from here on go to the new file, once it is in place.
+  if (!log_file_.Close()) {
+    *err = strerror(errno);
+    unlink(r->temp_path.c_str());
+    return false;
   }
 
-  for (size_t i = 0; i < dead_outputs.size(); ++i)
-    entries_.erase(dead_outputs[i]);
+  // The file must be the one the entries were taken from, so that what
+  // follows them is what was appended since.
+  struct stat st;
+  if (r->ok && (stat(r->path.c_str(), &st) < 0 || st.st_dev != r->st.st_dev ||
+                st.st_ino != r->st.st_ino || st.st_size < r->st.st_size)) {
+    r->ok = false;
+    r->err = "the log was replaced while it was rewritten";
+  }
+  if (r->ok) {
+    FILE* log = fopen(r->path.c_str(), "rb");
+    FILE* f = fopen(r->temp_path.c_str(), "ab");
+    r->ok = log && f && fseek(log, r->st.st_size, SEEK_SET) == 0;
+    char buf[64 << 10];
+    size_t size;
+    while (r->ok && (size = fread(buf, 1, sizeof(buf), log)) > 0)
+      r->ok = fwrite(buf, 1, size, f) == size;
+    if (r->ok && ferror(log))
+      r->ok = false;
+    if (f && fclose(f) != 0)
+      r->ok = false;
+    if (log)
+      fclose(log);
+    if (!r->ok)
+      r->err = strerror(errno);
+  }
+  if (!r->ok) {
+    unlink(r->temp_path.c_str());
+    *err = r->err;
+    return false;
+  }
 
-  fclose(f);
-  if (unlink(path.c_str()) < 0) {
+  if (unlink(r->path.c_str()) < 0) {
     *err = strerror(errno);
     return false;
   }
 
-  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+  if (rename(r->temp_path.c_str(), r->path.c_str()) < 0) {
     *err = strerror(errno);
     return false;
   }
@@ -452,11 +835,8 @@ bool BuildLog::Restat(const StringPiece path,
     return false;
   }
 
-  if (fprintf(f, kFileSignature, kCurrentVersion) < 0) {
-    *err = strerror(errno);
-    fclose(f);
-    return false;
-  }
+  ReadIndex();
+  vector<LogEntry*> entries;
   for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
     bool skip = output_count > 0;
     for (int j = 0; j < output_count; ++j) {
@@ -473,12 +853,13 @@ bool BuildLog::Restat(const StringPiece path,
       }
       i->second->mtime = mtime;
     }
+    entries.push_back(i->second);
+  }
 
-    if (!WriteEntry(f, *i->second)) {
-      *err = strerror(errno);
-      fclose(f);
-      return false;
-    }
+  if (!WriteIndexed(f, entries)) {
+    *err = strerror(errno);
+    fclose(f);
+    return false;
   }
 
   fclose(f);
@@ -15,11 +15,14 @@
 #ifndef NINJA_BUILD_LOG_H_
 #define NINJA_BUILD_LOG_H_
 
+#include <memory>
 #include <string>
+#include <vector>
 #include <stdio.h>
 
 #include "hash_map.h"
 #include "load_status.h"
+#include "log_writer.h"
 #include "timestamp.h"
 #include "util.h"  // uint64_t
 
@@ -40,6 +43,10 @@ struct BuildLogUser {
 ///    when we need to rebuild due to the command changing
 /// 2) timing information, perhaps for generating reports
 /// 3) restat information
+///
+/// The log is binary: an index of the entries as of the last recompaction,
+/// which is looked up where it is mapped, followed by the entries of the
+/// commands run since.  Older, text logs are read and then rewritten.
 struct BuildLog {
   BuildLog();
   ~BuildLog();
@@ -52,9 +59,13 @@ struct BuildLog {
                      TimeStamp mtime = 0);
   void Close();
 
-  /// Load the on-disk log.
+  /// Load the on-disk log.  Uses what Prefetch() read, if it read \a path.
   LoadStatus Load(const std::string& path, std::string* err);
 
+  /// Read \a path as Load() would, but without changing it on disk, so that
+  /// this can run on another thread while the manifest loads.
+  void Prefetch(const std::string& path);
+
   struct LogEntry {
     std::string output;
     uint64_t command_hash;
@@ -77,31 +88,83 @@ struct BuildLog {
   };
 
   /// Lookup a previously-run command by its output path.
-  LogEntry* LookupByOutput(const std::string& path);
+  LogEntry* LookupByOutput(StringPiece path);
 
-  /// Serialize an entry into a log file.
-  bool WriteEntry(FILE* f, const LogEntry& entry);
+  /// Serialize an entry onto \a out, as it is appended to a log file.
+  static void EncodeEntry(const LogEntry& entry, std::string* out);
+
+  /// Write the known log entries in the text format of version 6, for
+  /// tools that read that.
+  bool WriteText(FILE* f);
 
   /// Rewrite the known log entries, throwing away old data.
   bool Recompact(const std::string& path, const BuildLogUser& user,
                  std::string* err);
 
+  /// Begin a Recompact() that writes the new file on another thread, so
+  /// that commands can be recorded meanwhile.  Close() finishes it.
+  bool StartRecompact(const std::string& path, const BuildLogUser& user,
+                      std::string* err);
+
+  /// Wait for the new file StartRecompact() is writing, add the entries
+  /// appended to the log since, and replace the log with it.  Fails,
+  /// leaving the log as it is, if the log was replaced meanwhile.  Does
+  /// nothing if no recompaction is running.
+  bool FinishRecompact(std::string* err);
+
   /// Restat all outputs in the log
   bool Restat(StringPiece path, const DiskInterface& disk_interface,
               int output_count, char** outputs, std::string* err);
 
   typedef ExternalStringHashMap<LogEntry*>::Type Entries;
-  const Entries& entries() const { return entries_; }
+  /// All entries, including those only in the index so far.
+  const Entries& entries();
 
  private:
   /// Should be called before using log_file_. When false is returned, errno
   /// will be set.
   bool OpenForWriteIfNeeded();
 
+  /// Read \a path into entries_ and index_.  A log that can't be used, of
+  /// an unsupported version or damaged, sets \a start_over, for Load() to
+  /// remove.
+  LoadStatus Read(const std::string& path, bool* start_over,
+                  std::string* err);
+  /// Read() of a binary log.
+  LoadStatus ReadIndexed(const std::string& path, bool* start_over,
+                         std::string* err);
+
+  /// Move the entries of the index that are not in entries_ yet there, and
+  /// drop it.
+  void ReadIndex();
+
+  /// Write the signature and an index of \a entries.
+  static bool WriteIndexed(FILE* f, const std::vector<LogEntry*>& entries);
+
+  /// The index of a binary log; see build_log.cc.
+  struct Index;
+  std::unique_ptr<Index> index_;
+
+  /// The outcome of Prefetch(), which Load() reports.
+  struct Prefetched {
+    std::string path;
+    LoadStatus status;
+    bool start_over;
+    std::string err;
+  };
+  std::unique_ptr<Prefetched> prefetched_;
+
+  /// A recompaction running on another thread; see build_log.cc.
+  struct Recompaction;
+  std::unique_ptr<Recompaction> recompaction_;
+
   Entries entries_;
-  FILE* log_file_;
+  LogWriter log_file_;
   std::string log_file_path_;
   bool needs_recompaction_;
+  /// Whether entries can be appended to the log file as it is, which
+  /// StartRecompact() needs.  Not so for text logs and cut-off files.
+  bool appendable_;
 };
 
 #endif // NINJA_BUILD_LOG_H_
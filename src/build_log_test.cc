@@ -85,9 +85,10 @@ TEST_F(BuildLogTest, FirstWriteAddsSignature) {
 
   ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
   ASSERT_EQ("", err);
+  string first_contents = contents;
   if (contents.size() >= kVersionPos)
     contents[kVersionPos] = 'X';
-  EXPECT_EQ(kExpectedVersion, contents);
+  EXPECT_EQ(kExpectedVersion, contents.substr(0, strlen(kExpectedVersion)));
 
   // Opening the file anew shouldn't add a second version string.
   EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
@@ -97,9 +98,7 @@ TEST_F(BuildLogTest, FirstWriteAddsSignature) {
   contents.clear();
   ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
   ASSERT_EQ("", err);
-  if (contents.size() >= kVersionPos)
-    contents[kVersionPos] = 'X';
-  EXPECT_EQ(kExpectedVersion, contents);
+  EXPECT_EQ(first_contents, contents);
 }
 
 TEST_F(BuildLogTest, DoubleEntry) {
@@ -163,6 +162,176 @@ TEST_F(BuildLogTest, Truncate) {
   }
 }
 
+TEST_F(BuildLogTest, Index) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+  {
+    BuildLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    log.RecordCommand(state_.edges_[0], 15, 18);
+    log.RecordCommand(state_.edges_[1], 20, 25);
+    log.Close();
+    EXPECT_TRUE(log.Recompact(kTestFilename, *this, &err));
+  }
+
+  // Both entries are in the index; running one command again appends to it.
+  {
+    BuildLog log;
+    string err;
+    EXPECT_EQ(LOAD_SUCCESS, log.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    BuildLog::LogEntry* e = log.LookupByOutput("mid");
+    ASSERT_TRUE(e);
+    EXPECT_EQ(20, e->start_time);
+    EXPECT_FALSE(log.LookupByOutput("in"));
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    log.RecordCommand(state_.edges_[0], 30, 40);
+    log.Close();
+  }
+
+  BuildLog log;
+  string err;
+  EXPECT_EQ(LOAD_SUCCESS, log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(30, e->start_time);
+  EXPECT_EQ(40, e->end_time);
+  ASSERT_EQ(2u, log.entries().size());
+  e = log.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(25, e->end_time);
+}
+
+TEST_F(BuildLogTest, ConvertText) {
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v6\n");
+  fprintf(f, "1\t2\t3\tout\t%" PRIx64 "\n",
+      BuildLog::LogEntry::HashCommand("command"));
+  fclose(f);
+
+  // A text log is rewritten as an index when opened for writing.
+  {
+    BuildLog log;
+    string err;
+    EXPECT_EQ(LOAD_SUCCESS, log.Load(kTestFilename, &err));
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    log.Close();
+  }
+  string contents, err;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  EXPECT_EQ(0u, contents.find("# ninja log v7\n"));
+
+  BuildLog log;
+  EXPECT_EQ(LOAD_SUCCESS, log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(3, e->mtime);
+  ASSERT_NO_FATAL_FAILURE(AssertHash("command", e->command_hash));
+
+  // And written back as text on request.
+  f = fopen(kTestFilename, "wb");
+  EXPECT_TRUE(log.WriteText(f));
+  fclose(f);
+  contents.clear();
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  char expected[128];
+  snprintf(expected, sizeof(expected), "# ninja log v6\n1\t2\t3\tout\t%" PRIx64
+           "\n", BuildLog::LogEntry::HashCommand("command"));
+  EXPECT_EQ(expected, contents);
+}
+
+namespace {
+
+/// Write an index header with \a byte_order and \a record_size for both
+/// record kinds, and nothing after it.
+void WriteIndexHeader(uint32_t byte_order, uint16_t record_size,
+                      uint32_t entry_count, uint32_t bucket_count) {
+  FILE* f = fopen(kTestFilename, "wb");
+  char signature[16] = "# ninja log v7\n";
+  const uint16_t sizes[2] = { record_size, record_size };
+  const uint32_t counts[2] = { entry_count, bucket_count };
+  const uint64_t strings_size = 0;
+  fwrite(signature, sizeof(signature), 1, f);
+  fwrite(&byte_order, sizeof(byte_order), 1, f);
+  fwrite(sizes, sizeof(sizes), 1, f);
+  fwrite(counts, sizeof(counts), 1, f);
+  fwrite(&strings_size, sizeof(strings_size), 1, f);
+  fclose(f);
+}
+
+}  // namespace
+
+TEST_F(BuildLogTest, DamagedIndex) {
+  // A header claiming more records than the file holds.
+  WriteIndexHeader(0x01020304, 32, 1000, 2048);
+
+  string err;
+  BuildLog log;
+  EXPECT_EQ(LOAD_NOT_FOUND, log.Load(kTestFilename, &err));
+  EXPECT_NE(err.find("damaged"), string::npos);
+  struct stat st;
+  EXPECT_NE(0, stat(kTestFilename, &st));
+}
+
+TEST_F(BuildLogTest, ForeignIndex) {
+  // An empty index, as another byte order would write it...
+  WriteIndexHeader(0x04030201, 32, 0, 0);
+  string err;
+  BuildLog log;
+  EXPECT_EQ(LOAD_NOT_FOUND, log.Load(kTestFilename, &err));
+  EXPECT_NE(err.find("byte order"), string::npos);
+  struct stat st;
+  EXPECT_NE(0, stat(kTestFilename, &st));
+
+  // ...or with records of another width.
+  WriteIndexHeader(0x01020304, 40, 0, 0);
+  err.clear();
+  BuildLog other;
+  EXPECT_EQ(LOAD_NOT_FOUND, other.Load(kTestFilename, &err));
+  EXPECT_NE(err.find("layout"), string::npos);
+  EXPECT_NE(0, stat(kTestFilename, &st));
+
+  // The header a real index starts with is accepted.
+  WriteIndexHeader(0x01020304, 32, 0, 0);
+  err.clear();
+  BuildLog empty;
+  EXPECT_EQ(LOAD_SUCCESS, empty.Load(kTestFilename, &err));
+  EXPECT_EQ("", err);
+}
+
+TEST_F(BuildLogTest, WriteTextSorted) {
+  AssertParse(&state_,
+"build c: cat in\n"
+"build a: cat in\n"
+"build d: cat in\n"
+"build b: cat in\n");
+
+  BuildLog log;
+  string err;
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  for (size_t i = 0; i < state_.edges_.size(); ++i)
+    log.RecordCommand(state_.edges_[i], 1, 2);
+  log.Close();
+
+  // Entries come out by output, not in hash map order.
+  FILE* f = fopen(kTestFilename, "wb");
+  EXPECT_TRUE(log.WriteText(f));
+  fclose(f);
+  string contents;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  size_t a = contents.find("\ta\t"), b = contents.find("\tb\t");
+  size_t c = contents.find("\tc\t"), d = contents.find("\td\t");
+  ASSERT_NE(string::npos, d);
+  EXPECT_LT(a, b);
+  EXPECT_LT(b, c);
+  EXPECT_LT(c, d);
+}
+
 TEST_F(BuildLogTest, ObsoleteOldVersion) {
   FILE* f = fopen(kTestFilename, "wb");
   fprintf(f, "# ninja log v3\n");
@@ -175,6 +344,45 @@ TEST_F(BuildLogTest, ObsoleteOldVersion) {
   ASSERT_NE(err.find("version"), string::npos);
 }
 
+TEST_F(BuildLogTest, Prefetch) {
+  AssertParse(&state_, "build out: cat in\n");
+  {
+    BuildLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    log.RecordCommand(state_.edges_[0], 15, 18);
+    log.Close();
+  }
+
+  // Load() uses what Prefetch() read from the same path...
+  BuildLog log1;
+  log1.Prefetch(kTestFilename);
+  string err;
+  EXPECT_EQ(LOAD_SUCCESS, log1.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log1.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(15, e->start_time);
+
+  // ...and forgets what it read from elsewhere.
+  BuildLog log2;
+  log2.Prefetch(kTestFilename);
+  EXPECT_EQ(LOAD_NOT_FOUND, log2.Load("BuildLogTest-missing", &err));
+  EXPECT_EQ(0u, log2.entries().size());
+
+  // Only Load() starts over on an old version.
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v3\n");
+  fclose(f);
+  BuildLog log3;
+  log3.Prefetch(kTestFilename);
+  struct stat st;
+  EXPECT_EQ(0, stat(kTestFilename, &st));
+  EXPECT_EQ(LOAD_NOT_FOUND, log3.Load(kTestFilename, &err));
+  EXPECT_NE(err.find("version"), string::npos);
+  EXPECT_NE(0, stat(kTestFilename, &st));
+}
+
 TEST_F(BuildLogTest, SpacesInOutput) {
   FILE* f = fopen(kTestFilename, "wb");
   fprintf(f, "# ninja log v6\n");
@@ -325,6 +533,24 @@ TEST_F(BuildLogTest, MultiTargetEdge) {
   ASSERT_EQ(22, e2->end_time);
 }
 
+TEST_F(BuildLogTest, PrecomputedCommandHash) {
+  AssertParse(&state_,
+"build out: cat in\n"
+"build out2: cat in\n");
+  state_.edges_[1]->command_hash_ = 42;
+
+  BuildLog log;
+  log.RecordCommand(state_.edges_[0], 1, 2);
+  log.RecordCommand(state_.edges_[1], 1, 2);
+
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_NO_FATAL_FAILURE(AssertHash("cat in > out", e->command_hash));
+  e = log.LookupByOutput("out2");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(42u, e->command_hash);
+}
+
 struct BuildLogRecompactTest : public BuildLogTest {
   virtual bool IsPathDead(StringPiece s) const { return s == "out2"; }
 };
@@ -365,4 +591,79 @@ TEST_F(BuildLogRecompactTest, Recompact) {
   ASSERT_FALSE(log2.LookupByOutput("out2"));
 }
 
+TEST_F(BuildLogRecompactTest, RecordWhileRecompacting) {
+  AssertParse(&state_,
+"build out: cat in\n"
+"build out2: cat in\n"
+"build out3: cat in\n");
+
+  {
+    BuildLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    for (int i = 0; i < 200; ++i)
+      log.RecordCommand(state_.edges_[0], 15, 18 + i);
+    log.RecordCommand(state_.edges_[1], 21, 22);
+    log.Close();
+  }
+
+  // The recompaction runs while commands are recorded, which end up after
+  // the index it writes.
+  BuildLog log;
+  string err;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+  log.RecordCommand(state_.edges_[0], 30, 31);
+  log.RecordCommand(state_.edges_[2], 32, 33);
+  log.Close();
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, log2.entries().size());
+  BuildLog::LogEntry* e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(31, e->end_time);
+  e = log2.LookupByOutput("out3");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(33, e->end_time);
+  EXPECT_FALSE(log2.LookupByOutput("out2"));
+
+  struct stat st;
+  ASSERT_EQ(0, stat(kTestFilename, &st));
+  EXPECT_LT(st.st_size, 1000);
+}
+
+TEST_F(BuildLogRecompactTest, ReplacedWhileRecompacting) {
+  AssertParse(&state_, "build out: cat in\n");
+  {
+    BuildLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    log.RecordCommand(state_.edges_[0], 15, 18);
+    log.Close();
+  }
+
+  BuildLog log;
+  string err;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  EXPECT_TRUE(log.StartRecompact(kTestFilename, *this, &err));
+
+  // Another process replaces the log meanwhile; it is kept.
+  string replaced = string(kTestFilename) + ".other";
+  FILE* f = fopen(replaced.c_str(), "wb");
+  ASSERT_TRUE(f);
+  fprintf(f, "# ninja log v6\n");
+  fclose(f);
+  ASSERT_EQ(0, rename(replaced.c_str(), kTestFilename));
+  EXPECT_FALSE(log.FinishRecompact(&err));
+  EXPECT_EQ("the log was replaced while it was rewritten", err);
+
+  string recompacted = string(kTestFilename) + ".recompact";
+  struct stat st;
+  EXPECT_NE(0, stat(recompacted.c_str(), &st));
+  ASSERT_EQ(0, stat(kTestFilename, &st));
+  EXPECT_EQ(15, (int)st.st_size);
+}
+
 }  // anonymous namespace
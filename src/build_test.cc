@@ -645,7 +645,7 @@ bool FakeCommandRunner::StartCommand(Edge* edge) {
       edge->rule().name() == "touch-fail-tick2") {
     for (vector<Node*>::iterator out = edge->outputs_.begin();
          out != edge->outputs_.end(); ++out) {
-      fs_->Create((*out)->path(), "");
+      fs_->Create((*out)->path().AsString(), "");
     }
   } else if (edge->rule().name() == "true" ||
              edge->rule().name() == "fail" ||
@@ -657,9 +657,9 @@ bool FakeCommandRunner::StartCommand(Edge* edge) {
     assert(edge->outputs_.size() == 1);
     string content;
     string err;
-    if (fs_->ReadFile(edge->inputs_[0]->path(), &content, &err) ==
+    if (fs_->ReadFile(edge->inputs_[0]->path().AsString(), &content, &err) ==
         DiskInterface::Okay)
-      fs_->WriteFile(edge->outputs_[0]->path(), content);
+      fs_->WriteFile(edge->outputs_[0]->path().AsString(), content);
   } else if (edge->rule().name() == "touch-implicit-dep-out") {
     string dep = edge->GetBinding("test_dependency");
     fs_->Tick();
@@ -667,13 +667,13 @@ bool FakeCommandRunner::StartCommand(Edge* edge) {
     fs_->Tick();
     for (vector<Node*>::iterator out = edge->outputs_.begin();
          out != edge->outputs_.end(); ++out) {
-      fs_->Create((*out)->path(), "");
+      fs_->Create((*out)->path().AsString(), "");
     }
   } else if (edge->rule().name() == "touch-out-implicit-dep") {
     string dep = edge->GetBinding("test_dependency");
     for (vector<Node*>::iterator out = edge->outputs_.begin();
          out != edge->outputs_.end(); ++out) {
-      fs_->Create((*out)->path(), "");
+      fs_->Create((*out)->path().AsString(), "");
     }
     fs_->Tick();
     fs_->Create(dep, "");
@@ -688,8 +688,8 @@ bool FakeCommandRunner::StartCommand(Edge* edge) {
     string contents;
     for (vector<Node*>::iterator out = edge->outputs_.begin();
          out != edge->outputs_.end(); ++out) {
-      contents += (*out)->path() + ": " + dep + "\n";
-      fs_->Create((*out)->path(), "");
+      contents += (*out)->path().AsString() + ": " + dep + "\n";
+      fs_->Create((*out)->path().AsString(), "");
     }
     fs_->Create(depfile, contents);
   } else if (edge->rule().name() == "long-cc") {
@@ -701,8 +701,8 @@ bool FakeCommandRunner::StartCommand(Edge* edge) {
       fs_->Tick();
       fs_->Tick();
       fs_->Tick();
-      fs_->Create((*out)->path(), "");
-      contents += (*out)->path() + ": " + dep + "\n";
+      fs_->Create((*out)->path().AsString(), "");
+      contents += (*out)->path().AsString() + ": " + dep + "\n";
     }
     if (!dep.empty() && !depfile.empty())
       fs_->Create(depfile, contents);
@@ -751,7 +751,7 @@ bool FakeCommandRunner::WaitForCommand(Result* result) {
     const std::string prefix = edge->GetBinding("msvc_deps_prefix");
     for (std::vector<Node*>::iterator in = edge->inputs_.begin();
          in != edge->inputs_.end(); ++in) {
-      result->output += prefix + (*in)->path() + '\n';
+      result->output += prefix + (*in)->path().AsString() + '\n';
     }
   }
 
@@ -2787,6 +2787,56 @@ TEST_F(BuildWithDepsLogTest, TestInputMtimeRaceCondition) {
   }
 }
 
+/// ninja exit()s once the build is done, so the logs are never destroyed:
+/// Close() alone must get every record of the build to disk.
+TEST_F(BuildWithDepsLogTest, CloseWritesRecordsOut) {
+  string err;
+  const char* manifest =
+      "build out: cat in1\n"
+      "  deps = gcc\n"
+      "  depfile = in1.d\n";
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AddCatRule(&state));
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+  BuildLog build_log;
+  ASSERT_TRUE(build_log.Load(build_log_file_.path(), &err));
+  ASSERT_TRUE(build_log.OpenForWrite(build_log_file_.path(), *this, &err));
+  DepsLog deps_log;
+  ASSERT_TRUE(deps_log.Load(deps_log_file_.path(), &state, &err));
+  ASSERT_TRUE(deps_log.OpenForWrite(deps_log_file_.path(), &err));
+
+  Builder builder(&state, config_, &build_log, &deps_log, &fs_, &status_, 0);
+  builder.command_runner_.reset(&command_runner_);
+  EXPECT_TRUE(builder.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  fs_.Create("in1.d", "out: in2");
+  EXPECT_TRUE(builder.Build(&err));
+  EXPECT_EQ("", err);
+  builder.command_runner_.release();
+
+  build_log.Close();
+  deps_log.Close();
+
+  // Read the files back while the logs that wrote them are still alive.
+  BuildLog build_log2;
+  ASSERT_TRUE(build_log2.Load(build_log_file_.path(), &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(build_log2.LookupByOutput("out"));
+
+  State state2;
+  ASSERT_NO_FATAL_FAILURE(AddCatRule(&state2));
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state2, manifest));
+  DepsLog deps_log2;
+  ASSERT_TRUE(deps_log2.Load(deps_log_file_.path(), &state2, &err));
+  ASSERT_EQ("", err);
+  DepsLog::Deps* deps = deps_log2.GetDeps(state2.GetNode("out", 0));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(1, deps->node_count);
+  EXPECT_EQ("in2", deps->nodes[0]->path());
+}
+
 TEST_F(BuildWithDepsLogTest, TestInputMtimeRaceConditionWithDepFile) {
   string err;
   const char* manifest =
@@ -1,15 +1,446 @@
 #include "cnobi.h"
 #include "../cnobi/manifest.h"
 
+#include "arena.h"
+#include "disk_interface.h"
 #include "eval_env.h"
+#include "hash_map.h"
 #include "state.h"
 #include "version.h"
 #include "util.h"
 #include "metrics.h"
+#include "subprocess.h"
+#include "thread_pool.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
 #include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+/// Flags passed to the compiler after CNobi::CompilerCommand().  They are
+/// part of the cache keys, so changing them invalidates cached objects.
+const char kSharedFlags[] = "-fPIC -shared";
+const char kObjectFlags[] = "-fPIC -c";
+const char kLinkFlags[] = "-shared";
+
+/// Line prefix in a generated root source naming one of its shards.
+const char kShardDirective[] = "// cnobi-shard: ";
+
+/// Collect the shard sources listed in \a contents, relative to \a dir.
+void ReadShardDirectives(const std::string& contents, const std::string& dir,
+                         std::vector<std::string>* shards) {
+  const size_t prefix_len = sizeof(kShardDirective) - 1;
+  for (size_t pos = 0; pos < contents.size();) {
+    size_t end = contents.find('\n', pos);
+    if (end == std::string::npos)
+      end = contents.size();
+    if (contents.compare(pos, prefix_len, kShardDirective) == 0) {
+      std::string path = contents.substr(pos + prefix_len,
+                                         end - pos - prefix_len);
+      if (!path.empty() && path[path.size() - 1] == '\r')
+        path.resize(path.size() - 1);
+      shards->push_back(path[0] == '/' ? path : dir + path);
+    }
+    pos = end + 1;
+  }
+}
+
+/// Cache key of one translation unit: its text, the shared header and the
+/// exact compiler invocation.
+uint64_t SourceKey(const std::string& contents, uint64_t header_hash,
+                   const std::string& flags) {
+  uint64_t key[3];
+  key[0] = MurmurHash64A(contents.data(), contents.size());
+  key[1] = header_hash;
+  key[2] = MurmurHash64A(flags.data(), flags.size());
+  return MurmurHash64A(key, sizeof(key));
+}
+
+std::string CacheEntryPath(const std::string& cache_dir, uint64_t key,
+                           const char* extension) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016" PRIx64 "%s", key, extension);
+  return cache_dir + name;
+}
+
+bool FileExists(const std::string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+bool MakeCacheDir(const std::string& entry, std::string* err) {
+  RealDiskInterface disk_interface;
+  if (!disk_interface.MakeDirs(entry)) {
+    *err = "creating cnobi cache for " + entry + ": " + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+/// Numbers the temporary outputs of this process, whose subninjas may be
+/// compiled on several threads at once, and more than once each.
+std::atomic<unsigned> g_next_temp_id(0);
+
+/// A compiler invocation producing one cache entry.  The output is written
+/// under a private name and renamed into place once complete, so that
+/// concurrent ninja processes sharing the cache never observe a partial file.
+struct CompileStep {
+  void Init(const std::string& flags, const std::string& input,
+            const std::string& output) {
+    Init(flags, std::vector<std::string>(1, input), output);
+  }
+
+  void Init(const std::string& flags, const std::vector<std::string>& inputs,
+            const std::string& output) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int)getpid(),
+             g_next_temp_id++);
+    output_path = output;
+    temp_path = output + suffix;
+    description = inputs.size() == 1 ? inputs[0] : output;
+    command = flags + " -o ";
+    GetShellEscapedString(temp_path, &command);
+    for (std::vector<std::string>::const_iterator i = inputs.begin();
+         i != inputs.end(); ++i) {
+      command += " ";
+      GetShellEscapedString(*i, &command);
+    }
+  }
+
+  std::string command;
+  std::string temp_path;
+  std::string output_path;
+  std::string description;
+};
+
+/// Run \a steps one after the other.  Unlike SubprocessSet, this is safe on
+/// worker threads; compiler diagnostics go straight to the terminal.
+bool RunCompileStepsSerially(const std::vector<CompileStep>& steps,
+                             std::string* err) {
+  for (std::vector<CompileStep>::const_iterator step = steps.begin();
+       step != steps.end(); ++step) {
+    if (std::system(step->command.c_str()) != 0) {
+      *err = "couldn't compile " + step->description;
+      unlink(step->temp_path.c_str());
+      return false;
+    }
+    if (rename(step->temp_path.c_str(), step->output_path.c_str()) < 0) {
+      *err = "renaming " + step->temp_path + ": " + strerror(errno);
+      unlink(step->temp_path.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Run \a steps, with at most one compiler per processor if \a parallel,
+/// reporting the output of any that fail.
+bool RunCompileSteps(const std::vector<CompileStep>& steps, bool parallel,
+                     std::string* err) {
+  if (steps.empty())
+    return true;
+  METRIC_RECORD(".ninja cnobi compile");
+  if (!parallel)
+    return RunCompileStepsSerially(steps, err);
+  const size_t parallelism = std::max(GetProcessorCount(), 1);
+  SubprocessSet subprocs;
+  std::map<Subprocess*, const CompileStep*> running;
+  size_t next = 0;
+  bool failed = false;
+  while (!running.empty() || (!failed && next < steps.size())) {
+    while (!failed && next < steps.size() && running.size() < parallelism) {
+      Subprocess* subproc = subprocs.Add(steps[next].command);
+      if (!subproc) {
+        *err = "couldn't start compiler for " + steps[next].description;
+        failed = true;
+        break;
+      }
+      running[subproc] = &steps[next++];
+    }
+    if (running.empty())
+      break;
+
+    if (subprocs.DoWork()) {
+      subprocs.Clear();
+      for (std::map<Subprocess*, const CompileStep*>::iterator i =
+               running.begin(); i != running.end(); ++i)
+        unlink(i->second->temp_path.c_str());
+      *err = "interrupted by user";
+      return false;
+    }
+
+    while (Subprocess* subproc = subprocs.NextFinished()) {
+      const CompileStep* step = running[subproc];
+      running.erase(subproc);
+      ExitStatus status = subproc->Finish();
+      const std::string& output = subproc->GetOutput();
+      if (!output.empty())
+        fputs(output.c_str(), stderr);
+      delete subproc;
+      if (status != ExitSuccess) {
+        if (!failed)
+          *err = "couldn't compile " + step->description;
+        failed = true;
+        unlink(step->temp_path.c_str());
+      } else if (rename(step->temp_path.c_str(),
+                        step->output_path.c_str()) < 0) {
+        if (!failed)
+          *err = "renaming " + step->temp_path + ": " + strerror(errno);
+        failed = true;
+        unlink(step->temp_path.c_str());
+      }
+    }
+  }
+  return !failed;
+}
+
+/// Expand the tokens of \a eval in \a env, without building an EvalString.
+std::string EvaluateTokens(const struct EvalString_* eval, Env* env) {
+  std::string value;
+  for (; eval->first; ++eval) {
+    if (eval->second == VAR)
+      value.append(env->LookupVariable(eval->first));
+    else
+      value.append(eval->first);
+  }
+  return value;
+}
+
+/// A compiled manifest kept open for as long as the State whose nodes
+/// borrow its strings.
+struct SharedObject : public State::Image {
+  explicit SharedObject(void* handle) : handle_(handle) {}
+  virtual ~SharedObject() { dlclose(handle_); }
+  void* handle_;
+};
+
+/// The arena of a manifest's rules and scopes, released with the State.
+struct ArenaImage : public State::Image {
+  explicit ArenaImage(Arena* arena) : arena_(arena) {}
+  virtual ~ArenaImage() { delete arena_; }
+  Arena* arena_;
+};
+
+}  // namespace
+
+/// A pool named by an edge or rule, declared when merged if it is new.
+struct CNobi::StagedPool {
+  StagedPool() : name(NULL), depth(0) {}
+  StagedPool(const char* name, int depth) : name(name), depth(depth) {}
+  /// NULL or empty for the default pool.
+  const char* name;
+  int depth;
+};
+
+/// A rule with the pool its edges run in unless they name their own, both
+/// worked out once per rule rather than once per edge.
+struct CNobi::ResolvedRule {
+  ResolvedRule() : rule(NULL) {}
+  const Rule* rule;
+  /// Without a name if the rule names no pool.
+  StagedPool pool;
+};
+
+/// A path evaluated and canonicalized off the main thread, one the
+/// generator left canonical in the manifest image, or one listed in the
+/// node table of its manifest.
+struct CNobi::StagedPath {
+  StagedPath() : image_path(NULL), slash_bits(0), node(kNoNode) {}
+
+  static const size_t kNoNode = static_cast<size_t>(-1);
+
+  StringPiece Path() const {
+    return image_path ? StringPiece(image_path) : StringPiece(path);
+  }
+
+  std::string path;
+  /// The path in the manifest image, without a copy in \a path.
+  const char* image_path;
+  uint64_t slash_bits;
+  /// Index into Manifest::nodes, or kNoNode.
+  size_t node;
+};
+
+/// An edge whose rule, scope and paths have been worked out, ready to be
+/// added to the State.
+struct CNobi::StagedEdge {
+  StagedEdge() : command_hash(0) {}
+  const Rule* rule;
+  StagedPool pool;
+  BindingEnv* env;
+  /// Inputs, implicit inputs, order-only inputs, outputs, implicit outputs
+  /// and validations, in that order.
+  std::vector<StagedPath> paths;
+  size_t implicit_deps;
+  size_t order_only_deps;
+  size_t outs;
+  size_t implicit_outs;
+  size_t validations;
+  /// See Edge::command_hash_.
+  uint64_t command_hash;
+};
+
+/// A compiled manifest with the manifests it includes, converted into its
+/// scope.  Subninjas get a scope of their own and are converted on worker
+/// threads: nothing here touches the State, which is only filled in once
+/// every manifest is converted, in declaration order.
+struct CNobi::Manifest {
+  Manifest(const std::string& path, BindingEnv* scope,
+           const Manifest* parent = NULL)
+      : path(path), scope(scope), parent(parent), arena(new Arena),
+        num_nodes(0), ok(false) {}
+  ~Manifest() {
+    delete arena;
+    for (std::vector<Arena*>::iterator i = chunk_arenas.begin();
+         i != chunk_arenas.end(); ++i)
+      delete *i;
+    for (std::vector<Manifest*>::iterator i = children.begin();
+         i != children.end(); ++i)
+      delete *i;
+    for (std::vector<void*>::iterator i = handles.begin();
+         i != handles.end(); ++i)
+      dlclose(*i);
+  }
+
+  std::string path;
+  BindingEnv* scope;
+  /// The manifest this one is a subninja of, if any.
+  const Manifest* parent;
+  /// Rules, edge scopes and subninja scopes, which the State keeps using;
+  /// converted on the thread converting this manifest.
+  Arena* arena;
+  /// Edge scopes of chunks of edges staged on other threads, one each.
+  std::vector<Arena*> chunk_arenas;
+  /// Shared objects of this manifest and its includes.  Staged names and
+  /// paths point into them; they are handed to the State when merged, as
+  /// nodes keep pointing into them.
+  std::vector<void*> handles;
+  /// Version 1 rules by RuleInfo, converted on first use.
+  std::unordered_map<const struct RuleInfo*, ResolvedRule> rules;
+  /// Pools named by rules, declared when merged.
+  std::vector<StagedPool> pools;
+  /// The pools of the rules above, for subninjas using a rule by name.
+  std::unordered_map<const Rule*, StagedPool> rule_pools;
+  std::vector<StagedEdge> edges;
+  std::vector<StagedPath> defaults;
+  /// Node tables of this manifest and its includes, numbered consecutively,
+  /// and their nodes, created when merged.
+  struct NodeTable {
+    const char* strings;
+    const struct CNobiNode* nodes;
+    size_t size;
+  };
+  std::vector<NodeTable> node_tables;
+  size_t num_nodes;
+  std::vector<Node*> nodes;
+  /// Nodes of the targets of CNobi::set_targets(), which exist even if no
+  /// staged edge names them.
+  std::vector<size_t> targets;
+  std::vector<Manifest*> children;
+  bool ok;
+  std::string err;
+};
+
+/// The arrays of one translation unit of a version 2 manifest.
+struct CNobi::Tables {
+  Tables()
+      : header(NULL), strings(NULL), tokens(NULL), bindings(NULL),
+        paths(NULL), edges(NULL), pools(NULL), rules(NULL), nodes(NULL),
+        producers(NULL), command_hashes(NULL), node_base(0) {}
+
+  /// Look the arrays of \a unit up with \a lookup.  Only the root unit has
+  /// pools, rules, nodes and producers; command hashes are optional.
+  bool Open(const SymbolLookup& lookup, const std::string& unit,
+            const std::string& input_file, std::string* err) {
+    const void** fields[] = {
+      (const void**)&header, (const void**)&strings, (const void**)&tokens,
+      (const void**)&bindings, (const void**)&paths, (const void**)&edges,
+      (const void**)&pools, (const void**)&rules, (const void**)&nodes,
+      (const void**)&producers, (const void**)&command_hashes,
+    };
+    const char* suffixes[] = {
+      "_header", "_strings", "_tokens", "_bindings", "_paths", "_edges",
+      "_pools", "_rules", "_nodes", "_producers", "_command_hashes",
+    };
+    const size_t required = 6;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+      const std::string symbol = unit + suffixes[i];
+      *fields[i] = lookup(symbol);
+      if (!*fields[i] && i < required) {
+        *err = "dlsym failed for " + symbol + " in " + input_file;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const char* String(uint32_t offset) const { return strings + offset; }
+
+  /// Expand the tokens in \a range in \a env.
+  std::string Evaluate(const struct CNobiRange& range, Env* env) const {
+    std::string value;
+    for (uint32_t i = range.begin; i < range.begin + range.count; ++i) {
+      if (tokens[i].kind == VAR)
+        value.append(env->LookupVariable(String(tokens[i].str)));
+      else
+        value.append(String(tokens[i].str));
+    }
+    return value;
+  }
+
+  void ToEvalString(const struct CNobiRange& range, EvalString* eval) const {
+    for (uint32_t i = range.begin; i < range.begin + range.count; ++i) {
+      if (tokens[i].kind == VAR)
+        eval->AddSpecial(String(tokens[i].str));
+      else
+        eval->AddText(String(tokens[i].str));
+    }
+  }
+
+  /// Evaluate and canonicalize path number \a path, unless the generator
+  /// already did.
+  void StagePath(uint32_t path, Env* env, StagedPath* staged) const {
+    const struct CNobiRange& range = paths[path];
+    if (range.count == CNOBI_NODE) {
+      staged->node = node_base + range.begin;
+      return;
+    }
+    if (range.count == 1 && tokens[range.begin].kind == CANON) {
+      staged->image_path = String(tokens[range.begin].str);
+      staged->slash_bits = 0;
+      return;
+    }
+    staged->path = Evaluate(range, env);
+    CanonicalizePath(&staged->path, &staged->slash_bits);
+  }
+
+  const struct CNobiHeader* header;
+  const char* strings;
+  const struct CNobiToken* tokens;
+  const struct CNobiBinding* bindings;
+  const struct CNobiRange* paths;
+  const struct CNobiEdge* edges;
+  const struct CNobiPool* pools;
+  const struct CNobiRule* rules;
+  const struct CNobiNode* nodes;
+  const uint32_t* producers;
+  const uint64_t* command_hashes;
+  /// Index in Manifest::nodes of this manifest's first node.
+  size_t node_base;
+};
 
 size_t GetPathCount(const struct EvalString_* const* paths) {
     if (!paths) return 0;
@@ -22,303 +453,889 @@ size_t GetPathCount(const struct EvalString_* const* paths) {
 }
 
 CNobi::CNobi(State* state, ManifestParserOptions parser_opts):
-  state_(state), parser_opts_(parser_opts){
+  state_(state), parser_opts_(parser_opts), lazy_(false), pool_(NULL) {
     env_ = &state->bindings_;
-    // fprintf(stderr, "Debug: CNobi constructor called\n");
   }
 
 
 bool CNobi::Load(const std::string& input_file, std::string* err, CNobi* parent){
-  // fprintf(stderr, "Debug: CNobi::Load called with input_file=%s\n", input_file.c_str());
   METRIC_RECORD_IF(".ninja cnobi load", parent == NULL);
-  std::string input_so = input_file.substr(0, input_file.size()-1) + "so";
-  // fprintf(stderr, "Debug: Compiled shared object path=%s\n", input_so.c_str());
-
-  void* handle = dlopen(input_so.c_str(), RTLD_NOW);
-  if (!handle){
-    // fprintf(stderr, "Debug: dlopen failed, attempting to compile manifest\n");
-    if(!CompileManifest(input_file, input_so)){
-      *err = "couldn't compile " + input_file;
-      return false;
+  Manifest root(input_file, env_);
+  return Finish(&root, Convert(&root, input_file, true, err), err);
+}
+
+bool CNobi::LoadTables(const std::string& input_file,
+                       const SymbolLookup& lookup, std::string* err) {
+  Manifest root(input_file, env_);
+  return Finish(&root, ConvertTables(&root, lookup, input_file, true, err),
+                err);
+}
+
+bool CNobi::Finish(Manifest* root, bool ok, std::string* err) {
+  if (ok) {
+    root->ok = true;
+    if (!root->children.empty()) {
+      for (std::vector<Manifest*>::iterator i = root->children.begin();
+           i != root->children.end(); ++i)
+        QueueConvert(Workers(), *i);
+      Workers()->Wait();
     }
-    handle = dlopen(input_so.c_str(), RTLD_NOW);
+
+    METRIC_RECORD(".ninja cnobi merge");
+    // Size the path map for every node up front rather than growing it.
+    if (!state_->partial_)
+      state_->paths_.reserve(state_->paths_.size() + CountNodes(root));
+
+    ok = MergeEdges(root, err) && MergeDefaults(root, err);
   }
+  delete pool_;
+  pool_ = NULL;
+  // Even after a failure, scopes of the State may hold rules from them.
+  KeepArenas(root);
+  return ok;
+}
+
+void CNobi::KeepArenas(Manifest* manifest) {
+  state_->AddImage(new ArenaImage(manifest->arena));
+  manifest->arena = NULL;
+  for (std::vector<Arena*>::iterator i = manifest->chunk_arenas.begin();
+       i != manifest->chunk_arenas.end(); ++i)
+    state_->AddImage(new ArenaImage(*i));
+  manifest->chunk_arenas.clear();
+  for (std::vector<Manifest*>::iterator i = manifest->children.begin();
+       i != manifest->children.end(); ++i)
+    KeepArenas(*i);
+}
+
+void CNobi::QueueConvert(ThreadPool* pool, Manifest* manifest) {
+  pool->Add([this, pool, manifest]() {
+    manifest->ok = Convert(manifest, manifest->path, false, &manifest->err);
+    if (!manifest->ok)
+      return;
+    for (std::vector<Manifest*>::iterator i = manifest->children.begin();
+         i != manifest->children.end(); ++i)
+      QueueConvert(pool, *i);
+  });
+}
+
+bool CNobi::Convert(Manifest* manifest, const std::string& input_file,
+                    bool parallel_compile, std::string* err) {
+  std::string input_so;
+  if (!LocateCompiledManifest(input_file, parallel_compile, &input_so, err))
+    return false;
 
+  void* handle;
+  {
+    METRIC_RECORD(".ninja cnobi dlopen");
+    handle = dlopen(input_so.c_str(), RTLD_NOW);
+  }
   if (!handle) {
-    *err = "dlopen failed for " + input_so;
+    *err = "dlopen failed for " + input_so + ": " + dlerror();
     return false;
   }
+  manifest->handles.push_back(handle);
 
-  // fprintf(stderr, "Debug: dlopen succeeded\n");
-  StateInfo* manifest = reinterpret_cast<StateInfo*>(dlsym(handle, "manifest"));
-  if (!manifest) {
-    *err = "dlsym failed for manifest";
-    dlclose(handle);
-    return false;
+  if (dlsym(handle, "cnobi_header")) {
+    return ConvertTables(manifest, [handle](const std::string& symbol) {
+      return static_cast<const void*>(dlsym(handle, symbol.c_str()));
+    }, input_file, parallel_compile, err);
   }
 
-  // fprintf(stderr, "Debug: dlsym succeeded\n");
+  StateInfo* info = reinterpret_cast<StateInfo*>(dlsym(handle, "manifest"));
+  if (!info) {
+    *err = "dlsym failed for manifest in " + input_file;
+    return false;
+  }
 
-  if (manifest->bindings) {
-    // fprintf(stderr, "Debug: Processing bindings\n");
-    const struct Binding* bind = manifest->bindings;
+  BindingEnv* env = manifest->scope;
+  if (info->bindings) {
+    const struct Binding* bind = info->bindings;
     while (bind->key) {
-      const EvalString* es = ConvertEvalStringArray(bind->val);
-      const std::string eval_val = es->Evaluate(env_);
+      const std::string eval_val = EvaluateTokens(bind->val, env);
       if (std::string(bind->key) == "ninja_required_version" )
         CheckNinjaVersion(eval_val);
-      env_->AddBinding(bind->key, eval_val);
-      // fprintf(stderr, "Debug: Added binding key=%s, value=%s\n", bind->key, eval_val.c_str());
+      env->AddBinding(bind->key, eval_val);
       bind++;
     }
   }
 
-  if (manifest->edges) {
-    // fprintf(stderr, "Debug: Processing edges\n");
-    const struct EdgeInfo* edge = manifest->edges;
-    // size_t edge_number = 0;
-    while (edge->rule) {
-      // fprintf(stderr, "Debug: Processing edge %zu\n", edge_number);
-
-        const Rule* rule = env_->LookupRuleCurrentScope(edge->rule->name);
-        Edge* edge_;
-        if (rule == NULL) {
-            // fprintf(stderr, "Debug: Rule not found, creating new rule\n");
-            const Rule* rule_ = ToRule(edge->rule);
-            env_->AddRule(rule_);
-            edge_ = state_->AddEdge(rule_);
-        } else {
-            // fprintf(stderr, "Debug: Rule found, adding edge\n");
-            edge_ = state_->AddEdge(rule);
-        }
+  // Declare the rules up front, so that subninjas can refer to them.
+  if (info->rules) {
+    for (const struct RuleInfo* const* rule = info->rules; *rule; ++rule) {
+      if (!LookupRule(manifest, *rule, err))
+        return false;
+    }
+  }
 
-      BindingEnv* env = edge->bindings ? new BindingEnv(env_) : env_;
-      if (edge->bindings) {
-        // fprintf(stderr, "Debug: Processing edge bindings\n");
-        const struct Binding* bind = edge->bindings;
-        while (bind->key) {
-          // fprintf(stderr, "Debug: Processing binding key=%s\n", bind->key);
-          const EvalString* es = ConvertEvalStringArray(bind->val);
-          const std::string eval_val = es->Evaluate(env_);
-          // fprintf(stderr, "Debug: Evaluated value for key=%s is %s\n", bind->key, eval_val.c_str());
-          env->AddBinding(bind->key, eval_val);
-          // fprintf(stderr, "Debug: Added edge binding key=%s, value=%s\n", bind->key, eval_val.c_str());
-          bind++;
-        }
-      }
+  // Included manifests share this one's scope.
+  if (info->include) {
+    for (const struct EvalString_* const* inc = info->include; *inc; ++inc) {
+      std::string path = EvaluateTokens(*inc, env);
+      if (!Convert(manifest, path, parallel_compile, err))
+        return false;
+    }
+  }
 
-      edge_->env_ = env;
-
-      if (edge->pool) {
-        // fprintf(stderr, "Debug: Processing edge pool\n");
-        if (edge->pool->name && edge->pool->name[0]) {
-          Pool* pool = state_->LookupPool(edge->pool->name);
-          if (pool == NULL) {
-            if (edge->pool->depth < 0) {
-              *err = "pool " + std::string(edge->pool->name) + " has invalid depth";
-              return false;
-            }
-            pool = new Pool(edge->pool->name, edge->pool->depth);
-            state_->AddPool(pool);
-          }
-          edge_->pool_ = pool;
-        }
-      }
+  if (info->edges &&
+      !StageEdges(manifest, info->edges, parallel_compile, err))
+    return false;
+  if (info->edge_shards) {
+    for (const struct EdgeInfo* const* shard = info->edge_shards; *shard;
+         ++shard) {
+      if (!StageEdges(manifest, *shard, parallel_compile, err))
+        return false;
+    }
+  }
 
-        // Calculate sizes first
-        size_t in_size = GetPathCount(edge->in);
-        size_t out_size = GetPathCount(edge->out);
-        size_t implicit_in_size = GetPathCount(edge->implicit_deps);
-        size_t implicit_out_size = GetPathCount(edge->implicit_outs);
-        size_t order_only_size = GetPathCount(edge->order_only_deps);
-        size_t validation_size = GetPathCount(edge->validations);
-
-        edge_->implicit_deps_ = implicit_in_size;
-        edge_->order_only_deps_ = order_only_size;
-        edge_->implicit_outs_ = implicit_out_size;
-
-        // Reserve space based on sizes
-        edge_->inputs_.reserve(in_size + implicit_in_size + order_only_size);
-        edge_->outputs_.reserve(out_size + implicit_out_size);
-        edge_->validations_.reserve(validation_size);
-
-      // Convert inputs
-      if (edge->in) {
-        // fprintf(stderr, "Debug: Converting inputs\n");
-        const struct EvalString_* const* in = edge->in;
-        while (*in) {
-          // fprintf(stderr, "Debug: Processing input path\n");
-          const EvalString* es = ConvertEvalStringArray(*in);
-          std::string eval_val = es->Evaluate(env);
-          // fprintf(stderr, "Debug: Evaluated input path: %s\n", eval_val.c_str());
-          uint64_t slash_bits;
-          CanonicalizePath(&eval_val, &slash_bits);
-          state_->AddIn(edge_, eval_val, slash_bits);
-          // fprintf(stderr, "Debug: Added input: %s\n", eval_val.c_str());
-          in++;
-        }
-      }
+  if (info->defaults) {
+    for (const struct EvalString_* const* def = info->defaults; *def; ++def) {
+      manifest->defaults.push_back(StagedPath());
+      StagePath(*def, env, &manifest->defaults.back());
+    }
+  }
 
-      // Convert outputs
-      if (edge->out) {
-        // fprintf(stderr, "Debug: Converting outputs\n");
-        const struct EvalString_* const* out = edge->out;
-        while (*out) {
-          const EvalString* es = ConvertEvalStringArray(*out);
-          std::string eval_val = es->Evaluate(env);
-          uint64_t slash_bits;
-          CanonicalizePath(&eval_val, &slash_bits);
-          if (!state_->AddOut(edge_, eval_val, slash_bits, err)) {
-            // fprintf(stderr, "Debug: Failed to add output: %s\n", eval_val.c_str());
-            return false;
-          }
-          // fprintf(stderr, "Debug: Added output: %s\n", eval_val.c_str());
-          out++;
-        }
-      }
+  if (info->subninja) {
+    for (const struct EvalString_* const* sub = info->subninja; *sub; ++sub) {
+      std::string path = EvaluateTokens(*sub, env);
+      manifest->children.push_back(new Manifest(
+          path, manifest->arena->New<BindingEnv>(env), manifest));
+    }
+  }
+  return true;
+}
 
-      // Convert implicit inputs
-      if (edge->implicit_deps) {
-        // fprintf(stderr, "Debug: Converting implicit inputs\n");
-        const struct EvalString_* const* implicit = edge->implicit_deps;
-        while (*implicit) {
-          const EvalString* es = ConvertEvalStringArray(*implicit);
-          std::string eval_val = es->Evaluate(env);
-          uint64_t slash_bits;
-          CanonicalizePath(&eval_val, &slash_bits);
-          state_->AddIn(edge_, eval_val, slash_bits);
-          // fprintf(stderr, "Debug: Added implicit input: %s\n", eval_val.c_str());
-          implicit++;
-        }
+bool CNobi::ConvertTables(Manifest* manifest, const SymbolLookup& lookup,
+                          const std::string& input_file,
+                          bool parallel_compile, std::string* err) {
+  Tables root;
+  if (!root.Open(lookup, "cnobi", input_file, err))
+    return false;
+  const struct CNobiHeader* header = root.header;
+  if (header->version != CNOBI_ABI_VERSION) {
+    *err = input_file + ": unsupported manifest version";
+    return false;
+  }
+  if ((header->num_pools && !root.pools) ||
+      (header->num_rules && !root.rules)) {
+    *err = input_file + ": missing pool or rule table";
+    return false;
+  }
+
+  if (root.nodes) {
+    Manifest::NodeTable table = { root.strings, root.nodes,
+                                  header->num_nodes };
+    manifest->node_tables.push_back(table);
+    root.node_base = manifest->num_nodes;
+    manifest->num_nodes += table.size;
+  }
+
+  BindingEnv* env = manifest->scope;
+  for (uint32_t i = 0; i < header->bindings.count; ++i) {
+    const struct CNobiBinding& bind = root.bindings[header->bindings.begin + i];
+    const char* key = root.String(bind.key);
+    const std::string value = root.Evaluate(bind.value, env);
+    if (strcmp(key, "ninja_required_version") == 0)
+      CheckNinjaVersion(value);
+    env->AddBinding(key, value);
+  }
+
+  // Resolve every rule up front, so that subninjas can refer to them.
+  std::vector<ResolvedRule> rules(header->num_rules);
+  for (size_t i = 0; i < rules.size(); ++i) {
+    if (!TableRule(manifest, root, i, &rules[i], err))
+      return false;
+  }
+
+  // Included manifests share this one's scope.
+  for (uint32_t i = 0; i < header->includes.count; ++i) {
+    const std::string path =
+        root.Evaluate(root.paths[header->includes.begin + i], env);
+    if (!Convert(manifest, path, parallel_compile, err))
+      return false;
+  }
+
+  // Open every unit first, as the edges some targets need may be in any.
+  std::vector<Tables> units(1, root);
+  for (uint32_t i = 0; i < header->shards.count; ++i) {
+    const char* unit = root.String(root.tokens[header->shards.begin + i].str);
+    units.push_back(Tables());
+    units.back().node_base = root.node_base;
+    if (!units.back().Open(lookup, unit, input_file, err))
+      return false;
+  }
+  std::vector<bool> selected;
+  const bool partial =
+      SelectEdges(manifest, units, rules, input_file, &selected);
+  if (!partial)
+    selected.clear();
+  // The edges to stage, which go in consecutive slots.
+  std::vector<std::pair<const Tables*, uint32_t> > edges;
+  size_t first = 0;
+  for (size_t i = 0; i < units.size(); ++i) {
+    for (uint32_t e = 0; e < units[i].header->num_edges; ++e) {
+      if (selected.empty() || selected[first + e])
+        edges.push_back(std::make_pair(&units[i], e));
+    }
+    first += units[i].header->num_edges;
+  }
+  const size_t base = manifest->edges.size();
+  manifest->edges.resize(base + edges.size());
+  if (!StageChunks(manifest, edges.size(), parallel_compile,
+                   [&](size_t i, Arena* arena, std::string* err) {
+        return StageTableEdge(manifest, *edges[i].first, root, rules,
+                              edges[i].second, arena,
+                              &manifest->edges[base + i], err);
+      }, err))
+    return false;
+  if (partial)
+    state_->partial_ = true;
+
+  // Given targets, defaults are not built, and may name edges left out.
+  if (!partial || targets_.empty()) {
+    for (uint32_t i = 0; i < header->defaults.count; ++i) {
+      manifest->defaults.push_back(StagedPath());
+      root.StagePath(header->defaults.begin + i, env,
+                     &manifest->defaults.back());
+    }
+  }
+
+  for (uint32_t i = 0; i < header->subninjas.count; ++i) {
+    const std::string path =
+        root.Evaluate(root.paths[header->subninjas.begin + i], env);
+    manifest->children.push_back(new Manifest(
+        path, manifest->arena->New<BindingEnv>(env), manifest));
+  }
+  return true;
+}
+
+bool CNobi::StageTableEdge(Manifest* manifest, const Tables& unit,
+                           const Tables& root,
+                           const std::vector<ResolvedRule>& rules,
+                           uint32_t index, Arena* arena, StagedEdge* staged,
+                           std::string* err) {
+  const struct CNobiEdge& edge = unit.edges[index];
+  if (edge.rule >= rules.size() ||
+      (edge.pool != CNOBI_NONE && edge.pool >= root.header->num_pools)) {
+    *err = manifest->path + ": bad rule or pool index";
+    return false;
+  }
+  staged->rule = rules[edge.rule].rule;
+  if (unit.command_hashes)
+    staged->command_hash = unit.command_hashes[index];
+  if (edge.pool != CNOBI_NONE) {
+    const struct CNobiPool& pool = root.pools[edge.pool];
+    staged->pool = StagedPool(root.String(pool.name), pool.depth);
+  } else {
+    staged->pool = rules[edge.rule].pool;
+  }
+
+  BindingEnv* env = manifest->scope;
+  if (edge.bindings.count) {
+    env = arena->New<BindingEnv>(manifest->scope);
+    for (uint32_t b = 0; b < edge.bindings.count; ++b) {
+      const struct CNobiBinding& bind = unit.bindings[edge.bindings.begin + b];
+      env->AddBinding(unit.String(bind.key),
+                      unit.Evaluate(bind.value, manifest->scope));
+    }
+  }
+  staged->env = env;
+
+  staged->implicit_deps = edge.implicit_deps;
+  staged->order_only_deps = edge.order_only_deps;
+  staged->outs = edge.out;
+  staged->implicit_outs = edge.implicit_outs;
+  staged->validations = edge.validations;
+  staged->paths.resize(edge.in + edge.implicit_deps + edge.order_only_deps +
+                       edge.out + edge.implicit_outs + edge.validations);
+  for (size_t p = 0; p < staged->paths.size(); ++p)
+    unit.StagePath(edge.paths + p, env, &staged->paths[p]);
+  return true;
+}
+
+bool CNobi::StageChunks(
+    Manifest* manifest, size_t count, bool parallel,
+    const std::function<bool(size_t, Arena*, std::string*)>& stage,
+    std::string* err) {
+  // Small enough that chunks spread evenly over the workers, large enough
+  // that queueing them costs little next to staging their edges.
+  const size_t kChunkSize = 4096;
+  const int threads = parser_opts_.parse_threads_;
+  if (!parallel || count < 2 * kChunkSize || threads == 1 ||
+      (threads == 0 && GetProcessorCount() < 2)) {
+    for (size_t i = 0; i < count; ++i) {
+      if (!stage(i, manifest->arena, err))
+        return false;
+    }
+    return true;
+  }
+
+  const size_t chunks = (count + kChunkSize - 1) / kChunkSize;
+  std::vector<std::string> errors(chunks);
+  std::vector<char> failed(chunks, false);
+  for (size_t c = 0; c < chunks; ++c) {
+    Arena* arena = new Arena;
+    manifest->chunk_arenas.push_back(arena);
+    Workers()->Add([&, c, arena]() {
+      const size_t end = std::min(count, (c + 1) * kChunkSize);
+      for (size_t i = c * kChunkSize; i < end && !failed[c]; ++i)
+        failed[c] = !stage(i, arena, &errors[c]);
+    });
+  }
+  Workers()->Wait();
+  for (size_t c = 0; c < chunks; ++c) {
+    if (failed[c]) {
+      *err = errors[c];
+      return false;
+    }
+  }
+  return true;
+}
+
+ThreadPool* CNobi::Workers() {
+  if (!pool_)
+    pool_ = new ThreadPool(parser_opts_.parse_threads_);
+  return pool_;
+}
+
+bool CNobi::SelectEdges(Manifest* manifest, const std::vector<Tables>& units,
+                        const std::vector<ResolvedRule>& rules,
+                        const std::string& input_file,
+                        std::vector<bool>* selected) {
+  const Tables& root = units[0];
+  const struct CNobiHeader* header = root.header;
+  if (!lazy_ || manifest->scope != env_ || !root.nodes || !root.producers ||
+      header->includes.count || header->subninjas.count)
+    return false;
+
+  // The nodes to build.  Without targets or defaults, ninja builds the
+  // root nodes, which takes every edge.
+  std::vector<uint32_t> pending;
+  std::vector<std::string> wanted(targets_);
+  if (wanted.empty()) {
+    if (!header->defaults.count)
+      return false;
+    for (uint32_t i = 0; i < header->defaults.count; ++i) {
+      StagedPath path;
+      root.StagePath(header->defaults.begin + i, manifest->scope, &path);
+      if (path.node != StagedPath::kNoNode)
+        pending.push_back(path.node);
+      else
+        wanted.push_back(path.Path().AsString());
+    }
+  }
+  // The manifest and the text manifest it was generated from, which the
+  // build may regenerate, need not be nodes, unlike the others.
+  const size_t required = wanted.size();
+  wanted.push_back(input_file);
+  std::string source = SourceManifest(input_file);
+  if (!source.empty())
+    wanted.push_back(source);
+  for (size_t i = required; i < wanted.size(); ++i) {
+    uint64_t slash_bits;
+    CanonicalizePath(&wanted[i], &slash_bits);
+  }
+
+  // Look them all up in one pass over the node table.
+  ExternalStringHashMap<size_t>::Type positions;
+  for (size_t i = 0; i < wanted.size(); ++i)
+    positions[wanted[i]] = i;
+  std::vector<uint32_t> found(wanted.size(), CNOBI_NONE);
+  for (uint32_t i = 0; i < header->num_nodes; ++i) {
+    ExternalStringHashMap<size_t>::Type::iterator position =
+        positions.find(root.String(root.nodes[i].path));
+    if (position != positions.end())
+      found[position->second] = i;
+  }
+  for (size_t i = 0; i < found.size(); ++i) {
+    if (found[i] != CNOBI_NONE)
+      pending.push_back(found[i]);
+    else if (i < required)
+      return false;
+  }
+  manifest->targets.assign(pending.begin(), pending.end());
+
+  // Edges are numbered across units, root first.
+  std::vector<size_t> starts;
+  size_t num_edges = 0;
+  for (size_t i = 0; i < units.size(); ++i) {
+    starts.push_back(num_edges);
+    num_edges += units[i].header->num_edges;
+  }
+
+  // Follow inputs back to the edges producing them.
+  selected->assign(num_edges, false);
+  std::vector<bool> visited(header->num_nodes, false);
+  size_t count = 0;
+  while (!pending.empty()) {
+    uint32_t node = pending.back();
+    pending.pop_back();
+    if (node >= header->num_nodes)
+      return false;
+    if (visited[node])
+      continue;
+    visited[node] = true;
+    uint32_t index = root.producers[node];
+    if (index == CNOBI_NONE)
+      continue;
+    if (index >= num_edges)
+      return false;
+    if ((*selected)[index])
+      continue;
+    (*selected)[index] = true;
+    ++count;
+
+    size_t u = std::upper_bound(starts.begin(), starts.end(), index) -
+               starts.begin() - 1;
+    const Tables& unit = units[u];
+    const struct CNobiEdge& edge = unit.edges[index - starts[u]];
+    // A dyndep file, a depfile or the deps log may name inputs, such as
+    // generated headers, that the manifest does not lead to.
+    static const char* const kDiscovered[] = { "dyndep", "depfile", "deps" };
+    if (edge.rule >= rules.size())
+      return false;
+    for (size_t k = 0; k < sizeof(kDiscovered) / sizeof(kDiscovered[0]);
+         ++k) {
+      if (rules[edge.rule].rule->GetBinding(kDiscovered[k]))
+        return false;
+      for (uint32_t b = 0; b < edge.bindings.count; ++b) {
+        if (strcmp(unit.String(unit.bindings[edge.bindings.begin + b].key),
+                   kDiscovered[k]) == 0)
+          return false;
       }
+    }
+    const uint32_t paths = edge.in + edge.implicit_deps +
+                           edge.order_only_deps + edge.out +
+                           edge.implicit_outs + edge.validations;
+    for (uint32_t p = 0; p < paths; ++p) {
+      const struct CNobiRange& range = unit.paths[edge.paths + p];
+      // Paths that are not nodes may be anything.
+      if (range.count != CNOBI_NODE)
+        return false;
+      pending.push_back(range.begin);
+    }
+  }
+  if (count == num_edges)
+    return false;
+  return true;
+}
 
-      // Convert implicit outputs
-      if (edge->implicit_outs) {
-        // fprintf(stderr, "Debug: Converting implicit outputs\n");
-        const struct EvalString_* const* implicit_out = edge->implicit_outs;
-        while (*implicit_out) {
-          const EvalString* es = ConvertEvalStringArray(*implicit_out);
-          std::string eval_val = es->Evaluate(env);
-          uint64_t slash_bits;
-          CanonicalizePath(&eval_val, &slash_bits);
-          if (!state_->AddOut(edge_, eval_val, slash_bits, err)) {
-            // fprintf(stderr, "Debug: Failed to add implicit output: %s\n", eval_val.c_str());
-            return false;
-          }
-          // fprintf(stderr, "Debug: Added implicit output: %s\n", eval_val.c_str());
-          implicit_out++;
-        }
+bool CNobi::TableRule(Manifest* manifest, const Tables& root, size_t index,
+                      ResolvedRule* resolved, std::string* err) {
+  const struct CNobiRule& info = root.rules[index];
+  const char* name = root.String(info.name);
+  if (info.bindings.count == 0) {
+    // A reference to a rule of an enclosing scope, like phony.
+    return ScopeRule(manifest, name, resolved, err);
+  }
+
+  Rule* rule = manifest->arena->New<Rule>(name);
+  EvalString value;
+  for (uint32_t i = 0; i < info.bindings.count; ++i) {
+    const struct CNobiBinding& bind = root.bindings[info.bindings.begin + i];
+    value.Clear();
+    root.ToEvalString(bind.value, &value);
+    rule->AddBinding(root.String(bind.key), value);
+  }
+  resolved->rule = rule;
+  if (info.pool != CNOBI_NONE) {
+    if (info.pool >= root.header->num_pools) {
+      *err = manifest->path + ": bad rule or pool index";
+      return false;
+    }
+    const struct CNobiPool& pool = root.pools[info.pool];
+    resolved->pool = StagedPool(root.String(pool.name), pool.depth);
+    manifest->pools.push_back(resolved->pool);
+    manifest->rule_pools[rule] = resolved->pool;
+    EvalString pool_name;
+    pool_name.AddText(root.String(pool.name));
+    rule->AddBinding("pool", pool_name);
+  }
+  // As with version 1 rules, the first one of each name is registered in
+  // the scope for lookups by name.
+  if (!manifest->scope->LookupRuleCurrentScope(name))
+    manifest->scope->AddRule(rule);
+  return true;
+}
+
+bool CNobi::ScopeRule(const Manifest* manifest, const char* name,
+                      ResolvedRule* resolved, std::string* err) {
+  resolved->rule = manifest->scope->LookupRule(name);
+  if (!resolved->rule) {
+    *err = "unknown build rule '" + std::string(name) + "' in " +
+           manifest->path;
+    return false;
+  }
+  // The rule was declared by this manifest or an enclosing one, which has
+  // its pool.
+  for (const Manifest* m = manifest; m; m = m->parent) {
+    std::unordered_map<const Rule*, StagedPool>::const_iterator pool =
+        m->rule_pools.find(resolved->rule);
+    if (pool != m->rule_pools.end()) {
+      resolved->pool = pool->second;
+      break;
+    }
+  }
+  return true;
+}
+
+bool CNobi::StageEdges(Manifest* manifest, const struct EdgeInfo* edges,
+                       bool parallel, std::string* err) {
+  // Rules are converted on first use, which is not thread-safe, so they are
+  // looked up before the rest is staged.
+  const size_t base = manifest->edges.size();
+  for (const struct EdgeInfo* edge = edges; edge->rule; ++edge) {
+    manifest->edges.push_back(StagedEdge());
+    StagedEdge* staged = &manifest->edges.back();
+    const ResolvedRule* rule = LookupRule(manifest, edge->rule, err);
+    if (!rule)
+      return false;
+    staged->rule = rule->rule;
+    // DEFAULT_POOL has an empty name, which overrides the rule's pool.
+    staged->pool = edge->pool
+                       ? StagedPool(edge->pool->name, edge->pool->depth)
+                       : rule->pool;
+  }
+
+  return StageChunks(manifest, manifest->edges.size() - base, parallel,
+                     [&](size_t i, Arena* arena, std::string*) {
+    StageEdge(manifest, edges[i], arena, &manifest->edges[base + i]);
+    return true;
+  }, err);
+}
+
+void CNobi::StageEdge(Manifest* manifest, const struct EdgeInfo& edge,
+                      Arena* arena, StagedEdge* staged) {
+  BindingEnv* env = edge.bindings
+                        ? arena->New<BindingEnv>(manifest->scope)
+                        : manifest->scope;
+  if (edge.bindings) {
+    const struct Binding* bind = edge.bindings;
+    while (bind->key) {
+      env->AddBinding(bind->key, EvaluateTokens(bind->val, manifest->scope));
+      bind++;
+    }
+  }
+  staged->env = env;
+
+  staged->implicit_deps = GetPathCount(edge.implicit_deps);
+  staged->order_only_deps = GetPathCount(edge.order_only_deps);
+  staged->outs = GetPathCount(edge.out);
+  staged->implicit_outs = GetPathCount(edge.implicit_outs);
+  staged->validations = GetPathCount(edge.validations);
+  staged->paths.reserve(GetPathCount(edge.in) + staged->implicit_deps +
+                        staged->order_only_deps + staged->outs +
+                        staged->implicit_outs + staged->validations);
+  StagePaths(edge.in, env, &staged->paths);
+  StagePaths(edge.implicit_deps, env, &staged->paths);
+  StagePaths(edge.order_only_deps, env, &staged->paths);
+  StagePaths(edge.out, env, &staged->paths);
+  StagePaths(edge.implicit_outs, env, &staged->paths);
+  StagePaths(edge.validations, env, &staged->paths);
+}
+
+void CNobi::StagePaths(const struct EvalString_* const* paths,
+                       BindingEnv* env, std::vector<StagedPath>* staged) {
+  if (!paths)
+    return;
+  for (; *paths; ++paths) {
+    staged->push_back(StagedPath());
+    StagePath(*paths, env, &staged->back());
+  }
+}
+
+// static
+void CNobi::StagePath(const struct EvalString_* path, BindingEnv* env,
+                      StagedPath* staged) {
+  if (path->second == CANON) {
+    // The generator already evaluated and canonicalized this one.
+    staged->image_path = path->first;
+    staged->slash_bits = 0;
+    return;
+  }
+  staged->path = EvaluateTokens(path, env);
+  CanonicalizePath(&staged->path, &staged->slash_bits);
+}
+
+bool CNobi::MergeEdges(Manifest* manifest, std::string* err) {
+  if (!manifest->ok) {
+    *err = manifest->err;
+    return false;
+  }
+
+  for (std::vector<void*>::iterator i = manifest->handles.begin();
+       i != manifest->handles.end(); ++i)
+    state_->AddImage(new SharedObject(*i));
+  manifest->handles.clear();
+
+  for (std::vector<StagedPool>::iterator i = manifest->pools.begin();
+       i != manifest->pools.end(); ++i) {
+    if (!LookupPool(*i, err))
+      return false;
+  }
+
+  // Each node of the tables is looked up once, however many edges name it,
+  // and only if one does.
+  manifest->nodes.assign(manifest->num_nodes, NULL);
+  for (std::vector<size_t>::iterator i = manifest->targets.begin();
+       i != manifest->targets.end(); ++i)
+    TableNode(manifest, *i);
+
+  for (std::vector<StagedEdge>::iterator staged = manifest->edges.begin();
+       staged != manifest->edges.end(); ++staged) {
+    Edge* edge_ = state_->AddEdge(staged->rule);
+    edge_->env_ = staged->env;
+    edge_->command_hash_ = staged->command_hash;
+
+    if (staged->pool.name && staged->pool.name[0]) {
+      edge_->pool_ = LookupPool(staged->pool, err);
+      if (!edge_->pool_)
+        return false;
+    }
+
+    size_t ins = staged->paths.size() - staged->outs -
+                 staged->implicit_outs - staged->validations;
+    edge_->implicit_deps_ = staged->implicit_deps;
+    edge_->order_only_deps_ = staged->order_only_deps;
+    edge_->implicit_outs_ = staged->implicit_outs;
+    edge_->inputs_.reserve(ins);
+    edge_->outputs_.reserve(staged->outs + staged->implicit_outs);
+    edge_->validations_.reserve(staged->validations);
+
+    const size_t outs_end = ins + staged->outs + staged->implicit_outs;
+    for (size_t i = 0; i < staged->paths.size(); ++i) {
+      Node* node = PathNode(manifest, staged->paths[i], err);
+      if (!node)
+        return false;
+      if (i < ins) {
+        state_->AddIn(edge_, node);
+      } else if (i < outs_end) {
+        if (!state_->AddOut(edge_, node, err))
+          return false;
+      } else {
+        state_->AddValidation(edge_, node);
       }
+    }
 
-      // Convert order-only deps
-      if (edge->order_only_deps) {
-        // fprintf(stderr, "Debug: Converting order-only dependencies\n");
-        const struct EvalString_* const* order = edge->order_only_deps;
-        while (*order) {
-          const EvalString* es = ConvertEvalStringArray(*order);
-          std::string eval_val = es->Evaluate(env);
-          uint64_t slash_bits;
-          CanonicalizePath(&eval_val, &slash_bits);
-          state_->AddIn(edge_, eval_val, slash_bits);
-          // fprintf(stderr, "Debug: Added order-only dependency: %s\n", eval_val.c_str());
-          order++;
-        }
+    if (parser_opts_.phony_cycle_action_ == kPhonyCycleActionWarn &&
+        edge_->maybe_phonycycle_diagnostic()) {
+      Node* out = edge_->outputs_[0];
+      std::vector<Node*>::iterator new_end =
+          std::remove(edge_->inputs_.begin(), edge_->inputs_.end(), out);
+      if (new_end != edge_->inputs_.end()) {
+        edge_->inputs_.erase(new_end, edge_->inputs_.end());
       }
+    }
 
-      // Convert validations
-      if (edge->validations) {
-        // fprintf(stderr, "Debug: Converting validations\n");
-        const struct EvalString_* const* validation = edge->validations;
-        while (*validation) {
-          const EvalString* es = ConvertEvalStringArray(*validation);
-          std::string eval_val = es->Evaluate(env);
-          uint64_t slash_bits;
-          CanonicalizePath(&eval_val, &slash_bits);
-          state_->AddValidation(edge_, eval_val, slash_bits);
-          // fprintf(stderr, "Debug: Added validation: %s\n", eval_val.c_str());
-          validation++;
-        }
+    std::string dyndep = edge_->GetUnescapedDyndep();
+    if (!dyndep.empty()) {
+      uint64_t slash_bits;
+      CanonicalizePath(&dyndep, &slash_bits);
+      edge_->dyndep_ = state_->GetNode(dyndep, slash_bits);
+      edge_->dyndep_->set_dyndep_pending(true);
+      std::vector<Node*>::iterator dgi = std::find(
+          edge_->inputs_.begin(), edge_->inputs_.end(), edge_->dyndep_);
+      if (dgi == edge_->inputs_.end()) {
+        *err = "dyndep '" + dyndep + "' is not an input";
+        return false;
       }
+      assert(!edge_->dyndep_->generated_by_dep_loader());
+    }
+  }
 
-        if (parser_opts_.phony_cycle_action_ == kPhonyCycleActionWarn &&
-            edge_->maybe_phonycycle_diagnostic()) {
-            // fprintf(stderr, "Debug: Processing phony cycle diagnostic\n");
-            Node* out = edge_->outputs_[0];
-            std::vector<Node*>::iterator new_end =
-                std::remove(edge_->inputs_.begin(), edge_->inputs_.end(), out);
-            if (new_end != edge_->inputs_.end()) {
-                edge_->inputs_.erase(new_end, edge_->inputs_.end());
-            }
-        }
+  for (std::vector<Manifest*>::iterator i = manifest->children.begin();
+       i != manifest->children.end(); ++i) {
+    if (!MergeEdges(*i, err))
+      return false;
+  }
+  return true;
+}
 
-        std::string dyndep = edge_->GetUnescapedDyndep();
-        if (!dyndep.empty()) {
-            uint64_t slash_bits;
-            CanonicalizePath(&dyndep, &slash_bits);
-            edge_->dyndep_ = state_->GetNode(dyndep, slash_bits);
-            edge_->dyndep_->set_dyndep_pending(true);
-            std::vector<Node*>::iterator dgi =
-                std::find(edge_->inputs_.begin(), edge_->inputs_.end(), edge_->dyndep_);
-            if (dgi == edge_->inputs_.end()) {
-                *err = "dyndep '" + dyndep + "' is not an input";
-                return false;
-            }
-            assert(!edge_->dyndep_->generated_by_dep_loader());
-        }
+Node* CNobi::PathNode(Manifest* manifest, const StagedPath& path,
+                      std::string* err) {
+  if (path.image_path)
+    return state_->GetNodeInImage(path.image_path, path.slash_bits);
+  if (path.node == StagedPath::kNoNode)
+    return state_->GetNode(path.path, path.slash_bits);
+  if (path.node >= manifest->nodes.size()) {
+    *err = manifest->path + ": bad node index";
+    return NULL;
+  }
+  return TableNode(manifest, path.node);
+}
 
-        // edge_number++;
-      edge++;
+Node* CNobi::TableNode(Manifest* manifest, size_t index) {
+  Node*& node = manifest->nodes[index];
+  if (node)
+    return node;
+  size_t i = index;
+  for (std::vector<Manifest::NodeTable>::iterator table =
+           manifest->node_tables.begin();
+       table != manifest->node_tables.end(); i -= table->size, ++table) {
+    if (i < table->size) {
+      node = state_->GetNodeInImage(table->strings + table->nodes[i].path,
+                                    table->nodes[i].slash_bits);
+      break;
     }
   }
+  return node;
+}
 
-  if(manifest->defaults){
-    // fprintf(stderr, "Debug: Processing defaults\n");
-    const struct EvalString_* const* def = manifest->defaults;
-    while (*def) {
-        const EvalString* es = ConvertEvalStringArray(*def);
-        std::string eval_val = es->Evaluate(env_);
-        uint64_t slash_bits;
-        CanonicalizePath(&eval_val, &slash_bits);
-        if (!state_->AddDefault(eval_val, err)) {
-            // fprintf(stderr, "Debug: Failed to add default: %s\n", eval_val.c_str());
-            return false;
-        }
-        // fprintf(stderr, "Debug: Added default: %s\n", eval_val.c_str());
-        def++;
+size_t CNobi::CountNodes(const Manifest* manifest) {
+  size_t count = manifest->num_nodes;
+  for (std::vector<Manifest*>::const_iterator i = manifest->children.begin();
+       i != manifest->children.end(); ++i)
+    count += CountNodes(*i);
+  return count;
+}
+
+bool CNobi::MergeDefaults(Manifest* manifest, std::string* err) {
+  // Defaults go in after every edge, so that they may name outputs of
+  // subninjas declared later.
+  for (std::vector<StagedPath>::iterator i = manifest->defaults.begin();
+       i != manifest->defaults.end(); ++i) {
+    if (!state_->AddDefault(i->Path(), err))
+      return false;
+  }
+  for (std::vector<Manifest*>::iterator i = manifest->children.begin();
+       i != manifest->children.end(); ++i) {
+    if (!MergeDefaults(*i, err))
+      return false;
+  }
+  return true;
+}
+
+Pool* CNobi::LookupPool(const StagedPool& staged, std::string* err) {
+  Pool* pool = state_->LookupPool(staged.name);
+  if (pool == NULL) {
+    if (staged.depth < 0) {
+      *err = "pool " + std::string(staged.name) + " has invalid depth";
+      return NULL;
     }
+    pool = new Pool(staged.name, staged.depth);
+    state_->AddPool(pool);
   }
+  return pool;
+}
 
-  if (manifest->include) {
-      // std::cout << "\nIncludes:\n";
-      // const char** inc = manifest->include;
-      // while (*inc) {
-      //     std::cout << "  " << *inc << "\n";
-      //     inc++;
-      // }
+// static
+std::string CNobi::CacheDir() {
+  const char* dir = getenv("CNOBI_CACHE_DIR");
+  if (dir && *dir)
+    return dir;
+  dir = getenv("XDG_CACHE_HOME");
+  if (dir && *dir)
+    return std::string(dir) + "/cnobi";
+  dir = getenv("HOME");
+  if (dir && *dir)
+    return std::string(dir) + "/.cache/cnobi";
+  return ".cnobi_cache";
+}
+
+// static
+std::string CNobi::CompilerCommand() {
+  const char* cc = getenv("CNOBI_CC");
+  if (cc && *cc)
+    return cc;
+  return "gcc";
+}
+
+// static
+std::string CNobi::SourceManifest(const std::string& input_file) {
+  static const char kSuffix[] = "_ninja.c";
+  const size_t suffix = sizeof(kSuffix) - 1;
+  if (input_file.size() <= suffix ||
+      input_file.compare(input_file.size() - suffix, suffix, kSuffix) != 0)
+    return std::string();
+  return input_file.substr(0, input_file.size() - suffix) + ".ninja";
+}
+
+bool CNobi::LocateCompiledManifest(const std::string& input_file,
+                                   bool parallel_compile,
+                                   std::string* so_path, std::string* err) {
+  METRIC_RECORD(".ninja cnobi cache lookup");
+  std::string contents, read_err;
+  if (ReadFile(input_file, &contents, &read_err) < 0) {
+    *err = "loading '" + input_file + "': " + read_err;
+    return false;
   }
 
-  if (manifest->subninja) {
-      // std::cout << "\nSubninjas:\n";
-      // const char** sub = manifest->subninja;
-      // while (*sub) {
-      //     std::cout << "  " << *sub << "\n";
-      //     sub++;
-      // }
+  // The generated sources include "manifest.h" from their own directory,
+  // and shard paths are relative to it too.  A missing header hashes like
+  // an empty one; the compiler will complain.
+  std::string::size_type slash = input_file.find_last_of('/');
+  const std::string dir =
+      slash == std::string::npos ? "" : input_file.substr(0, slash + 1);
+  std::vector<std::string> shards;
+  ReadShardDirectives(contents, dir, &shards);
+  std::string header;
+  if (ReadFile(dir + "manifest.h", &header, &read_err) < 0)
+    header.clear();
+  const uint64_t header_hash = MurmurHash64A(header.data(), header.size());
+  const std::string compiler = CompilerCommand();
+  const std::string cache_dir = CacheDir();
+
+  if (shards.empty()) {
+    const std::string flags = compiler + " " + kSharedFlags;
+    *so_path = CacheEntryPath(cache_dir,
+                              SourceKey(contents, header_hash, flags), ".so");
+    if (FileExists(*so_path))
+      return true;
+    if (!MakeCacheDir(*so_path, err))
+      return false;
+    std::vector<CompileStep> steps(1);
+    steps[0].Init(flags, input_file, *so_path);
+    return RunCompileSteps(steps, parallel_compile, err);
   }
 
-  // fprintf(stderr, "Debug: CNobi::Load completed successfully\n");
-  dlclose(handle);
-  return true;
-}
+  // Sharded manifest: every translation unit becomes its own cached object,
+  // so editing one shard only recompiles that shard before relinking.
+  const std::string object_flags = compiler + " " + kObjectFlags;
+  std::vector<std::string> objects;
+  std::vector<uint64_t> link_key;
+  std::set<uint64_t> object_keys;
+  std::vector<CompileStep> steps;
+  shards.insert(shards.begin(), input_file);
+  for (size_t i = 0; i < shards.size(); ++i) {
+    if (i > 0) {
+      contents.clear();
+      if (ReadFile(shards[i], &contents, &read_err) < 0) {
+        *err = "loading '" + shards[i] + "': " + read_err;
+        return false;
+      }
+    }
+    uint64_t key = SourceKey(contents, header_hash, object_flags);
+    link_key.push_back(key);
+    // Identical shards share one object, which is compiled and linked once.
+    if (!object_keys.insert(key).second)
+      continue;
+    objects.push_back(CacheEntryPath(cache_dir, key, ".o"));
+    if (!FileExists(objects.back())) {
+      steps.push_back(CompileStep());
+      steps.back().Init(object_flags, shards[i], objects.back());
+    }
+  }
+  const std::string link_flags = compiler + " " + kLinkFlags;
+  link_key.push_back(MurmurHash64A(link_flags.data(), link_flags.size()));
+  *so_path = CacheEntryPath(
+      cache_dir,
+      MurmurHash64A(link_key.data(), link_key.size() * sizeof(link_key[0])),
+      ".so");
+  if (FileExists(*so_path))
+    return true;
+  if (!MakeCacheDir(*so_path, err))
+    return false;
+  if (!RunCompileSteps(steps, parallel_compile, err))
+    return false;
 
-bool CNobi::CompileManifest(const std::string& input_file, const std::string& input_so){
-  auto exec_command = "gcc " + input_file + " -fPIC -shared -o " + input_so;
-  return std::system(exec_command.c_str()) == 0;
+  steps.assign(1, CompileStep());
+  steps[0].Init(link_flags, objects, *so_path);
+  return RunCompileSteps(steps, parallel_compile, err);
 }
 
-const EvalString* CNobi::ConvertEvalStringArray(const struct EvalString_* eval_array) {
-    EvalString* eval_string = new EvalString();
-    
+// static
+void CNobi::ConvertEvalStringArray(const struct EvalString_* eval_array,
+                                   EvalString* eval_string) {
+    eval_string->Clear();
     while (eval_array->first) {
         if (eval_array->second == LIT) {
             eval_string->AddText(StringPiece(eval_array->first));
@@ -327,38 +1344,57 @@ const EvalString* CNobi::ConvertEvalStringArray(const struct EvalString_* eval_a
         }
         eval_array++;
     }
-    
-    return eval_string;
 }
 
 
-const Rule* CNobi::ToRule(const struct RuleInfo* rule_info) {
-    if (!rule_info) {
-        // fprintf(stderr, "Debug: RuleInfo is NULL\n");
-        return nullptr;
-    }
+const CNobi::ResolvedRule* CNobi::LookupRule(
+    Manifest* manifest, const struct RuleInfo* rule_info, std::string* err) {
+  std::unordered_map<const struct RuleInfo*, ResolvedRule>::iterator i =
+      manifest->rules.find(rule_info);
+  if (i != manifest->rules.end())
+    return &i->second;
 
-    Rule* rule = new Rule(rule_info->name);
-    if (!rule) {
-        // fprintf(stderr, "Debug: Failed to allocate memory for Rule\n");
-        return nullptr;
+  ResolvedRule resolved;
+  if (!rule_info->bindings) {
+    // A rule without bindings, like PHONY_RULE, refers to the rule of that
+    // name in scope, which an enclosing manifest may have declared.
+    if (!ScopeRule(manifest, rule_info->name, &resolved, err))
+      return NULL;
+  } else {
+    // Rules are told apart by their RuleInfo, since rules of different
+    // subninja scopes may share a name.  The first one of each name is
+    // registered in the scope for lookups by name.
+    resolved.rule = ToRule(manifest, rule_info);
+    if (rule_info->pool && rule_info->pool->name &&
+        rule_info->pool->name[0]) {
+      resolved.pool =
+          StagedPool(rule_info->pool->name, rule_info->pool->depth);
+      manifest->rule_pools[resolved.rule] = resolved.pool;
     }
+    if (!manifest->scope->LookupRuleCurrentScope(rule_info->name))
+      manifest->scope->AddRule(resolved.rule);
+  }
+  return &(manifest->rules[rule_info] = resolved);
+}
+
+const Rule* CNobi::ToRule(Manifest* manifest,
+                          const struct RuleInfo* rule_info) {
+    Rule* rule = manifest->arena->New<Rule>(rule_info->name);
 
     if (rule_info->bindings) {
+        // The rule keeps a copy of each value; one EvalString does for all.
+        EvalString value;
         const struct Binding* bind = rule_info->bindings;
         while (bind->key) {
-            const EvalString* es = ConvertEvalStringArray(bind->val);
-            rule->AddBinding(bind->key, *es);
+            ConvertEvalStringArray(bind->val, &value);
+            rule->AddBinding(bind->key, value);
             bind++;
         }
     }
 
     if (rule_info->pool && rule_info->pool->name && rule_info->pool->name[0]) {
-        Pool* pool = state_->LookupPool(rule_info->pool->name);
-        if (!pool) {
-            pool = new Pool(rule_info->pool->name, rule_info->pool->depth);
-            state_->AddPool(pool);
-        }
+        manifest->pools.push_back(
+            StagedPool(rule_info->pool->name, rule_info->pool->depth));
         EvalString pool_name_eval;
         pool_name_eval.AddText(StringPiece(rule_info->pool->name));
         rule->AddBinding("pool", pool_name_eval);
@@ -366,4 +1402,3 @@ const Rule* CNobi::ToRule(const struct RuleInfo* rule_info) {
 
     return rule;
 }
-
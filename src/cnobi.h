@@ -1,17 +1,24 @@
 #ifndef CNOBI_H
 #define CNOBI_H
 
+#include <functional>
 #include <string>
+#include <vector>
 #include "manifest_parser.h"
 
+struct Arena;
 struct Rule;
 struct Edge;
+struct Node;
+struct Pool;
+struct ThreadPool;
 struct EvalString;
 struct BindingEnv;
 struct State;
 
 struct RuleInfo;
 struct PoolInfo;
+struct EdgeInfo;
 struct EvalString_;
 
 struct CNobi {
@@ -19,17 +26,162 @@ struct CNobi {
 
     bool Load(const std::string& input_file, std::string* err, CNobi* parent = NULL);
 
+    /// Finds the arrays of a version 2 manifest by symbol name, such as
+    /// "cnobi_edges"; NULL for those it lacks.
+    typedef std::function<const void*(const std::string&)> SymbolLookup;
+
+    /// Load a version 2 manifest that is already in memory rather than a
+    /// shared object, such as a graph snapshot (see graph_snapshot.h).
+    /// \a input_file is the manifest it stands for.  The arrays must
+    /// outlive the State, as nodes borrow their paths.
+    bool LoadTables(const std::string& input_file, const SymbolLookup& lookup,
+                    std::string* err);
+
+    /// Only add the edges needed to build \a targets, which are canonical
+    /// paths, or the manifest's defaults if there are none, and the edge
+    /// rebuilding the manifest itself.  This takes a version 2 manifest
+    /// with an output index (cnobi_producers) and without includes or
+    /// subninjas; others are loaded whole, as are manifests naming a target
+    /// that is not one of their nodes, so that errors come out as usual,
+    /// and those where a needed edge has a dyndep, depfile or deps binding,
+    /// whose inputs only the build discovers.
+    /// State::partial_ tells whether edges were left out.  Not for tools,
+    /// which look at the whole graph.
+    void set_targets(const std::vector<std::string>& targets) {
+      lazy_ = true;
+      targets_ = targets;
+    }
+
+    /// Directory holding compiled manifests, keyed by content hash.
+    /// Taken from $CNOBI_CACHE_DIR, falling back to $XDG_CACHE_HOME/cnobi,
+    /// then ~/.cache/cnobi, then .cnobi_cache in the working directory.
+    static std::string CacheDir();
+
+    /// Compiler used to build manifests; $CNOBI_CC, or gcc if unset.
+    static std::string CompilerCommand();
+
+    /// The text manifest \a input_file was generated from, going by the
+    /// names cnobi/manifest.py and -t cnobi-gen write: build.ninja for
+    /// build_ninja.c.  Empty if \a input_file is not named that way.
+    static std::string SourceManifest(const std::string& input_file);
 
     private:
-    bool CompileManifest(const std::string& input_file, const std::string& input_so);
-    const Rule* ToRule(const struct RuleInfo*);
-    const EvalString* ConvertEvalStringArray(const struct EvalString_* eval_array);
+    friend struct CNobiCacheTest;
+
+    struct Manifest;
+    struct ResolvedRule;
+    struct StagedEdge;
+    struct StagedPath;
+    struct StagedPool;
+    struct Tables;
+
+    /// Find the compiled form of \a input_file in the cache, compiling it
+    /// into the cache first if no object for its current contents exists.
+    /// The cache key covers the C source, the manifest.h next to it and the
+    /// compiler command line, so a stale object is never picked up.
+    /// Sharded manifests (see manifest.py --shards) are compiled one object
+    /// per shard, in parallel if \a parallel_compile, and only changed
+    /// shards are rebuilt.
+    bool LocateCompiledManifest(const std::string& input_file,
+                                bool parallel_compile, std::string* so_path,
+                                std::string* err);
+
+    /// Open \a input_file and convert it into \a manifest's scope, staging
+    /// its edges, defaults and subninjas.  Only reads enclosing scopes, so
+    /// independent subninjas may be converted concurrently.
+    bool Convert(Manifest* manifest, const std::string& input_file,
+                 bool parallel_compile, std::string* err);
+    /// Convert a version 2 manifest, whose arrays \a lookup finds.
+    bool ConvertTables(Manifest* manifest, const SymbolLookup& lookup,
+                       const std::string& input_file, bool parallel_compile,
+                       std::string* err);
+    /// Convert the subninjas of \a root, if \a ok, then add everything to
+    /// the State.
+    bool Finish(Manifest* root, bool ok, std::string* err);
+    /// Stage edge \a index of one unit of a version 2 manifest, whose rules
+    /// and pools are those of \a root, allocating its scope in \a arena.
+    /// Only reads \a manifest, so edges may be staged concurrently.
+    bool StageTableEdge(Manifest* manifest, const Tables& unit,
+                        const Tables& root,
+                        const std::vector<ResolvedRule>& rules,
+                        uint32_t index, Arena* arena, StagedEdge* staged,
+                        std::string* err);
+    /// Call \a stage for each of \a count edges, with the arena to allocate
+    /// in.  If \a parallel, large numbers of edges are split in chunks
+    /// staged on worker threads, each with an arena of its own, unless
+    /// parse_threads_ asks for one thread.
+    bool StageChunks(
+        Manifest* manifest, size_t count, bool parallel,
+        const std::function<bool(size_t, Arena*, std::string*)>& stage,
+        std::string* err);
+    /// The workers that convert subninjas and stage edges, started on
+    /// first use, parse_threads_ of them.
+    ThreadPool* Workers();
+    /// Mark in \a selected the edges of \a units, root first, that the
+    /// targets of set_targets() need, following the output index.  False
+    /// if every edge should be staged instead.
+    bool SelectEdges(Manifest* manifest, const std::vector<Tables>& units,
+                     const std::vector<ResolvedRule>& rules,
+                     const std::string& input_file,
+                     std::vector<bool>* selected);
+    /// Convert rule \a index of the rule table of \a root and resolve its
+    /// pool into \a resolved.
+    bool TableRule(Manifest* manifest, const Tables& root, size_t index,
+                   ResolvedRule* resolved, std::string* err);
+    /// Resolve the rule named \a name in the scope of \a manifest, declared
+    /// by it or an enclosing manifest, with the pool it was declared with.
+    static bool ScopeRule(const Manifest* manifest, const char* name,
+                          ResolvedRule* resolved, std::string* err);
+    /// Convert \a manifest on \a pool, then its subninjas.
+    void QueueConvert(ThreadPool* pool, Manifest* manifest);
+    /// Evaluate the paths of a rule-terminated EdgeInfo array, on worker
+    /// threads if \a parallel (see StageChunks()).
+    bool StageEdges(Manifest* manifest, const struct EdgeInfo* edges,
+                    bool parallel, std::string* err);
+    void StageEdge(Manifest* manifest, const struct EdgeInfo& edge,
+                   Arena* arena, StagedEdge* staged);
+    void StagePaths(const struct EvalString_* const* paths, BindingEnv* env,
+                    std::vector<StagedPath>* staged);
+    /// Evaluate and canonicalize \a path, unless the generator already did.
+    static void StagePath(const struct EvalString_* path, BindingEnv* env,
+                          StagedPath* staged);
+
+    /// Add the staged edges of \a manifest and its subninjas to the state,
+    /// in declaration order.
+    bool MergeEdges(Manifest* manifest, std::string* err);
+    bool MergeDefaults(Manifest* manifest, std::string* err);
+    /// The node for \a path, from the node tables of \a manifest if listed.
+    Node* PathNode(Manifest* manifest, const StagedPath& path,
+                   std::string* err);
+    /// Node number \a index of the node tables of \a manifest, created on
+    /// first use.
+    Node* TableNode(Manifest* manifest, size_t index);
+    /// The number of nodes in the node tables of \a manifest and its
+    /// subninjas.
+    static size_t CountNodes(const Manifest* manifest);
+    Pool* LookupPool(const StagedPool& pool, std::string* err);
+
+    /// The Rule for \a rule_info in \a manifest and its pool, converting
+    /// it on first use.
+    const ResolvedRule* LookupRule(Manifest* manifest,
+                                   const struct RuleInfo* rule_info,
+                                   std::string* err);
+    const Rule* ToRule(Manifest* manifest, const struct RuleInfo* rule_info);
+    /// Set \a eval to the tokens of \a eval_array.
+    static void ConvertEvalStringArray(const struct EvalString_* eval_array,
+                                       EvalString* eval);
+    /// Hand the arenas of \a manifest and its subninjas to the State, whose
+    /// edges and scopes are allocated in them.
+    void KeepArenas(Manifest* manifest);
     // const EvalString* ToEvalString(const struct EvalString_*, bool convert_entire_array = false);
     // const Edge* ToEdge(const struct EdgeInfo*);
 
     State* state_;
     ManifestParserOptions parser_opts_;
     BindingEnv* env_;
+    bool lazy_;
+    std::vector<std::string> targets_;
+    ThreadPool* pool_;
 };
 
 #endif
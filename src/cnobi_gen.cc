@@ -0,0 +1,563 @@
+#include "cnobi_gen.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "eval_env.h"
+#include "graph.h"
+#include "state.h"
+
+#include "build/cnobi_manifest_h.h"
+#include "../cnobi/manifest.h"
+
+using namespace std;
+
+void AppendCStringLiteral(const string& str, string* out) {
+  out->push_back('"');
+  for (string::const_iterator i = str.begin(); i != str.end(); ++i) {
+    unsigned char c = *i;
+    if (c == '"' || c == '\\' || c == '?') {
+      // '?' is escaped so that no trigraph can form.
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c < 0x20 || c == 0x7f) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\%03o", c);
+      out->append(buf);
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+// static
+const char* CNobiGenerator::ManifestHeader() {
+  return kCNobiManifestH;
+}
+
+// static
+string CNobiGenerator::OutputPath(const string& manifest) {
+  string output = manifest;
+  string::size_type dot = output.find_last_of('.');
+  string::size_type slash = output.find_last_of('/');
+  if (dot != string::npos && (slash == string::npos || dot > slash))
+    output.resize(dot);
+  return output + "_ninja.c";
+}
+
+void CNobiGenerator::CollectNames() {
+  if (!rule_names_.empty() || !pool_names_.empty())
+    return;
+  // Name the pools and rules in use.  Their ninja names need not be valid C
+  // identifiers, and rules in different subninja scopes may share a name.
+  for (vector<Edge*>::const_iterator e = state_->edges_.begin();
+       e != state_->edges_.end(); ++e) {
+    const Edge* edge = *e;
+    if (edge->pool_ != &State::kDefaultPool &&
+        edge->pool_ != &State::kConsolePool &&
+        pool_names_.find(edge->pool_) == pool_names_.end()) {
+      char name[32];
+      snprintf(name, sizeof(name), "p%zu", pool_names_.size());
+      pool_names_[edge->pool_] = name;
+    }
+    if (edge->rule_ != &State::kPhonyRule &&
+        rule_names_.find(edge->rule_) == rule_names_.end()) {
+      char name[32];
+      snprintf(name, sizeof(name), "r%zu", rules_.size());
+      rule_names_[edge->rule_] = name;
+      rules_.push_back(edge->rule_);
+    }
+  }
+}
+
+void CNobiGenerator::Generate(string* out) {
+  CollectNames();
+  out->append("#include \"manifest.h\"\n\n");
+  out->append("// Pool declarations\n");
+  GeneratePools(out);
+  out->append("\n// Rule declarations\n");
+  GenerateRules(out);
+
+  out->append("\n// Main manifest\nMANIFEST = {\n");
+  const map<string, string>& bindings = state_->bindings_.GetBindings();
+  if (!bindings.empty()) {
+    out->append("  BINDINGS\n");
+    for (map<string, string>::const_iterator b = bindings.begin();
+         b != bindings.end(); ++b) {
+      AppendBinding(b->first, b->second, "    ", out);
+    }
+    out->append("  END,\n");
+  }
+  if (!state_->edges_.empty()) {
+    out->append("  EDGES\n");
+    for (vector<Edge*>::const_iterator e = state_->edges_.begin();
+         e != state_->edges_.end(); ++e) {
+      GenerateEdge(*e, out);
+    }
+    out->append("  END,\n");
+  }
+  AppendPaths("defaults", state_->defaults_.begin(), state_->defaults_.end(),
+              "  ", out);
+  out->append("};\n");
+}
+
+/// The arrays of a version 2 manifest, see cnobi/manifest.h.  Strings,
+/// tokens, bindings, paths and nodes are added through the methods below;
+/// CNobiGenerator fills in the other arrays.
+struct CNobiGenerator::TableWriter {
+  TableWriter() : blob_size_(0) {}
+
+  /// Offset of \a str in the string blob, adding it if new.
+  uint32_t String(const string& str) {
+    map<string, uint32_t>::iterator i = offsets_.find(str);
+    if (i != offsets_.end())
+      return i->second;
+    uint32_t offset = blob_size_;
+    offsets_[str] = offset;
+    blob_.push_back(str);
+    blob_size_ += str.size() + 1;
+    return offset;
+  }
+
+  uint32_t Token(const string& str, uint32_t kind) {
+    tokens_.push_back(String(str));
+    tokens_.push_back(kind);
+    return tokens_.size() / 2 - 1;
+  }
+
+  /// A path naming \a node, through the node table.
+  void NodePath(const Node* node) {
+    map<const Node*, uint32_t>::iterator i = node_index_.find(node);
+    if (i == node_index_.end()) {
+      i = node_index_.insert(make_pair(node, NumNodes())).first;
+      nodes_.push_back(String(node->path().AsString()));
+      nodes_.push_back(node->slash_bits());
+      // Edges are written in the order of State::edges_, i.e. by id.
+      producers_.push_back(node->in_edge() ? node->in_edge()->id_
+                                           : CNOBI_NONE);
+    }
+    paths_.push_back(i->second);
+    paths_.push_back(CNOBI_NODE);
+  }
+
+  /// A path naming \a node by its path: a single CANON token for a
+  /// canonical path without backslashes, otherwise a literal that the
+  /// loader canonicalizes.
+  void Path(const Node* node) {
+    paths_.push_back(Token(node->path().AsString(),
+                           node->slash_bits() ? LIT : CANON));
+    paths_.push_back(1);
+  }
+
+  void Binding(const string& key, uint32_t first_token, uint32_t count) {
+    bindings_.push_back(String(key));
+    bindings_.push_back(first_token);
+    bindings_.push_back(count);
+  }
+
+  uint32_t NumTokens() const { return tokens_.size() / 2; }
+  uint32_t NumBindings() const { return bindings_.size() / 3; }
+  uint32_t NumPaths() const { return paths_.size() / 2; }
+  uint32_t NumNodes() const { return nodes_.size() / 2; }
+
+  /// Append the arrays to \a out as C definitions.
+  void Write(string* out) {
+    out->append("const struct CNobiHeader cnobi_header = {");
+    AppendNumbers(header, header.size(), out);
+    out->append("};\n\nconst char cnobi_strings[] =\n");
+    for (vector<string>::const_iterator i = blob_.begin(); i != blob_.end();
+         ++i) {
+      out->append("  ");
+      AppendCStringLiteral(*i + '\0', out);
+      out->append("\n");
+    }
+    if (blob_.empty())
+      out->append("  \"\"\n");
+    out->append(";\n");
+    AppendArray("CNobiToken", "cnobi_tokens", tokens_, 2, out);
+    AppendArray("CNobiBinding", "cnobi_bindings", bindings_, 3, out);
+    AppendArray("CNobiRange", "cnobi_paths", paths_, 2, out);
+    AppendArray("CNobiEdge", "cnobi_edges", edges, 11, out);
+    AppendArray("CNobiPool", "cnobi_pools", pools, 2, out);
+    AppendArray("CNobiRule", "cnobi_rules", rules, 4, out);
+    AppendArray("CNobiNode", "cnobi_nodes", nodes_, 2, out);
+    out->append("\nconst uint32_t cnobi_producers[] = {\n");
+    if (producers_.empty())
+      out->append("  0,\n");
+    for (vector<uint32_t>::const_iterator i = producers_.begin();
+         i != producers_.end(); ++i) {
+      char buf[16];
+      snprintf(buf, sizeof(buf), "  %u,\n", *i);
+      out->append(buf);
+    }
+    out->append("};\n");
+    out->append("\nconst uint64_t cnobi_command_hashes[] = {\n");
+    if (command_hashes.empty())
+      out->append("  0,\n");
+    for (vector<uint64_t>::const_iterator i = command_hashes.begin();
+         i != command_hashes.end(); ++i) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "  0x%" PRIx64 "u,\n", *i);
+      out->append(buf);
+    }
+    out->append("};\n");
+  }
+
+  /// Set \a arrays to the bytes of each array, by symbol name.
+  void WriteImage(vector<pair<string, string> >* arrays) {
+    string blob;
+    blob.reserve(blob_size_);
+    for (vector<string>::const_iterator i = blob_.begin(); i != blob_.end();
+         ++i) {
+      blob.append(*i);
+      blob.push_back('\0');
+    }
+    arrays->clear();
+    arrays->push_back(make_pair(string("cnobi_header"), Bytes(header)));
+    arrays->push_back(make_pair(string("cnobi_strings"), blob));
+    arrays->push_back(make_pair(string("cnobi_tokens"), Bytes(tokens_)));
+    arrays->push_back(make_pair(string("cnobi_bindings"), Bytes(bindings_)));
+    arrays->push_back(make_pair(string("cnobi_paths"), Bytes(paths_)));
+    arrays->push_back(make_pair(string("cnobi_edges"), Bytes(edges)));
+    arrays->push_back(make_pair(string("cnobi_pools"), Bytes(pools)));
+    arrays->push_back(make_pair(string("cnobi_rules"), Bytes(rules)));
+    arrays->push_back(make_pair(string("cnobi_nodes"), Bytes(nodes_)));
+    arrays->push_back(make_pair(string("cnobi_producers"),
+                                Bytes(producers_)));
+    arrays->push_back(make_pair(string("cnobi_command_hashes"),
+                                Bytes(command_hashes)));
+  }
+
+  vector<uint32_t> header;
+  vector<uint32_t> edges;
+  vector<uint64_t> command_hashes;
+  vector<uint32_t> pools;
+  vector<uint32_t> rules;
+
+ private:
+  template <typename T>
+  static string Bytes(const vector<T>& values) {
+    if (values.empty())
+      return string();
+    return string(reinterpret_cast<const char*>(&values[0]),
+                  values.size() * sizeof(T));
+  }
+
+  /// Append an array whose elements are \a width numbers each; nested
+  /// structs need no braces of their own in C initializers.
+  static void AppendArray(const char* type, const char* name,
+                          const vector<uint32_t>& values, size_t width,
+                          string* out) {
+    out->append(string("\nconst struct ") + type + " " + name + "[] = {\n");
+    if (values.empty())
+      out->append("  {0},\n");
+    for (size_t i = 0; i < values.size(); i += width) {
+      out->append("  {");
+      AppendNumbers(vector<uint32_t>(values.begin() + i,
+                                     values.begin() + i + width),
+                    width, out);
+      out->append("},\n");
+    }
+    out->append("};\n");
+  }
+
+  static void AppendNumbers(const vector<uint32_t>& values, size_t count,
+                            string* out) {
+    for (size_t i = 0; i < count; ++i) {
+      char buf[16];
+      snprintf(buf, sizeof(buf), i ? ", %u" : "%u", values[i]);
+      out->append(buf);
+    }
+  }
+
+  map<string, uint32_t> offsets_;
+  vector<string> blob_;
+  uint32_t blob_size_;
+  map<const Node*, uint32_t> node_index_;
+  vector<uint32_t> nodes_;
+  /// For each node, the edge writing it, which is what lets the loader
+  /// leave out edges that the targets it builds don't need.
+  vector<uint32_t> producers_;
+  vector<uint32_t> tokens_;
+  vector<uint32_t> bindings_;
+  vector<uint32_t> paths_;
+};
+
+void CNobiGenerator::GenerateTables(string* out) {
+  TableWriter tables;
+  FillTables(&tables);
+  out->append("#include \"manifest.h\"\n\n");
+  tables.Write(out);
+}
+
+void CNobiGenerator::GenerateTableImage(
+    vector<pair<string, string> >* arrays) {
+  TableWriter tables;
+  FillTables(&tables);
+  tables.WriteImage(arrays);
+}
+
+void CNobiGenerator::FillTables(TableWriter* writer) {
+  CollectNames();
+  TableWriter& tables = *writer;
+
+  // Pools and rules are numbered in the order Generate() names them.
+  map<const Pool*, uint32_t> pool_index;
+  vector<uint32_t>& pools = tables.pools;
+  for (map<string, Pool*>::const_iterator p = state_->pools_.begin();
+       p != state_->pools_.end(); ++p) {
+    if (pool_names_.find(p->second) == pool_names_.end() &&
+        p->second != &State::kConsolePool)
+      continue;
+    pool_index[p->second] = pools.size() / 2;
+    pools.push_back(tables.String(p->first));
+    pools.push_back(p->second->depth());
+  }
+
+  map<const Rule*, uint32_t> rule_index;
+  vector<uint32_t>& rules = tables.rules;
+  vector<const Rule*> table_rules(rules_);
+  table_rules.push_back(&State::kPhonyRule);
+  for (vector<const Rule*>::const_iterator r = table_rules.begin();
+       r != table_rules.end(); ++r) {
+    const Rule* rule = *r;
+    rule_index[rule] = rules.size() / 4;
+    rules.push_back(tables.String(rule->name()));
+    rules.push_back(CNOBI_NONE);
+    // Phony has no bindings, so it refers to ninja's own phony rule.  The
+    // "pool" binding stays a binding: edges carry their resolved pool.
+    uint32_t first = tables.NumBindings();
+    for (Rule::Bindings::const_iterator b = rule->bindings_.begin();
+         b != rule->bindings_.end(); ++b) {
+      uint32_t first_token = tables.NumTokens();
+      for (EvalString::TokenList::const_iterator t =
+               b->second.parsed_.begin();
+           t != b->second.parsed_.end(); ++t) {
+        tables.Token(t->first, t->second == EvalString::RAW ? LIT : VAR);
+      }
+      tables.Binding(b->first, first_token, tables.NumTokens() - first_token);
+    }
+    rules.push_back(first);
+    rules.push_back(tables.NumBindings() - first);
+  }
+
+  vector<uint32_t>& header = tables.header;
+  header.assign(1, CNOBI_ABI_VERSION);
+  header.push_back(state_->edges_.size());
+  header.push_back(pools.size() / 2);
+  header.push_back(rules.size() / 4);
+
+  const map<string, string>& scope = state_->bindings_.GetBindings();
+  header.push_back(tables.NumBindings());
+  for (map<string, string>::const_iterator b = scope.begin(); b != scope.end();
+       ++b) {
+    tables.Binding(b->first, tables.Token(b->second, LIT), 1);
+  }
+  header.push_back(scope.size());
+
+  vector<uint32_t>& edges = tables.edges;
+  vector<uint64_t>& command_hashes = tables.command_hashes;
+  for (vector<Edge*>::const_iterator e = state_->edges_.begin();
+       e != state_->edges_.end(); ++e) {
+    const Edge* edge = *e;
+    command_hashes.push_back(edge->is_phony() ? 0 : edge->CommandHash());
+    edges.push_back(rule_index[edge->rule_]);
+    edges.push_back(edge->pool_ == &State::kDefaultPool
+                        ? CNOBI_NONE : pool_index[edge->pool_]);
+    edges.push_back(tables.NumPaths());
+    for (vector<Node*>::const_iterator n = edge->inputs_.begin();
+         n != edge->inputs_.end(); ++n)
+      tables.NodePath(*n);
+    for (vector<Node*>::const_iterator n = edge->outputs_.begin();
+         n != edge->outputs_.end(); ++n)
+      tables.NodePath(*n);
+    for (vector<Node*>::const_iterator n = edge->validations_.begin();
+         n != edge->validations_.end(); ++n)
+      tables.NodePath(*n);
+    edges.push_back(edge->inputs_.size() - edge->implicit_deps_ -
+                    edge->order_only_deps_);
+    edges.push_back(edge->implicit_deps_);
+    edges.push_back(edge->order_only_deps_);
+    edges.push_back(edge->outputs_.size() - edge->implicit_outs_);
+    edges.push_back(edge->implicit_outs_);
+    edges.push_back(edge->validations_.size());
+
+    map<string, string> bindings;
+    CollectEdgeBindings(edge, &bindings);
+    edges.push_back(tables.NumBindings());
+    for (map<string, string>::const_iterator b = bindings.begin();
+         b != bindings.end(); ++b) {
+      tables.Binding(b->first, tables.Token(b->second, LIT), 1);
+    }
+    edges.push_back(bindings.size());
+  }
+
+  // Includes and subninjas are flattened, as in Generate().  Defaults stay
+  // paths rather than nodes: naming an unknown target is an error.
+  for (int i = 0; i < 2; ++i) {
+    header.push_back(0);
+    header.push_back(0);
+  }
+  header.push_back(tables.NumPaths());
+  for (vector<Node*>::const_iterator n = state_->defaults_.begin();
+       n != state_->defaults_.end(); ++n)
+    tables.Path(*n);
+  header.push_back(state_->defaults_.size());
+  header.push_back(0);  // No shards.
+  header.push_back(0);
+  header.push_back(tables.NumNodes());
+}
+
+void CNobiGenerator::GeneratePools(string* out) {
+  for (map<string, Pool*>::const_iterator p = state_->pools_.begin();
+       p != state_->pools_.end(); ++p) {
+    map<const Pool*, string>::const_iterator name = pool_names_.find(p->second);
+    if (name == pool_names_.end())
+      continue;
+    out->append("NAMED_POOL(" + name->second + ", ");
+    AppendCStringLiteral(p->first, out);
+    char depth[32];
+    snprintf(depth, sizeof(depth), ")\n  .depth = %d,\nEND_POOL\n",
+             p->second->depth());
+    out->append(depth);
+  }
+}
+
+void CNobiGenerator::GenerateRules(string* out) {
+  for (vector<const Rule*>::const_iterator r = rules_.begin();
+       r != rules_.end(); ++r) {
+    const Rule* rule = *r;
+    out->append("NAMED_RULE(" + rule_names_[rule] + ", ");
+    AppendCStringLiteral(rule->name(), out);
+    out->append(")\n");
+    // The "pool" binding stays a binding: edges carry their resolved pool.
+    if (!rule->bindings_.empty()) {
+      out->append("  BINDINGS\n");
+      for (Rule::Bindings::const_iterator b = rule->bindings_.begin();
+           b != rule->bindings_.end(); ++b) {
+        out->append("    {");
+        AppendCStringLiteral(b->first, out);
+        out->append(", ");
+        AppendEvalString(b->second, out);
+        out->append("},\n");
+      }
+      out->append("  END\n");
+    }
+    out->append("END_RULE\n");
+  }
+}
+
+void CNobiGenerator::CollectEdgeBindings(const Edge* edge,
+                                         map<string, string>* bindings) {
+  // CNobi gives each edge a single scope below the root, so flatten the
+  // chain of subninja scopes into it.  Variables of the edge's own scope
+  // override rule bindings; those of enclosing scopes do not, so they are
+  // left out where the rule binds the same name.
+  for (const BindingEnv* env = edge->env_; env && env != &state_->bindings_;
+       env = env->parent()) {
+    const map<string, string>& scope = env->GetBindings();
+    for (map<string, string>::const_iterator b = scope.begin();
+         b != scope.end(); ++b) {
+      if (env != edge->env_ && edge->rule_->GetBinding(b->first))
+        continue;
+      bindings->insert(*b);  // Inner scopes were visited first.
+    }
+  }
+}
+
+void CNobiGenerator::GenerateEdge(const Edge* edge, string* out) {
+  out->append("    {\n");
+  if (edge->rule_ == &State::kPhonyRule)
+    out->append("      .rule = &PHONY_RULE,\n");
+  else
+    out->append("      .rule = &" + rule_names_[edge->rule_] + ",\n");
+
+  if (edge->pool_ == &State::kConsolePool)
+    out->append("      .pool = &CONSOLE_POOL,\n");
+  else if (edge->pool_ != &State::kDefaultPool)
+    out->append("      .pool = &" + pool_names_[edge->pool_] + ",\n");
+
+  vector<Node*>::const_iterator explicit_in_end =
+      edge->inputs_.end() - edge->implicit_deps_ - edge->order_only_deps_;
+  vector<Node*>::const_iterator implicit_in_end =
+      edge->inputs_.end() - edge->order_only_deps_;
+  vector<Node*>::const_iterator explicit_out_end =
+      edge->outputs_.end() - edge->implicit_outs_;
+  const string indent = "      ";
+  AppendPaths("in", edge->inputs_.begin(), explicit_in_end, indent, out);
+  AppendPaths("implicit_deps", explicit_in_end, implicit_in_end, indent, out);
+  AppendPaths("order_only_deps", implicit_in_end, edge->inputs_.end(), indent,
+              out);
+  AppendPaths("out", edge->outputs_.begin(), explicit_out_end, indent, out);
+  AppendPaths("implicit_outs", explicit_out_end, edge->outputs_.end(), indent,
+              out);
+  AppendPaths("validations", edge->validations_.begin(),
+              edge->validations_.end(), indent, out);
+
+  map<string, string> bindings;
+  CollectEdgeBindings(edge, &bindings);
+  if (!bindings.empty()) {
+    out->append("      BINDINGS\n");
+    for (map<string, string>::const_iterator b = bindings.begin();
+         b != bindings.end(); ++b) {
+      AppendBinding(b->first, b->second, "        ", out);
+    }
+    out->append("      END\n");
+  }
+  out->append("    },\n");
+}
+
+void CNobiGenerator::AppendPaths(const char* field,
+                                 vector<Node*>::const_iterator begin,
+                                 vector<Node*>::const_iterator end,
+                                 const string& indent, string* out) {
+  if (begin == end)
+    return;
+  out->append(indent + "." + field + " = PATHS\n");
+  for (vector<Node*>::const_iterator n = begin; n != end; ++n) {
+    out->append(indent + "  ");
+    // Node paths are canonical already.  Those that had backslashes need
+    // their slash_bits back, which the loader gets by canonicalizing again.
+    if ((*n)->slash_bits() == 0) {
+      out->append("P(");
+      AppendCStringLiteral((*n)->path().AsString(), out);
+      out->append(")");
+    } else {
+      AppendLiteral((*n)->path().AsString(), out);
+    }
+    out->append(",\n");
+  }
+  out->append(indent + "END,\n");
+}
+
+void CNobiGenerator::AppendEvalString(const EvalString& eval, string* out) {
+  out->append("EVAL");
+  for (EvalString::TokenList::const_iterator t = eval.parsed_.begin();
+       t != eval.parsed_.end(); ++t) {
+    out->append(t->second == EvalString::RAW ? " LIT(" : " VAR(");
+    AppendCStringLiteral(t->first, out);
+    out->append(")");
+  }
+  out->append(" END");
+}
+
+void CNobiGenerator::AppendLiteral(const string& value, string* out) {
+  out->append("EVAL");
+  if (!value.empty()) {
+    out->append(" LIT(");
+    AppendCStringLiteral(value, out);
+    out->append(")");
+  }
+  out->append(" END");
+}
+
+void CNobiGenerator::AppendBinding(const string& key, const string& value,
+                                   const char* indent, string* out) {
+  out->append(indent);
+  out->append("{");
+  AppendCStringLiteral(key, out);
+  out->append(", ");
+  AppendLiteral(value, out);
+  out->append("},\n");
+}
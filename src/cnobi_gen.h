@@ -0,0 +1,76 @@
+#ifndef CNOBI_GEN_H
+#define CNOBI_GEN_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct Edge;
+struct EvalString;
+struct Node;
+struct Pool;
+struct Rule;
+struct State;
+
+/// Writes a loaded State as C source in the format of cnobi/manifest.h, so
+/// that a manifest read by ManifestParser can be compiled and loaded back
+/// through CNobi.  Paths, defaults and variables are emitted as the parser
+/// left them, i.e. already evaluated; paths are emitted as canonical P()
+/// paths, which the loader takes without further work.  Rule bindings keep
+/// their variable references since they are expanded per edge.  Includes
+/// and subninjas are flattened into the one source.
+struct CNobiGenerator {
+  explicit CNobiGenerator(const State* state) : state_(state) {}
+
+  /// Append the C source for the whole state to \a out.
+  void Generate(std::string* out);
+
+  /// Like Generate(), in the relocation-free version 2 layout.
+  void GenerateTables(std::string* out);
+
+  /// Set \a arrays to the arrays GenerateTables() defines, as raw bytes by
+  /// symbol name ("cnobi_edges"...), for images that are not compiled.
+  void GenerateTableImage(
+      std::vector<std::pair<std::string, std::string> >* arrays);
+
+  /// The contents of cnobi/manifest.h, which generated sources include.
+  static const char* ManifestHeader();
+
+  /// The C source written for the text manifest \a manifest, as named by
+  /// cnobi/manifest.py: build.ninja -> build_ninja.c.
+  static std::string OutputPath(const std::string& manifest);
+
+ private:
+  struct TableWriter;
+
+  /// Fill in the arrays of a version 2 manifest.
+  void FillTables(TableWriter* tables);
+  /// Name the pools and rules edges use.
+  void CollectNames();
+  void GeneratePools(std::string* out);
+  void GenerateRules(std::string* out);
+  void GenerateEdge(const Edge* edge, std::string* out);
+
+  /// Collect the variables visible to \a edge below the root scope.
+  void CollectEdgeBindings(const Edge* edge,
+                           std::map<std::string, std::string>* bindings);
+
+  void AppendPaths(const char* field, std::vector<Node*>::const_iterator begin,
+                   std::vector<Node*>::const_iterator end,
+                   const std::string& indent, std::string* out);
+  void AppendEvalString(const EvalString& eval, std::string* out);
+  void AppendLiteral(const std::string& value, std::string* out);
+  void AppendBinding(const std::string& key, const std::string& value,
+                     const char* indent, std::string* out);
+
+  const State* state_;
+  std::vector<const Rule*> rules_;
+  std::map<const Rule*, std::string> rule_names_;
+  std::map<const Pool*, std::string> pool_names_;
+};
+
+/// Append \a str to \a out as a double-quoted C string literal.
+void AppendCStringLiteral(const std::string& str, std::string* out);
+
+#endif  // CNOBI_GEN_H
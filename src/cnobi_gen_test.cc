@@ -0,0 +1,232 @@
+#include "cnobi_gen.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "build_log.h"
+#include "manifest_parser.h"
+#include "state.h"
+#include "test.h"
+
+using namespace std;
+
+namespace {
+
+struct CNobiGenTest : public testing::Test {
+  void AssertParse(const char* input) {
+    ManifestParser parser(&state_, &fs_);
+    string err;
+    EXPECT_TRUE(parser.ParseTest(input, &err));
+    ASSERT_EQ("", err);
+  }
+
+  string Generate() {
+    string out;
+    CNobiGenerator generator(&state_);
+    generator.Generate(&out);
+    return out;
+  }
+
+  State state_;
+  VirtualFileSystem fs_;
+};
+
+bool Contains(const string& haystack, const string& needle) {
+  return haystack.find(needle) != string::npos;
+}
+
+}  // namespace
+
+TEST(CNobiGen, CStringLiteral) {
+  string out;
+  AppendCStringLiteral("a\"b\\c?\?=\n\x7f", &out);
+  EXPECT_EQ("\"a\\\"b\\\\c\\?\\?=\\012\\177\"", out);
+}
+
+TEST(CNobiGen, OutputPath) {
+  EXPECT_EQ("build_ninja.c", CNobiGenerator::OutputPath("build.ninja"));
+  EXPECT_EQ("out/rules_ninja.c", CNobiGenerator::OutputPath("out/rules"));
+  EXPECT_EQ("a.b/x_ninja.c", CNobiGenerator::OutputPath("a.b/x"));
+}
+
+TEST_F(CNobiGenTest, Edge) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"pool link\n"
+"  depth = 2\n"
+"rule cc\n"
+"  command = cc $flags $in -o $out\n"
+"build ./a.o | a.d: cc a.c | a.h || gen |@ lint\n"
+"  pool = link\n"
+"  flags = -O$ 2\n"
+"build gen lint: phony\n"
+"default a.o\n"));
+
+  string out = Generate();
+  EXPECT_TRUE(Contains(out, "NAMED_POOL(p0, \"link\")\n  .depth = 2,\n"));
+  EXPECT_TRUE(Contains(out, "NAMED_RULE(r0, \"cc\")\n"));
+  EXPECT_TRUE(Contains(out, "{\"command\", EVAL LIT(\"cc \") VAR(\"flags\") "
+                            "LIT(\" \") VAR(\"in\") LIT(\" -o \") VAR(\"out\") "
+                            "END},\n"));
+  EXPECT_TRUE(Contains(out,
+"      .rule = &r0,\n"
+"      .pool = &p0,\n"
+"      .in = PATHS\n"
+"        P(\"a.c\"),\n"
+"      END,\n"
+"      .implicit_deps = PATHS\n"
+"        P(\"a.h\"),\n"
+"      END,\n"
+"      .order_only_deps = PATHS\n"
+"        P(\"gen\"),\n"
+"      END,\n"
+"      .out = PATHS\n"
+"        P(\"a.o\"),\n"
+"      END,\n"
+"      .implicit_outs = PATHS\n"
+"        P(\"a.d\"),\n"
+"      END,\n"
+"      .validations = PATHS\n"
+"        P(\"lint\"),\n"
+"      END,\n"));
+  EXPECT_TRUE(Contains(out, "{\"flags\", EVAL LIT(\"-O 2\") END},\n"));
+  EXPECT_TRUE(Contains(out, "      .rule = &PHONY_RULE,\n"));
+  EXPECT_TRUE(Contains(out, "  .defaults = PATHS\n    P(\"a.o\"),\n"));
+}
+
+TEST_F(CNobiGenTest, SubninjaScopes) {
+  fs_.Create("sub.ninja",
+"flags = -O3\n"
+"command = scope\n"
+"rule cc\n"
+"  command = sub $flags\n"
+"build sub.o: cc sub.c\n");
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule cc\n"
+"  command = top $flags\n"
+"build top.o: cc top.c\n"
+"subninja sub.ninja\n"));
+
+  string out = Generate();
+  // Both rules are kept, under their own name.
+  EXPECT_TRUE(Contains(out, "NAMED_RULE(r0, \"cc\")\n"));
+  EXPECT_TRUE(Contains(out, "NAMED_RULE(r1, \"cc\")\n"));
+  EXPECT_TRUE(Contains(out, "      .rule = &r1,\n"));
+  // The subninja scope is flattened into the edge.  Its "command" overrides
+  // the rule's, as the edge has no scope of its own.
+  EXPECT_TRUE(Contains(out,
+"      BINDINGS\n"
+"        {\"command\", EVAL LIT(\"scope\") END},\n"
+"        {\"flags\", EVAL LIT(\"-O3\") END},\n"
+"      END\n"));
+}
+
+TEST_F(CNobiGenTest, EnclosingScopeDoesNotOverrideRule) {
+  fs_.Create("sub.ninja",
+"description = scope\n"
+"rule cc\n"
+"  command = cc\n"
+"  description = rule\n"
+"build sub.o: cc sub.c\n"
+"  flags = -g\n");
+  ASSERT_NO_FATAL_FAILURE(AssertParse("subninja sub.ninja\n"));
+
+  string out = Generate();
+  EXPECT_TRUE(Contains(out,
+"      BINDINGS\n"
+"        {\"flags\", EVAL LIT(\"-g\") END},\n"
+"      END\n"));
+  EXPECT_FALSE(Contains(out, "LIT(\"scope\")"));
+}
+
+TEST_F(CNobiGenTest, Tables) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"pool link\n"
+"  depth = 2\n"
+"rule cc\n"
+"  command = cc $in\n"
+"build a.o: cc a.c\n"
+"  pool = link\n"
+"build all: phony a.o\n"
+"default all\n"));
+
+  string out;
+  CNobiGenerator generator(&state_);
+  generator.GenerateTables(&out);
+  // Strings are shared, and so are the tokens of paths naming one node.
+  EXPECT_TRUE(Contains(out,
+"const char cnobi_strings[] =\n"
+"  \"console\\000\"\n"
+"  \"link\\000\"\n"
+"  \"cc\\000\"\n"
+"  \"cc \\000\"\n"
+"  \"in\\000\"\n"
+"  \"command\\000\"\n"
+"  \"rspfile\\000\"\n"
+"  \"rspfile_content\\000\"\n"
+"  \"phony\\000\"\n"
+"  \"a.c\\000\"\n"
+"  \"a.o\\000\"\n"
+"  \"pool\\000\"\n"
+"  \"all\\000\"\n"
+";\n"));
+  // Two edges, pools and rules; three scope bindings, one default and three
+  // nodes.
+  EXPECT_TRUE(Contains(out, "cnobi_header = {2, 2, 2, 2, 3, 0, 0, 0, 0, 0, "
+                            "4, 1, 0, 0, 3};\n"));
+  EXPECT_TRUE(Contains(out,
+"const struct CNobiToken cnobi_tokens[] = {\n"
+"  {16, 0},\n"
+"  {20, 1},\n"
+"  {8, 0},\n"
+"  {74, 2},\n"
+"};\n"));
+  EXPECT_TRUE(Contains(out,
+"const struct CNobiPool cnobi_pools[] = {\n"
+"  {0, 1},\n"
+"  {8, 2},\n"
+"};\n"));
+  // phony has no bindings, so it refers to ninja's own.
+  EXPECT_TRUE(Contains(out,
+"const struct CNobiRule cnobi_rules[] = {\n"
+"  {13, 4294967295, 0, 3},\n"
+"  {55, 4294967295, 3, 0},\n"
+"};\n"));
+  // cc a.c -> a.o in pool "link", with the edge's "pool" binding, then
+  // phony a.o -> all.
+  EXPECT_TRUE(Contains(out,
+"const struct CNobiEdge cnobi_edges[] = {\n"
+"  {0, 1, 0, 1, 0, 0, 1, 0, 0, 3, 1},\n"
+"  {1, 4294967295, 2, 1, 0, 0, 1, 0, 0, 4, 0},\n"
+"};\n"));
+  // Edges name nodes; the default is a plain path.
+  EXPECT_TRUE(Contains(out,
+"const struct CNobiRange cnobi_paths[] = {\n"
+"  {0, 4294967295},\n"
+"  {1, 4294967295},\n"
+"  {1, 4294967295},\n"
+"  {2, 4294967295},\n"
+"  {3, 1},\n"
+"};\n"));
+  EXPECT_TRUE(Contains(out,
+"const struct CNobiNode cnobi_nodes[] = {\n"
+"  {61, 0},\n"
+"  {65, 0},\n"
+"  {74, 0},\n"
+"};\n"));
+  // a.c is a source, a.o and all are written by the two edges.
+  EXPECT_TRUE(Contains(out,
+"const uint32_t cnobi_producers[] = {\n"
+"  4294967295,\n"
+"  0,\n"
+"  1,\n"
+"};\n"));
+  // The hash of "cc a.c" as the build log keeps it; phony has no command.
+  char hash[32];
+  snprintf(hash, sizeof(hash), "0x%" PRIx64 "u",
+           BuildLog::LogEntry::HashCommand("cc a.c"));
+  EXPECT_TRUE(Contains(out,
+"const uint64_t cnobi_command_hashes[] = {\n"
+"  " + string(hash) + ",\n"
+"  0x0u,\n"
+"};\n"));
+}
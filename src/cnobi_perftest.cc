@@ -0,0 +1,260 @@
+// Compares cnobi manifest loading with ManifestParser on the same graph.
+// Expects to be run in ninja's root directory, with a C compiler for the
+// generated manifests (see CNobi::CompilerCommand()).
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "cnobi.h"
+#include "cnobi_gen.h"
+#include "disk_interface.h"
+#include "manifest_parser.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+using namespace std;
+
+namespace {
+
+/// Timings of one load, in milliseconds, and its peak RSS in KiB.
+struct Sample {
+  Sample()
+      : ok(false), total(0), generate(0), lookup(0), dlopen(0), convert(0),
+        merge(0), rss_kb(0) {}
+  bool ok;
+  double total;
+  /// Writing the C, not counting the parse it starts from.
+  double generate;
+  /// Finding or compiling the shared object in the cache.
+  double lookup;
+  double dlopen;
+  /// Whatever is left: staging edges and converting subninjas.
+  double convert;
+  double merge;
+  long rss_kb;
+};
+
+bool WriteFakeManifests(const string& dir, int targets, string* err) {
+  RealDiskInterface disk_interface;
+  TimeStamp mtime = disk_interface.Stat(dir + "/build.ninja", err);
+  if (mtime != 0)  // 0 means that the file doesn't exist yet.
+    return mtime != -1;
+
+  char command[512];
+  snprintf(command, sizeof(command),
+           "python3 misc/write_fake_manifests.py -t %d %s", targets,
+           dir.c_str());
+  printf("Creating manifest data..."); fflush(stdout);
+  int exit_code = system(command);
+  printf("done.\n");
+  if (exit_code != 0)
+    *err = string("Failed to run ") + command;
+  return exit_code == 0;
+}
+
+/// Run \a load in a child process, so that each load starts from the same
+/// empty heap and its peak RSS is its own.
+template <typename Load>
+Sample Measure(Load load) {
+  int fds[2];
+  if (pipe(fds) < 0)
+    Fatal("pipe: %s", strerror(errno));
+  int64_t start = GetTimeMillis();
+  pid_t pid = fork();
+  if (pid < 0)
+    Fatal("fork: %s", strerror(errno));
+  if (pid == 0) {
+    close(fds[0]);
+    g_metrics = new Metrics;
+    Sample sample;
+    sample.ok = load(&sample);
+    if (write(fds[1], &sample, sizeof(sample)) != sizeof(sample))
+      _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+  Sample sample;
+  if (read(fds[0], &sample, sizeof(sample)) != sizeof(sample))
+    sample.ok = false;
+  close(fds[0]);
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0)
+    Fatal("wait4: %s", strerror(errno));
+  sample.total = GetTimeMillis() - start;
+  sample.rss_kb = usage.ru_maxrss;
+  return sample;
+}
+
+bool ParseManifest(Sample*) {
+  RealDiskInterface disk_interface;
+  State state;
+  ManifestParser parser(&state, &disk_interface);
+  string err;
+  if (!parser.Load("build.ninja", &err)) {
+    fprintf(stderr, "ManifestParser: %s\n", err.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool LoadCNobi(Sample* sample) {
+  State state;
+  CNobi cnobi(&state);
+  string err;
+  if (!cnobi.Load("build_ninja.c", &err)) {
+    fprintf(stderr, "CNobi: %s\n", err.c_str());
+    return false;
+  }
+  sample->lookup = g_metrics->TotalMillis(".ninja cnobi cache lookup");
+  sample->dlopen = g_metrics->TotalMillis(".ninja cnobi dlopen");
+  sample->merge = g_metrics->TotalMillis(".ninja cnobi merge");
+  sample->convert = g_metrics->TotalMillis(".ninja cnobi load") -
+                    sample->lookup - sample->dlopen - sample->merge;
+  return true;
+}
+
+/// Write build_ninja.c with the generator of -t cnobi-gen, timing only
+/// the generation, or with cnobi/manifest.py from \a root.
+bool GenerateC(const string& root, bool python, Sample* sample) {
+  if (python) {
+    string command = "python3 " + root + "/cnobi/manifest.py build.ninja";
+    return system(command.c_str()) == 0;
+  }
+  RealDiskInterface disk_interface;
+  State state;
+  ManifestParser parser(&state, &disk_interface);
+  string err;
+  if (!parser.Load("build.ninja", &err)) {
+    fprintf(stderr, "ManifestParser: %s\n", err.c_str());
+    return false;
+  }
+  int64_t start = GetTimeMillis();
+  string contents;
+  CNobiGenerator(&state).GenerateTables(&contents);
+  bool ok = disk_interface.WriteFile("build_ninja.c", contents) &&
+            disk_interface.WriteFile("manifest.h",
+                                     CNobiGenerator::ManifestHeader());
+  sample->generate = GetTimeMillis() - start;
+  return ok;
+}
+
+void Report(const char* name, const vector<Sample>& samples, bool phases) {
+  double min_total = samples[0].total, max_total = 0, sum = 0;
+  long rss_kb = 0;
+  for (vector<Sample>::const_iterator s = samples.begin();
+       s != samples.end(); ++s) {
+    min_total = min(min_total, s->total);
+    max_total = max(max_total, s->total);
+    sum += s->total;
+    rss_kb = max(rss_kb, s->rss_kb);
+  }
+  printf("%-16s min %.0fms  max %.0fms  avg %.1fms  peak RSS %.1fMiB\n", name,
+         min_total, max_total, sum / samples.size(), rss_kb / 1024.0);
+  if (!phases)
+    return;
+  // Phases of the fastest load.
+  const Sample* best = &samples[0];
+  for (vector<Sample>::const_iterator s = samples.begin();
+       s != samples.end(); ++s) {
+    if (s->total < best->total)
+      best = &*s;
+  }
+  printf("%-16s lookup %.1fms  dlopen %.1fms  convert %.1fms  "
+         "merge %.1fms\n", "", best->lookup, best->dlopen, best->convert,
+         best->merge);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int targets = 1500;
+  int repetitions = 5;
+  bool python = false;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("pr:t:h"))) != -1) {
+    switch (opt) {
+    case 'p':
+      python = true;
+      break;
+    case 'r':
+      repetitions = max(1, atoi(optarg));
+      break;
+    case 't':
+      targets = max(1, atoi(optarg));
+      break;
+    case 'h':
+    default:
+      printf("usage: cnobi_perftest [options]\n"
+"\n"
+"options:\n"
+"  -t N   number of targets of the fake manifests [default=1500]\n"
+"  -r N   number of loads to time [default=5]\n"
+"  -p     generate the C with cnobi/manifest.py rather than -t cnobi-gen\n"
+             );
+      return 1;
+    }
+  }
+
+  char root[PATH_MAX];
+  if (!getcwd(root, sizeof(root)))
+    Fatal("getcwd: %s", strerror(errno));
+  char manifest_dir[64];
+  snprintf(manifest_dir, sizeof(manifest_dir), "build/cnobi_perftest_%d",
+           targets);
+
+  string err;
+  if (!WriteFakeManifests(manifest_dir, targets, &err)) {
+    fprintf(stderr, "Failed to write test data: %s\n", err.c_str());
+    return 1;
+  }
+  if (chdir(manifest_dir) < 0)
+    Fatal("chdir: %s", strerror(errno));
+  // A cache of our own, emptied so that the first load compiles.
+  setenv("CNOBI_CACHE_DIR", "cnobi_cache", 1);
+  if (system("rm -rf cnobi_cache") != 0)
+    Fatal("cannot empty cnobi_cache");
+
+  Sample generate = Measure([python, root](Sample* sample) {
+    return GenerateC(root, python, sample);
+  });
+  if (!generate.ok) {
+    fprintf(stderr, "Failed to generate build_ninja.c\n");
+    return 1;
+  }
+  if (python) {
+    printf("%-16s %.0fms (manifest.py)\n", "generate", generate.total);
+  } else {
+    printf("%-16s %.0fms (after a parse)\n", "generate", generate.generate);
+  }
+
+  Sample compile = Measure(LoadCNobi);
+  if (!compile.ok)
+    return 1;
+  printf("%-16s %.0fms, of a first load taking %.0fms\n", "compile",
+         compile.lookup, compile.total);
+
+  vector<Sample> parser_samples, cnobi_samples;
+  for (int i = 0; i < repetitions; ++i) {
+    parser_samples.push_back(Measure(ParseManifest));
+    cnobi_samples.push_back(Measure(LoadCNobi));
+    if (!parser_samples.back().ok || !cnobi_samples.back().ok)
+      return 1;
+  }
+  Report("ManifestParser", parser_samples, false);
+  Report("CNobi", cnobi_samples, true);
+  return 0;
+}
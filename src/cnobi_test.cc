@@ -0,0 +1,502 @@
+#include "cnobi.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "cnobi_gen.h"
+#include "disk_interface.h"
+#include "graph.h"
+#include "graph_fingerprint.h"
+#include "manifest_parser.h"
+#include "state.h"
+#include "test.h"
+
+using namespace std;
+
+namespace {
+
+/// A compiler that logs its command lines to compile.log before running
+/// gcc.  Commands naming a file called broken* fail, after writing part of
+/// their output.
+const char kCompiler[] =
+"echo \"$*\" >> compile.log\n"
+"case \"$*\" in\n"
+"*broken*)\n"
+"  while [ $# -gt 1 ]; do\n"
+"    if [ \"$1\" = -o ]; then echo partial > \"$2\"; fi\n"
+"    shift\n"
+"  done\n"
+"  exit 1;;\n"
+"esac\n"
+"exec gcc \"$@\"\n";
+
+const char kRule[] =
+"RULE(cc)\n"
+"  BINDINGS\n"
+"    {\"command\", EVAL LIT(\"cc \") VAR(\"in\") END},\n"
+"  END\n"
+"END_RULE\n";
+
+/// Edges of rule cc, one per output, in the version 1 layout.
+string Edges(const vector<string>& outputs) {
+  string out;
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    out += "    {.rule = &cc, .in = PATHS P(\"" + outputs[i] + ".c\"), END,"
+           " .out = PATHS P(\"" + outputs[i] + ".o\"), END},\n";
+  }
+  return out;
+}
+
+/// A version 1 manifest with a rule and one edge per output.
+string Manifest(const vector<string>& outputs) {
+  return string("#include \"manifest.h\"\n") + kRule +
+"MANIFEST = {\n"
+"  RULES &cc, 0},\n"
+"  EDGES\n" + Edges(outputs) +
+"  END,\n"
+"};\n";
+}
+
+/// A shard of Sharded() defining \a name.
+string Shard(const string& name, const vector<string>& outputs) {
+  return "#include \"manifest.h\"\n"
+         "EXTERN_RULE(cc)\n"
+         "SHARD(" + name + ")\n" + Edges(outputs) +
+         "END_SHARD\n";
+}
+
+/// A version 1 manifest whose edges are all in the shards \a names, the
+/// sources of which are <name>.c.
+string Sharded(const vector<string>& names) {
+  string out = "#include \"manifest.h\"\n";
+  for (size_t i = 0; i < names.size(); ++i)
+    out += "// cnobi-shard: " + names[i] + ".c\n";
+  out += kRule;
+  for (size_t i = 0; i < names.size(); ++i)
+    out += "EXTERN_SHARD(" + names[i] + ")\n";
+  out += "MANIFEST = {\n"
+         "  RULES &cc, 0},\n"
+         "  SHARDS ";
+  for (size_t i = 0; i < names.size(); ++i)
+    out += names[i] + ", ";
+  out += "0},\n"
+         "};\n";
+  return out;
+}
+
+/// Load the arrays of a table image with \a parse_threads staging threads.
+void LoadImage(const vector<pair<string, string> >& arrays, int parse_threads,
+               State* state) {
+  ManifestParserOptions options;
+  options.parse_threads_ = parse_threads;
+  CNobi cnobi(state, options);
+  string err;
+  EXPECT_TRUE(cnobi.LoadTables("build.ninja", [&arrays](const string& name) {
+    for (size_t i = 0; i < arrays.size(); ++i) {
+      if (arrays[i].first == name)
+        return static_cast<const void*>(arrays[i].second.data());
+    }
+    return static_cast<const void*>(NULL);
+  }, &err));
+  EXPECT_EQ("", err);
+}
+
+/// The command and paths of \a edge, in order.
+string Describe(const Edge* edge) {
+  string out = edge->EvaluateCommand() + " |";
+  for (vector<Node*>::const_iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i)
+    out += " " + (*i)->path().AsString();
+  out += " ->";
+  for (vector<Node*>::const_iterator i = edge->outputs_.begin();
+       i != edge->outputs_.end(); ++i)
+    out += " " + (*i)->path().AsString();
+  char counts[64];
+  snprintf(counts, sizeof(counts), " (%d %d %d)", edge->implicit_deps_,
+           edge->order_only_deps_, edge->implicit_outs_);
+  return out + counts;
+}
+
+}  // namespace
+
+// Edges staged in chunks on workers are merged in the order a serial load
+// gives, including edges with several outputs either side of a boundary.
+TEST(CNobiStagingTest, Chunks) {
+  const int kChunk = 4096;
+  string input =
+"rule cc\n"
+"  command = cc $flags $in -o $out\n";
+  char line[160];
+  for (int i = 0; i < 3 * kChunk + 100; ++i) {
+    const bool multiple = i % kChunk == kChunk - 1 || i % kChunk == 0;
+    if (multiple) {
+      snprintf(line, sizeof(line),
+               "build o%d.o o%d.d | o%d.i: cc s%d.c | h%d.h || gen\n",
+               i, i, i, i, i % 50);
+    } else {
+      snprintf(line, sizeof(line), "build o%d.o: cc s%d.c | h%d.h\n",
+               i, i, i % 50);
+    }
+    input += line;
+    if (multiple || i % 1000 == 0) {
+      snprintf(line, sizeof(line), "  flags = -g%d\n", i);
+      input += line;
+    }
+  }
+  State parsed;
+  VirtualFileSystem fs;
+  ManifestParser parser(&parsed, &fs);
+  string err;
+  ASSERT_TRUE(parser.ParseTest(input, &err));
+  ASSERT_EQ("", err);
+  vector<pair<string, string> > arrays;
+  CNobiGenerator(&parsed).GenerateTableImage(&arrays);
+
+  // Declared after the arrays, whose strings their nodes borrow.
+  State serial, chunked;
+  ASSERT_NO_FATAL_FAILURE(LoadImage(arrays, 1, &serial));
+  ASSERT_NO_FATAL_FAILURE(LoadImage(arrays, 4, &chunked));
+  ASSERT_EQ(parsed.edges_.size(), serial.edges_.size());
+  ASSERT_EQ(serial.edges_.size(), chunked.edges_.size());
+  EXPECT_EQ(serial.paths_.size(), chunked.paths_.size());
+  for (size_t i = 0; i < serial.edges_.size(); ++i) {
+    const Edge* edge = chunked.edges_[i];
+    ASSERT_EQ(Describe(serial.edges_[i]), Describe(edge)) << "edge " << i;
+    for (size_t o = 0; o < edge->outputs_.size(); ++o)
+      EXPECT_EQ(edge, edge->outputs_[o]->in_edge());
+  }
+  EXPECT_EQ("cc -g4095 s4095.c -o o4095.o o4095.d | s4095.c h45.h gen -> "
+            "o4095.o o4095.d o4095.i (1 1 1)",
+            Describe(chunked.edges_[kChunk - 1]));
+  EXPECT_EQ(GraphFingerprint::Of(parsed), GraphFingerprint::Of(chunked));
+}
+
+/// Points the compiled manifest cache and the compiler at the temporary
+/// directory, for tests of CNobi::LocateCompiledManifest().
+struct CNobiCacheTest : public testing::Test {
+  virtual void SetUp() {
+    SaveEnv("CNOBI_CC", &saved_cc_);
+    SaveEnv("CNOBI_CACHE_DIR", &saved_cache_dir_);
+    temp_dir_.CreateAndEnter("Ninja-CNobiCacheTest");
+    disk_interface_.WriteFile("cc.sh", kCompiler);
+    disk_interface_.WriteFile("manifest.h", CNobiGenerator::ManifestHeader());
+    setenv("CNOBI_CC", "sh cc.sh", 1);
+    setenv("CNOBI_CACHE_DIR", "cache", 1);
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+    RestoreEnv("CNOBI_CC", saved_cc_);
+    RestoreEnv("CNOBI_CACHE_DIR", saved_cache_dir_);
+  }
+
+  static void SaveEnv(const char* name, pair<bool, string>* saved) {
+    const char* value = getenv(name);
+    *saved = make_pair(value != NULL, value ? value : "");
+  }
+
+  static void RestoreEnv(const char* name, const pair<bool, string>& saved) {
+    if (saved.first)
+      setenv(name, saved.second.c_str(), 1);
+    else
+      unsetenv(name);
+  }
+
+  bool Locate(const string& input_file, bool parallel, string* so_path,
+              string* err) {
+    State state;
+    CNobi cnobi(&state);
+    return cnobi.LocateCompiledManifest(input_file, parallel, so_path, err);
+  }
+
+  /// Compile and load \a input_file, returning its fingerprint.
+  GraphFingerprint Load(const string& input_file) {
+    State state;
+    CNobi cnobi(&state);
+    string err;
+    EXPECT_TRUE(cnobi.Load(input_file, &err));
+    EXPECT_EQ("", err);
+    return GraphFingerprint::Of(state);
+  }
+
+  /// The compiler command lines run so far.
+  vector<string> Compiles() {
+    string contents, err;
+    vector<string> lines;
+    if (disk_interface_.ReadFile("compile.log", &contents, &err) !=
+        FileReader::Okay)
+      return lines;
+    for (size_t pos = 0; pos < contents.size();) {
+      size_t end = contents.find('\n', pos);
+      lines.push_back(contents.substr(pos, end - pos));
+      pos = end + 1;
+    }
+    return lines;
+  }
+
+  /// The files in the cache, sorted.
+  vector<string> CacheEntries() {
+    vector<string> entries;
+    DIR* dir = opendir("cache");
+    if (!dir)
+      return entries;
+    while (struct dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] != '.')
+        entries.push_back(string("cache/") + entry->d_name);
+    }
+    closedir(dir);
+    sort(entries.begin(), entries.end());
+    return entries;
+  }
+
+  pair<bool, string> saved_cc_;
+  pair<bool, string> saved_cache_dir_;
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_interface_;
+};
+
+TEST_F(CNobiCacheTest, Hit) {
+  disk_interface_.WriteFile("build_ninja.c",
+                            Manifest(vector<string>(1, "a")));
+  string so_path, err;
+  ASSERT_TRUE(Locate("build_ninja.c", false, &so_path, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(vector<string>(1, so_path), CacheEntries());
+  EXPECT_EQ(1u, Compiles().size());
+
+  // The same source is not compiled again.
+  string again;
+  ASSERT_TRUE(Locate("build_ninja.c", false, &again, &err));
+  EXPECT_EQ(so_path, again);
+  EXPECT_EQ(1u, Compiles().size());
+}
+
+TEST_F(CNobiCacheTest, MissAfterChange) {
+  vector<string> outputs(1, "a");
+  disk_interface_.WriteFile("build_ninja.c", Manifest(outputs));
+  string first, err;
+  ASSERT_TRUE(Locate("build_ninja.c", false, &first, &err));
+
+  outputs.push_back("b");
+  disk_interface_.WriteFile("build_ninja.c", Manifest(outputs));
+  string second;
+  ASSERT_TRUE(Locate("build_ninja.c", false, &second, &err));
+  ASSERT_EQ("", err);
+  EXPECT_NE(first, second);
+  EXPECT_EQ(2u, Compiles().size());
+  EXPECT_EQ(2u, CacheEntries().size());
+
+  // So is a change to the header the source includes.
+  disk_interface_.WriteFile("manifest.h",
+                            string(CNobiGenerator::ManifestHeader()) + "\n");
+  string third;
+  ASSERT_TRUE(Locate("build_ninja.c", false, &third, &err));
+  EXPECT_NE(second, third);
+  EXPECT_EQ(3u, Compiles().size());
+}
+
+TEST_F(CNobiCacheTest, FailedCompileLeavesNoEntry) {
+  disk_interface_.WriteFile("broken_ninja.c",
+                            Manifest(vector<string>(1, "a")));
+  for (int parallel = 0; parallel < 2; ++parallel) {
+    string so_path, err;
+    EXPECT_FALSE(Locate("broken_ninja.c", parallel, &so_path, &err));
+    EXPECT_EQ("couldn't compile broken_ninja.c", err);
+    // Neither the object nor the partial output it was written to is left
+    // to be taken for a compiled manifest, so each attempt compiles.
+    EXPECT_EQ(vector<string>(), CacheEntries());
+    EXPECT_EQ(parallel + 1u, Compiles().size());
+  }
+}
+
+TEST_F(CNobiCacheTest, Shards) {
+  const char* kNames[] = { "edges_0", "edges_1", "edges_2" };
+  vector<string> names(kNames, kNames + 3);
+  const char* kOutputs[] = { "a", "b", "c", "d", "e", "f" };
+  vector<string> outputs(kOutputs, kOutputs + 6);
+  disk_interface_.WriteFile("build_ninja.c", Sharded(names));
+  for (size_t i = 0; i < names.size(); ++i) {
+    disk_interface_.WriteFile(
+        names[i] + ".c",
+        Shard(names[i], vector<string>(outputs.begin() + 2 * i,
+                                       outputs.begin() + 2 * i + 2)));
+  }
+  disk_interface_.WriteFile("full_ninja.c", Manifest(outputs));
+  EXPECT_EQ(Load("full_ninja.c"), Load("build_ninja.c"));
+  // The full manifest, then an object per source and their link.
+  EXPECT_EQ(1u + 4u + 1u, Compiles().size());
+
+  // Change one edge: only its shard is compiled again before the link.
+  outputs[3] = "g";
+  disk_interface_.WriteFile("edges_1.c",
+                            Shard("edges_1", vector<string>(
+                                outputs.begin() + 2, outputs.begin() + 4)));
+  disk_interface_.RemoveFile("compile.log");
+  GraphFingerprint sharded = Load("build_ninja.c");
+  vector<string> compiles = Compiles();
+  ASSERT_EQ(2u, compiles.size());
+  EXPECT_NE(string::npos, compiles[0].find(" -c "));
+  EXPECT_NE(string::npos, compiles[0].find(" edges_1.c"));
+  EXPECT_EQ(string::npos, compiles[1].find(" -c "));
+
+  disk_interface_.WriteFile("full_ninja.c", Manifest(outputs));
+  EXPECT_EQ(Load("full_ninja.c"), sharded);
+}
+
+// Shards with the same text share a cache key: they are compiled once, and
+// their object linked once.
+TEST_F(CNobiCacheTest, IdenticalShards) {
+  const char* kOutputs[] = { "a", "b" };
+  vector<string> outputs(kOutputs, kOutputs + 2);
+  disk_interface_.WriteFile("build_ninja.c",
+                            "// cnobi-shard: copy.c\n" +
+                                Sharded(vector<string>(1, "edges_0")));
+  disk_interface_.WriteFile("edges_0.c", Shard("edges_0", outputs));
+  disk_interface_.WriteFile("copy.c", Shard("edges_0", outputs));
+  disk_interface_.WriteFile("full_ninja.c", Manifest(outputs));
+  for (int parallel = 0; parallel < 2; ++parallel) {
+    string so_path, err;
+    EXPECT_TRUE(Locate("build_ninja.c", parallel, &so_path, &err));
+    EXPECT_EQ("", err);
+  }
+  // An object for the manifest and one for both shards, then their link.
+  EXPECT_EQ(3u, Compiles().size());
+  EXPECT_EQ(Load("full_ninja.c"), Load("build_ninja.c"));
+}
+
+// An included manifest adds to the scope of the one including it; a
+// subninja reads it, but its own bindings stay in a scope of its own.
+TEST_F(CNobiCacheTest, IncludeAndSubninjaScopes) {
+  disk_interface_.WriteFile("build_ninja.c",
+"#include \"manifest.h\"\n"
+"RULE(cc)\n"
+"  BINDINGS\n"
+"    {\"command\",\n"
+"     EVAL LIT(\"cc \") VAR(\"flags\") LIT(\" \") VAR(\"in\") END},\n"
+"  END\n"
+"END_RULE\n"
+"MANIFEST = {\n"
+"  BINDINGS\n"
+"    BL(flags, \"-O2\")\n"
+"    BL(subdir, \"sub\")\n"
+"  END,\n"
+"  RULES &cc, 0},\n"
+"  INCLUDES EVAL LIT(\"rules_ninja.c\") END, END,\n"
+"  SUBNINJAS EVAL VAR(\"subdir\") LIT(\"/build_ninja.c\") END, END,\n"
+"  EDGES\n"
+"    {.rule = &cc, .in = PATHS P(\"a.c\"), END,\n"
+"     .out = PATHS P(\"a.o\"), END},\n"
+"  END,\n"
+"};\n");
+  disk_interface_.WriteFile("rules_ninja.c",
+"#include \"manifest.h\"\n"
+"NAMED_RULE(link_rule, \"link\")\n"
+"  BINDINGS\n"
+"    {\"command\",\n"
+"     EVAL LIT(\"link \") VAR(\"libs\") LIT(\" \") VAR(\"in\") END},\n"
+"  END\n"
+"END_RULE\n"
+"MANIFEST = {\n"
+"  BINDINGS\n"
+"    BL(libs, \"-lm\")\n"
+"  END,\n"
+"  RULES &link_rule, 0},\n"
+"  EDGES\n"
+"    {.rule = &link_rule, .in = PATHS P(\"a.o\"), END,\n"
+"     .out = PATHS P(\"app\"), END},\n"
+"  END,\n"
+"};\n");
+  ASSERT_TRUE(disk_interface_.MakeDir("sub"));
+  disk_interface_.WriteFile("sub/manifest.h", CNobiGenerator::ManifestHeader());
+  disk_interface_.WriteFile("sub/build_ninja.c",
+"#include \"manifest.h\"\n"
+"RULE_REF(cc, \"cc\")\n"
+"RULE_REF(link_rule, \"link\")\n"
+"MANIFEST = {\n"
+"  BINDINGS\n"
+"    BL(flags, \"-g\")\n"
+"  END,\n"
+"  EDGES\n"
+"    {.rule = &cc, .in = PATHS P(\"sub.c\"), END,\n"
+"     .out = PATHS P(\"sub.o\"), END},\n"
+"    {.rule = &link_rule, .in = PATHS P(\"sub.o\"), END,\n"
+"     .out = PATHS P(\"sub\"), END},\n"
+"  END,\n"
+"};\n");
+
+  State state;
+  CNobi cnobi(&state);
+  string err;
+  ASSERT_TRUE(cnobi.Load("build_ninja.c", &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ("cc -O2 a.c",
+            state.GetNode("a.o", 0)->in_edge()->EvaluateCommand());
+  EXPECT_EQ("link -lm a.o",
+            state.GetNode("app", 0)->in_edge()->EvaluateCommand());
+  EXPECT_EQ("cc -g sub.c",
+            state.GetNode("sub.o", 0)->in_edge()->EvaluateCommand());
+  EXPECT_EQ("link -lm sub.o",
+            state.GetNode("sub", 0)->in_edge()->EvaluateCommand());
+  EXPECT_EQ("-O2", state.bindings_.LookupVariable("flags"));
+  EXPECT_EQ("-lm", state.bindings_.LookupVariable("libs"));
+
+  // The same as the text manifests would give.
+  disk_interface_.WriteFile("build.ninja",
+"flags = -O2\n"
+"subdir = sub\n"
+"rule cc\n"
+"  command = cc $flags $in\n"
+"include rules.ninja\n"
+"build a.o: cc a.c\n"
+"subninja $subdir/build.ninja\n");
+  disk_interface_.WriteFile("rules.ninja",
+"libs = -lm\n"
+"rule link\n"
+"  command = link $libs $in\n"
+"build app: link a.o\n");
+  disk_interface_.WriteFile("sub/build.ninja",
+"flags = -g\n"
+"build sub.o: cc sub.c\n"
+"build sub: link sub.o\n");
+  State parsed;
+  ManifestParser parser(&parsed, &disk_interface_);
+  ASSERT_TRUE(parser.Load("build.ninja", &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(GraphFingerprint::Of(parsed), GraphFingerprint::Of(state));
+}
+
+// The same subninja twice, under different scopes: its conversions may run
+// at once, and must not write the same temporary file.
+TEST_F(CNobiCacheTest, SubninjaTwice) {
+  disk_interface_.WriteFile("build_ninja.c",
+"#include \"manifest.h\"\n"
+"MANIFEST = {\n"
+"  SUBNINJAS\n"
+"    EVAL LIT(\"sub/build_ninja.c\") END,\n"
+"    EVAL LIT(\"sub/build_ninja.c\") END,\n"
+"  END,\n"
+"};\n");
+  ASSERT_TRUE(disk_interface_.MakeDir("sub"));
+  disk_interface_.WriteFile("sub/manifest.h", CNobiGenerator::ManifestHeader());
+  disk_interface_.WriteFile("sub/build_ninja.c",
+"#include \"manifest.h\"\n"
+"MANIFEST = {\n"
+"  BINDINGS\n"
+"    BL(flags, \"-g\")\n"
+"  END,\n"
+"};\n");
+
+  ManifestParserOptions options;
+  options.parse_threads_ = 4;
+  State state;
+  CNobi cnobi(&state, options);
+  string err;
+  ASSERT_TRUE(cnobi.Load("build_ninja.c", &err));
+  ASSERT_EQ("", err);
+  vector<string> entries = CacheEntries();
+  for (size_t i = 0; i < entries.size(); ++i)
+    EXPECT_EQ(string::npos, entries[i].find(".tmp")) << entries[i];
+}
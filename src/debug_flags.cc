@@ -26,3 +26,7 @@ bool g_keep_depfile = false;
 bool g_keep_rsp = false;
 
 bool g_experimental_statcache = true;
+
+bool g_graph_snapshot = true;
+
+bool g_sync_logs = false;
@@ -28,4 +28,8 @@ extern bool g_keep_rsp;
 
 extern bool g_experimental_statcache;
 
+extern bool g_graph_snapshot;
+
+extern bool g_sync_logs;
+
 #endif // NINJA_EXPLAIN_H_
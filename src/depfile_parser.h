@@ -32,7 +32,13 @@ struct DepfileParser {
   /// Parse an input file.  Input must be NUL-terminated.
   /// Warning: may mutate the content in-place and parsed StringPieces are
   /// pointers within it.
-  bool Parse(std::string* content, std::string* err);
+  bool Parse(std::string* content, std::string* err) {
+    return Parse(&(*content)[0], content->size(), err);
+  }
+
+  /// Parse the \a size bytes at \a content, which a NUL must follow, as
+  /// in a FileContents.  The same warning applies.
+  bool Parse(char* content, size_t size, std::string* err);
 
   std::vector<StringPiece> outs_;
   std::vector<StringPiece> ins_;
@@ -19,6 +19,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #ifndef _WIN32
 #include <unistd.h>
 #elif defined(_MSC_VER) && (_MSC_VER < 1900)
@@ -26,11 +27,15 @@ typedef __int32 int32_t;
 typedef unsigned __int32 uint32_t;
 #endif
 
+#include "disk_interface.h"
 #include "graph.h"
+#include "hash_map.h"
 #include "metrics.h"
 #include "state.h"
 #include "util.h"
 
+#include <thread>
+
 using namespace std;
 
 // The version is stored as 4 bytes after the signature and also serves as a
@@ -44,17 +49,104 @@ static const int32_t kCurrentVersion = 4;
 // internal buffers having to have this size.
 static constexpr size_t kMaxRecordSize = (1 << 19) - 1;
 
-DepsLog::~DepsLog() {
-  Close();
+/// Append to \a buf the record that gives \a path the id \a id.
+static void AppendPathRecord(StringPiece path, int id, string* buf) {
+  int padding = (4 - path.len_ % 4) % 4;  // Pad path to 4 byte boundary.
+  uint32_t size = path.len_ + padding + 4;
+  buf->append(reinterpret_cast<const char*>(&size), 4);
+  buf->append(path.str_, path.len_);
+  buf->append(padding, '\0');
+  unsigned checksum = ~(unsigned)id;
+  buf->append(reinterpret_cast<const char*>(&checksum), 4);
+}
+
+/// Append to \a buf the record of the \a count dependencies in \a ids of
+/// the output \a out_id.
+static void AppendDepsRecord(int out_id, TimeStamp mtime, int count,
+                             const int* ids, string* buf) {
+  uint32_t size = 4 * (1 + 2 + count);
+  size |= 0x80000000;  // Deps record: set high bit.
+  buf->append(reinterpret_cast<const char*>(&size), 4);
+  buf->append(reinterpret_cast<const char*>(&out_id), 4);
+  uint32_t mtime_part = static_cast<uint32_t>(mtime & 0xffffffff);
+  buf->append(reinterpret_cast<const char*>(&mtime_part), 4);
+  mtime_part = static_cast<uint32_t>((mtime >> 32) & 0xffffffff);
+  buf->append(reinterpret_cast<const char*>(&mtime_part), 4);
+  buf->append(reinterpret_cast<const char*>(ids), 4 * count);
+}
+
+/// The live deps as of StartRecompact(), by the ids they had then, which
+/// the thread writes to temp_path under new ids, and the log file they were
+/// taken from, if it still has the same inode.  Once the thread is done,
+/// new_ids maps each old id to the new one, or -1.
+struct DepsLog::Recompaction {
+  string path;
+  string temp_path;
+  struct stat st;
+  vector<string> paths;
+  struct Output {
+    int id;
+    TimeStamp mtime;
+    size_t inputs;  // Offset in input_ids.
+    int input_count;
+  };
+  vector<Output> outputs;
+  vector<int> input_ids;
+  thread writer;
+  bool ok;
+  string err;
+  vector<int> new_ids;
+  /// The outputs whose deps were recorded in the log since, by old id.
+  vector<int> recorded;
+
+  void Write();
+};
+
+void DepsLog::Recompaction::Write() {
+  METRIC_RECORD(".ninja_deps recompact");
+  ok = false;
+  // OpenForWrite() opens for append.  Make sure it's not appending to a
+  // left-over file from a previous recompaction attempt that crashed somehow.
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    err = strerror(errno);
+    return;
+  }
+  string buf(kFileSignature, kFileSignatureSize);
+  buf.append(reinterpret_cast<const char*>(&kCurrentVersion), 4);
+
+  // Ids go to paths in the order RecordDeps() would give them.
+  new_ids.assign(paths.size(), -1);
+  int next_id = 0;
+  vector<int> ids;
+  for (vector<Output>::iterator o = outputs.begin(); o != outputs.end(); ++o) {
+    ids.assign(1, o->id);
+    ids.insert(ids.end(), input_ids.begin() + o->inputs,
+               input_ids.begin() + o->inputs + o->input_count);
+    for (vector<int>::iterator id = ids.begin(); id != ids.end(); ++id) {
+      if (new_ids[*id] < 0) {
+        new_ids[*id] = next_id++;
+        AppendPathRecord(paths[*id], new_ids[*id], &buf);
+      }
+      *id = new_ids[*id];
+    }
+    AppendDepsRecord(ids[0], o->mtime, o->input_count, ids.data() + 1, &buf);
+  }
+
+  ok = fwrite(buf.data(), buf.size(), 1, f) == 1;
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok)
+    err = strerror(errno);
 }
 
 bool DepsLog::OpenForWrite(const string& path, string* err) {
   if (needs_recompaction_) {
-    if (!Recompact(path, err))
+    if (!StartRecompact(path, err))
       return false;
   }
 
-  assert(!file_);
+  assert(!file_.is_open());
   file_path_ = path;  // we don't actually open the file right now, but will do
                       // so on the first write attempt
   return true;
@@ -71,13 +163,13 @@ bool DepsLog::RecordDeps(Node* node, TimeStamp mtime, int node_count,
   bool made_change = false;
 
   // Assign ids to all nodes that are missing one.
-  if (node->id() < 0) {
+  if (node->id() < 0 && !AdoptId(node)) {
     if (!RecordId(node))
       return false;
     made_change = true;
   }
   for (int i = 0; i < node_count; ++i) {
-    if (nodes[i]->id() < 0) {
+    if (nodes[i]->id() < 0 && !AdoptId(nodes[i])) {
       if (!RecordId(nodes[i]))
         return false;
       made_change = true;
@@ -115,25 +207,15 @@ bool DepsLog::RecordDeps(Node* node, TimeStamp mtime, int node_count,
   if (!OpenForWriteIfNeeded()) {
     return false;
   }
-  size |= 0x80000000;  // Deps record: set high bit.
-  if (fwrite(&size, 4, 1, file_) < 1)
-    return false;
-  int id = node->id();
-  if (fwrite(&id, 4, 1, file_) < 1)
-    return false;
-  uint32_t mtime_part = static_cast<uint32_t>(mtime & 0xffffffff);
-  if (fwrite(&mtime_part, 4, 1, file_) < 1)
-    return false;
-  mtime_part = static_cast<uint32_t>((mtime >> 32) & 0xffffffff);
-  if (fwrite(&mtime_part, 4, 1, file_) < 1)
-    return false;
-  for (int i = 0; i < node_count; ++i) {
-    id = nodes[i]->id();
-    if (fwrite(&id, 4, 1, file_) < 1)
-      return false;
-  }
-  if (fflush(file_) != 0)
+  vector<int> ids(node_count);
+  for (int i = 0; i < node_count; ++i)
+    ids[i] = nodes[i]->id();
+  string record;
+  AppendDepsRecord(node->id(), mtime, node_count, ids.data(), &record);
+  if (!file_.Append(record.data(), record.size()))
     return false;
+  if (recompaction_)
+    recompaction_->recorded.push_back(node->id());
 
   // Update in-memory representation.
   Deps* deps = new Deps(mtime, node_count);
@@ -146,142 +228,249 @@ bool DepsLog::RecordDeps(Node* node, TimeStamp mtime, int node_count,
 
 void DepsLog::Close() {
   OpenForWriteIfNeeded();  // create the file even if nothing has been recorded
-  if (file_)
-    fclose(file_);
-  file_ = NULL;
+  if (!file_.Close())
+    Warning("writing deps log: %s", strerror(errno));
+
+  string err;
+  if (!FinishRecompact(&err))
+    Warning("failed recompaction: %s", err.c_str());
+}
+
+struct DepsLog::Staged {
+  /// A path or dependency record, as read from the file.
+  struct Record {
+    /// Where the record starts in the file.
+    size_t offset;
+    bool is_deps;
+    /// Path records only.
+    StringPiece path;
+    int expected_id;
+    /// Dependency records only: the output id and mtime, and the input ids,
+    /// which need not be aligned.
+    int out_id;
+    TimeStamp mtime;
+    const char* inputs;
+    int input_count;
+  };
+
+  std::string path;
+  /// LOAD_SUCCESS unless the file could not be read.
+  LoadStatus status;
+  std::string err;
+  FileContents contents;
+  /// The file does not start with the signature and version.
+  bool bad_header;
+  int32_t version;
+  std::vector<Record> records;
+  int path_count;
+  /// The records end before the file does, which Load() truncates to
+  /// this size.
+  bool read_failed;
+  size_t valid_size;
+};
+
+DepsLog::DepsLog() : state_(NULL), needs_recompaction_(false) {}
+
+DepsLog::~DepsLog() {
+  Close();
+}
+
+void DepsLog::Prefetch(const string& path) {
+  METRIC_RECORD(".ninja_deps prefetch");
+  staged_.reset(new Staged);
+  Stage(path, staged_.get());
+}
+
+void DepsLog::Stage(const string& path, Staged* staged) {
+  staged->path = path;
+  staged->status = LOAD_SUCCESS;
+  staged->bad_header = false;
+  staged->version = 0;
+  staged->read_failed = false;
+  staged->valid_size = 0;
+  staged->path_count = 0;
+
+  RealDiskInterface disk;
+  switch (disk.MapFile(path, &staged->contents, &staged->err)) {
+  case FileReader::Okay:
+    break;
+  case FileReader::NotFound:
+    staged->err.clear();
+    staged->status = LOAD_NOT_FOUND;
+    return;
+  default:
+    staged->status = LOAD_ERROR;
+    return;
+  }
+
+  const char* data = staged->contents.data();
+  const size_t size = staged->contents.size();
+  if (size >= kFileSignatureSize + 4)
+    memcpy(&staged->version, data + kFileSignatureSize, 4);
+  if (size < kFileSignatureSize + 4 ||
+      memcmp(data, kFileSignature, kFileSignatureSize) != 0 ||
+      staged->version != kCurrentVersion) {
+    staged->bad_header = true;
+    return;
+  }
+
+  size_t offset = kFileSignatureSize + 4;
+  for (;;) {
+    staged->valid_size = offset;
+    if (offset == size)
+      break;
+
+    // Like a clean end of file, a record size cut short is not an error.
+    unsigned record_size;
+    if (size - offset < 4)
+      break;
+    memcpy(&record_size, data + offset, 4);
+    bool is_deps = (record_size >> 31) != 0;
+    record_size = record_size & 0x7FFFFFFF;
+    if (record_size > kMaxRecordSize || size - offset - 4 < record_size) {
+      staged->read_failed = true;
+      break;
+    }
+    const char* buf = data + offset + 4;
+
+    Staged::Record record;
+    record.offset = offset;
+    record.is_deps = is_deps;
+    if (is_deps) {
+      if ((record_size % 4) != 0 || record_size < 12) {
+        staged->read_failed = true;
+        break;
+      }
+      uint32_t header[3];
+      memcpy(header, buf, sizeof(header));
+      record.out_id = header[0];
+      record.mtime = (TimeStamp)(((uint64_t)header[2] << 32) |
+                                 (uint64_t)header[1]);
+      record.inputs = buf + 12;
+      record.input_count = (record_size / 4) - 3;
+    } else {
+      int path_size = record_size - 4;
+      if (path_size <= 0) {
+        staged->read_failed = true;
+        break;
+      }
+      // There can be up to 3 bytes of padding.
+      if (buf[path_size - 1] == '\0') --path_size;
+      if (buf[path_size - 1] == '\0') --path_size;
+      if (buf[path_size - 1] == '\0') --path_size;
+      record.path = StringPiece(buf, path_size);
+      // The one's complement of the id, to make it look less like a
+      // dependency record entry.
+      unsigned checksum;
+      memcpy(&checksum, buf + record_size - 4, 4);
+      record.expected_id = ~checksum;
+      ++staged->path_count;
+    }
+    staged->records.push_back(record);
+    offset += 4 + record_size;
+  }
 }
 
 LoadStatus DepsLog::Load(const string& path, State* state, string* err) {
   METRIC_RECORD(".ninja_deps load");
-  char buf[kMaxRecordSize + 1];
-  FILE* f = fopen(path.c_str(), "rb");
-  if (!f) {
-    if (errno == ENOENT)
-      return LOAD_NOT_FOUND;
-    *err = strerror(errno);
-    return LOAD_ERROR;
+  std::unique_ptr<Staged> staged;
+  if (staged_ && staged_->path == path) {
+    staged.swap(staged_);
+  } else {
+    staged.reset(new Staged);
+    Stage(path, staged.get());
   }
+  staged_.reset();
 
-  bool valid_header = fread(buf, kFileSignatureSize, 1, f) == 1 &&
-                      !memcmp(buf, kFileSignature, kFileSignatureSize);
-
-  int32_t version = 0;
-  bool valid_version =
-      fread(&version, 4, 1, f) == 1 && version == kCurrentVersion;
+  if (staged->status != LOAD_SUCCESS) {
+    *err = staged->err;
+    return staged->status;
+  }
 
   // Note: For version differences, this should migrate to the new format.
   // But the v1 format could sometimes (rarely) end up with invalid data, so
   // don't migrate v1 to v3 to force a rebuild. (v2 only existed for a few days,
   // and there was no release with it, so pretend that it never happened.)
-  if (!valid_header || !valid_version) {
-    if (version == 1)
+  if (staged->bad_header) {
+    if (staged->version == 1)
       *err = "deps log version change; rebuilding";
     else
       *err = "bad deps log signature or version; starting over";
-    fclose(f);
+    staged->contents.Clear();
     unlink(path.c_str());
     // Don't report this as a failure.  An empty deps log will cause
     // us to rebuild the outputs anyway.
     return LOAD_SUCCESS;
   }
 
-  long offset;
+  // Give ids to the Nodes the manifest has, and keep the other paths in
+  // unresolved_ for Nodes created later.  Dependency records are only
+  // checked here; GetDeps() decodes them.
+  state_ = state;
+  size_t buckets = 1;
+  while (buckets < 2 * (size_t)staged->path_count)
+    buckets *= 2;
+  unresolved_.assign(buckets, 0);
+  size_t valid_size = staged->valid_size;
   bool read_failed = false;
   int unique_dep_record_count = 0;
   int total_dep_record_count = 0;
-  for (;;) {
-    offset = ftell(f);
-
-    unsigned size;
-    if (fread(&size, 4, 1, f) < 1) {
-      if (!feof(f))
-        read_failed = true;
-      break;
-    }
-    bool is_deps = (size >> 31) != 0;
-    size = size & 0x7FFFFFFF;
-
-    if (size > kMaxRecordSize || fread(buf, size, 1, f) < 1) {
-      read_failed = true;
-      break;
-    }
-
-    if (is_deps) {
-      if ((size % 4) != 0) {
+  const vector<Staged::Record>& records = staged->records;
+  for (size_t r = 0; r < records.size(); ++r) {
+    const Staged::Record& record = records[r];
+    if (record.is_deps) {
+      bool valid_ids = record.out_id >= 0;
+      for (int i = 0; valid_ids && i < record.input_count; ++i) {
+        int node_id;
+        memcpy(&node_id, record.inputs + 4 * i, 4);
+        if (node_id < 0 || node_id >= (int)nodes_.size())
+          valid_ids = false;
+      }
+      if (!valid_ids) {
         read_failed = true;
+        valid_size = record.offset;
         break;
       }
-      int* deps_data = reinterpret_cast<int*>(buf);
-      int out_id = deps_data[0];
-      TimeStamp mtime;
-      mtime = (TimeStamp)(((uint64_t)(unsigned int)deps_data[2] << 32) |
-                          (uint64_t)(unsigned int)deps_data[1]);
-      deps_data += 3;
-      int deps_count = (size / 4) - 3;
-
-      for (int i = 0; i < deps_count; ++i) {
-        int node_id = deps_data[i];
-        if (node_id >= (int)nodes_.size() || !nodes_[node_id]) {
-          read_failed = true;
-          break;
-        }
-      }
-      if (read_failed)
-        break;
 
-      Deps* deps = new Deps(mtime, deps_count);
-      for (int i = 0; i < deps_count; ++i) {
-        deps->nodes[i] = nodes_[deps_data[i]];
+      if (record.out_id >= (int)deps_.size()) {
+        deps_.resize(record.out_id + 1);
+        pending_.resize(record.out_id + 1, -1);
       }
-
       total_dep_record_count++;
-      if (!UpdateDeps(out_id, deps))
+      if (pending_[record.out_id] < 0)
         ++unique_dep_record_count;
+      pending_[record.out_id] = r;
     } else {
-      int path_size = size - 4;
-      if (path_size <= 0) {
-        read_failed = true;
-        break;
-      }
-      // There can be up to 3 bytes of padding.
-      if (buf[path_size - 1] == '\0') --path_size;
-      if (buf[path_size - 1] == '\0') --path_size;
-      if (buf[path_size - 1] == '\0') --path_size;
-      StringPiece subpath(buf, path_size);
-      // It is not necessary to pass in a correct slash_bits here. It will
-      // either be a Node that's in the manifest (in which case it will already
-      // have a correct slash_bits that GetNode will look up), or it is an
-      // implicit dependency from a .d which does not affect the build command
-      // (and so need not have its slashes maintained).
-      Node* node = state->GetNode(subpath, 0);
-
       // Check that the expected index matches the actual index. This can only
       // happen if two ninja processes write to the same deps log concurrently.
-      // (This uses unary complement to make the checksum look less like a
-      // dependency record entry.)
-      unsigned checksum = *reinterpret_cast<unsigned*>(buf + size - 4);
-      int expected_id = ~checksum;
       int id = nodes_.size();
-      if (id != expected_id || node->id() >= 0) {
+      Node* node = state->LookupNode(record.path);
+      int* bucket = node ? NULL : UnresolvedBucket(record.path);
+      if (id != record.expected_id || (node && node->id() >= 0) ||
+          (bucket && *bucket)) {
         read_failed = true;
+        valid_size = record.offset;
         break;
       }
-      node->set_id(id);
+      if (node)
+        node->set_id(id);
+      else
+        *bucket = id + 1;
       nodes_.push_back(node);
+      paths_.push_back(record.path);
     }
   }
+  if (!read_failed)
+    read_failed = staged->read_failed;
+  loaded_.swap(staged);
 
   if (read_failed) {
     // An error occurred while loading; try to recover by truncating the
-    // file to the last fully-read record.
-    if (ferror(f)) {
-      *err = strerror(ferror(f));
-    } else {
-      *err = "premature end of file";
-    }
-    fclose(f);
-
-    if (!Truncate(path, offset, err))
+    // file to the last fully-read record.  Decode what was read first, as
+    // that is about to be cut from under the mapping.
+    Materialize();
+    *err = "premature end of file";
+    if (!Truncate(path, valid_size, err))
       return LOAD_ERROR;
 
     // The truncate succeeded; we'll just report the load error as a
@@ -290,12 +479,12 @@ LoadStatus DepsLog::Load(const string& path, State* state, string* err) {
     return LOAD_SUCCESS;
   }
 
-  fclose(f);
-
-  // Rebuild the log if there are too many dead records.
+  // Rebuild the log if there are too many dead records.  With only part of
+  // the graph loaded, live records can't be told from dead ones.
   int kMinCompactionEntryCount = 1000;
   int kCompactionRatio = 3;
-  if (total_dep_record_count > kMinCompactionEntryCount &&
+  if (!state->partial_ &&
+      total_dep_record_count > kMinCompactionEntryCount &&
       total_dep_record_count > unique_dep_record_count * kCompactionRatio) {
     needs_recompaction_ = true;
   }
@@ -306,12 +495,80 @@ LoadStatus DepsLog::Load(const string& path, State* state, string* err) {
 DepsLog::Deps* DepsLog::GetDeps(Node* node) {
   // Abort if the node has no id (never referenced in the deps) or if
   // there's no deps recorded for the node.
-  if (node->id() < 0 || node->id() >= (int)deps_.size())
+  if (node->id() < 0 && !AdoptId(node))
     return NULL;
-  return deps_[node->id()];
+  int id = node->id();
+  if (id >= (int)deps_.size())
+    return NULL;
+  if (!deps_[id] && id < (int)pending_.size() && pending_[id] >= 0)
+    Decode(id);
+  return deps_[id];
+}
+
+bool DepsLog::AdoptId(Node* node) {
+  if (unresolved_.empty())
+    return false;
+  int id = *UnresolvedBucket(node->path()) - 1;
+  if (id < 0 || nodes_[id])
+    return false;
+  node->set_id(id);
+  nodes_[id] = node;
+  return true;
+}
+
+int* DepsLog::UnresolvedBucket(StringPiece path) {
+  size_t mask = unresolved_.size() - 1;
+  size_t bucket = MurmurHash64A(path.str_, path.len_) & mask;
+  while (unresolved_[bucket] && paths_[unresolved_[bucket] - 1] != path)
+    bucket = (bucket + 1) & mask;
+  return &unresolved_[bucket];
+}
+
+Node* DepsLog::NodeForId(int id) {
+  Node* node = nodes_[id];
+  if (!node) {
+    // It is not necessary to pass in a correct slash_bits here. It will
+    // either be a Node that's in the manifest (in which case it will already
+    // have a correct slash_bits that GetNode will look up), or it is an
+    // implicit dependency from a .d which does not affect the build command
+    // (and so need not have its slashes maintained).
+    node = state_->GetNode(paths_[id], 0);
+    assert(node->id() < 0);
+    node->set_id(id);
+    nodes_[id] = node;
+  }
+  return node;
+}
+
+void DepsLog::Decode(int out_id) {
+  const Staged::Record& record = loaded_->records[pending_[out_id]];
+  pending_[out_id] = -1;
+  Deps* deps = new Deps(record.mtime, record.input_count);
+  for (int i = 0; i < record.input_count; ++i) {
+    int id;
+    memcpy(&id, record.inputs + 4 * i, 4);
+    deps->nodes[i] = NodeForId(id);
+  }
+  deps_[out_id] = deps;
+}
+
+void DepsLog::Materialize() {
+  if (!loaded_)
+    return;
+  for (int id = 0; id < (int)pending_.size(); ++id) {
+    if (pending_[id] >= 0)
+      Decode(id);
+  }
+  for (int id = 0; id < (int)paths_.size(); ++id)
+    NodeForId(id);
+  pending_.clear();
+  unresolved_.clear();
+  paths_.clear();
+  loaded_.reset();
 }
 
 Node* DepsLog::GetFirstReverseDepsNode(Node* node) {
+  Materialize();
   for (size_t id = 0; id < deps_.size(); ++id) {
     Deps* deps = deps_[id];
     if (!deps)
@@ -325,25 +582,24 @@ Node* DepsLog::GetFirstReverseDepsNode(Node* node) {
 }
 
 bool DepsLog::Recompact(const string& path, string* err) {
-  METRIC_RECORD(".ninja_deps recompact");
+  return StartRecompact(path, err) && FinishRecompact(err);
+}
 
+bool DepsLog::StartRecompact(const string& path, string* err) {
+  Materialize();
   Close();
-  string temp_path = path + ".recompact";
-
-  // OpenForWrite() opens for append.  Make sure it's not appending to a
-  // left-over file from a previous recompaction attempt that crashed somehow.
-  unlink(temp_path.c_str());
-
-  DepsLog new_log;
-  if (!new_log.OpenForWrite(temp_path, err))
+  std::unique_ptr<Recompaction> recompaction(new Recompaction);
+  recompaction->path = path;
+  recompaction->temp_path = path + ".recompact";
+  if (stat(path.c_str(), &recompaction->st) < 0) {
+    *err = strerror(errno);
     return false;
+  }
 
-  // Clear all known ids so that new ones can be reassigned.  The new indices
-  // will refer to the ordering in new_log, not in the current log.
+  // Copy the live deps, for the thread to write without Nodes.
+  recompaction->paths.reserve(nodes_.size());
   for (vector<Node*>::iterator i = nodes_.begin(); i != nodes_.end(); ++i)
-    (*i)->set_id(-1);
-
-  // Write out all deps again.
+    recompaction->paths.push_back((*i)->path().AsString());
   for (int old_id = 0; old_id < (int)deps_.size(); ++old_id) {
     Deps* deps = deps_[old_id];
     if (!deps) continue;  // If nodes_[old_id] is a leaf, it has no deps.
@@ -351,25 +607,109 @@ bool DepsLog::Recompact(const string& path, string* err) {
     if (!IsDepsEntryLiveFor(nodes_[old_id]))
       continue;
 
-    if (!new_log.RecordDeps(nodes_[old_id], deps->mtime,
-                            deps->node_count, deps->nodes)) {
-      new_log.Close();
-      return false;
-    }
+    Recompaction::Output output = { old_id, deps->mtime,
+                                    recompaction->input_ids.size(),
+                                    deps->node_count };
+    recompaction->outputs.push_back(output);
+    for (int i = 0; i < deps->node_count; ++i)
+      recompaction->input_ids.push_back(deps->nodes[i]->id());
+  }
+
+  Recompaction* r = recompaction.get();
+  recompaction->writer = thread([r]() { r->Write(); });
+  recompaction_.swap(recompaction);
+  needs_recompaction_ = false;
+  return true;
+}
+
+bool DepsLog::FinishRecompact(string* err) {
+  if (!recompaction_)
+    return true;
+  std::unique_ptr<Recompaction> r;
+  r.swap(recompaction_);
+  r->writer.join();
+  // Deps recorded from here on go to the new file, once it is in place.
+  bool writable = file_.is_open() || !file_path_.empty();
+  bool closed = file_.Close();
+  file_path_ = writable ? r->path : string();
+  if (!closed) {
+    *err = strerror(errno);
+    unlink(r->temp_path.c_str());
+    return false;
+  }
+
+  // The deps recorded since are added from memory, which only knows about
+  // the file the deps were taken from.
+  struct stat st;
+  if (r->ok && (stat(r->path.c_str(), &st) < 0 || st.st_dev != r->st.st_dev ||
+                st.st_ino != r->st.st_ino || st.st_size < r->st.st_size)) {
+    r->ok = false;
+    r->err = "the log was replaced while it was rewritten";
+  }
+  if (!r->ok) {
+    unlink(r->temp_path.c_str());
+    *err = r->err;
+    return false;
+  }
+
+  // Clear all known ids so that new ones can be reassigned.  The new indices
+  // will refer to the ordering in the new file, not in the current log.
+  vector<Node*> old_nodes;
+  vector<Deps*> old_deps;
+  old_nodes.swap(nodes_);
+  old_deps.swap(deps_);
+  for (vector<Node*>::iterator i = old_nodes.begin(); i != old_nodes.end();
+       ++i)
+    (*i)->set_id(-1);
+  for (int old_id = 0; old_id < (int)r->new_ids.size(); ++old_id) {
+    int id = r->new_ids[old_id];
+    if (id < 0) continue;
+    if (id >= (int)nodes_.size())
+      nodes_.resize(id + 1);
+    nodes_[id] = old_nodes[old_id];
+    nodes_[id]->set_id(id);
   }
 
-  new_log.Close();
+  // Keep the deps that were written, unless they were recorded again since.
+  vector<bool> recorded(old_deps.size());
+  for (vector<int>::iterator i = r->recorded.begin(); i != r->recorded.end();
+       ++i)
+    recorded[*i] = true;
+  deps_.resize(nodes_.size());
+  for (vector<Recompaction::Output>::iterator o = r->outputs.begin();
+       o != r->outputs.end(); ++o) {
+    if (recorded[o->id]) continue;
+    deps_[r->new_ids[o->id]] = old_deps[o->id];
+    old_deps[o->id] = NULL;
+  }
 
-  // All nodes now have ids that refer to new_log, so steal its data.
-  deps_.swap(new_log.deps_);
-  nodes_.swap(new_log.nodes_);
+  file_path_ = r->temp_path;
+  bool ok = true;
+  for (int old_id = 0; ok && old_id < (int)old_deps.size(); ++old_id) {
+    if (!recorded[old_id]) continue;
+    Deps* deps = old_deps[old_id];
+    ok = RecordDeps(old_nodes[old_id], deps->mtime, deps->node_count,
+                    deps->nodes);
+  }
+  if (!ok)
+    *err = strerror(errno);
+  OpenForWriteIfNeeded();
+  if (!file_.Close() && ok) {
+    *err = strerror(errno);
+    ok = false;
+  }
+  file_path_ = writable ? r->path : string();
+  for (vector<Deps*>::iterator i = old_deps.begin(); i != old_deps.end(); ++i)
+    delete *i;
+  if (!ok)
+    return false;
 
-  if (unlink(path.c_str()) < 0) {
+  if (unlink(r->path.c_str()) < 0) {
     *err = strerror(errno);
     return false;
   }
 
-  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+  if (rename(r->temp_path.c_str(), r->path.c_str()) < 0) {
     *err = strerror(errno);
     return false;
   }
@@ -394,6 +734,10 @@ bool DepsLog::UpdateDeps(int out_id, Deps* deps) {
   bool delete_old = deps_[out_id] != NULL;
   if (delete_old)
     delete deps_[out_id];
+  if (out_id < (int)pending_.size() && pending_[out_id] >= 0) {
+    pending_[out_id] = -1;
+    delete_old = true;
+  }
   deps_[out_id] = deps;
   return delete_old;
 }
@@ -412,18 +756,10 @@ bool DepsLog::RecordId(Node* node) {
   if (!OpenForWriteIfNeeded()) {
     return false;
   }
-  if (fwrite(&size, 4, 1, file_) < 1)
-    return false;
-  if (fwrite(node->path().data(), path_size, 1, file_) < 1) {
-    return false;
-  }
-  if (padding && fwrite("\0\0", padding, 1, file_) < 1)
-    return false;
   int id = nodes_.size();
-  unsigned checksum = ~(unsigned)id;
-  if (fwrite(&checksum, 4, 1, file_) < 1)
-    return false;
-  if (fflush(file_) != 0)
+  string record;
+  AppendPathRecord(node->path(), id, &record);
+  if (!file_.Append(record.data(), record.size()))
     return false;
 
   node->set_id(id);
@@ -436,32 +772,30 @@ bool DepsLog::OpenForWriteIfNeeded() {
   if (file_path_.empty()) {
     return true;
   }
-  file_ = fopen(file_path_.c_str(), "ab");
-  if (!file_) {
-    return false;
-  }
-  // Set the buffer size to this and flush the file buffer after every record
-  // to make sure records aren't written partially.
-  if (setvbuf(file_, NULL, _IOFBF, kMaxRecordSize + 1) != 0) {
+  FILE* f = fopen(file_path_.c_str(), "ab");
+  if (!f) {
     return false;
   }
-  SetCloseOnExec(fileno(file_));
+  SetCloseOnExec(fileno(f));
 
   // Opening a file in append mode doesn't set the file pointer to the file's
   // end on Windows. Do that explicitly.
-  fseek(file_, 0, SEEK_END);
+  fseek(f, 0, SEEK_END);
 
-  if (ftell(file_) == 0) {
-    if (fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, file_) < 1) {
-      return false;
-    }
-    if (fwrite(&kCurrentVersion, 4, 1, file_) < 1) {
+  if (ftell(f) == 0) {
+    if (fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, f) < 1 ||
+        fwrite(&kCurrentVersion, 4, 1, f) < 1) {
+      fclose(f);
       return false;
     }
   }
-  if (fflush(file_) != 0) {
+  if (fflush(f) != 0) {
+    fclose(f);
     return false;
   }
+  // Records are written whole, so that none is written partially, on a
+  // thread of their own when there is a processor to spare for it.
+  file_.Open(f, GetProcessorCount() > 1);
   file_path_.clear();
   return true;
 }
@@ -15,12 +15,15 @@
 #ifndef NINJA_DEPS_LOG_H_
 #define NINJA_DEPS_LOG_H_
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include <stdio.h>
 
 #include "load_status.h"
+#include "log_writer.h"
+#include "string_piece.h"
 #include "timestamp.h"
 
 struct Node;
@@ -65,8 +68,13 @@ struct State;
 /// If two records reference the same output the latter one in the file
 /// wins, allowing updates to just be appended to the file.  A separate
 /// repacking step can run occasionally to remove dead records.
+///
+/// Loading maps the file and only checks the records, giving ids to the
+/// Nodes the manifest has.  A dependency record is decoded when GetDeps()
+/// asks for its output, and Nodes for the paths only it names are created
+/// then.
 struct DepsLog {
-  DepsLog() : needs_recompaction_(false), file_(NULL) {}
+  DepsLog();
   ~DepsLog();
 
   // Writing (build-time) interface.
@@ -85,13 +93,28 @@ struct DepsLog {
     int node_count;
     Node** nodes;
   };
+  /// Load \a path, using the records Prefetch() read if it read \a path.
   LoadStatus Load(const std::string& path, State* state, std::string* err);
+  /// Read and check the records of \a path without resolving their paths
+  /// to Nodes or changing the file, so that this can run on another thread
+  /// while the manifest loads.
+  void Prefetch(const std::string& path);
   Deps* GetDeps(Node* node);
   Node* GetFirstReverseDepsNode(Node* node);
 
   /// Rewrite the known log entries, throwing away old data.
   bool Recompact(const std::string& path, std::string* err);
 
+  /// Begin a Recompact() that writes the new file on another thread, so
+  /// that deps can be recorded meanwhile.  Close() finishes it.
+  bool StartRecompact(const std::string& path, std::string* err);
+
+  /// Wait for the new file StartRecompact() is writing, give the nodes the
+  /// ids they have in it, record there the deps recorded since, and replace
+  /// the log with it.  Fails, leaving the log as it is, if the log was
+  /// replaced meanwhile.  Does nothing if no recompaction is running.
+  bool FinishRecompact(std::string* err);
+
   /// Returns if the deps entry for a node is still reachable from the manifest.
   ///
   /// The deps log can contain deps entries for files that were built in the
@@ -100,11 +123,35 @@ struct DepsLog {
   /// it from code that runs on every build.
   static bool IsDepsEntryLiveFor(const Node* node);
 
-  /// Used for tests.
-  const std::vector<Node*>& nodes() const { return nodes_; }
-  const std::vector<Deps*>& deps() const { return deps_; }
+  /// Every path and dependency record, decoded.  Used for tests.
+  const std::vector<Node*>& nodes() {
+    Materialize();
+    return nodes_;
+  }
+  const std::vector<Deps*>& deps() {
+    Materialize();
+    return deps_;
+  }
 
  private:
+  /// The records of a log file, read into a staging area until Load()
+  /// adds them to the State.  Defined in deps_log.cc.
+  struct Staged;
+  void Stage(const std::string& path, Staged* staged);
+
+  /// Give \a node the id its path has in the loaded file, if it has one
+  /// and no Node has taken it yet.
+  bool AdoptId(Node* node);
+  /// The bucket of unresolved_ that holds \a path, or where it would go.
+  int* UnresolvedBucket(StringPiece path);
+  /// The Node for \a id, creating it if loading did not.
+  Node* NodeForId(int id);
+  /// Decode the pending record for \a out_id.
+  void Decode(int out_id);
+  /// Decode every pending record and create a Node for every path, then
+  /// drop the loaded file.
+  void Materialize();
+
   // Updates the in-memory representation.  Takes ownership of |deps|.
   // Returns true if a prior deps record was deleted.
   bool UpdateDeps(int out_id, Deps* deps);
@@ -115,8 +162,28 @@ struct DepsLog {
   /// be set.
   bool OpenForWriteIfNeeded();
 
+  /// What Prefetch() read.
+  std::unique_ptr<Staged> staged_;
+
+  /// The loaded file, while records in it are still to be decoded, and the
+  /// State their Nodes go in.
+  std::unique_ptr<Staged> loaded_;
+  State* state_;
+  /// The path of each id in the loaded file.
+  std::vector<StringPiece> paths_;
+  /// A hash table, probed linearly, of the ids plus one of the paths that
+  /// had no Node at load time; 0 marks an empty bucket.
+  std::vector<int> unresolved_;
+  /// For each id, the index in loaded_ of its dependency record if that is
+  /// not decoded yet, or -1.
+  std::vector<int> pending_;
+
+  /// A recompaction running on another thread; see deps_log.cc.
+  struct Recompaction;
+  std::unique_ptr<Recompaction> recompaction_;
+
   bool needs_recompaction_;
-  FILE* file_;
+  LogWriter file_;
   std::string file_path_;
 
   /// Maps id -> Node.
@@ -351,6 +351,120 @@ TEST_F(DepsLogTest, Recompact) {
 }
 
 // Verify that invalid file headers cause a new build.
+TEST_F(DepsLogTest, RecordWhileRecompacting) {
+  const char kManifest[] =
+"rule cc\n"
+"  command = cc\n"
+"  deps = gcc\n"
+"build out.o: cc\n"
+"build other_out.o: cc\n";
+
+  {
+    State state;
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    deps.push_back(state.GetNode("bar.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+    deps.clear();
+    deps.push_back(state.GetNode("baz.h", 0));
+    log.RecordDeps(state.GetNode("gone.o", 0), 1, deps);
+    log.Close();
+  }
+
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_TRUE(log.StartRecompact(kTestFilename, &err));
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+
+    // Deps recorded meanwhile, for an output the new file has and for one
+    // it does not, go to the old file and then to the new one.
+    Node* out = state.GetNode("out.o", 0);
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    deps.push_back(state.GetNode("new.h", 0));
+    ASSERT_TRUE(log.RecordDeps(out, 2, deps));
+    Node* other_out = state.GetNode("other_out.o", 0);
+    deps.clear();
+    deps.push_back(state.GetNode("bar.h", 0));
+    ASSERT_TRUE(log.RecordDeps(other_out, 3, deps));
+    ASSERT_TRUE(log.FinishRecompact(&err));
+
+    // Deps recorded after that go to the new file.
+    ASSERT_TRUE(log.RecordDeps(other_out, 4, deps));
+    log.Close();
+
+    for (int i = 0; i < (int)log.nodes().size(); ++i)
+      EXPECT_EQ(i, log.nodes()[i]->id());
+    EXPECT_EQ(-1, state.LookupNode("gone.o")->id());
+    DepsLog::Deps* out_deps = log.GetDeps(out);
+    ASSERT_TRUE(out_deps);
+    EXPECT_EQ(2, out_deps->mtime);
+  }
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+  DepsLog log;
+  string err;
+  ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  DepsLog::Deps* deps = log.GetDeps(state.GetNode("out.o", 0));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(2, deps->mtime);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("foo.h", deps->nodes[0]->path());
+  EXPECT_EQ("new.h", deps->nodes[1]->path());
+  deps = log.GetDeps(state.GetNode("other_out.o", 0));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(4, deps->mtime);
+  ASSERT_EQ(1, deps->node_count);
+  EXPECT_EQ("bar.h", deps->nodes[0]->path());
+  EXPECT_FALSE(log.GetDeps(state.GetNode("gone.o", 0)));
+  EXPECT_EQ(NULL, state.LookupNode("baz.h"));
+}
+
+TEST_F(DepsLogTest, ReplacedWhileRecompacting) {
+  {
+    State state;
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+    log.Close();
+  }
+
+  State state;
+  DepsLog log;
+  string err;
+  ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_TRUE(log.StartRecompact(kTestFilename, &err));
+
+  // Another process replaces the log meanwhile; it is kept.
+  string replaced = string(kTestFilename) + ".other";
+  {
+    DepsLog other;
+    ASSERT_TRUE(other.OpenForWrite(replaced, &err));
+    other.Close();
+  }
+  ASSERT_EQ(0, rename(replaced.c_str(), kTestFilename));
+  EXPECT_FALSE(log.FinishRecompact(&err));
+  EXPECT_EQ("the log was replaced while it was rewritten", err);
+
+  string recompacted = string(kTestFilename) + ".recompact";
+  struct stat st;
+  EXPECT_NE(0, stat(recompacted.c_str(), &st));
+  ASSERT_EQ(0, stat(kTestFilename, &st));
+  EXPECT_EQ(16, (int)st.st_size);
+}
+
 TEST_F(DepsLogTest, InvalidHeader) {
   const char *kInvalidHeaders[] = {
     "",                              // Empty file.
@@ -514,6 +628,135 @@ TEST_F(DepsLogTest, TruncatedRecovery) {
   }
 }
 
+TEST_F(DepsLogTest, Prefetch) {
+  {
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+    deps.push_back(state.GetNode("bar.h", 0));
+    log.RecordDeps(state.GetNode("out2.o", 0), 2, deps);
+    log.Close();
+  }
+  struct stat st;
+  ASSERT_EQ(0, stat(kTestFilename, &st));
+  string err;
+  ASSERT_TRUE(Truncate(kTestFilename, st.st_size - 2, &err));
+
+  // Prefetch() leaves the damaged file for Load() to truncate.
+  State state;
+  DepsLog log;
+  log.Prefetch(kTestFilename);
+  struct stat prefetched;
+  ASSERT_EQ(0, stat(kTestFilename, &prefetched));
+  EXPECT_EQ(st.st_size - 2, prefetched.st_size);
+  EXPECT_EQ(LOAD_SUCCESS, log.Load(kTestFilename, &state, &err));
+  EXPECT_EQ("premature end of file; recovering", err);
+  ASSERT_EQ(0, stat(kTestFilename, &prefetched));
+  EXPECT_LT(prefetched.st_size, st.st_size - 2);
+
+  DepsLog::Deps* deps = log.GetDeps(state.GetNode("out.o", 0));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(1, deps->node_count);
+  EXPECT_EQ("foo.h", deps->nodes[0]->path());
+  EXPECT_EQ(NULL, log.GetDeps(state.GetNode("out2.o", 0)));
+
+  // What was read from another path is not used.
+  State state2;
+  DepsLog log2;
+  log2.Prefetch(kTestFilename);
+  err.clear();
+  EXPECT_EQ(LOAD_NOT_FOUND, log2.Load("DepsLogTest-missing", &state2, &err));
+  EXPECT_TRUE(log2.nodes().empty());
+}
+
+TEST_F(DepsLogTest, LazyLoad) {
+  {
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    deps.push_back(state.GetNode("bar.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+    deps.clear();
+    deps.push_back(state.GetNode("baz.h", 0));
+    log.RecordDeps(state.GetNode("other.o", 0), 2, deps);
+    log.Close();
+  }
+
+  // Only the nodes the manifest has are created by Load().
+  State state;
+  Node* out = state.GetNode("out.o", 0);
+  DepsLog log;
+  string err;
+  EXPECT_EQ(LOAD_SUCCESS, log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0, out->id());
+  EXPECT_EQ(NULL, state.LookupNode("foo.h"));
+  EXPECT_EQ(NULL, state.LookupNode("other.o"));
+
+  // GetDeps() creates the inputs of the one output it decodes.
+  DepsLog::Deps* deps = log.GetDeps(out);
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(1, deps->mtime);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("foo.h", deps->nodes[0]->path());
+  EXPECT_EQ(1, deps->nodes[0]->id());
+  EXPECT_EQ("bar.h", deps->nodes[1]->path());
+  EXPECT_EQ(NULL, state.LookupNode("baz.h"));
+
+  // A node created later takes the id the log gave its path.
+  Node* other = state.GetNode("other.o", 0);
+  deps = log.GetDeps(other);
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(3, other->id());
+  ASSERT_EQ(1, deps->node_count);
+  EXPECT_EQ("baz.h", deps->nodes[0]->path());
+  EXPECT_EQ(NULL, log.GetDeps(state.GetNode("missing.o", 0)));
+
+  // nodes() lists every path of the log.
+  ASSERT_EQ(5u, log.nodes().size());
+  EXPECT_EQ(state.LookupNode("baz.h"), log.nodes()[4]);
+}
+
+TEST_F(DepsLogTest, LazyLoadRecordDeps) {
+  {
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+    log.Close();
+  }
+  struct stat st;
+  ASSERT_EQ(0, stat(kTestFilename, &st));
+
+  // Recording the same deps for nodes that were not loaded writes nothing:
+  // they take the ids already in the log.
+  State state;
+  DepsLog log;
+  string err;
+  EXPECT_EQ(LOAD_SUCCESS, log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  vector<Node*> deps;
+  deps.push_back(state.GetNode("foo.h", 0));
+  log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+  log.Close();
+  struct stat recorded;
+  ASSERT_EQ(0, stat(kTestFilename, &recorded));
+  EXPECT_EQ(st.st_size, recorded.st_size);
+  EXPECT_EQ(0, state.LookupNode("out.o")->id());
+  EXPECT_EQ(1, state.LookupNode("foo.h")->id());
+}
+
 TEST_F(DepsLogTest, ReverseDepsNodes) {
   State state;
   DepsLog log;
@@ -28,6 +28,8 @@
 
 #include <sstream>
 #else
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #endif
 
@@ -135,6 +137,41 @@ bool StatAllFilesInDir(const string& dir, map<string, TimeStamp>* stamps,
 
 }  // namespace
 
+// FileContents ----------------------------------------------------------------
+
+void FileContents::Adopt(string* contents) {
+  Clear();
+  string_.swap(*contents);
+}
+
+void FileContents::AdoptMapping(char* map, size_t size, size_t map_size) {
+  Clear();
+  map_ = map;
+  size_ = size;
+  map_size_ = map_size;
+}
+
+void FileContents::Clear() {
+#ifndef _WIN32
+  if (map_)
+    munmap(map_, map_size_);
+#endif
+  map_ = NULL;
+  size_ = 0;
+  map_size_ = 0;
+  string_.clear();
+}
+
+// FileReader ------------------------------------------------------------------
+
+FileReader::Status FileReader::MapFile(const string& path,
+                                       FileContents* contents, string* err) {
+  string buffer;
+  Status status = ReadFile(path, &buffer, err);
+  contents->Adopt(&buffer);
+  return status;
+}
+
 // DiskInterface ---------------------------------------------------------------
 
 bool DiskInterface::MakeDirs(const string& path) {
@@ -290,6 +327,71 @@ FileReader::Status RealDiskInterface::ReadFile(const string& path,
   }
 }
 
+FileReader::Status RealDiskInterface::MapFile(const string& path,
+                                              FileContents* contents,
+                                              string* err) {
+#ifdef _WIN32
+  return FileReader::MapFile(path, contents, err);
+#else
+  contents->Clear();
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    err->assign(strerror(errno));
+    return errno == ENOENT ? NotFound : OtherError;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    err->assign(strerror(errno));
+    close(fd);
+    return OtherError;
+  }
+
+  if (!S_ISREG(st.st_mode) || (size_t)st.st_size < kMinMappedFileSize) {
+    string buffer(st.st_size, '\0');
+    size_t len = 0;
+    for (;;) {
+      if (len == buffer.size())
+        buffer.resize(len + (64 << 10));
+      ssize_t n = read(fd, &buffer[len], buffer.size() - len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0) {
+        err->assign(strerror(errno));
+        close(fd);
+        return OtherError;
+      }
+      if (n == 0)
+        break;
+      len += n;
+    }
+    close(fd);
+    buffer.resize(len);
+    contents->Adopt(&buffer);
+    return Okay;
+  }
+
+  // Reserve at least one page of zeros past the end, for the NUL that the
+  // lexers stop at, then map the file over the start of it.
+  const size_t size = st.st_size;
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  const size_t map_size = (size / page_size + 1) * page_size;
+  void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED ||
+      mmap(map, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+           0) == MAP_FAILED) {
+    err->assign(strerror(errno));
+    if (map != MAP_FAILED)
+      munmap(map, map_size);
+    close(fd);
+    return OtherError;
+  }
+  close(fd);
+  contents->AdoptMapping(static_cast<char*>(map), size, map_size);
+  return Okay;
+#endif
+}
+
 int RealDiskInterface::RemoveFile(const string& path) {
 #ifdef _WIN32
   DWORD attributes = GetFileAttributesA(path.c_str());
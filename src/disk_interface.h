@@ -15,11 +15,48 @@
 #ifndef NINJA_DISK_INTERFACE_H_
 #define NINJA_DISK_INTERFACE_H_
 
+#include <stddef.h>
+
 #include <map>
 #include <string>
 
+#include "string_piece.h"
 #include "timestamp.h"
 
+/// The contents of a file, always followed by a NUL so that the re2c lexers
+/// can run over them in place.  Large files are mapped copy-on-write rather
+/// than copied onto the heap, so the parsers' writes stay private; such a
+/// file must not be truncated while its contents are in use.
+struct FileContents {
+  FileContents() : map_(NULL), size_(0), map_size_(0) {}
+  ~FileContents() { Clear(); }
+
+  char* data() { return map_ ? map_ : &string_[0]; }
+  size_t size() const { return map_ ? size_ : string_.size(); }
+  bool empty() const { return size() == 0; }
+  StringPiece AsStringPiece() {
+    return StringPiece(data(), size());
+  }
+
+  /// Take over the contents of \a contents.
+  void Adopt(std::string* contents);
+
+  /// Take over a mapping of \a map_size bytes at \a map, whose first
+  /// \a size bytes are the file and whose remainder is zeros.
+  void AdoptMapping(char* map, size_t size, size_t map_size);
+
+  void Clear();
+
+ private:
+  FileContents(const FileContents&);
+  void operator=(const FileContents&);
+
+  std::string string_;
+  char* map_;
+  size_t size_;
+  size_t map_size_;
+};
+
 /// Interface for reading files from disk.  See DiskInterface for details.
 /// This base offers the minimum interface needed just to read files.
 struct FileReader {
@@ -36,6 +73,11 @@ struct FileReader {
   /// On error, return another Status and fill |err|.
   virtual Status ReadFile(const std::string& path, std::string* contents,
                           std::string* err) = 0;
+
+  /// ReadFile() into \a contents, which may map the file instead.  This
+  /// default reads it with ReadFile().
+  virtual Status MapFile(const std::string& path, FileContents* contents,
+                         std::string* err);
 };
 
 /// Interface for accessing the disk.
@@ -76,8 +118,14 @@ struct RealDiskInterface : public DiskInterface {
   virtual bool WriteFile(const std::string& path, const std::string& contents);
   virtual Status ReadFile(const std::string& path, std::string* contents,
                           std::string* err);
+  /// Maps files of kMinMappedFileSize bytes or more, and reads smaller ones,
+  /// for which mapping costs more than copying.
+  virtual Status MapFile(const std::string& path, FileContents* contents,
+                         std::string* err);
   virtual int RemoveFile(const std::string& path);
 
+  static const size_t kMinMappedFileSize = 64 << 10;
+
   /// Whether stat information can be cached.  Only has an effect on Windows.
   void AllowStatCache(bool allow);
 
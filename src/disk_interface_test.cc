@@ -220,6 +220,43 @@ TEST_F(DiskInterfaceTest, ReadFile) {
   EXPECT_EQ("", err);
 }
 
+TEST_F(DiskInterfaceTest, MapFile) {
+  string err;
+  FileContents contents;
+  ASSERT_EQ(DiskInterface::NotFound,
+            disk_.MapFile("foobar", &contents, &err));
+  EXPECT_TRUE(contents.empty());
+  EXPECT_NE("", err);
+  err.clear();
+
+  // Small files are read, large ones mapped; a size that is a multiple of
+  // the page size still leaves room for the NUL after the contents.
+  const size_t kSizes[] = {
+    0, 15, RealDiskInterface::kMinMappedFileSize,
+    RealDiskInterface::kMinMappedFileSize + 1234,
+  };
+  for (size_t i = 0; i < sizeof(kSizes) / sizeof(kSizes[0]); ++i) {
+    string content(kSizes[i], 'x');
+    for (size_t j = 0; j < content.size(); j += 100)
+      content[j] = '\n';
+    ASSERT_TRUE(disk_.WriteFile("testfile", content));
+
+    ASSERT_EQ(DiskInterface::Okay, disk_.MapFile("testfile", &contents, &err));
+    EXPECT_EQ("", err);
+    ASSERT_EQ(content.size(), contents.size());
+    EXPECT_EQ(content, contents.AsStringPiece().AsString());
+    EXPECT_EQ('\0', contents.data()[contents.size()]);
+
+    // Writes, as the depfile parser makes, do not reach the file.
+    if (!content.empty()) {
+      contents.data()[0] = 'y';
+      string read;
+      ASSERT_EQ(DiskInterface::Okay, disk_.ReadFile("testfile", &read, &err));
+      EXPECT_EQ(content, read);
+    }
+  }
+}
+
 TEST_F(DiskInterfaceTest, MakeDirs) {
   string path = "path/with/double//slash/";
   EXPECT_TRUE(disk_.MakeDirs(path));
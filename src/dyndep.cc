@@ -38,7 +38,7 @@ bool DyndepLoader::LoadDyndeps(Node* node, DyndepFile* ddf,
   node->set_dyndep_pending(false);
 
   // Load the dyndep information from the file.
-  explanations_.Record(node, "loading dyndep file '%s'", node->path().c_str());
+  explanations_.Record(node, "loading dyndep file '%s'", node->path_c_str());
 
   if (!LoadDyndepFile(node, ddf, err))
     return false;
@@ -51,9 +51,9 @@ bool DyndepLoader::LoadDyndeps(Node* node, DyndepFile* ddf,
 
     DyndepFile::iterator ddi = ddf->find(edge);
     if (ddi == ddf->end()) {
-      *err = ("'" + edge->outputs_[0]->path() + "' "
+      *err = ("'" + edge->outputs_[0]->path().AsString() + "' "
               "not mentioned in its dyndep file "
-              "'" + node->path() + "'");
+              "'" + node->path().AsString() + "'");
       return false;
     }
 
@@ -68,9 +68,10 @@ bool DyndepLoader::LoadDyndeps(Node* node, DyndepFile* ddf,
   for (const auto& dyndep_output : *ddf) {
     if (!dyndep_output.second.used_) {
       Edge* const edge = dyndep_output.first;
-      *err = ("dyndep file '" + node->path() + "' mentions output "
-              "'" + edge->outputs_[0]->path() + "' whose build statement "
-              "does not have a dyndep binding for the file");
+      *err = ("dyndep file '" + node->path().AsString() + "' mentions output "
+              "'" + edge->outputs_[0]->path().AsString() + "' "
+              "whose build statement does not have a dyndep binding for the "
+              "file");
       return false;
     }
   }
@@ -96,7 +97,7 @@ bool DyndepLoader::UpdateEdge(Edge* edge, Dyndeps const* dyndeps,
   for (Node* node : dyndeps->implicit_outputs_) {
     if (node->in_edge()) {
       // This node already has an edge producing it.
-      *err = "multiple rules generate " + node->path();
+      *err = "multiple rules generate " + node->path().AsString();
       return false;
     }
     node->set_in_edge(edge);
@@ -118,5 +119,5 @@ bool DyndepLoader::UpdateEdge(Edge* edge, Dyndeps const* dyndeps,
 bool DyndepLoader::LoadDyndepFile(Node* file, DyndepFile* ddf,
                                   std::string* err) const {
   DyndepParser parser(state_, disk_interface_, ddf);
-  return parser.Load(file->path(), err);
+  return parser.Load(file->path().AsString(), err);
 }
@@ -33,7 +33,7 @@ struct DyndepParser: public Parser {
 
 private:
   /// Parse a file, given its contents as a string.
-  bool Parse(const std::string& filename, const std::string& input,
+  bool Parse(const std::string& filename, StringPiece input,
              std:: string* err);
 
   bool ParseDyndepVersion(std::string* err);
@@ -82,6 +82,10 @@ const map<string, const Rule*>& BindingEnv::GetRules() const {
   return rules_;
 }
 
+const map<string, string>& BindingEnv::GetBindings() const {
+  return bindings_;
+}
+
 string BindingEnv::LookupWithFallback(const string& var,
                                       const EvalString* eval,
                                       Env* env) {
@@ -51,6 +51,7 @@ struct EvalString {
 
 private:
   friend struct CNobi;
+  friend struct CNobiGenerator;
 
   enum TokenType { RAW, SPECIAL };
   typedef std::vector<std::pair<std::string, TokenType> > TokenList;
@@ -73,6 +74,7 @@ struct Rule {
   // Allow the parsers to reach into this object and fill out its fields.
   friend struct ManifestParser;
   friend struct CNobi;
+  friend struct CNobiGenerator;
 
   std::string name_;
   typedef std::map<std::string, EvalString> Bindings;
@@ -94,6 +96,10 @@ struct BindingEnv : public Env {
   const std::map<std::string, const Rule*>& GetRules() const;
 
   void AddBinding(const std::string& key, const std::string& val);
+  const std::map<std::string, std::string>& GetBindings() const;
+
+  BindingEnv* parent() const { return parent_; }
+  void set_parent(BindingEnv* parent) { parent_ = parent; }
 
   /// This is tricky.  Edges want lookup scope to go in this order:
   /// 1) value set on edge itself (edge_->env_)
@@ -32,7 +32,7 @@
 using namespace std;
 
 bool Node::Stat(DiskInterface* disk_interface, string* err) {
-  mtime_ = disk_interface->Stat(path_, err);
+  mtime_ = disk_interface->Stat(path_.AsString(), err);
   if (mtime_ == -1) {
     return false;
   }
@@ -92,7 +92,7 @@ bool DependencyScan::RecomputeNodeDirty(Node* node, std::vector<Node*>* stack,
       return false;
     if (!node->exists())
       explanations_.Record(node, "%s has no in-edge and is missing",
-                           node->path().c_str());
+                           node->path_c_str());
     node->set_dirty(!node->exists());
     return true;
   }
@@ -183,7 +183,7 @@ bool DependencyScan::RecomputeNodeDirty(Node* node, std::vector<Node*>* stack,
       // If a regular input is dirty (or missing), we're dirty.
       // Otherwise consider mtime.
       if ((*i)->dirty()) {
-        explanations_.Record(node, "%s is dirty", (*i)->path().c_str());
+        explanations_.Record(node, "%s is dirty", (*i)->path_c_str());
         dirty = true;
       } else {
         if (!most_recent_input || (*i)->mtime() > most_recent_input->mtime()) {
@@ -248,10 +248,10 @@ bool DependencyScan::VerifyDAG(Node* node, vector<Node*>* stack, string* err) {
   // Construct the error message rejecting the cycle.
   *err = "dependency cycle: ";
   for (vector<Node*>::const_iterator i = start; i != stack->end(); ++i) {
-    err->append((*i)->path());
+    err->append((*i)->path().AsString());
     err->append(" -> ");
   }
-  err->append((*start)->path());
+  err->append((*start)->path().AsString());
 
   if ((start + 1) == stack->end() && edge->maybe_phonycycle_diagnostic()) {
     // The manifest parser would have filtered out the self-referencing
@@ -264,10 +264,11 @@ bool DependencyScan::VerifyDAG(Node* node, vector<Node*>* stack, string* err) {
 
 bool DependencyScan::RecomputeOutputsDirty(Edge* edge, Node* most_recent_input,
                                            bool* outputs_dirty, string* err) {
-  string command = edge->EvaluateCommand(/*incl_rsp_file=*/true);
+  // Phony edges have no command to compare.
+  uint64_t command_hash = edge->is_phony() ? 0 : edge->CommandHash();
   for (vector<Node*>::iterator o = edge->outputs_.begin();
        o != edge->outputs_.end(); ++o) {
-    if (RecomputeOutputDirty(edge, most_recent_input, command, *o)) {
+    if (RecomputeOutputDirty(edge, most_recent_input, command_hash, *o)) {
       *outputs_dirty = true;
       return true;
     }
@@ -277,7 +278,7 @@ bool DependencyScan::RecomputeOutputsDirty(Edge* edge, Node* most_recent_input,
 
 bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
                                           const Node* most_recent_input,
-                                          const string& command,
+                                          uint64_t command_hash,
                                           Node* output) {
   if (edge->is_phony()) {
     // Phony edges don't write any output.  Outputs are only dirty if
@@ -285,7 +286,7 @@ bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
     if (edge->inputs_.empty() && !output->exists()) {
       explanations_.Record(
           output, "output %s of phony edge with no inputs doesn't exist",
-          output->path().c_str());
+          output->path_c_str());
       return true;
     }
 
@@ -302,7 +303,7 @@ bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
   // Dirty if we're missing the output.
   if (!output->exists()) {
     explanations_.Record(output, "output %s doesn't exist",
-                         output->path().c_str());
+                         output->path_c_str());
     return true;
   }
 
@@ -325,8 +326,8 @@ bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
     explanations_.Record(output,
                          "output %s older than most recent input %s "
                          "(%" PRId64 " vs %" PRId64 ")",
-                         output->path().c_str(),
-                         most_recent_input->path().c_str(), output->mtime(),
+                         output->path_c_str(),
+                         most_recent_input->path_c_str(), output->mtime(),
                          most_recent_input->mtime());
     return true;
   }
@@ -334,13 +335,12 @@ bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
   if (build_log()) {
     bool generator = edge->GetBindingBool("generator");
     if (entry || (entry = build_log()->LookupByOutput(output->path()))) {
-      if (!generator &&
-          BuildLog::LogEntry::HashCommand(command) != entry->command_hash) {
+      if (!generator && command_hash != entry->command_hash) {
         // May also be dirty due to the command changing since the last build.
         // But if this is a generator rule, the command changing does not make us
         // dirty.
         explanations_.Record(output, "command line changed for %s",
-                             output->path().c_str());
+                             output->path_c_str());
         return true;
       }
       if (most_recent_input && entry->mtime < most_recent_input->mtime()) {
@@ -354,14 +354,14 @@ bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
             output,
             "recorded mtime of %s older than most recent input %s (%" PRId64
             " vs %" PRId64 ")",
-            output->path().c_str(), most_recent_input->path().c_str(),
+            output->path_c_str(), most_recent_input->path_c_str(),
             entry->mtime, most_recent_input->mtime());
         return true;
       }
     }
     if (!entry && !generator) {
       explanations_.Record(output, "command line not found in log for %s",
-                           output->path().c_str());
+                           output->path_c_str());
       return true;
     }
   }
@@ -506,6 +506,12 @@ std::string Edge::EvaluateCommand(const bool incl_rsp_file) const {
   return command;
 }
 
+uint64_t Edge::CommandHash() const {
+  if (command_hash_)
+    return command_hash_;
+  return BuildLog::LogEntry::HashCommand(EvaluateCommand(true));
+}
+
 std::string Edge::GetBinding(const std::string& key) const {
   EdgeEnv env(this, EdgeEnv::kShellEscape);
   return env.LookupVariable(key);
@@ -534,18 +540,18 @@ void Edge::Dump(const char* prefix) const {
   printf("%s[ ", prefix);
   for (vector<Node*>::const_iterator i = inputs_.begin();
        i != inputs_.end() && *i != NULL; ++i) {
-    printf("%s ", (*i)->path().c_str());
+    printf("%s ", (*i)->path_c_str());
   }
   printf("--%s-> ", rule_->name().c_str());
   for (vector<Node*>::const_iterator i = outputs_.begin();
        i != outputs_.end() && *i != NULL; ++i) {
-    printf("%s ", (*i)->path().c_str());
+    printf("%s ", (*i)->path_c_str());
   }
   if (!validations_.empty()) {
     printf(" validations ");
     for (std::vector<Node*>::const_iterator i = validations_.begin();
          i != validations_.end() && *i != NULL; ++i) {
-      printf("%s ", (*i)->path().c_str());
+      printf("%s ", (*i)->path_c_str());
     }
   }
   if (pool_) {
@@ -575,8 +581,8 @@ bool Edge::maybe_phonycycle_diagnostic() const {
 }
 
 // static
-string Node::PathDecanonicalized(const string& path, uint64_t slash_bits) {
-  string result = path;
+string Node::PathDecanonicalized(StringPiece path, uint64_t slash_bits) {
+  string result = path.AsString();
 #ifdef _WIN32
   uint64_t mask = 1;
   for (char* c = &result[0]; (c = strchr(c, '/')) != NULL;) {
@@ -591,7 +597,7 @@ string Node::PathDecanonicalized(const string& path, uint64_t slash_bits) {
 
 void Node::Dump(const char* prefix) const {
   printf("%s <%s 0x%p> mtime: %" PRId64 "%s, (:%s), ",
-         prefix, path().c_str(), this,
+         prefix, path_c_str(), this,
          mtime(), exists() ? "" : " (:missing)",
          dirty() ? " dirty" : " clean");
   if (in_edge()) {
@@ -641,8 +647,8 @@ bool ImplicitDepLoader::LoadDepFile(Edge* edge, const string& path,
                                     string* err) {
   METRIC_RECORD("depfile load");
   // Read depfile content.  Treat a missing depfile as empty.
-  string content;
-  switch (disk_interface_->ReadFile(path, &content, err)) {
+  FileContents content;
+  switch (disk_interface_->MapFile(path, &content, err)) {
   case DiskInterface::Okay:
     break;
   case DiskInterface::NotFound:
@@ -663,7 +669,7 @@ bool ImplicitDepLoader::LoadDepFile(Edge* edge, const string& path,
                         ? *depfile_parser_options_
                         : DepfileParserOptions());
   string depfile_err;
-  if (!depfile.Parse(&content, &depfile_err)) {
+  if (!depfile.Parse(content.data(), content.size(), &depfile_err)) {
     *err = path + ": " + depfile_err;
     return false;
   }
@@ -684,7 +690,7 @@ bool ImplicitDepLoader::LoadDepFile(Edge* edge, const string& path,
   if (opath != *primary_out) {
     explanations_.Record(first_output,
                          "expected depfile '%s' to mention '%s', got '%s'",
-                         path.c_str(), first_output->path().c_str(),
+                         path.c_str(), first_output->path_c_str(),
                          primary_out->AsString().c_str());
     return false;
   }
@@ -727,7 +733,7 @@ bool ImplicitDepLoader::LoadDepsFromLog(Edge* edge, string* err) {
   DepsLog::Deps* deps = deps_log_ ? deps_log_->GetDeps(output) : NULL;
   if (!deps) {
     explanations_.Record(output, "deps for '%s' are missing",
-                         output->path().c_str());
+                         output->path_c_str());
     return false;
   }
 
@@ -736,7 +742,7 @@ bool ImplicitDepLoader::LoadDepsFromLog(Edge* edge, string* err) {
     explanations_.Record(output,
                          "stored deps info out of date for '%s' (%" PRId64
                          " vs %" PRId64 ")",
-                         output->path().c_str(), deps->mtime, output->mtime());
+                         output->path_c_str(), deps->mtime, output->mtime());
     return false;
   }
 
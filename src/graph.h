@@ -39,7 +39,15 @@ struct State;
 /// Information about a node in the dependency graph: the file, whether
 /// it's dirty, mtime, etc.
 struct Node {
+  /// Create a node owning a copy of \a path.
   Node(const std::string& path, uint64_t slash_bits)
+      : owned_path_(path), path_(owned_path_), slash_bits_(slash_bits) {}
+
+  /// Create a node whose path points into memory that outlives it, such as
+  /// a manifest image that State::AddImage() keeps mapped, rather than
+  /// owning a copy.  \a path must be NUL-terminated.
+  struct BorrowPath {};
+  Node(StringPiece path, uint64_t slash_bits, BorrowPath)
       : path_(path), slash_bits_(slash_bits) {}
 
   /// Return false on error.
@@ -78,12 +86,14 @@ struct Node {
     return exists_ != ExistenceStatusUnknown;
   }
 
-  const std::string& path() const { return path_; }
+  StringPiece path() const { return path_; }
+  /// path(), which is always NUL-terminated, as a C string.
+  const char* path_c_str() const { return path_.str_; }
   /// Get |path()| but use slash_bits to convert back to original slash styles.
   std::string PathDecanonicalized() const {
     return PathDecanonicalized(path_, slash_bits_);
   }
-  static std::string PathDecanonicalized(const std::string& path,
+  static std::string PathDecanonicalized(StringPiece path,
                                          uint64_t slash_bits);
   uint64_t slash_bits() const { return slash_bits_; }
 
@@ -118,7 +128,12 @@ struct Node {
   void Dump(const char* prefix="") const;
 
 private:
-  std::string path_;
+  Node(const Node&);  // path_ may point into owned_path_.
+  void operator=(const Node&);
+
+  /// Empty if the path is borrowed.
+  std::string owned_path_;
+  StringPiece path_;
 
   /// Set bits starting from lowest for backslashes that were normalized to
   /// forward slashes by CanonicalizePath. See |PathDecanonicalized|.
@@ -188,6 +203,10 @@ struct Edge {
   /// full contents of a response file (if applicable)
   std::string EvaluateCommand(bool incl_rsp_file = false) const;
 
+  /// The hash of EvaluateCommand(true) kept in the build log, taken from
+  /// command_hash_ if set.
+  uint64_t CommandHash() const;
+
   /// Returns the shell-escaped value of |key|.
   std::string GetBinding(const std::string& key) const;
   bool GetBindingBool(const std::string& key) const;
@@ -225,6 +244,10 @@ struct Edge {
   bool deps_missing_ = false;
   bool generated_by_dep_loader_ = false;
   TimeStamp command_start_time_ = 0;
+  /// CommandHash() as worked out by the manifest generator, which saves
+  /// evaluating the command when checking it against the build log; 0 if
+  /// unknown.
+  uint64_t command_hash_ = 0;
 
   const Rule& rule() const { return *rule_; }
   Pool* pool() const { return pool_; }
@@ -372,10 +395,11 @@ struct DependencyScan {
                           std::vector<Node*>* validation_nodes, std::string* err);
   bool VerifyDAG(Node* node, std::vector<Node*>* stack, std::string* err);
 
-  /// Recompute whether a given single output should be marked dirty.
+  /// Recompute whether a given single output should be marked dirty,
+  /// given the edge's Edge::CommandHash().
   /// Returns true if so.
   bool RecomputeOutputDirty(const Edge* edge, const Node* most_recent_input,
-                            const std::string& command, Node* output);
+                            uint64_t command_hash, Node* output);
 
   void RecordExplanation(const Node* node, const char* fmt, ...);
 
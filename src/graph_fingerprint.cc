@@ -0,0 +1,199 @@
+#include "graph_fingerprint.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+
+#include "graph.h"
+#include "hash_map.h"
+#include "state.h"
+#include "thread_pool.h"
+#include "util.h"
+
+using namespace std;
+
+namespace {
+
+/// Seeds of the two halves of each 128-bit hash.
+const uint64_t kHighSeed = 0x6e696e6a61677266ULL;
+const uint64_t kLowSeed = 0x636e6f6269667072ULL;
+
+/// The bindings that change what an edge does, other than its pool, which
+/// is described by name and depth.
+const char* const kBindings[] = {
+  "command", "description", "depfile", "deps", "dyndep", "generator",
+  "msvc_deps_prefix", "restat", "rspfile", "rspfile_content",
+};
+
+/// Sums of the hashes of graph parts, which do not depend on the order
+/// they are added in.
+struct Sums {
+  Sums() : high(0), low(0), count(0) {}
+
+  void Add(const string& text) {
+    high += MurmurHash64A(text.data(), text.size(), kHighSeed);
+    low += MurmurHash64A(text.data(), text.size(), kLowSeed);
+    ++count;
+  }
+
+  void Add(const Sums& other) {
+    high += other.high;
+    low += other.low;
+    count += other.count;
+  }
+
+  uint64_t high;
+  uint64_t low;
+  uint64_t count;
+};
+
+void AppendPaths(const char* label, vector<Node*>::const_iterator begin,
+                 vector<Node*>::const_iterator end, string* text) {
+  if (begin == end)
+    return;
+  text->append(label);
+  for (vector<Node*>::const_iterator n = begin; n != end; ++n) {
+    text->push_back(' ');
+    text->append((*n)->path().str_, (*n)->path().len_);
+  }
+  text->push_back('\n');
+}
+
+/// The descriptions of the edges of \a state, by first output.
+map<string, string> DescribeEdges(const State& state) {
+  map<string, string> edges;
+  for (vector<Edge*>::const_iterator e = state.edges_.begin();
+       e != state.edges_.end(); ++e) {
+    string output;
+    if (!(*e)->outputs_.empty())
+      output = (*e)->outputs_[0]->path().AsString();
+    edges[output] = GraphFingerprint::Describe(*e);
+  }
+  return edges;
+}
+
+/// The top-level builddir binding, which decides where the logs go.
+string BuildDir(const State& state) {
+  const map<string, string>& bindings = state.bindings_.GetBindings();
+  map<string, string>::const_iterator builddir = bindings.find("builddir");
+  return builddir == bindings.end() ? string() : builddir->second;
+}
+
+vector<string> SortedDefaults(const State& state) {
+  vector<string> paths;
+  for (vector<Node*>::const_iterator n = state.defaults_.begin();
+       n != state.defaults_.end(); ++n)
+    paths.push_back((*n)->path().AsString());
+  sort(paths.begin(), paths.end());
+  return paths;
+}
+
+}  // namespace
+
+string GraphFingerprint::Describe(const Edge* edge) {
+  string text = "rule " + edge->rule().name() + "\n";
+  if (edge->pool() && edge->pool() != &State::kDefaultPool) {
+    char depth[32];
+    snprintf(depth, sizeof(depth), " %d\n", edge->pool()->depth());
+    text += "pool " + edge->pool()->name() + depth;
+  }
+
+  const vector<Node*>& outs = edge->outputs_;
+  vector<Node*>::const_iterator implicit_outs =
+      outs.end() - edge->implicit_outs_;
+  AppendPaths("out", outs.begin(), implicit_outs, &text);
+  AppendPaths("implicit_out", implicit_outs, outs.end(), &text);
+  const vector<Node*>& ins = edge->inputs_;
+  vector<Node*>::const_iterator order_only =
+      ins.end() - edge->order_only_deps_;
+  vector<Node*>::const_iterator implicit = order_only - edge->implicit_deps_;
+  AppendPaths("in", ins.begin(), implicit, &text);
+  AppendPaths("implicit", implicit, order_only, &text);
+  AppendPaths("order_only", order_only, ins.end(), &text);
+  AppendPaths("validation", edge->validations_.begin(),
+              edge->validations_.end(), &text);
+
+  for (size_t i = 0; i < sizeof(kBindings) / sizeof(kBindings[0]); ++i) {
+    string value = edge->GetBinding(kBindings[i]);
+    if (!value.empty())
+      text += string(kBindings[i]) + " = " + value + "\n";
+  }
+  return text;
+}
+
+GraphFingerprint GraphFingerprint::Of(const State& state) {
+  const vector<Edge*>& edges = state.edges_;
+  // As in CNobi::StageChunks(): chunks spread evenly over the workers, but
+  // are large enough that queueing them costs little.
+  const size_t kChunkSize = 4096;
+  const size_t chunks = (edges.size() + kChunkSize - 1) / kChunkSize;
+  vector<Sums> chunk_sums(chunks);
+  auto hash_chunk = [&](size_t c) {
+    const size_t end = min(edges.size(), (c + 1) * kChunkSize);
+    for (size_t i = c * kChunkSize; i < end; ++i)
+      chunk_sums[c].Add(Describe(edges[i]));
+  };
+  if (chunks < 2 || GetProcessorCount() < 2) {
+    for (size_t c = 0; c < chunks; ++c)
+      hash_chunk(c);
+  } else {
+    ThreadPool pool;
+    for (size_t c = 0; c < chunks; ++c)
+      pool.Add([&hash_chunk, c]() { hash_chunk(c); });
+    pool.Wait();
+  }
+
+  Sums sums;
+  for (vector<Sums>::const_iterator s = chunk_sums.begin();
+       s != chunk_sums.end(); ++s)
+    sums.Add(*s);
+  for (vector<Node*>::const_iterator n = state.defaults_.begin();
+       n != state.defaults_.end(); ++n)
+    sums.Add("default " + (*n)->path().AsString() + "\n");
+  sums.Add("builddir = " + BuildDir(state) + "\n");
+
+  // Mix the sums, so that each half depends on all of them.
+  const uint64_t mixed[] = { sums.high, sums.low, sums.count };
+  GraphFingerprint fingerprint;
+  fingerprint.high = MurmurHash64A(mixed, sizeof(mixed), kHighSeed);
+  fingerprint.low = MurmurHash64A(mixed, sizeof(mixed), kLowSeed);
+  return fingerprint;
+}
+
+void GraphFingerprint::Diff(const State& a, const State& b, size_t limit,
+                            vector<string>* diffs) {
+  map<string, string> a_edges = DescribeEdges(a);
+  map<string, string> b_edges = DescribeEdges(b);
+  map<string, string>::const_iterator i = a_edges.begin();
+  map<string, string>::const_iterator j = b_edges.begin();
+  while (diffs->size() < limit &&
+         (i != a_edges.end() || j != b_edges.end())) {
+    if (j == b_edges.end() || (i != a_edges.end() && i->first < j->first)) {
+      diffs->push_back("only in the first graph:\n" + i->second);
+      ++i;
+    } else if (i == a_edges.end() || j->first < i->first) {
+      diffs->push_back("only in the second graph:\n" + j->second);
+      ++j;
+    } else {
+      if (i->second != j->second) {
+        diffs->push_back("first graph:\n" + i->second +
+                         "second graph:\n" + j->second);
+      }
+      ++i;
+      ++j;
+    }
+  }
+
+  if (diffs->size() < limit && SortedDefaults(a) != SortedDefaults(b))
+    diffs->push_back("the defaults differ\n");
+  if (diffs->size() < limit && BuildDir(a) != BuildDir(b))
+    diffs->push_back("builddir differs\n");
+}
+
+string GraphFingerprint::ToString() const {
+  char hex[33];
+  snprintf(hex, sizeof(hex), "%016" PRIx64 "%016" PRIx64, high, low);
+  return hex;
+}
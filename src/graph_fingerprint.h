@@ -0,0 +1,49 @@
+#ifndef NINJA_GRAPH_FINGERPRINT_H_
+#define NINJA_GRAPH_FINGERPRINT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+struct Edge;
+struct State;
+
+/// A 128-bit fingerprint of a loaded graph: its edges, as their rule, pool,
+/// paths and evaluated bindings, its defaults and its build directory.  It
+/// does not depend on the order of edges, the loader used or what the
+/// manifest looked like, so that manifests loaded by ManifestParser and by
+/// CNobi compare equal exactly when they describe the same build, and it
+/// may key caches of loaded graphs.
+struct GraphFingerprint {
+  GraphFingerprint() : high(0), low(0) {}
+
+  /// Fingerprint the whole of \a state, hashing large graphs on worker
+  /// threads.
+  static GraphFingerprint Of(const State& state);
+
+  /// The text Of() hashes for \a edge, one line per field.
+  static std::string Describe(const Edge* edge);
+
+  /// Describe up to \a limit differences between the edges of \a a and
+  /// \a b, in order of their first output: edges only one of them has, and
+  /// edges whose descriptions differ.
+  static void Diff(const State& a, const State& b, size_t limit,
+                   std::vector<std::string>* diffs);
+
+  /// 32 hex digits.
+  std::string ToString() const;
+
+  bool operator==(const GraphFingerprint& other) const {
+    return high == other.high && low == other.low;
+  }
+  bool operator!=(const GraphFingerprint& other) const {
+    return !(*this == other);
+  }
+
+  uint64_t high;
+  uint64_t low;
+};
+
+#endif  // NINJA_GRAPH_FINGERPRINT_H_
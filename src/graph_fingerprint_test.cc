@@ -0,0 +1,163 @@
+#include "graph_fingerprint.h"
+
+#include <utility>
+
+#include "cnobi.h"
+#include "cnobi_gen.h"
+#include "manifest_parser.h"
+#include "state.h"
+#include "test.h"
+
+using namespace std;
+
+namespace {
+
+struct GraphFingerprintTest : public testing::Test {
+  void AssertParse(State* state, const char* input) {
+    ManifestParser parser(state, &fs_);
+    string err;
+    EXPECT_TRUE(parser.ParseTest(input, &err));
+    ASSERT_EQ("", err);
+  }
+
+  VirtualFileSystem fs_;
+};
+
+const char kManifest[] =
+"builddir = out\n"
+"pool link\n"
+"  depth = 1\n"
+"rule cc\n"
+"  command = cc $flags $in -o $out\n"
+"  depfile = $out.d\n"
+"rule ld\n"
+"  command = ld $in -o $out\n"
+"  pool = link\n"
+"build a.o: cc a.c | a.h || gen\n"
+"  flags = -O2\n"
+"build b.o: cc b.c\n"
+"build app | app.map: ld a.o b.o |@ lint\n"
+"build gen lint: phony\n"
+"default app\n";
+
+}  // namespace
+
+TEST_F(GraphFingerprintTest, IndependentOfOrderAndSpelling) {
+  State a, b;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&a, kManifest));
+  // The same graph, declared in another order and with the commands spelled
+  // out differently.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&b,
+"builddir = out\n"
+"pool link\n"
+"  depth = 1\n"
+"rule ld\n"
+"  command = ld $in -o $out\n"
+"rule cc\n"
+"  command = cc $flags $in -o $out\n"
+"  depfile = $out.d\n"
+"flags = \n"
+"build gen lint: phony\n"
+"build app | app.map: ld ./a.o b.o |@ lint\n"
+"  pool = link\n"
+"build b.o: cc b.c\n"
+"build a.o: cc a.c | a.h || gen\n"
+"  flags = -O2\n"
+"default app\n"));
+
+  EXPECT_EQ(GraphFingerprint::Of(a).ToString(),
+            GraphFingerprint::Of(b).ToString());
+  vector<string> diffs;
+  GraphFingerprint::Diff(a, b, 10, &diffs);
+  EXPECT_TRUE(diffs.empty());
+}
+
+TEST_F(GraphFingerprintTest, Differences) {
+  State a, b;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&a, kManifest));
+  // b.o moves into the order-only inputs of app.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&b,
+"builddir = out\n"
+"pool link\n"
+"  depth = 1\n"
+"rule cc\n"
+"  command = cc $flags $in -o $out\n"
+"  depfile = $out.d\n"
+"rule ld\n"
+"  command = ld $in -o $out\n"
+"  pool = link\n"
+"build a.o: cc a.c | a.h || gen\n"
+"  flags = -O2\n"
+"build b.o: cc b.c\n"
+"build app | app.map: ld a.o || b.o |@ lint\n"
+"build gen lint: phony\n"
+"build extra: phony\n"
+"default app\n"));
+
+  EXPECT_NE(GraphFingerprint::Of(a), GraphFingerprint::Of(b));
+  vector<string> diffs;
+  GraphFingerprint::Diff(a, b, 10, &diffs);
+  ASSERT_EQ(2u, diffs.size());
+  EXPECT_EQ("first graph:\n"
+            "rule ld\n"
+            "pool link 1\n"
+            "out app\n"
+            "implicit_out app.map\n"
+            "in a.o b.o\n"
+            "validation lint\n"
+            "command = ld a.o b.o -o app\n"
+            "second graph:\n"
+            "rule ld\n"
+            "pool link 1\n"
+            "out app\n"
+            "implicit_out app.map\n"
+            "in a.o\n"
+            "order_only b.o\n"
+            "validation lint\n"
+            "command = ld a.o -o app\n", diffs[0]);
+  EXPECT_EQ("only in the second graph:\nrule phony\nout extra\n", diffs[1]);
+
+  diffs.clear();
+  GraphFingerprint::Diff(a, b, 1, &diffs);
+  EXPECT_EQ(1u, diffs.size());
+}
+
+TEST_F(GraphFingerprintTest, DefaultsAndBuildDir) {
+  State a, b, c;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&a, "build x: phony\ndefault x\n"));
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&b, "build x: phony\n"));
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&c,
+"builddir = out\nbuild x: phony\ndefault x\n"));
+  EXPECT_NE(GraphFingerprint::Of(a), GraphFingerprint::Of(b));
+  EXPECT_NE(GraphFingerprint::Of(a), GraphFingerprint::Of(c));
+
+  vector<string> diffs;
+  GraphFingerprint::Diff(a, b, 10, &diffs);
+  ASSERT_EQ(1u, diffs.size());
+  EXPECT_EQ("the defaults differ\n", diffs[0]);
+  diffs.clear();
+  GraphFingerprint::Diff(a, c, 10, &diffs);
+  ASSERT_EQ(1u, diffs.size());
+  EXPECT_EQ("builddir differs\n", diffs[0]);
+}
+
+TEST_F(GraphFingerprintTest, CNobiTables) {
+  State parsed;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&parsed, kManifest));
+  vector<pair<string, string> > arrays;
+  CNobiGenerator(&parsed).GenerateTableImage(&arrays);
+
+  // Declared after the arrays, whose strings its nodes borrow.
+  State loaded;
+  CNobi cnobi(&loaded);
+  string err;
+  EXPECT_TRUE(cnobi.LoadTables("build.ninja", [&arrays](const string& name) {
+    for (size_t i = 0; i < arrays.size(); ++i) {
+      if (arrays[i].first == name)
+        return static_cast<const void*>(arrays[i].second.data());
+    }
+    return static_cast<const void*>(NULL);
+  }, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(GraphFingerprint::Of(parsed), GraphFingerprint::Of(loaded));
+}
@@ -0,0 +1,282 @@
+#include "graph_snapshot.h"
+#include "../cnobi/manifest.h"
+
+#include "cnobi.h"
+#include "cnobi_gen.h"
+#include "metrics.h"
+#include "state.h"
+#include "version.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+#include <utility>
+
+using namespace std;
+
+namespace {
+
+const char kSnapshotMagic[8] = {'n', 'i', 'n', 'j', 'a', 'g', 'r', 'f'};
+/// Bumped whenever the layout below or the tables it holds change.
+const uint32_t kSnapshotVersion = 1;
+
+/// The file starts with a FileHeader and one SectionEntry per section.
+/// Section data follows, each aligned to 8 bytes so that the tables can be
+/// used where they are mapped.  The "key" section comes first; the others
+/// are the arrays of a version 2 cnobi manifest, by symbol name.
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_sections;
+};
+
+struct SectionEntry {
+  char name[32];
+  uint64_t offset;
+  uint64_t size;
+};
+
+const char kKeySection[] = "key";
+
+/// The key up to the manifest files: the ninja version, the manifest and
+/// the parser options, each NUL-terminated.
+string KeyPrefix(const string& manifest, const ManifestParserOptions& options) {
+  char action[16];
+  snprintf(action, sizeof(action), "%d", (int)options.phony_cycle_action_);
+  string key;
+  key.append(kNinjaVersion).push_back('\0');
+  key.append(manifest).push_back('\0');
+  key.append(action).push_back('\0');
+  return key;
+}
+
+/// The mtime and size of \a path as kept in the key, or "missing".
+string FileStamp(const string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0)
+    return "missing";
+  char stamp[64];
+  snprintf(stamp, sizeof(stamp), "%" PRId64 ".%09ld %" PRId64,
+           (int64_t)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+           (int64_t)st.st_size);
+  return stamp;
+}
+
+/// A mapped snapshot, kept for as long as the State whose nodes borrow
+/// its strings.
+struct MappedSnapshot : public State::Image {
+  MappedSnapshot(void* data, size_t size) : data_(data), size_(size) {}
+  virtual ~MappedSnapshot() { munmap(data_, size_); }
+  void* data_;
+  size_t size_;
+};
+
+typedef map<string, pair<const char*, size_t> > Sections;
+
+/// Find the sections of the \a size bytes at \a data.  False if the file
+/// is not a snapshot of this version, or is cut short.
+bool ReadSections(const char* data, size_t size, Sections* sections) {
+  if (size < sizeof(FileHeader))
+    return false;
+  const FileHeader* header = reinterpret_cast<const FileHeader*>(data);
+  if (memcmp(header->magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 ||
+      header->version != kSnapshotVersion ||
+      header->num_sections > (size - sizeof(FileHeader)) /
+                                 sizeof(SectionEntry))
+    return false;
+  const SectionEntry* entries =
+      reinterpret_cast<const SectionEntry*>(header + 1);
+  for (uint32_t i = 0; i < header->num_sections; ++i) {
+    const SectionEntry& entry = entries[i];
+    if (entry.name[sizeof(entry.name) - 1] != '\0' || entry.offset > size ||
+        entry.size > size - entry.offset || entry.offset % 8 != 0)
+      return false;
+    (*sections)[entry.name] = make_pair(data + entry.offset, entry.size);
+  }
+  return true;
+}
+
+/// Whether \a key names \a manifest and \a options, and every file in it
+/// still has the recorded mtime and size.
+bool KeyIsCurrent(const pair<const char*, size_t>& key,
+                  const string& manifest,
+                  const ManifestParserOptions& options) {
+  string prefix = KeyPrefix(manifest, options);
+  if (key.second < prefix.size() || key.first[key.second - 1] != '\0' ||
+      prefix.compare(0, string::npos, key.first, prefix.size()) != 0)
+    return false;
+  const char* end = key.first + key.second;
+  for (const char* p = key.first + prefix.size(); p < end;) {
+    const char* path = p;
+    p += strlen(p) + 1;
+    if (p >= end || FileStamp(path) != p)
+      return false;
+    p += strlen(p) + 1;
+  }
+  return true;
+}
+
+/// Check the arrays against the counts in their header, so that the loader
+/// does not read past a section.
+bool SectionsMatchHeader(const Sections& sections, string* err) {
+  Sections::const_iterator header = sections.find("cnobi_header");
+  Sections::const_iterator strings = sections.find("cnobi_strings");
+  if (header == sections.end() ||
+      header->second.second != sizeof(CNobiHeader) ||
+      strings == sections.end() || strings->second.second == 0 ||
+      strings->second.first[strings->second.second - 1] != '\0') {
+    *err = "malformed graph snapshot";
+    return false;
+  }
+  const CNobiHeader* h =
+      reinterpret_cast<const CNobiHeader*>(header->second.first);
+  const struct {
+    const char* name;
+    uint64_t size;
+  } expected[] = {
+    {"cnobi_edges", (uint64_t)h->num_edges * sizeof(CNobiEdge)},
+    {"cnobi_pools", (uint64_t)h->num_pools * sizeof(CNobiPool)},
+    {"cnobi_rules", (uint64_t)h->num_rules * sizeof(CNobiRule)},
+    {"cnobi_nodes", (uint64_t)h->num_nodes * sizeof(CNobiNode)},
+    {"cnobi_producers", (uint64_t)h->num_nodes * sizeof(uint32_t)},
+    {"cnobi_command_hashes", (uint64_t)h->num_edges * sizeof(uint64_t)},
+  };
+  for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+    Sections::const_iterator s = sections.find(expected[i].name);
+    if (s == sections.end() || s->second.second != expected[i].size) {
+      *err = string("malformed graph snapshot: bad ") + expected[i].name;
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+void GraphSnapshot::RecordingFileReader::Record(const string& path) {
+  lock_guard<mutex> lock(mutex_);
+  files_.push_back(path);
+}
+
+FileReader::Status GraphSnapshot::RecordingFileReader::ReadFile(
+    const string& path, string* contents, string* err) {
+  Record(path);
+  return reader_->ReadFile(path, contents, err);
+}
+
+FileReader::Status GraphSnapshot::RecordingFileReader::MapFile(
+    const string& path, FileContents* contents, string* err) {
+  Record(path);
+  return reader_->MapFile(path, contents, err);
+}
+
+GraphSnapshot::LoadStatus GraphSnapshot::Load(
+    const string& path, const string& manifest,
+    const ManifestParserOptions& options, const vector<string>* targets,
+    State* state, string* err) {
+  METRIC_RECORD(".ninja_graph load");
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return STALE;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return STALE;
+  }
+  size_t size = st.st_size;
+  void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return STALE;
+
+  Sections sections;
+  if (!ReadSections(static_cast<const char*>(data), size, &sections) ||
+      sections.find(kKeySection) == sections.end() ||
+      !KeyIsCurrent(sections[kKeySection], manifest, options)) {
+    munmap(data, size);
+    return STALE;
+  }
+  if (!SectionsMatchHeader(sections, err)) {
+    munmap(data, size);
+    return FAILED;
+  }
+
+  // Nodes borrow their paths from the mapping from here on.
+  state->AddImage(new MappedSnapshot(data, size));
+  CNobi cnobi(state, options);
+  if (targets)
+    cnobi.set_targets(*targets);
+  CNobi::SymbolLookup lookup = [&sections](const string& name) -> const void* {
+    Sections::const_iterator s = sections.find(name);
+    return s == sections.end() ? NULL : s->second.first;
+  };
+  if (!cnobi.LoadTables(manifest, lookup, err))
+    return FAILED;
+  return LOADED;
+}
+
+bool GraphSnapshot::Write(const string& path, const string& manifest,
+                          const ManifestParserOptions& options,
+                          const vector<string>& files, const State& state,
+                          string* err) {
+  METRIC_RECORD(".ninja_graph write");
+  vector<pair<string, string> > arrays;
+  CNobiGenerator(&state).GenerateTableImage(&arrays);
+
+  string key = KeyPrefix(manifest, options);
+  for (vector<string>::const_iterator f = files.begin(); f != files.end();
+       ++f) {
+    key.append(*f).push_back('\0');
+    key.append(FileStamp(*f)).push_back('\0');
+  }
+  arrays.insert(arrays.begin(), make_pair(string(kKeySection), key));
+
+  FileHeader header;
+  memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+  header.version = kSnapshotVersion;
+  header.num_sections = arrays.size();
+  vector<SectionEntry> entries(arrays.size());
+  uint64_t offset = sizeof(header) + entries.size() * sizeof(SectionEntry);
+  for (size_t i = 0; i < arrays.size(); ++i) {
+    SectionEntry& entry = entries[i];
+    memset(entry.name, 0, sizeof(entry.name));
+    strncpy(entry.name, arrays[i].first.c_str(), sizeof(entry.name) - 1);
+    offset = (offset + 7) & ~(uint64_t)7;
+    entry.offset = offset;
+    entry.size = arrays[i].second.size();
+    offset += entry.size;
+  }
+
+  string contents(reinterpret_cast<const char*>(&header), sizeof(header));
+  contents.append(reinterpret_cast<const char*>(&entries[0]),
+                  entries.size() * sizeof(SectionEntry));
+  for (size_t i = 0; i < arrays.size(); ++i) {
+    contents.resize(entries[i].offset, '\0');
+    contents.append(arrays[i].second);
+  }
+
+  // Written aside and renamed, so that a concurrent ninja never maps half
+  // a snapshot.
+  string temp_path = path + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = "opening " + temp_path + ": " + strerror(errno);
+    return false;
+  }
+  bool ok = fwrite(contents.data(), 1, contents.size(), f) == contents.size();
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok || rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = "writing " + path + ": " + strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
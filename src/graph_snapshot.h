@@ -0,0 +1,66 @@
+#ifndef NINJA_GRAPH_SNAPSHOT_H_
+#define NINJA_GRAPH_SNAPSHOT_H_
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "disk_interface.h"
+#include "manifest_parser.h"
+
+struct State;
+
+/// The graph of a text manifest, saved after a successful parse so that
+/// later runs can map it instead of parsing while no manifest file
+/// changed.  The file holds the arrays of a version 2 cnobi manifest (see
+/// cnobi/manifest.h), written by CNobiGenerator and loaded through
+/// CNobi::LoadTables(), after a key naming every file the parser read with
+/// its mtime and size.  Any difference in the key, the ninja version or
+/// the parser options makes the snapshot stale, and ninja parses as usual.
+struct GraphSnapshot {
+  /// Passes reads on to another FileReader, recording the paths read, for
+  /// the key of the snapshot of what a ManifestParser reads through it.
+  /// Reads may come from several threads, as ManifestParser parses
+  /// subninjas concurrently.
+  struct RecordingFileReader : public FileReader {
+    explicit RecordingFileReader(FileReader* reader) : reader_(reader) {}
+
+    virtual Status ReadFile(const std::string& path, std::string* contents,
+                            std::string* err);
+    virtual Status MapFile(const std::string& path, FileContents* contents,
+                           std::string* err);
+
+    const std::vector<std::string>& files() const { return files_; }
+
+   private:
+    void Record(const std::string& path);
+
+    FileReader* reader_;
+    std::mutex mutex_;
+    std::vector<std::string> files_;
+  };
+
+  enum LoadStatus { LOADED, STALE, FAILED };
+
+  /// Load the snapshot at \a path of \a manifest into \a state, which must
+  /// be empty.  STALE, with \a state untouched, if there is no snapshot or
+  /// it does not match the manifest files on disk; FAILED, filling in
+  /// \a err, if a snapshot that looked current could not be loaded, after
+  /// which \a state holds part of the graph.  Only the edges that
+  /// \a targets need are loaded unless \a targets is NULL; see
+  /// CNobi::set_targets().
+  static LoadStatus Load(const std::string& path, const std::string& manifest,
+                         const ManifestParserOptions& options,
+                         const std::vector<std::string>* targets,
+                         State* state, std::string* err);
+
+  /// Write the snapshot of \a state, parsed from \a manifest by reading
+  /// \a files, to \a path.  The file is written under another name and
+  /// renamed into place.
+  static bool Write(const std::string& path, const std::string& manifest,
+                    const ManifestParserOptions& options,
+                    const std::vector<std::string>& files, const State& state,
+                    std::string* err);
+};
+
+#endif  // NINJA_GRAPH_SNAPSHOT_H_
@@ -0,0 +1,229 @@
+#include "graph_snapshot.h"
+
+#include "build.h"
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+using namespace std;
+
+namespace {
+
+const char kSnapshot[] = ".ninja_graph";
+
+struct GraphSnapshotTest : public testing::Test {
+  virtual void SetUp() {
+    // The key stats the manifests, so they have to be real files.
+    temp_dir_.CreateAndEnter("Ninja-GraphSnapshotTest");
+    disk_interface_.WriteFile("rules.ninja",
+"rule cc\n"
+"  command = cc $flags $in -o $out\n");
+    disk_interface_.WriteFile("build.ninja",
+"flags = -O2\n"
+"include rules.ninja\n"
+"build a.o: cc a.c\n"
+"build b.o: cc b.c\n"
+"  flags = -g\n"
+"build all: phony a.o b.o\n"
+"default all\n");
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  /// Parse build.ninja into \a state and snapshot it.
+  void ParseAndWrite(State* state) {
+    GraphSnapshot::RecordingFileReader reader(&disk_interface_);
+    ManifestParser parser(state, &reader);
+    string err;
+    ASSERT_TRUE(parser.Load("build.ninja", &err));
+    ASSERT_EQ("", err);
+    ASSERT_EQ(2u, reader.files().size());
+    ASSERT_TRUE(GraphSnapshot::Write(kSnapshot, "build.ninja",
+                                     ManifestParserOptions(), reader.files(),
+                                     *state, &err));
+    ASSERT_EQ("", err);
+  }
+
+  GraphSnapshot::LoadStatus Load(State* state,
+                                 const vector<string>* targets = NULL) {
+    string err;
+    GraphSnapshot::LoadStatus status =
+        GraphSnapshot::Load(kSnapshot, "build.ninja", ManifestParserOptions(),
+                            targets, state, &err);
+    EXPECT_EQ("", err);
+    return status;
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_interface_;
+};
+
+}  // namespace
+
+TEST_F(GraphSnapshotTest, RoundTrip) {
+  State parsed;
+  ASSERT_NO_FATAL_FAILURE(ParseAndWrite(&parsed));
+
+  State state;
+  ASSERT_EQ(GraphSnapshot::LOADED, Load(&state));
+  ASSERT_EQ(parsed.edges_.size(), state.edges_.size());
+  Node* a = state.LookupNode("a.o");
+  ASSERT_TRUE(a && a->in_edge());
+  EXPECT_EQ("cc -O2 a.c -o a.o", a->in_edge()->EvaluateCommand());
+  Node* b = state.LookupNode("b.o");
+  ASSERT_TRUE(b && b->in_edge());
+  EXPECT_EQ("cc -g b.c -o b.o", b->in_edge()->EvaluateCommand());
+  ASSERT_EQ(1u, state.defaults_.size());
+  EXPECT_EQ("all", state.defaults_[0]->path());
+}
+
+TEST_F(GraphSnapshotTest, Targets) {
+  State parsed;
+  ASSERT_NO_FATAL_FAILURE(ParseAndWrite(&parsed));
+
+  State state;
+  vector<string> targets(1, "a.o");
+  ASSERT_EQ(GraphSnapshot::LOADED, Load(&state, &targets));
+  EXPECT_TRUE(state.partial_);
+  ASSERT_TRUE(state.LookupNode("a.o"));
+  EXPECT_TRUE(state.LookupNode("a.o")->in_edge());
+  EXPECT_FALSE(state.LookupNode("b.o"));
+}
+
+// A generated header that only a depfile names must still get its edge.
+TEST_F(GraphSnapshotTest, TargetsWithDepfile) {
+  disk_interface_.WriteFile("rules.ninja",
+"rule cc\n"
+"  command = cc $in -o $out\n"
+"  depfile = $out.d\n"
+"rule gen\n"
+"  command = gen $out\n");
+  disk_interface_.WriteFile("build.ninja",
+"include rules.ninja\n"
+"build gen.h: gen\n"
+"build a.o: cc a.c\n"
+"build b.o: cc b.c\n");
+  State parsed;
+  ASSERT_NO_FATAL_FAILURE(ParseAndWrite(&parsed));
+
+  State state;
+  vector<string> targets(1, "a.o");
+  ASSERT_EQ(GraphSnapshot::LOADED, Load(&state, &targets));
+  EXPECT_FALSE(state.partial_);
+  ASSERT_TRUE(state.LookupNode("gen.h"));
+  EXPECT_TRUE(state.LookupNode("gen.h")->in_edge());
+}
+
+// Likewise for a depfile, or deps, set on the edge.
+TEST_F(GraphSnapshotTest, TargetsWithEdgeDeps) {
+  disk_interface_.WriteFile("build.ninja",
+"include rules.ninja\n"
+"rule gen\n"
+"  command = gen $out\n"
+"build gen.h: gen\n"
+"build a.o: cc a.c\n"
+"  deps = gcc\n"
+"  depfile = a.o.d\n"
+"build b.o: cc b.c\n");
+  State parsed;
+  ASSERT_NO_FATAL_FAILURE(ParseAndWrite(&parsed));
+
+  State state;
+  vector<string> targets(1, "a.o");
+  ASSERT_EQ(GraphSnapshot::LOADED, Load(&state, &targets));
+  EXPECT_FALSE(state.partial_);
+  ASSERT_TRUE(state.LookupNode("gen.h"));
+  EXPECT_TRUE(state.LookupNode("gen.h")->in_edge());
+}
+
+// An edge without a pool of its own runs in its rule's.
+TEST_F(GraphSnapshotTest, RulePool) {
+  disk_interface_.WriteFile("rules.ninja",
+"pool link\n"
+"  depth = 1\n"
+"rule ld\n"
+"  command = ld $in -o $out\n"
+"  pool = link\n");
+  disk_interface_.WriteFile("build.ninja",
+"include rules.ninja\n"
+"build out1: ld in\n"
+"build out2: ld in\n");
+  State parsed;
+  ASSERT_NO_FATAL_FAILURE(ParseAndWrite(&parsed));
+
+  State state;
+  ASSERT_EQ(GraphSnapshot::LOADED, Load(&state));
+  Edge* edge = state.GetNode("out1", 0)->in_edge();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("link", edge->pool()->name());
+  EXPECT_EQ(1, edge->pool()->depth());
+
+  // The pool holds the second edge back until the first is done.
+  state.GetNode("out1", 0)->MarkDirty();
+  state.GetNode("out2", 0)->MarkDirty();
+  Plan plan;
+  string err;
+  EXPECT_TRUE(plan.AddTarget(state.GetNode("out1", 0), &err));
+  EXPECT_TRUE(plan.AddTarget(state.GetNode("out2", 0), &err));
+  ASSERT_EQ("", err);
+  plan.PrepareQueue();
+  Edge* first = plan.FindWork();
+  ASSERT_TRUE(first);
+  EXPECT_FALSE(plan.FindWork());
+  plan.EdgeFinished(first, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  Edge* second = plan.FindWork();
+  ASSERT_TRUE(second);
+  EXPECT_NE(first, second);
+  plan.EdgeFinished(second, Plan::kEdgeSucceeded, &err);
+  EXPECT_FALSE(plan.more_to_do());
+}
+
+TEST_F(GraphSnapshotTest, StaleInclude) {
+  State parsed;
+  ASSERT_NO_FATAL_FAILURE(ParseAndWrite(&parsed));
+
+  // A different size makes the key stale even within one mtime tick.
+  disk_interface_.WriteFile("rules.ninja",
+"rule cc\n"
+"  command = gcc $flags $in -o $out\n");
+  State state;
+  EXPECT_EQ(GraphSnapshot::STALE, Load(&state));
+  EXPECT_TRUE(state.edges_.empty());
+}
+
+TEST_F(GraphSnapshotTest, StaleOptions) {
+  State parsed;
+  ASSERT_NO_FATAL_FAILURE(ParseAndWrite(&parsed));
+
+  ManifestParserOptions options;
+  options.phony_cycle_action_ = kPhonyCycleActionError;
+  State state;
+  string err;
+  EXPECT_EQ(GraphSnapshot::STALE,
+            GraphSnapshot::Load(kSnapshot, "build.ninja", options, NULL,
+                                &state, &err));
+  EXPECT_EQ(GraphSnapshot::STALE,
+            GraphSnapshot::Load(kSnapshot, "other.ninja",
+                                ManifestParserOptions(), NULL, &state, &err));
+  EXPECT_EQ("", err);
+}
+
+TEST_F(GraphSnapshotTest, Truncated) {
+  State parsed;
+  ASSERT_NO_FATAL_FAILURE(ParseAndWrite(&parsed));
+
+  string contents, err;
+  ASSERT_EQ(FileReader::Okay,
+            disk_interface_.ReadFile(kSnapshot, &contents, &err));
+  contents.resize(contents.size() / 2);
+  disk_interface_.WriteFile(kSnapshot, contents);
+  State state;
+  EXPECT_EQ(GraphSnapshot::STALE, Load(&state));
+
+  State missing;
+  disk_interface_.RemoveFile(kSnapshot);
+  EXPECT_EQ(GraphSnapshot::STALE, Load(&missing));
+}
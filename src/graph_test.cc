@@ -211,7 +211,7 @@ TEST_F(GraphTest, RootNodes) {
   vector<Node*> root_nodes = state_.RootNodes(&err);
   EXPECT_EQ(4u, root_nodes.size());
   for (size_t i = 0; i < root_nodes.size(); ++i) {
-    string name = root_nodes[i]->path();
+    string name = root_nodes[i]->path().AsString();
     EXPECT_EQ("out", name.substr(0, 3));
   }
 }
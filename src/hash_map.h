@@ -53,6 +53,54 @@ unsigned int MurmurHash2(const void* key, size_t len) {
   return h;
 }
 
+// 64bit MurmurHash2, by Austin Appleby
+#if defined(_MSC_VER)
+#define BIG_CONSTANT(x) (x)
+#else   // defined(_MSC_VER)
+#define BIG_CONSTANT(x) (x##LLU)
+#endif // !defined(_MSC_VER)
+static inline
+uint64_t MurmurHash64A(const void* key, size_t len,
+                       uint64_t seed = BIG_CONSTANT(0xDECAFBADDECAFBAD)) {
+  const uint64_t m = BIG_CONSTANT(0xc6a4a7935bd1e995);
+  const int r = 47;
+  uint64_t h = seed ^ (len * m);
+  const unsigned char* data = static_cast<const unsigned char*>(key);
+  while (len >= 8) {
+    uint64_t k;
+    memcpy(&k, data, sizeof k);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+    data += 8;
+    len -= 8;
+  }
+  switch (len & 7)
+  {
+  case 7: h ^= uint64_t(data[6]) << 48;
+          NINJA_FALLTHROUGH;
+  case 6: h ^= uint64_t(data[5]) << 40;
+          NINJA_FALLTHROUGH;
+  case 5: h ^= uint64_t(data[4]) << 32;
+          NINJA_FALLTHROUGH;
+  case 4: h ^= uint64_t(data[3]) << 24;
+          NINJA_FALLTHROUGH;
+  case 3: h ^= uint64_t(data[2]) << 16;
+          NINJA_FALLTHROUGH;
+  case 2: h ^= uint64_t(data[1]) << 8;
+          NINJA_FALLTHROUGH;
+  case 1: h ^= uint64_t(data[0]);
+          h *= m;
+  };
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+#undef BIG_CONSTANT
+
 #include <unordered_map>
 
 namespace std {
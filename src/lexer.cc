@@ -66,9 +66,15 @@ Lexer::Lexer(const char* input) {
 }
 
 void Lexer::Start(StringPiece filename, StringPiece input) {
+  Start(filename, input, 0, input.len_);
+}
+
+void Lexer::Start(StringPiece filename, StringPiece input, size_t begin,
+                  size_t end) {
   filename_ = filename;
   input_ = input;
-  ofs_ = input_.str_;
+  ofs_ = input_.str_ + begin;
+  end_ = input_.str_ + end;
   last_token_ = NULL;
 }
 
@@ -453,6 +459,10 @@ yy72:
 
   }
 
+  if (start >= end_) {
+    token = TEOF;
+    p = start;
+  }
   last_token_ = start;
   ofs_ = p;
   if (token != NEWLINE && token != TEOF)
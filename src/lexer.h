@@ -61,6 +61,12 @@ struct Lexer {
   /// Start parsing some input.
   void Start(StringPiece filename, StringPiece input);
 
+  /// Start parsing the statements in [\a begin, \a end) of \a input, as
+  /// offsets that fall on the start of top-level statements.  Errors give
+  /// positions in the whole of \a input.
+  void Start(StringPiece filename, StringPiece input, size_t begin,
+             size_t end);
+
   /// Read a Token from the Token enum.
   Token ReadToken();
 
@@ -100,6 +106,8 @@ private:
   StringPiece filename_;
   StringPiece input_;
   const char* ofs_;
+  /// Tokens from here on read as TEOF.
+  const char* end_;
   const char* last_token_;
 };
 
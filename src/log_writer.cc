@@ -0,0 +1,147 @@
+#include "log_writer.h"
+
+#include <errno.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "debug_flags.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+LogWriter::LogWriter()
+    : file_(NULL), threaded_(false), writing_(false), closing_(false),
+      error_(0) {}
+
+LogWriter::~LogWriter() {
+  Close();
+}
+
+void LogWriter::Open(FILE* file, bool threaded) {
+  file_ = file;
+  threaded_ = threaded;
+  writing_ = false;
+  closing_ = false;
+  error_ = 0;
+  if (threaded_)
+    thread_ = thread(&LogWriter::Work, this);
+}
+
+bool LogWriter::Append(const void* data, size_t size) {
+  // The thread sets error_ under the lock, so it is only read under it.
+  int error;
+  if (!threaded_) {
+    if (error_ == 0 && !Write(static_cast<const char*>(data), size))
+      error_ = errno;
+    error = error_;
+  } else {
+    lock_guard<mutex> lock(mutex_);
+    if (error_ == 0)
+      queue_.append(static_cast<const char*>(data), size);
+    error = error_;
+  }
+  if (error != 0) {
+    errno = error;
+    return false;
+  }
+  if (threaded_)
+    queued_.notify_one();
+  return true;
+}
+
+bool LogWriter::Flush() {
+  int error;
+  if (!threaded_) {
+    error = error_;
+  } else {
+    unique_lock<mutex> lock(mutex_);
+    while (error_ == 0 && (writing_ || !queue_.empty()))
+      WaitFor(&written_, &lock);
+    error = error_;
+  }
+  if (error != 0) {
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+bool LogWriter::Close() {
+  if (!file_)
+    return true;
+  bool ok = Flush();
+  if (threaded_) {
+    {
+      lock_guard<mutex> lock(mutex_);
+      closing_ = true;
+    }
+    queued_.notify_one();
+    thread_.join();
+  }
+  if (fclose(file_) != 0 && ok) {
+    error_ = errno;
+    ok = false;
+  }
+  file_ = NULL;
+  queue_.clear();
+  return ok;
+}
+
+void LogWriter::Work() {
+  unique_lock<mutex> lock(mutex_);
+  for (;;) {
+    while (queue_.empty() && !closing_)
+      WaitFor(&queued_, &lock);
+    if (queue_.empty())
+      return;
+    // Take everything queued so far, so that Append() can go on queueing
+    // into the other buffer meanwhile.
+    batch_.clear();
+    batch_.swap(queue_);
+    writing_ = true;
+    lock.unlock();
+    bool ok = Write(batch_.data(), batch_.size());
+    int error = errno;
+    lock.lock();
+    writing_ = false;
+    if (!ok) {
+      // Drop the rest: a log with a gap in it would be read wrongly.
+      error_ = error;
+      queue_.clear();
+    }
+    written_.notify_all();
+    if (!ok)
+      return;
+  }
+}
+
+bool LogWriter::Write(const char* data, size_t size) {
+  int fd = fileno(file_);
+  while (size > 0) {
+#ifdef _WIN32
+    int written = _write(fd, data, (unsigned)size);
+#else
+    ssize_t written = write(fd, data, size);
+#endif
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  if (g_sync_logs) {
+#if defined(_WIN32)
+    return _commit(fd) == 0;
+#elif defined(__APPLE__)
+    return fsync(fd) == 0;
+#else
+    return fdatasync(fd) == 0;
+#endif
+  }
+  return true;
+}
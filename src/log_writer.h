@@ -0,0 +1,64 @@
+#ifndef NINJA_LOG_WRITER_H_
+#define NINJA_LOG_WRITER_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/// Appends the records of a log file for the BuildLog and DepsLog.  When
+/// threaded, Append() only queues the record, and a thread of its own
+/// writes out what was queued, so that the build loop does not wait for
+/// the disk; records queued while a write is in flight go out together in
+/// the next one.  Each record is written whole, in the order queued, so a
+/// log cut short by a crash loses only records at its end.
+///
+/// An error writing is reported, with errno set, by the calls after it.
+struct LogWriter {
+  LogWriter();
+  /// Close()s the file.
+  ~LogWriter();
+
+  /// Write to \a file from now on, taking it over; what was written to it
+  /// through stdio must have been flushed.  Writes go through a thread if
+  /// \a threaded.
+  void Open(FILE* file, bool threaded);
+  bool is_open() const { return file_ != NULL; }
+
+  /// Write the \a size bytes at \a data, a whole record, or queue them.
+  bool Append(const void* data, size_t size);
+
+  /// Wait until everything appended is written.
+  bool Flush();
+
+  /// Flush(), then close the file.
+  bool Close();
+
+ private:
+  void Work();
+  /// Write \a size bytes at \a data to the file, then sync it if
+  /// g_sync_logs is set.
+  bool Write(const char* data, size_t size);
+
+  FILE* file_;
+  bool threaded_;
+  std::thread thread_;
+
+  std::mutex mutex_;
+  /// Signalled when records are queued or the writer is closing.
+  std::condition_variable queued_;
+  /// Signalled when a write finishes.
+  std::condition_variable written_;
+  /// Records not written yet, and the buffer the thread writes from.
+  std::string queue_;
+  std::string batch_;
+  bool writing_;
+  bool closing_;
+  /// errno of the first write that failed, or 0.
+  int error_;
+};
+
+#endif  // NINJA_LOG_WRITER_H_
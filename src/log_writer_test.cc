@@ -0,0 +1,92 @@
+#include "log_writer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "test.h"
+#include "util.h"
+
+using namespace std;
+
+namespace {
+
+const char kTestFilename[] = "LogWriterTest-tempfile";
+
+struct LogWriterTest : public testing::Test {
+  virtual void SetUp() { unlink(kTestFilename); }
+  virtual void TearDown() { unlink(kTestFilename); }
+
+  string Contents() {
+    string contents, err;
+    ReadFile(kTestFilename, &contents, &err);
+    return contents;
+  }
+};
+
+TEST_F(LogWriterTest, Threaded) {
+  FILE* f = fopen(kTestFilename, "ab");
+  ASSERT_TRUE(f);
+  fputs("header\n", f);
+  fflush(f);
+
+  LogWriter writer;
+  writer.Open(f, true);
+  string expected = "header\n";
+  for (int i = 0; i < 1000; ++i) {
+    string record = "record " + to_string(i) + "\n";
+    ASSERT_TRUE(writer.Append(record.data(), record.size()));
+    expected += record;
+  }
+  // Flush() waits for every record queued so far.
+  ASSERT_TRUE(writer.Flush());
+  EXPECT_EQ(expected, Contents());
+
+  ASSERT_TRUE(writer.Append("last\n", 5));
+  ASSERT_TRUE(writer.Close());
+  EXPECT_FALSE(writer.is_open());
+  EXPECT_EQ(expected + "last\n", Contents());
+}
+
+TEST_F(LogWriterTest, Unthreaded) {
+  FILE* f = fopen(kTestFilename, "ab");
+  ASSERT_TRUE(f);
+  LogWriter writer;
+  writer.Open(f, false);
+  ASSERT_TRUE(writer.Append("a\n", 2));
+  // Written right away.
+  EXPECT_EQ("a\n", Contents());
+  ASSERT_TRUE(writer.Append("b\n", 2));
+  ASSERT_TRUE(writer.Close());
+  EXPECT_EQ("a\nb\n", Contents());
+}
+
+TEST_F(LogWriterTest, ReportsErrors) {
+  // Writes to a read-only file fail, which the calls after report with the
+  // errno of the failed write.
+  for (int threaded = 0; threaded < 2; ++threaded) {
+    FILE* f = fopen(kTestFilename, "ab");
+    ASSERT_TRUE(f);
+    fclose(f);
+    f = fopen(kTestFilename, "rb");
+    ASSERT_TRUE(f);
+    LogWriter writer;
+    writer.Open(f, threaded);
+    writer.Append("lost\n", 5);
+    errno = 0;
+    EXPECT_FALSE(writer.Flush());
+    EXPECT_EQ(EBADF, errno);
+    errno = 0;
+    EXPECT_FALSE(writer.Append("lost\n", 5));
+    EXPECT_EQ(EBADF, errno);
+    errno = 0;
+    EXPECT_FALSE(writer.Flush());
+    EXPECT_EQ(EBADF, errno);
+    EXPECT_FALSE(writer.Close());
+    EXPECT_EQ("", Contents());
+  }
+}
+
+}  // anonymous namespace
@@ -17,28 +17,284 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <memory>
 #include <vector>
 
+#include "disk_interface.h"
 #include "graph.h"
 #include "state.h"
+#include "thread_pool.h"
 #include "util.h"
 #include "version.h"
 
 using namespace std;
 
+namespace {
+
+/// A path evaluated and canonicalized while parsing, added to the State
+/// when its statement is merged.
+struct StagedPath {
+  StagedPath() : slash_bits(0) {}
+  string path;
+  uint64_t slash_bits;
+};
+
+/// Evaluate \a paths in \a env.  Empty paths are kept, and only reported
+/// once merged, so that errors come out in the order they always have.
+void StagePaths(const vector<EvalString>& paths, Env* env,
+                vector<StagedPath>* staged) {
+  staged->resize(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    StagedPath& path = (*staged)[i];
+    path.path = paths[i].Evaluate(env);
+    if (!path.path.empty())
+      CanonicalizePath(&path.path, &path.slash_bits);
+  }
+}
+
+/// Files are split into chunks of about this size.  Runs of build and
+/// default statements shorter than the minimum are parsed in place, so that
+/// files which change the scope often are not snapshotted as often.
+const size_t kChunkBytes = 1 << 20;
+const size_t kMinChunkBytes = kChunkBytes / 4;
+
+/// A range of a file to parse, on a worker if it is a chunk.
+struct Span {
+  Span(size_t begin, size_t end, bool chunk)
+      : begin(begin), end(end), chunk(chunk) {}
+  size_t begin;
+  size_t end;
+  bool chunk;
+};
+
+bool StartsWith(StringPiece input, size_t pos, const char* prefix) {
+  const size_t len = strlen(prefix);
+  return input.len_ - pos >= len &&
+         memcmp(input.str_ + pos, prefix, len) == 0;
+}
+
+/// Split \a input into chunks of build and default statements, which only
+/// read the scope, and the spans between them.  Top-level statements start
+/// at the start of a line, unless the newline before it is escaped by an
+/// odd number of '$'s outside a comment.
+void SplitStatements(StringPiece input, vector<Span>* spans) {
+  // The lexer stops at a NUL, so the spans do too.
+  const char* nul =
+      static_cast<const char*>(memchr(input.str_, '\0', input.len_));
+  const size_t size = nul ? nul - input.str_ : input.len_;
+  size_t done = 0;
+  size_t run = string::npos;  // Where the current run of chunks starts.
+  auto end_run = [&](size_t pos, size_t min_bytes) {
+    if (run == string::npos || pos - run < min_bytes)
+      return;
+    if (done < run)
+      spans->push_back(Span(done, run, false));
+    spans->push_back(Span(run, pos, true));
+    done = pos;
+    run = string::npos;
+  };
+
+  for (size_t pos = 0; pos < size;) {
+    const char c = input.str_[pos];
+    if (c != ' ' && c != '#' && c != '\r' && c != '\n') {
+      if (StartsWith(input, pos, "build ") ||
+          StartsWith(input, pos, "default ")) {
+        end_run(pos, kChunkBytes);
+        if (run == string::npos)
+          run = pos;
+      } else {
+        end_run(pos, kMinChunkBytes);
+        run = string::npos;
+      }
+    }
+
+    // Find the next line that is not a continuation of this one.  A
+    // comment ends at its newline, '$' or not.
+    size_t first = pos;
+    while (first < size && input.str_[first] == ' ')
+      ++first;
+    const bool comment = first < size && input.str_[first] == '#';
+    for (;;) {
+      const char* found = static_cast<const char*>(
+          memchr(input.str_ + pos, '\n', size - pos));
+      if (!found) {
+        pos = size;
+        break;
+      }
+      size_t newline = found - input.str_;
+      size_t dollars = newline;
+      if (dollars > pos && input.str_[dollars - 1] == '\r')
+        --dollars;
+      size_t escape = dollars;
+      while (escape > pos && input.str_[escape - 1] == '$')
+        --escape;
+      pos = newline + 1;
+      if (comment || (dollars - escape) % 2 == 0)
+        break;
+    }
+  }
+  end_run(size, kMinChunkBytes);
+  if (done < size)
+    spans->push_back(Span(done, size, false));
+}
+
+}  // namespace
+
+/// A build statement, with everything that depends on its scope evaluated.
+struct ManifestParser::StagedEdge {
+  StagedEdge()
+      : rule(NULL), env(NULL), implicit_outs(0), implicit(0), order_only(0) {}
+  const Rule* rule;
+  BindingEnv* env;
+  string pool_name;
+  vector<StagedPath> outs;
+  vector<StagedPath> ins;
+  vector<StagedPath> validations;
+  int implicit_outs;
+  int implicit;
+  int order_only;
+  /// Empty if the edge has no dyndep binding.
+  StagedPath dyndep;
+};
+
+/// A statement whose effect on the State waits for Merge().
+struct ManifestParser::Statement {
+  enum Kind { POOL, EDGE, DEFAULT, SUBNINJA, INCLUDE, CHUNK, ERROR };
+
+  Statement(Kind kind, const Lexer& lexer)
+      : kind(kind), lexer(lexer), depth(-1), edge(NULL), file(NULL) {}
+
+  Kind kind;
+  /// Where the statement was read, for errors found when merging it.
+  Lexer lexer;
+  /// The pool name, the canonical default path or the error message.
+  string text;
+  /// The pool depth; -1 if the rest of the declaration failed to parse.
+  int depth;
+  StagedEdge* edge;
+  /// The subninja, included file or chunk of this file.
+  StagedFile* file;
+};
+
+/// The statements of one file.  The lexers of its statements point into
+/// its path and contents.
+struct ManifestParser::StagedFile {
+  StagedFile() : env(NULL), parent_env(NULL) {}
+
+  ~StagedFile() {
+    Clear();
+    // The scope of a subninja was parsed against a snapshot of its parent;
+    // from now on it sees its parent's bindings as they end up.
+    if (env)
+      env->set_parent(parent_env);
+    for (vector<BindingEnv*>::iterator e = snapshots.begin();
+         e != snapshots.end(); ++e)
+      delete *e;
+  }
+
+  /// Drop the statements, once merged.
+  void Clear() {
+    for (vector<Statement>::iterator s = statements.begin();
+         s != statements.end(); ++s) {
+      delete s->edge;
+      delete s->file;
+    }
+    statements.clear();
+  }
+
+  string path;
+  FileContents contents;
+  /// The scope of a subninja and its enclosing one; NULL for includes.
+  BindingEnv* env;
+  BindingEnv* parent_env;
+  vector<Statement> statements;
+  /// Snapshots taken for the subninjas of this file.
+  vector<BindingEnv*> snapshots;
+};
+
 ManifestParser::ManifestParser(State* state, FileReader* file_reader,
                                ManifestParserOptions options)
     : Parser(state, file_reader),
-      options_(options), quiet_(false) {
+      options_(options), quiet_(false), concurrent_(false), file_(NULL),
+      snapshot_(NULL), workers_(NULL) {
   env_ = &state->bindings_;
+  scope_ = env_;
 }
 
-bool ManifestParser::Parse(const string& filename, const string& input,
+bool ManifestParser::Parse(const string& filename, StringPiece input,
                            string* err) {
+  StagedFile root;
+  ThreadPool* workers = NULL;
+  concurrent_ = options_.parse_threads_ > 1 ||
+                (options_.parse_threads_ == 0 && GetProcessorCount() > 1);
+  file_ = &root;
+  workers_ = &workers;
+  snapshot_ = NULL;
+  if (!ParseStatements(filename, input, err)) {
+    root.statements.push_back(Statement(Statement::ERROR, lexer_));
+    root.statements.back().text = *err;
+  }
+  // Stops the workers once every subninja is parsed.
+  delete workers;
+  file_ = NULL;
+  workers_ = NULL;
+  return Merge(&root, err);
+}
+
+bool ManifestParser::ParseStatements(const string& filename,
+                                     StringPiece input, string* err) {
+  if (concurrent_ && input.len_ >= 2 * kChunkBytes)
+    return ParseChunks(filename, input, err);
   lexer_.Start(filename, input);
+  return ParseToEnd(err);
+}
 
+bool ManifestParser::ParseChunks(const string& filename, StringPiece input,
+                                 string* err) {
+  vector<Span> spans;
+  SplitStatements(input, &spans);
+  for (vector<Span>::const_iterator span = spans.begin(); span != spans.end();
+       ++span) {
+    lexer_.Start(filename, input, span->begin, span->end);
+    if (!span->chunk) {
+      if (!ParseToEnd(err))
+        return false;
+      continue;
+    }
+
+    StagedFile* file = new StagedFile;
+    file_->statements.push_back(Statement(Statement::CHUNK, lexer_));
+    file_->statements.back().file = file;
+    shared_ptr<ManifestParser> subparser = NewSubparser(file);
+    subparser->env_ = ScopeSnapshot();
+    subparser->scope_ = scope_;
+    subparser->lexer_ = lexer_;
+    if (!*workers_)
+      *workers_ = new ThreadPool(options_.parse_threads_);
+    (*workers_)->Add([subparser, file]() {
+      string err;
+      if (!subparser->ParseToEnd(&err)) {
+        file->statements.push_back(Statement(Statement::ERROR,
+                                             subparser->lexer_));
+        file->statements.back().text = err;
+      }
+    });
+  }
+  return true;
+}
+
+bool ManifestParser::ParseToEnd(string* err) {
   for (;;) {
+    // With nothing parsed concurrently, statements are merged as they are
+    // parsed, while what they refer to is still in cache.
+    if (!concurrent_ && !file_->statements.empty()) {
+      bool merged = Merge(file_, err);
+      file_->Clear();
+      if (!merged)
+        return false;
+    }
     Lexer::Token token = lexer_.ReadToken();
     switch (token) {
     case Lexer::POOL:
@@ -69,6 +325,7 @@ bool ManifestParser::Parse(const string& filename, const string& input,
       if (name == "ninja_required_version")
         CheckNinjaVersion(value);
       env_->AddBinding(name, value);
+      snapshot_ = NULL;
       break;
     }
     case Lexer::INCLUDE:
@@ -103,8 +360,10 @@ bool ManifestParser::ParsePool(string* err) {
   if (!ExpectToken(Lexer::NEWLINE, err))
     return false;
 
-  if (state_->LookupPool(name) != NULL)
-    return lexer_.Error("duplicate pool '" + name + "'", err);
+  // Checked for duplicates when merged, even if the rest fails to parse.
+  file_->statements.push_back(Statement(Statement::POOL, lexer_));
+  const size_t index = file_->statements.size() - 1;
+  file_->statements[index].text = name;
 
   int depth = -1;
 
@@ -127,7 +386,7 @@ bool ManifestParser::ParsePool(string* err) {
   if (depth < 0)
     return lexer_.Error("expected 'depth =' line", err);
 
-  state_->AddPool(new Pool(name, depth));
+  file_->statements[index].depth = depth;
   return true;
 }
 
@@ -170,6 +429,7 @@ bool ManifestParser::ParseRule(string* err) {
     return lexer_.Error("expected 'command =' line", err);
 
   env_->AddRule(rule);
+  snapshot_ = NULL;
   return true;
 }
 
@@ -191,14 +451,13 @@ bool ManifestParser::ParseDefault(string* err) {
     return lexer_.Error("expected target name", err);
 
   do {
-    string path = eval.Evaluate(env_);
-    if (path.empty())
-      return lexer_.Error("empty path", err);
-    uint64_t slash_bits;  // Unused because this only does lookup.
-    CanonicalizePath(&path, &slash_bits);
-    std::string default_err;
-    if (!state_->AddDefault(path, &default_err))
-      return lexer_.Error(default_err, err);
+    Statement statement(Statement::DEFAULT, lexer_);
+    statement.text = eval.Evaluate(env_);
+    if (!statement.text.empty()) {
+      uint64_t slash_bits;  // Unused because this only does lookup.
+      CanonicalizePath(&statement.text, &slash_bits);
+    }
+    file_->statements.push_back(statement);
 
     eval.Clear();
     if (!lexer_.ReadPath(&eval, err))
@@ -318,26 +577,206 @@ bool ManifestParser::ParseEdge(string* err) {
     has_indent_token = lexer_.PeekToken(Lexer::INDENT);
   }
 
-  Edge* edge = state_->AddEdge(rule);
-  edge->env_ = env;
 
-  string pool_name = edge->GetBinding("pool");
-  if (!pool_name.empty()) {
-    Pool* pool = state_->LookupPool(pool_name);
+  StagedEdge* staged = new StagedEdge;
+  staged->rule = rule;
+  staged->env = env;
+  file_->statements.push_back(Statement(Statement::EDGE, lexer_));
+  file_->statements.back().edge = staged;
+
+  // Evaluate the pool as on a new edge, before it has any paths.
+  Edge probe;
+  probe.rule_ = rule;
+  probe.env_ = env;
+  staged->pool_name = probe.GetBinding("pool");
+
+  StagePaths(outs, env, &staged->outs);
+  staged->implicit_outs = implicit_outs;
+  StagePaths(ins, env, &staged->ins);
+  staged->implicit = implicit;
+  staged->order_only = order_only;
+  StagePaths(validations, env, &staged->validations);
+
+  // The dyndep binding is evaluated once the edge has its paths, which only
+  // matters if it comes from the rule: other bindings were evaluated where
+  // they were declared.  Stand-in nodes give it the explicit paths.
+  vector<Node*> nodes;
+  if (rule->GetBinding("dyndep")) {
+    for (size_t i = 0; i < staged->outs.size() - implicit_outs; ++i) {
+      nodes.push_back(new Node(staged->outs[i].path,
+                               staged->outs[i].slash_bits));
+      probe.outputs_.push_back(nodes.back());
+    }
+    for (size_t i = 0; i < staged->ins.size() - implicit - order_only; ++i) {
+      nodes.push_back(new Node(staged->ins[i].path,
+                               staged->ins[i].slash_bits));
+      probe.inputs_.push_back(nodes.back());
+    }
+  }
+  staged->dyndep.path = probe.GetUnescapedDyndep();
+  for (vector<Node*>::iterator n = nodes.begin(); n != nodes.end(); ++n)
+    delete *n;
+  if (!staged->dyndep.path.empty())
+    CanonicalizePath(&staged->dyndep.path, &staged->dyndep.slash_bits);
+
+  // Everything else is evaluated when the edge is used, in its scope as
+  // it ends up.
+  if (env == env_)
+    staged->env = scope_;
+  else
+    env->set_parent(scope_);
+  return true;
+}
+
+bool ManifestParser::ParseFileInclude(bool new_scope, string* err) {
+  EvalString eval;
+  if (!lexer_.ReadPath(&eval, err))
+    return false;
+  string path = eval.Evaluate(env_);
+
+  StagedFile* file = new StagedFile;
+  file->path = path;
+  file_->statements.push_back(Statement(
+      new_scope ? Statement::SUBNINJA : Statement::INCLUDE, lexer_));
+  file_->statements.back().file = file;
+
+  unique_ptr<ManifestParser> subparser = NewSubparser(file);
+  if (new_scope) {
+    file->env = new BindingEnv(concurrent_ ? ScopeSnapshot() : env_);
+    file->parent_env = env_;
+    subparser->env_ = file->env;
+    subparser->scope_ = file->env;
+  } else {
+    subparser->env_ = env_;
+    subparser->scope_ = scope_;
+  }
+
+  // Subninjas only read their snapshot of this scope, so they can be
+  // parsed while this file is.  Includes add to this scope, so they are
+  // parsed in place.
+  if (new_scope && !*workers_ && concurrent_)
+    *workers_ = new ThreadPool(options_.parse_threads_);
+  const Lexer at = lexer_;
+  if (new_scope && *workers_) {
+    shared_ptr<ManifestParser> worker(std::move(subparser));
+    (*workers_)->Add([worker, file, at]() {
+      ParseIncludedFile(worker.get(), file, at);
+    });
+  } else {
+    ParseIncludedFile(subparser.get(), file, at);
+    if (!new_scope)
+      snapshot_ = NULL;
+  }
+
+  if (!ExpectToken(Lexer::NEWLINE, err))
+    return false;
+
+  return true;
+}
+
+unique_ptr<ManifestParser> ManifestParser::NewSubparser(StagedFile* file) {
+  unique_ptr<ManifestParser> subparser(
+      new ManifestParser(state_, file_reader_, options_));
+  subparser->quiet_ = quiet_;
+  subparser->concurrent_ = concurrent_;
+  subparser->file_ = file;
+  subparser->workers_ = workers_;
+  return subparser;
+}
+
+void ManifestParser::ParseIncludedFile(ManifestParser* parser,
+                                       StagedFile* file, const Lexer& at) {
+  string err;
+  string read_err;
+  if (parser->file_reader_->MapFile(file->path, &file->contents,
+                                    &read_err) != FileReader::Okay) {
+    err = "loading '" + file->path + "': " + read_err;
+    Lexer lexer = at;
+    lexer.Error(string(err), &err);
+  } else if (parser->ParseStatements(file->path,
+                                     file->contents.AsStringPiece(), &err)) {
+    return;
+  }
+  file->statements.push_back(Statement(Statement::ERROR, at));
+  file->statements.back().text = err;
+}
+
+BindingEnv* ManifestParser::ScopeSnapshot() {
+  if (snapshot_)
+    return snapshot_;
+  // Enclosing scopes are snapshots already, or do not change any more.
+  snapshot_ = new BindingEnv(env_->parent());
+  const map<string, string>& bindings = env_->GetBindings();
+  for (map<string, string>::const_iterator b = bindings.begin();
+       b != bindings.end(); ++b)
+    snapshot_->AddBinding(b->first, b->second);
+  const map<string, const Rule*>& rules = env_->GetRules();
+  for (map<string, const Rule*>::const_iterator r = rules.begin();
+       r != rules.end(); ++r)
+    snapshot_->AddRule(r->second);
+  file_->snapshots.push_back(snapshot_);
+  return snapshot_;
+}
+
+bool ManifestParser::Merge(StagedFile* file, string* err) {
+  for (vector<Statement>::iterator s = file->statements.begin();
+       s != file->statements.end(); ++s) {
+    switch (s->kind) {
+    case Statement::POOL:
+      if (state_->LookupPool(s->text) != NULL)
+        return s->lexer.Error("duplicate pool '" + s->text + "'", err);
+      if (s->depth >= 0)
+        state_->AddPool(new Pool(s->text, s->depth));
+      break;
+    case Statement::EDGE:
+      if (!MergeEdge(*s, err))
+        return false;
+      // Merged edges need their staged paths no more.
+      delete s->edge;
+      s->edge = NULL;
+      break;
+    case Statement::DEFAULT: {
+      if (s->text.empty())
+        return s->lexer.Error("empty path", err);
+      std::string default_err;
+      if (!state_->AddDefault(s->text, &default_err))
+        return s->lexer.Error(default_err, err);
+      break;
+    }
+    case Statement::SUBNINJA:
+    case Statement::INCLUDE:
+    case Statement::CHUNK:
+      if (!Merge(s->file, err))
+        return false;
+      break;
+    case Statement::ERROR:
+      *err = s->text;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ManifestParser::MergeEdge(Statement& statement, string* err) {
+  const StagedEdge& staged = *statement.edge;
+  Lexer& lexer = statement.lexer;
+  Edge* edge = state_->AddEdge(staged.rule);
+  edge->env_ = staged.env;
+
+  if (!staged.pool_name.empty()) {
+    Pool* pool = state_->LookupPool(staged.pool_name);
     if (pool == NULL)
-      return lexer_.Error("unknown pool name '" + pool_name + "'", err);
+      return lexer.Error("unknown pool name '" + staged.pool_name + "'", err);
     edge->pool_ = pool;
   }
 
-  edge->outputs_.reserve(outs.size());
-  for (size_t i = 0, e = outs.size(); i != e; ++i) {
-    string path = outs[i].Evaluate(env);
-    if (path.empty())
-      return lexer_.Error("empty path", err);
-    uint64_t slash_bits;
-    CanonicalizePath(&path, &slash_bits);
-    if (!state_->AddOut(edge, path, slash_bits, err)) {
-      lexer_.Error(std::string(*err), err);
+  edge->outputs_.reserve(staged.outs.size());
+  for (size_t i = 0, e = staged.outs.size(); i != e; ++i) {
+    const StagedPath& path = staged.outs[i];
+    if (path.path.empty())
+      return lexer.Error("empty path", err);
+    if (!state_->AddOut(edge, path.path, path.slash_bits, err)) {
+      lexer.Error(std::string(*err), err);
       return false;
     }
   }
@@ -349,29 +788,24 @@ bool ManifestParser::ParseEdge(string* err) {
     delete edge;
     return true;
   }
-  edge->implicit_outs_ = implicit_outs;
-
-  edge->inputs_.reserve(ins.size());
-  for (vector<EvalString>::iterator i = ins.begin(); i != ins.end(); ++i) {
-    string path = i->Evaluate(env);
-    if (path.empty())
-      return lexer_.Error("empty path", err);
-    uint64_t slash_bits;
-    CanonicalizePath(&path, &slash_bits);
-    state_->AddIn(edge, path, slash_bits);
+  edge->implicit_outs_ = staged.implicit_outs;
+
+  edge->inputs_.reserve(staged.ins.size());
+  for (vector<StagedPath>::const_iterator i = staged.ins.begin();
+       i != staged.ins.end(); ++i) {
+    if (i->path.empty())
+      return lexer.Error("empty path", err);
+    state_->AddIn(edge, i->path, i->slash_bits);
   }
-  edge->implicit_deps_ = implicit;
-  edge->order_only_deps_ = order_only;
-
-  edge->validations_.reserve(validations.size());
-  for (std::vector<EvalString>::iterator v = validations.begin();
-      v != validations.end(); ++v) {
-    string path = v->Evaluate(env);
-    if (path.empty())
-      return lexer_.Error("empty path", err);
-    uint64_t slash_bits;
-    CanonicalizePath(&path, &slash_bits);
-    state_->AddValidation(edge, path, slash_bits);
+  edge->implicit_deps_ = staged.implicit;
+  edge->order_only_deps_ = staged.order_only;
+
+  edge->validations_.reserve(staged.validations.size());
+  for (vector<StagedPath>::const_iterator v = staged.validations.begin();
+       v != staged.validations.end(); ++v) {
+    if (v->path.empty())
+      return lexer.Error("empty path", err);
+    state_->AddValidation(edge, v->path, v->slash_bits);
   }
 
   if (options_.phony_cycle_action_ == kPhonyCycleActionWarn &&
@@ -388,7 +822,7 @@ bool ManifestParser::ParseEdge(string* err) {
       if (!quiet_) {
         Warning("phony target '%s' names itself as an input; "
                 "ignoring [-w phonycycle=warn]",
-                out->path().c_str());
+                out->path_c_str());
       }
     }
   }
@@ -396,41 +830,17 @@ bool ManifestParser::ParseEdge(string* err) {
   // Lookup, validate, and save any dyndep binding.  It will be used later
   // to load generated dependency information dynamically, but it must
   // be one of our manifest-specified inputs.
-  string dyndep = edge->GetUnescapedDyndep();
-  if (!dyndep.empty()) {
-    uint64_t slash_bits;
-    CanonicalizePath(&dyndep, &slash_bits);
-    edge->dyndep_ = state_->GetNode(dyndep, slash_bits);
+  const StagedPath& dyndep = staged.dyndep;
+  if (!dyndep.path.empty()) {
+    edge->dyndep_ = state_->GetNode(dyndep.path, dyndep.slash_bits);
     edge->dyndep_->set_dyndep_pending(true);
     vector<Node*>::iterator dgi =
       std::find(edge->inputs_.begin(), edge->inputs_.end(), edge->dyndep_);
     if (dgi == edge->inputs_.end()) {
-      return lexer_.Error("dyndep '" + dyndep + "' is not an input", err);
+      return lexer.Error("dyndep '" + dyndep.path + "' is not an input", err);
     }
     assert(!edge->dyndep_->generated_by_dep_loader());
   }
 
   return true;
 }
-
-bool ManifestParser::ParseFileInclude(bool new_scope, string* err) {
-  EvalString eval;
-  if (!lexer_.ReadPath(&eval, err))
-    return false;
-  string path = eval.Evaluate(env_);
-
-  ManifestParser subparser(state_, file_reader_, options_);
-  if (new_scope) {
-    subparser.env_ = new BindingEnv(env_);
-  } else {
-    subparser.env_ = env_;
-  }
-
-  if (!subparser.Load(path, err, &lexer_))
-    return false;
-
-  if (!ExpectToken(Lexer::NEWLINE, err))
-    return false;
-
-  return true;
-}
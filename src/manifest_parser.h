@@ -15,10 +15,13 @@
 #ifndef NINJA_MANIFEST_PARSER_H_
 #define NINJA_MANIFEST_PARSER_H_
 
+#include <memory>
+
 #include "parser.h"
 
 struct BindingEnv;
 struct EvalString;
+struct ThreadPool;
 
 enum DupeEdgeAction {
   kDupeEdgeActionWarn,
@@ -32,9 +35,23 @@ enum PhonyCycleAction {
 
 struct ManifestParserOptions {
   PhonyCycleAction phony_cycle_action_ = kPhonyCycleActionWarn;
+  /// Threads to parse subninjas and chunks of large files on: 0 for one
+  /// per processor, 1 to parse everything in place.  CNobi stages the
+  /// edges of large manifests on as many.
+  int parse_threads_ = 0;
 };
 
 /// Parses .ninja files.
+///
+/// Statements are parsed into a list first and applied to the State once
+/// every file is parsed, in declaration order.  That lets subninjas, which
+/// only read their enclosing scopes, be parsed concurrently on worker
+/// threads, each against a snapshot of its parent scope as it was at the
+/// subninja line.  The FileReader must therefore allow concurrent reads.
+/// Large files are split where runs of build and default statements start,
+/// and those chunks are parsed on the workers the same way; the statements
+/// between them, which may change the scope, are parsed in place.
+/// Parsing serially, statements are merged as soon as they are parsed.
 struct ManifestParser : public Parser {
   ManifestParser(State* state, FileReader* file_reader,
                  ManifestParserOptions options = ManifestParserOptions());
@@ -46,10 +63,27 @@ struct ManifestParser : public Parser {
   }
 
 private:
-  /// Parse a file, given its contents as a string.
-  bool Parse(const std::string& filename, const std::string& input,
+  struct StagedEdge;
+  struct StagedFile;
+  struct Statement;
+
+  /// Parse a file, given its contents as a string, and the files it
+  /// includes, then add what they declare to the State.
+  bool Parse(const std::string& filename, StringPiece input,
              std::string* err);
 
+  /// Parse \a input into the statements of file_, without touching the
+  /// State.  On a syntax error, fill in \a err and return false.
+  bool ParseStatements(const std::string& filename, StringPiece input,
+                       std::string* err);
+
+  /// ParseStatements() for a large file, in chunks.
+  bool ParseChunks(const std::string& filename, StringPiece input,
+                   std::string* err);
+
+  /// Parse statements until lexer_ reads TEOF.
+  bool ParseToEnd(std::string* err);
+
   /// Parse various statement types.
   bool ParsePool(std::string* err);
   bool ParseRule(std::string* err);
@@ -60,9 +94,38 @@ private:
   /// Parse either a 'subninja' or 'include' line.
   bool ParseFileInclude(bool new_scope, std::string* err);
 
+  /// A parser adding statements to \a file, sharing the workers of this one.
+  std::unique_ptr<ManifestParser> NewSubparser(StagedFile* file);
+
+  /// Read \a file and parse it with \a parser, which file_ of points to.
+  /// \a at is the statement including it, for errors loading it.
+  static void ParseIncludedFile(ManifestParser* parser, StagedFile* file,
+                                const Lexer& at);
+
+  /// A copy of the bindings and rules of env_, whose parent is that of
+  /// env_: the scope a subninja sees, as it was at the subninja line,
+  /// while this file is parsed on.  Shared until env_ changes.
+  BindingEnv* ScopeSnapshot();
+
+  /// Apply the statements of \a file to the State, in order.
+  bool Merge(StagedFile* file, std::string* err);
+  bool MergeEdge(Statement& statement, std::string* err);
+
   BindingEnv* env_;
+  /// The scope edges are declared in.  This is env_, except in chunks, which
+  /// are parsed against a snapshot of it.
+  BindingEnv* scope_;
   ManifestParserOptions options_;
   bool quiet_;
+  /// Whether subninjas are parsed on worker threads.
+  bool concurrent_;
+  /// The file being parsed, which statements are added to.
+  StagedFile* file_;
+  /// See ScopeSnapshot(); NULL when it has to be taken anew.
+  BindingEnv* snapshot_;
+  /// The workers parsing subninjas, shared by the parsers of one Parse()
+  /// and started on first use.  NULL if subninjas are parsed in place.
+  ThreadPool** workers_;
 };
 
 #endif  // NINJA_MANIFEST_PARSER_H_
@@ -57,11 +57,59 @@ bool WriteFakeManifests(const string& dir, string* err) {
   return exit_code == 0;
 }
 
-int LoadManifests(bool measure_command_evaluation) {
+/// Write one flat manifest with \a num_edges compile edges, as the
+/// generators of very large builds do, unless it exists already.
+bool WriteFlatManifest(const string& dir, int num_edges, string* err) {
+  RealDiskInterface disk_interface;
+  TimeStamp mtime = disk_interface.Stat(dir + "/build.ninja", err);
+  if (mtime != 0)  // 0 means that the file doesn't exist yet.
+    return mtime != -1;
+
+  printf("Creating manifest data..."); fflush(stdout);
+  string manifest =
+"cflags = -O2 -Wall -Werror -fno-exceptions\n"
+"rule cc\n"
+"  command = clang++ -MMD -MF $out.d $cflags $defines -c $in -o $out\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"rule ar\n"
+"  command = rm -f $out && ar crs $out $in\n";
+  const int kObjectsPerLibrary = 100;
+  char line[256];
+  string objects;
+  for (int i = 0; i < num_edges; ++i) {
+    int library = i / kObjectsPerLibrary;
+    snprintf(line, sizeof(line),
+             "build obj/lib%d/source_file_%d.o: cc ../src/lib%d/"
+             "source_file_%d.cc || gen/lib%d.stamp\n"
+             "  defines = -DLIB%d\n",
+             library, i, library, i, library, library);
+    manifest += line;
+    snprintf(line, sizeof(line), " obj/lib%d/source_file_%d.o", library, i);
+    objects += line;
+    if ((i + 1) % kObjectsPerLibrary == 0 || i + 1 == num_edges) {
+      snprintf(line, sizeof(line),
+               "build gen/lib%d.stamp: phony\n"
+               "build lib/lib%d.a: ar", library, library);
+      manifest += line + objects + "\n";
+      objects.clear();
+    }
+  }
+  if (!disk_interface.MakeDirs(dir + "/build.ninja") ||
+      !disk_interface.WriteFile(dir + "/build.ninja", manifest)) {
+    *err = "Failed to write " + dir + "/build.ninja";
+    return false;
+  }
+  printf("done.\n");
+  return true;
+}
+
+int LoadManifests(bool measure_command_evaluation,
+                  const ManifestParserOptions& options) {
   string err;
   RealDiskInterface disk_interface;
   State state;
-  ManifestParser parser(&state, &disk_interface);
+  ManifestParser parser(&state, &disk_interface, options);
   if (!parser.Load("build.ninja", &err)) {
     fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
     exit(1);
@@ -78,46 +126,72 @@ int LoadManifests(bool measure_command_evaluation) {
 
 int main(int argc, char* argv[]) {
   bool measure_command_evaluation = true;
+  bool flat = false;
   int opt;
-  while ((opt = getopt(argc, argv, const_cast<char*>("fh"))) != -1) {
+  while ((opt = getopt(argc, argv, const_cast<char*>("fch"))) != -1) {
     switch (opt) {
     case 'f':
       measure_command_evaluation = false;
       break;
+    case 'c':
+      flat = true;
+      break;
     case 'h':
     default:
       printf("usage: manifest_parser_perftest\n"
 "\n"
 "options:\n"
 "  -f     only measure manifest load time, not command evaluation time\n"
+"  -c     measure parsing one large flat manifest in chunks, on 1, 2, 4...\n"
+"         threads up to the number of processors\n"
              );
     return 1;
     }
   }
 
-  const char kManifestDir[] = "build/manifest_perftest";
+  const char* manifest_dir =
+      flat ? "build/manifest_perftest_flat" : "build/manifest_perftest";
 
   string err;
-  if (!WriteFakeManifests(kManifestDir, &err)) {
+  if (!(flat ? WriteFlatManifest(manifest_dir, 300000, &err)
+             : WriteFakeManifests(manifest_dir, &err))) {
     fprintf(stderr, "Failed to write test data: %s\n", err.c_str());
     return 1;
   }
 
-  if (chdir(kManifestDir) < 0)
+  if (chdir(manifest_dir) < 0)
     Fatal("chdir: %s", strerror(errno));
 
-  const int kNumRepetitions = 5;
-  vector<int> times;
-  for (int i = 0; i < kNumRepetitions; ++i) {
-    int64_t start = GetTimeMillis();
-    int optimization_guard = LoadManifests(measure_command_evaluation);
-    int delta = (int)(GetTimeMillis() - start);
-    printf("%dms (hash: %x)\n", delta, optimization_guard);
-    times.push_back(delta);
+  // Without -c, parse with the default of one thread per processor.
+  vector<int> thread_counts(1, 0);
+  if (flat) {
+    thread_counts[0] = 1;
+    for (int threads = 2; threads <= GetProcessorCount(); threads *= 2)
+      thread_counts.push_back(threads);
   }
 
-  int min = *min_element(times.begin(), times.end());
-  int max = *max_element(times.begin(), times.end());
-  float total = accumulate(times.begin(), times.end(), 0.0f);
-  printf("min %dms  max %dms  avg %.1fms\n", min, max, total / times.size());
+  for (size_t t = 0; t < thread_counts.size(); ++t) {
+    ManifestParserOptions options;
+    options.parse_threads_ = thread_counts[t];
+    if (flat)
+      printf("%d thread%s:\n", options.parse_threads_,
+             options.parse_threads_ == 1 ? "" : "s");
+
+    const int kNumRepetitions = 5;
+    vector<int> times;
+    for (int i = 0; i < kNumRepetitions; ++i) {
+      int64_t start = GetTimeMillis();
+      int optimization_guard =
+          LoadManifests(measure_command_evaluation, options);
+      int delta = (int)(GetTimeMillis() - start);
+      printf("%dms (hash: %x)\n", delta, optimization_guard);
+      times.push_back(delta);
+    }
+
+    int min = *min_element(times.begin(), times.end());
+    int max = *max_element(times.begin(), times.end());
+    float total = accumulate(times.begin(), times.end(), 0.0f);
+    printf("min %dms  max %dms  avg %.1fms\n", min, max,
+           total / times.size());
+  }
 }
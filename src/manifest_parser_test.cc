@@ -18,6 +18,7 @@
 #include <vector>
 
 #include "graph.h"
+#include "graph_fingerprint.h"
 #include "state.h"
 #include "test.h"
 
@@ -863,6 +864,59 @@ TEST_F(ParserTest, SubNinja) {
   EXPECT_EQ("varref outer", state.edges_[2]->EvaluateCommand());
 }
 
+TEST_F(ParserTest, SubNinjaScope) {
+  // Paths and bindings in a subninja see the scope as it was at the
+  // subninja line, but commands are evaluated later and see the final one.
+  fs_.Create("test.ninja",
+    "dir = $var\n"
+    "build $dir/out: varref\n");
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule varref\n"
+"  command = varref $var\n"
+"var = before\n"
+"subninja test.ninja\n"
+"var = after\n"));
+
+  Node* node = state.LookupNode("before/out");
+  ASSERT_TRUE(node);
+  EXPECT_EQ("varref after", node->in_edge()->EvaluateCommand());
+}
+
+TEST_F(ParserTest, PoolInEarlierSubNinja) {
+  // Pools are global, so a later subninja may use one an earlier declares.
+  fs_.Create("pool.ninja",
+    "pool link\n"
+    "  depth = 2\n");
+  fs_.Create("use.ninja",
+    "rule ld\n"
+    "  command = ld\n"
+    "  pool = link\n"
+    "build out: ld\n");
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"subninja pool.ninja\n"
+"subninja use.ninja\n"));
+
+  Node* node = state.LookupNode("out");
+  ASSERT_TRUE(node && node->in_edge());
+  EXPECT_EQ("link", node->in_edge()->pool()->name());
+}
+
+TEST_F(ParserTest, SubNinjaErrorOrder) {
+  // Errors are reported in declaration order, however the subninjas were
+  // scheduled.
+  fs_.Create("first.ninja", "build\n");
+  fs_.Create("second.ninja", "rule\n");
+  ManifestParser parser(&state, &fs_);
+  string err;
+  EXPECT_FALSE(parser.ParseTest("subninja first.ninja\n"
+                                "subninja second.ninja\n"
+                                "build\n", &err));
+  EXPECT_EQ("first.ninja:1: expected path\n"
+            "build\n"
+            "     ^ near here"
+            , err);
+}
+
 TEST_F(ParserTest, MissingSubNinja) {
   ManifestParser parser(&state, &fs_);
   string err;
@@ -1136,3 +1190,116 @@ TEST_F(ParserTest, DyndepRuleInput) {
   EXPECT_TRUE(edge->dyndep_->dyndep_pending());
   EXPECT_EQ(edge->dyndep_->path(), "in");
 }
+
+namespace {
+
+/// A manifest large enough to be parsed in chunks, with statements that
+/// change the scope between runs of edges.
+string ChunkedManifest() {
+  string input =
+"rule cc\n"
+"  command = cc $flags $in -o $out\n"
+"flags = -O1\n";
+  char line[128];
+  for (int i = 0; i < 40000; ++i) {
+    if (i == 20000) {
+      input += "flags = -O2\n"
+               "rule ld\n"
+               "  command = ld $in -o $out\n"
+               "build app: ld out/obj/o0.o out/obj/o20000.o\n";
+    }
+    snprintf(line, sizeof(line),
+             "build out/obj/o%d.o: cc src/some/dir/s%d.c | out/gen/%d.h\n",
+             i, i, i % 100);
+    input += line;
+    if (i % 1000 == 0)
+      input += "  flags = $flags -g\n";
+    if (i % 7000 == 0)
+      input += "# A comment.\n\n";
+  }
+  input += "build out/gen/gen.h $\n"
+           "build out/gen/gen.c: phony\n"
+           "flags = -O3\n"
+           "default app\n";
+  return input;
+}
+
+}  // namespace
+
+TEST_F(ParserTest, Chunks) {
+  const string input = ChunkedManifest();
+  ManifestParserOptions options;
+  options.parse_threads_ = 2;
+  ManifestParser parser(&state, &fs_, options);
+  string err;
+  EXPECT_TRUE(parser.ParseTest(input, &err));
+  ASSERT_EQ("", err);
+  VerifyGraph(state);
+
+  State serial;
+  options.parse_threads_ = 1;
+  ManifestParser serial_parser(&serial, &fs_, options);
+  EXPECT_TRUE(serial_parser.ParseTest(input, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(GraphFingerprint::Of(serial), GraphFingerprint::Of(state));
+
+  // Edge bindings were evaluated in the scope where the edge is, commands
+  // in the final one.
+  ASSERT_EQ(40002u, state.edges_.size());
+  EXPECT_EQ("cc -O1 -g src/some/dir/s0.c -o out/obj/o0.o",
+            state.GetNode("out/obj/o0.o", 0)->in_edge()->EvaluateCommand());
+  EXPECT_EQ("cc -O2 -g src/some/dir/s20000.c -o out/obj/o20000.o",
+            state.GetNode("out/obj/o20000.o", 0)->in_edge()
+                ->EvaluateCommand());
+  EXPECT_EQ("cc -O3 src/some/dir/s39999.c -o out/obj/o39999.o",
+            state.GetNode("out/obj/o39999.o", 0)->in_edge()
+                ->EvaluateCommand());
+  EXPECT_TRUE(state.GetNode("build", 0)->in_edge());
+  ASSERT_EQ(1u, state.defaults_.size());
+  EXPECT_EQ("app", state.defaults_[0]->path());
+}
+
+TEST_F(ParserTest, ChunkAfterCommentEndingInDollar) {
+  // A '$' ending a comment does not continue it onto the rule after it.
+  string input = ChunkedManifest();
+  input.insert(input.find("build out/obj/o30000.o"),
+               "# Link everything: $\n"
+               "rule link\n"
+               "  command = link $in -o $out\n");
+  input += "build linked: link out/obj/o1.o\n";
+  ManifestParserOptions options;
+  options.parse_threads_ = 4;
+  ManifestParser parser(&state, &fs_, options);
+  string err;
+  EXPECT_TRUE(parser.ParseTest(input, &err));
+  ASSERT_EQ("", err);
+  VerifyGraph(state);
+
+  State serial;
+  options.parse_threads_ = 1;
+  ManifestParser serial_parser(&serial, &fs_, options);
+  EXPECT_TRUE(serial_parser.ParseTest(input, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(GraphFingerprint::Of(serial), GraphFingerprint::Of(state));
+  EXPECT_EQ("link out/obj/o1.o -o linked",
+            state.GetNode("linked", 0)->in_edge()->EvaluateCommand());
+}
+
+TEST_F(ParserTest, ChunkErrorOrder) {
+  // An error in an early chunk comes out before one in the statements
+  // parsed in place after it, with its line in the whole file.
+  string input = ChunkedManifest();
+  input.insert(input.find("build out/obj/o100.o"), "build: cc\n");
+  input += "rule\n";
+  for (int threads = 1; threads <= 2; ++threads) {
+    State state;
+    ManifestParserOptions options;
+    options.parse_threads_ = threads;
+    ManifestParser parser(&state, &fs_, options);
+    string err;
+    EXPECT_FALSE(parser.ParseTest(input, &err));
+    EXPECT_EQ("input:107: expected path\n"
+              "build: cc\n"
+              "     ^ near here", err);
+  }
+}
@@ -71,6 +71,7 @@ ScopedMetric::~ScopedMetric() {
 }
 
 Metric* Metrics::NewMetric(const string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
   Metric* metric = new Metric;
   metric->name = name;
   metric->count = 0;
@@ -91,14 +92,26 @@ void Metrics::Report() {
   for (vector<Metric*>::iterator i = metrics_.begin();
        i != metrics_.end(); ++i) {
     Metric* metric = *i;
-    uint64_t micros = TimerToMicros(metric->sum);
+    int count = metric->count;
+    uint64_t micros = TimerToMicros(metric->sum.load());
     double total = micros / (double)1000;
-    double avg = micros / (double)metric->count;
+    double avg = micros / (double)count;
     printf("%-*s\t%-6d\t%-8.1f\t%.1f\n", width, metric->name.c_str(),
-           metric->count, avg, total);
+           count, avg, total);
   }
 }
 
+double Metrics::TotalMillis(const string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  int64_t micros = 0;
+  for (vector<Metric*>::iterator i = metrics_.begin();
+       i != metrics_.end(); ++i) {
+    if ((*i)->name == name)
+      micros += TimerToMicros((*i)->sum.load());
+  }
+  return micros / 1000.0;
+}
+
 double Stopwatch::Elapsed() const {
   // Convert to micros after converting to double to minimize error.
   return 1e-6 * TimerToMicros(static_cast<double>(NowRaw() - started_));
@@ -15,6 +15,8 @@
 #ifndef NINJA_METRICS_H_
 #define NINJA_METRICS_H_
 
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -24,12 +26,13 @@
 /// various actions.  To use, see METRIC_RECORD below.
 
 /// A single metrics we're tracking, like "depfile load time".
+/// Code paths may be hit from several threads at once.
 struct Metric {
   std::string name;
   /// Number of times we've hit the code path.
-  int count;
+  std::atomic<int> count;
   /// Total time (in platform-dependent units) we've spent on the code path.
-  int64_t sum;
+  std::atomic<int64_t> sum;
 };
 
 /// A scoped object for recording a metric across the body of a function.
@@ -52,7 +55,12 @@ struct Metrics {
   /// Print a summary report to stdout.
   void Report();
 
+  /// Milliseconds spent in the metrics named \a name, summed over the
+  /// threads that hit them; 0 if none was hit.
+  double TotalMillis(const std::string& name);
+
 private:
+  std::mutex mutex_;
   std::vector<Metric*> metrics_;
 };
 
@@ -65,7 +65,7 @@ MissingDependencyScannerDelegate::~MissingDependencyScannerDelegate() {}
 
 void MissingDependencyPrinter::OnMissingDep(Node* node, const std::string& path,
                                             const Rule& generator) {
-  std::cout << "Missing dep: " << node->path() << " uses " << path
+  std::cout << "Missing dep: " << node->path_c_str() << " uses " << path
             << " (generated by " << generator.name() << ")\n";
 }
 
@@ -143,7 +143,8 @@ void MissingDependencyScanner::ProcessNodeDeps(Node* node, Node** dep_nodes,
           generated_nodes_.insert(dep_nodes[i]);
           generator_rules_.insert(&(*ne)->rule());
           missing_deps_rule_names.insert((*ne)->rule().name());
-          delegate_->OnMissingDep(node, dep_nodes[i]->path(), (*ne)->rule());
+          delegate_->OnMissingDep(node, dep_nodes[i]->path().AsString(),
+                                  (*ne)->rule());
         }
       }
     }
@@ -17,13 +17,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <chrono>
-
 
 #include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <string>
+#include <thread>
 
 #ifdef _WIN32
 #include "getopt.h"
@@ -37,17 +36,21 @@
 #include <unistd.h>
 #endif
 
+#include "arena.h"
 #include "browse.h"
 #include "build.h"
 #include "build_log.h"
 #include "deps_log.h"
 #include "clean.h"
 #include "cnobi.h"
+#include "cnobi_gen.h"
 #include "command_collector.h"
 #include "debug_flags.h"
 #include "depfile_parser.h"
 #include "disk_interface.h"
 #include "graph.h"
+#include "graph_fingerprint.h"
+#include "graph_snapshot.h"
 #include "graphviz.h"
 #include "json.h"
 #include "manifest_parser.h"
@@ -70,11 +73,79 @@ void CreateWin32MiniDump(_EXCEPTION_POINTERS* pep);
 
 namespace {
 
+/// Where the graph of a text manifest is saved between runs; see
+/// graph_snapshot.h.
+const char kGraphSnapshotPath[] = ".ninja_graph";
+
 bool ShouldUseCNobi(const string& filename) {
   return (filename.length() > 2 &&
           filename.substr(filename.length() - 2) == ".c");
 }
 
+/// The targets on the command line as canonical paths, for loaders that
+/// can leave out edges they do not need.  False if one is empty or names
+/// the first output of an edge using it ("foo^"), which takes every edge.
+bool CanonicalTargets(int argc, char** argv, vector<string>* targets) {
+  for (int i = 0; i < argc; ++i) {
+    string path = argv[i];
+    if (path.empty() || path[path.size() - 1] == '^')
+      return false;
+    uint64_t slash_bits;
+    CanonicalizePath(&path, &slash_bits);
+    targets->push_back(path);
+  }
+  return true;
+}
+
+/// Where the log named \a name goes for \a build_dir.
+string LogPath(const string& build_dir, const char* name) {
+  if (build_dir.empty())
+    return name;
+  return build_dir + "/" + name;
+}
+
+/// The builddir that \a manifest sets, going by the plain "builddir = dir"
+/// lines in its first 64 KiB: the value of the last one, or "" if there is
+/// none.  False if the value needs evaluating, or the file can't be read.
+/// This is only a guess: the binding may be further on, or in an included
+/// file.
+bool GuessBuildDir(const string& manifest, string* build_dir) {
+  FILE* f = fopen(manifest.c_str(), "rb");
+  if (!f)
+    return false;
+  char buf[64 << 10];
+  size_t len = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+
+  build_dir->clear();
+  const char kBinding[] = "builddir";
+  const char* end = buf + len;
+  for (const char* line = buf; line < end;) {
+    const char* eol = static_cast<const char*>(memchr(line, '\n', end - line));
+    if (!eol)
+      eol = end;
+    const char* p = line;
+    line = eol + 1;
+    if ((size_t)(eol - p) < sizeof(kBinding) ||
+        memcmp(p, kBinding, sizeof(kBinding) - 1) != 0)
+      continue;
+    p += sizeof(kBinding) - 1;
+    while (p < eol && *p == ' ')
+      ++p;
+    if (p == eol || *p != '=')
+      continue;
+    ++p;
+    while (p < eol && *p == ' ')
+      ++p;
+    if (eol > p && eol[-1] == '\r')
+      --eol;
+    if (memchr(p, '$', eol - p))
+      return false;
+    build_dir->assign(p, eol - p);
+  }
+  return true;
+}
+
 struct Tool;
 
 /// Command-line options.
@@ -98,6 +169,7 @@ struct NinjaMain : public BuildLogUser {
   NinjaMain(const char* ninja_command, const BuildConfig& config) :
       ninja_command_(ninja_command), config_(config),
       start_time_millis_(GetTimeMillis()) {}
+  ~NinjaMain() { JoinLogPrefetch(); }
 
   /// Command line used to run Ninja.
   const char* ninja_command_;
@@ -117,6 +189,9 @@ struct NinjaMain : public BuildLogUser {
   BuildLog build_log_;
   DepsLog deps_log_;
 
+  /// Reads the logs while the manifest loads; see PrefetchLogs().
+  std::thread log_prefetch_;
+
   /// The type of functions that are the entry points to tools (subcommands).
   typedef int (NinjaMain::*ToolFunc)(const Options*, int, char**);
 
@@ -139,16 +214,27 @@ struct NinjaMain : public BuildLogUser {
   int ToolCommands(const Options* options, int argc, char* argv[]);
   int ToolInputs(const Options* options, int argc, char* argv[]);
   int ToolClean(const Options* options, int argc, char* argv[]);
+  int ToolCNobiGen(const Options* options, int argc, char* argv[]);
+  int ToolFingerprint(const Options* options, int argc, char* argv[]);
   int ToolCleanDead(const Options* options, int argc, char* argv[]);
   int ToolCompilationDatabase(const Options* options, int argc, char* argv[]);
   int ToolCompilationDatabaseForTargets(const Options* options, int argc,
                                         char* argv[]);
   int ToolRecompact(const Options* options, int argc, char* argv[]);
   int ToolRestat(const Options* options, int argc, char* argv[]);
+  int ToolBuildLog(const Options* options, int argc, char* argv[]);
   int ToolUrtle(const Options* options, int argc, char** argv);
   int ToolRules(const Options* options, int argc, char* argv[]);
   int ToolWinCodePage(const Options* options, int argc, char* argv[]);
 
+  /// Start reading the logs on another thread, from where they go if
+  /// \a input_file sets builddir as GuessBuildDir() expects.  OpenBuildLog()
+  /// and OpenDepsLog() use what it read if the guess was right.
+  void PrefetchLogs(const char* input_file);
+
+  /// Wait for PrefetchLogs() to finish.
+  void JoinLogPrefetch();
+
   /// Open the build log.
   /// @return false on error.
   bool OpenBuildLog(bool recompact_only = false);
@@ -157,15 +243,40 @@ struct NinjaMain : public BuildLogUser {
   /// @return false on error.
   bool OpenDepsLog(bool recompact_only = false);
 
+  /// Write out what is queued for the logs and close them, waiting for the
+  /// recompactions OpenBuildLog() and OpenDepsLog() may have started.
+  /// exit() skips the destructors that would otherwise do it, so every
+  /// exit() once the logs are opened goes through here.
+  void CloseLogs();
+
   /// Ensure the build directory exists, creating it if necessary.
   /// @return false on error.
   bool EnsureBuildDirExists();
 
-  /// Rebuild the manifest, if necessary.
+  /// Rebuild the manifest, if necessary.  For a cnobi manifest that is
+  /// not itself built, rebuild the text manifest it was generated from.
   /// Fills in \a err on error.
   /// @return true if the manifest was rebuilt.
   bool RebuildManifest(const char* input_file, string* err, Status* status);
 
+  /// Write the C source for \a state to \a output, in layout \a abi, and
+  /// manifest.h next to it.
+  /// @return false on error.
+  bool WriteCNobiManifest(const State& state, const string& output, int abi);
+
+  /// Regenerate \a input_file, a cnobi manifest, if the text manifest it
+  /// was generated from (see CNobi::SourceManifest()) is newer.
+  /// Fills in \a err on error.
+  /// @return false on error.
+  bool RegenerateCNobiManifest(const char* input_file,
+                               const ManifestParserOptions& options,
+                               string* err, Status* status);
+
+  /// Load \a path into \a state with the loader its name calls for:
+  /// CNobi for C sources, ManifestParser otherwise, never a snapshot.
+  bool LoadGraph(const string& path, const ManifestParserOptions& options,
+                 State* state, string* err);
+
   /// For each edge, lookup in build log how long it took last time,
   /// and record that in the edge itself. It will be used for ETA prediction.
   void ParsePreviousElapsedTimes();
@@ -181,6 +292,9 @@ struct NinjaMain : public BuildLogUser {
     Node* n = state_.LookupNode(s);
     if (n && n->in_edge())
       return false;
+    // The edge building it may just not be loaded.
+    if (state_.partial_)
+      return false;
     // Just checking n isn't enough: If an old output is both in the build log
     // and in the deps log, it will have a Node object in state_.  (It will also
     // have an in edge if one of its inputs is another output that's in the deps
@@ -278,6 +392,13 @@ bool NinjaMain::RebuildManifest(const char* input_file, string* err,
   uint64_t slash_bits;  // Unused because this path is only used for lookup.
   CanonicalizePath(&path, &slash_bits);
   Node* node = state_.LookupNode(path);
+  if (!node && ShouldUseCNobi(path)) {
+    // The generator edge writes the text manifest; the C is regenerated
+    // from it on the next cycle.
+    string source = CNobi::SourceManifest(path);
+    if (!source.empty())
+      node = state_.LookupNode(source);
+  }
   if (!node){
     // status->Info(path.c_str());
     return false;
@@ -365,7 +486,7 @@ Node* NinjaMain::CollectTarget(const char* cpath, string* err) {
     } else {
       Node* suggestion = state_.SpellcheckNode(path);
       if (suggestion) {
-        *err += ", did you mean '" + suggestion->path() + "'?";
+        *err += ", did you mean '" + suggestion->path().AsString() + "'?";
       }
     }
     return NULL;
@@ -421,7 +542,7 @@ int NinjaMain::ToolQuery(const Options* options, int argc, char* argv[]) {
       return 1;
     }
 
-    printf("%s:\n", node->path().c_str());
+    printf("%s:\n", node->path_c_str());
     if (Edge* edge = node->in_edge()) {
       if (edge->dyndep_ && edge->dyndep_->dyndep_pending()) {
         if (!dyndep_loader.LoadDyndeps(edge->dyndep_, &err)) {
@@ -435,13 +556,13 @@ int NinjaMain::ToolQuery(const Options* options, int argc, char* argv[]) {
           label = "| ";
         else if (edge->is_order_only(in))
           label = "|| ";
-        printf("    %s%s\n", label, edge->inputs_[in]->path().c_str());
+        printf("    %s%s\n", label, edge->inputs_[in]->path_c_str());
       }
       if (!edge->validations_.empty()) {
         printf("  validations:\n");
         for (std::vector<Node*>::iterator validation = edge->validations_.begin();
              validation != edge->validations_.end(); ++validation) {
-          printf("    %s\n", (*validation)->path().c_str());
+          printf("    %s\n", (*validation)->path_c_str());
         }
       }
     }
@@ -450,7 +571,7 @@ int NinjaMain::ToolQuery(const Options* options, int argc, char* argv[]) {
          edge != node->out_edges().end(); ++edge) {
       for (vector<Node*>::iterator out = (*edge)->outputs_.begin();
            out != (*edge)->outputs_.end(); ++out) {
-        printf("    %s\n", (*out)->path().c_str());
+        printf("    %s\n", (*out)->path_c_str());
       }
     }
     const std::vector<Edge*> validation_edges = node->validation_out_edges();
@@ -460,7 +581,7 @@ int NinjaMain::ToolQuery(const Options* options, int argc, char* argv[]) {
            edge != validation_edges.end(); ++edge) {
         for (vector<Node*>::iterator out = (*edge)->outputs_.begin();
              out != (*edge)->outputs_.end(); ++out) {
-          printf("    %s\n", (*out)->path().c_str());
+          printf("    %s\n", (*out)->path_c_str());
         }
       }
     }
@@ -497,7 +618,7 @@ int ToolTargetsList(const vector<Node*>& nodes, int depth, int indent) {
        ++n) {
     for (int i = 0; i < indent; ++i)
       printf("  ");
-    const char* target = (*n)->path().c_str();
+    const char* target = (*n)->path_c_str();
     if ((*n)->in_edge()) {
       printf("%s: %s\n", target, (*n)->in_edge()->rule_->name().c_str());
       if (depth > 1 || depth <= 0)
@@ -515,7 +636,7 @@ int ToolTargetsSourceList(State* state) {
     for (vector<Node*>::iterator inps = (*e)->inputs_.begin();
          inps != (*e)->inputs_.end(); ++inps) {
       if (!(*inps)->in_edge())
-        printf("%s\n", (*inps)->path().c_str());
+        printf("%s\n", (*inps)->path_c_str());
     }
   }
   return 0;
@@ -530,7 +651,7 @@ int ToolTargetsList(State* state, const string& rule_name) {
     if ((*e)->rule_->name() == rule_name) {
       for (vector<Node*>::iterator out_node = (*e)->outputs_.begin();
            out_node != (*e)->outputs_.end(); ++out_node) {
-        rules.insert((*out_node)->path());
+        rules.insert((*out_node)->path().AsString());
       }
     }
   }
@@ -550,7 +671,7 @@ int ToolTargetsList(State* state) {
     for (vector<Node*>::iterator out_node = (*e)->outputs_.begin();
          out_node != (*e)->outputs_.end(); ++out_node) {
       printf("%s: %s\n",
-             (*out_node)->path().c_str(),
+             (*out_node)->path_c_str(),
              (*e)->rule_->name().c_str());
     }
   }
@@ -558,10 +679,13 @@ int ToolTargetsList(State* state) {
 }
 
 int NinjaMain::ToolDeps(const Options* options, int argc, char** argv) {
+  // Creates the nodes of every path in the log, so that outputs the
+  // manifest no longer has can still be named.
+  const vector<Node*>& log_nodes = deps_log_.nodes();
   vector<Node*> nodes;
   if (argc == 0) {
-    for (vector<Node*>::const_iterator ni = deps_log_.nodes().begin();
-         ni != deps_log_.nodes().end(); ++ni) {
+    for (vector<Node*>::const_iterator ni = log_nodes.begin();
+         ni != log_nodes.end(); ++ni) {
       if (DepsLog::IsDepsEntryLiveFor(*ni))
         nodes.push_back(*ni);
     }
@@ -578,19 +702,19 @@ int NinjaMain::ToolDeps(const Options* options, int argc, char** argv) {
        it != end; ++it) {
     DepsLog::Deps* deps = deps_log_.GetDeps(*it);
     if (!deps) {
-      printf("%s: deps not found\n", (*it)->path().c_str());
+      printf("%s: deps not found\n", (*it)->path_c_str());
       continue;
     }
 
     string err;
-    TimeStamp mtime = disk_interface.Stat((*it)->path(), &err);
+    TimeStamp mtime = disk_interface.Stat((*it)->path().AsString(), &err);
     if (mtime == -1)
       Error("%s", err.c_str());  // Log and ignore Stat() errors;
     printf("%s: #deps %d, deps mtime %" PRId64 " (%s)\n",
-           (*it)->path().c_str(), deps->node_count, deps->mtime,
+           (*it)->path_c_str(), deps->node_count, deps->mtime,
            (!mtime || mtime > deps->mtime ? "STALE":"VALID"));
     for (int i = 0; i < deps->node_count; ++i)
-      printf("    %s\n", deps->nodes[i]->path().c_str());
+      printf("    %s\n", deps->nodes[i]->path_c_str());
     printf("\n");
   }
 
@@ -955,9 +1079,9 @@ void PrintOneCompdbObject(std::string const& directory, const Edge* const edge,
   printf("\",\n    \"command\": \"");
   PrintJSONString(EvaluateCommandWithRspfile(edge, eval_mode));
   printf("\",\n    \"file\": \"");
-  PrintJSONString(edge->inputs_[0]->path());
+  PrintJSONString(edge->inputs_[0]->path().AsString());
   printf("\",\n    \"output\": \"");
-  PrintJSONString(edge->outputs_[0]->path());
+  PrintJSONString(edge->outputs_[0]->path().AsString());
   printf("\"\n  }");
 }
 
@@ -1033,6 +1157,33 @@ int NinjaMain::ToolRecompact(const Options* options, int argc, char* argv[]) {
   return 0;
 }
 
+int NinjaMain::ToolBuildLog(const Options* options, int argc, char* argv[]) {
+  if (argc > 0) {
+    printf("usage: ninja -t buildlog\n");
+    return 1;
+  }
+
+  string log_path =
+      LogPath(state_.bindings_.LookupVariable("builddir"), ".ninja_log");
+  string err;
+  const LoadStatus status = build_log_.Load(log_path, &err);
+  if (status == LOAD_ERROR) {
+    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
+    return 1;
+  }
+  if (!err.empty()) {
+    // Hack: Load() can return a warning via err by returning LOAD_SUCCESS.
+    Warning("%s", err.c_str());
+    err.clear();
+  }
+
+  if (!build_log_.WriteText(stdout)) {
+    Error("writing build log: %s", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
 int NinjaMain::ToolRestat(const Options* options, int argc, char* argv[]) {
   // The restat tool uses getopt, and expects argv[0] to contain the name of the
   // tool, i.e. "restat"
@@ -1190,7 +1341,7 @@ int NinjaMain::ToolCompilationDatabaseForTargets(const Options* options,
         Fatal(
             "'%s' is not a target "
             "(i.e. it is not an output of any `build` statement)",
-            node->path().c_str());
+            node->path_c_str());
       }
       collector.CollectFrom(node);
     }
@@ -1203,6 +1354,187 @@ int NinjaMain::ToolCompilationDatabaseForTargets(const Options* options,
   return 0;
 }
 
+int NinjaMain::ToolCNobiGen(const Options* options, int argc, char* argv[]) {
+  // The cnobi-gen tool uses getopt, and expects argv[0] to contain the name of
+  // the tool, i.e. "cnobi-gen".
+  argc++;
+  argv--;
+
+  string output;
+  int abi = 2;
+
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("a:ho:"))) != -1) {
+    switch (opt) {
+    case 'a':
+      abi = atoi(optarg);
+      if (abi == 1 || abi == 2)
+        break;
+      Error("unknown layout version '%s'", optarg);
+      return 1;
+    case 'o':
+      output = optarg;
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t cnobi-gen [options]\n"
+             "\n"
+             "options:\n"
+             "  -a ABI   layout to write: 2 for relocation-free tables, "
+             "1 for the\n"
+             "           pointer-based structures [default=2]\n"
+             "  -o FILE  write the C manifest to FILE "
+             "[default=<manifest>_ninja.c]\n"
+             "  -h       print this message\n"
+             );
+      return 1;
+    }
+  }
+
+  if (output.empty())
+    output = CNobiGenerator::OutputPath(options->input_file);
+
+  return WriteCNobiManifest(state_, output, abi) ? 0 : 1;
+}
+
+bool NinjaMain::WriteCNobiManifest(const State& state, const string& output,
+                                   int abi) {
+  string contents;
+  CNobiGenerator generator(&state);
+  if (abi == 1)
+    generator.Generate(&contents);
+  else
+    generator.GenerateTables(&contents);
+
+  // The generated source includes the manifest.h sitting next to it.
+  string header = output;
+  string::size_type slash = header.find_last_of('/');
+  header.resize(slash == string::npos ? 0 : slash + 1);
+  header += "manifest.h";
+
+  return disk_interface_.WriteFile(output, contents) &&
+         disk_interface_.WriteFile(header, CNobiGenerator::ManifestHeader());
+}
+
+bool NinjaMain::RegenerateCNobiManifest(const char* input_file,
+                                        const ManifestParserOptions& options,
+                                        string* err, Status* status) {
+  string source = CNobi::SourceManifest(input_file);
+  if (source.empty())
+    return true;
+  TimeStamp source_mtime = disk_interface_.Stat(source, err);
+  if (source_mtime <= 0)
+    return source_mtime == 0;  // No text manifest: use the C as it is.
+  TimeStamp mtime = disk_interface_.Stat(input_file, err);
+  if (mtime < 0)
+    return false;
+  if (mtime >= source_mtime)
+    return true;
+
+  // Parse the text manifest once to write the C; the compiled manifest
+  // cache then rebuilds only the objects whose sources changed.
+  status->Info("regenerating %s from %s", input_file, source.c_str());
+  METRIC_RECORD(".ninja cnobi regeneration");
+  State state;
+  ManifestParser parser(&state, &disk_interface_, options);
+  if (!parser.Load(source, err))
+    return false;
+  if (!WriteCNobiManifest(state, input_file, 2)) {
+    *err = "writing " + string(input_file);
+    return false;
+  }
+  return true;
+}
+
+bool NinjaMain::LoadGraph(const string& path,
+                          const ManifestParserOptions& options, State* state,
+                          string* err) {
+  if (ShouldUseCNobi(path))
+    return CNobi(state, options).Load(path, err);
+  ManifestParser parser(state, &disk_interface_, options);
+  return parser.Load(path, err);
+}
+
+int NinjaMain::ToolFingerprint(const Options* options, int argc,
+                               char* argv[]) {
+  // The fingerprint tool uses getopt, and expects argv[0] to contain the
+  // name of the tool, i.e. "fingerprint".
+  argc++;
+  argv--;
+
+  size_t limit = 10;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hn:"))) != -1) {
+    switch (opt) {
+    case 'n':
+      limit = max(1, atoi(optarg));
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t fingerprint [options] [other-manifest]\n"
+"\n"
+"print the fingerprint of the graph of the input file, and compare it with\n"
+"the graph of other-manifest, loaded the other way, if given.  By default\n"
+"a C manifest is compared with the text manifest it was generated from,\n"
+"and a text manifest with its C manifest if there is one.\n"
+"\n"
+"options:\n"
+"  -n N     show up to N differing edges [default=10]\n");
+      return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
+  ManifestParserOptions parser_opts;
+  if (options->phony_cycle_should_err)
+    parser_opts.phony_cycle_action_ = kPhonyCycleActionError;
+
+  string input = options->input_file;
+  string other;
+  string err;
+  if (argc > 0) {
+    other = argv[0];
+  } else if (ShouldUseCNobi(input)) {
+    other = CNobi::SourceManifest(input);
+  } else {
+    string output = CNobiGenerator::OutputPath(input);
+    if (disk_interface_.Stat(output, &err) > 0)
+      other = output;
+  }
+
+  State first;
+  if (!LoadGraph(input, parser_opts, &first, &err)) {
+    Error("loading '%s': %s", input.c_str(), err.c_str());
+    return 1;
+  }
+  GraphFingerprint fingerprint = GraphFingerprint::Of(first);
+  printf("%s  %s\n", fingerprint.ToString().c_str(), input.c_str());
+  if (other.empty())
+    return 0;
+
+  State second;
+  if (!LoadGraph(other, parser_opts, &second, &err)) {
+    Error("loading '%s': %s", other.c_str(), err.c_str());
+    return 1;
+  }
+  GraphFingerprint other_fingerprint = GraphFingerprint::Of(second);
+  printf("%s  %s\n", other_fingerprint.ToString().c_str(), other.c_str());
+  if (fingerprint == other_fingerprint)
+    return 0;
+
+  vector<string> diffs;
+  GraphFingerprint::Diff(first, second, limit, &diffs);
+  printf("\nthe graphs differ; first graph: %s, second graph: %s\n",
+         input.c_str(), other.c_str());
+  for (vector<string>::const_iterator d = diffs.begin(); d != diffs.end();
+       ++d)
+    printf("\n%s", d->c_str());
+  return 1;
+}
+
 int NinjaMain::ToolUrtle(const Options* options, int argc, char** argv) {
   // RLE encoded.
   const char* urtle =
@@ -1241,6 +1573,10 @@ const Tool* ChooseTool(const string& tool_name) {
 #endif
     { "clean", "clean built files",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolClean },
+    { "cnobi-gen", "write the loaded manifest as C source for cnobi",
+      Tool::RUN_AFTER_LOAD, &NinjaMain::ToolCNobiGen },
+    { "fingerprint", "compare the graphs of a text and a C manifest",
+      Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolFingerprint },
     { "commands", "list all commands required to rebuild given targets",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolCommands },
     { "inputs", "list all inputs required to rebuild given targets",
@@ -1264,6 +1600,8 @@ const Tool* ChooseTool(const string& tool_name) {
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolRecompact },
     { "restat",  "restats all outputs in the build log",
       Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolRestat },
+    { "buildlog",  "print the build log in its old text format",
+      Tool::RUN_AFTER_LOAD, &NinjaMain::ToolBuildLog },
     { "rules",  "list all rules",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolRules },
     { "cleandead",  "clean built files that are no longer produced by the manifest",
@@ -1313,6 +1651,8 @@ bool DebugEnable(const string& name) {
 "  explain      explain what caused a command to execute\n"
 "  keepdepfile  don't delete depfiles after they're read by ninja\n"
 "  keeprsp      don't delete @response files on success\n"
+"  nograph      always parse the manifest, ignoring .ninja_graph\n"
+"  synclogs     sync the build and deps logs to disk as they are written\n"
 #ifdef _WIN32
 "  nostatcache  don't batch stat() calls per directory and cache them\n"
 #endif
@@ -1330,6 +1670,12 @@ bool DebugEnable(const string& name) {
   } else if (name == "keeprsp") {
     g_keep_rsp = true;
     return true;
+  } else if (name == "nograph") {
+    g_graph_snapshot = false;
+    return true;
+  } else if (name == "synclogs") {
+    g_sync_logs = true;
+    return true;
   } else if (name == "nostatcache") {
     g_experimental_statcache = false;
     return true;
@@ -1337,7 +1683,7 @@ bool DebugEnable(const string& name) {
     const char* suggestion =
         SpellcheckString(name.c_str(),
                          "stats", "explain", "keepdepfile", "keeprsp",
-                         "nostatcache", NULL);
+                         "nograph", "synclogs", "nostatcache", NULL);
     if (suggestion) {
       Error("unknown debug setting '%s', did you mean '%s'?",
             name.c_str(), suggestion);
@@ -1379,10 +1725,35 @@ bool WarningEnable(const string& name, Options* options) {
   }
 }
 
+void NinjaMain::PrefetchLogs(const char* input_file) {
+  // With one processor, reading the logs would only slow the manifest down.
+  if (GetProcessorCount() < 2)
+    return;
+  string manifest = input_file;
+  if (ShouldUseCNobi(manifest))
+    manifest = CNobi::SourceManifest(input_file);
+  string build_dir;
+  if (!GuessBuildDir(manifest, &build_dir))
+    return;
+  log_prefetch_ = std::thread([this, build_dir]() {
+    build_log_.Prefetch(LogPath(build_dir, ".ninja_log"));
+    deps_log_.Prefetch(LogPath(build_dir, ".ninja_deps"));
+  });
+}
+
+void NinjaMain::JoinLogPrefetch() {
+  if (log_prefetch_.joinable())
+    log_prefetch_.join();
+}
+
+void NinjaMain::CloseLogs() {
+  build_log_.Close();
+  deps_log_.Close();
+}
+
 bool NinjaMain::OpenBuildLog(bool recompact_only) {
-  string log_path = ".ninja_log";
-  if (!build_dir_.empty())
-    log_path = build_dir_ + "/" + log_path;
+  JoinLogPrefetch();
+  string log_path = LogPath(build_dir_, ".ninja_log");
 
   string err;
   const LoadStatus status = build_log_.Load(log_path, &err);
@@ -1419,9 +1790,8 @@ bool NinjaMain::OpenBuildLog(bool recompact_only) {
 /// Open the deps log: load it, then open for writing.
 /// @return false on error.
 bool NinjaMain::OpenDepsLog(bool recompact_only) {
-  string path = ".ninja_deps";
-  if (!build_dir_.empty())
-    path = build_dir_ + "/" + path;
+  JoinLogPrefetch();
+  string path = LogPath(build_dir_, ".ninja_deps");
 
   string err;
   const LoadStatus status = deps_log_.Load(path, &state_, &err);
@@ -1463,6 +1833,14 @@ void NinjaMain::DumpMetrics() {
   int buckets = (int)state_.paths_.bucket_count();
   printf("path->node hash load %.2f (%d entries / %d buckets)\n",
          count / (double) buckets, count, buckets);
+
+  Arena::Stats arenas = Arena::Totals();
+  if (arenas.arenas) {
+    printf("load arenas: %d objects in %.1f KiB used of %.1f KiB "
+           "(%d blocks, %d arenas)\n",
+           (int)arenas.objects, arenas.used / 1024.0,
+           arenas.reserved / 1024.0, (int)arenas.blocks, (int)arenas.arenas);
+  }
 }
 
 bool NinjaMain::EnsureBuildDirExists() {
@@ -1704,62 +2082,111 @@ NORETURN void real_main(int argc, char** argv) {
       parser_opts.phony_cycle_action_ = kPhonyCycleActionError;
     }
 
+    // The logs are opened once the manifest has loaded, but need not wait
+    // for it to be read.
+    if (!options.tool || options.tool->when == Tool::RUN_AFTER_LOGS)
+      ninja.PrefetchLogs(options.input_file);
+
     string err;
     bool load_success;
     status->Info("Input file: %s", options.input_file);
     if (ShouldUseCNobi(options.input_file)) {
+      if (!ninja.RegenerateCNobiManifest(options.input_file, parser_opts,
+                                         &err, status)) {
+        status->Error("regenerating '%s': %s", options.input_file,
+                      err.c_str());
+        ninja.JoinLogPrefetch();
+        exit(1);
+      }
       status->Info("Using CNobi for %s", options.input_file);
-      auto load_start_time = chrono::high_resolution_clock::now();
+      // Timed as ".ninja cnobi load" by -d stats; see cnobi_perftest.
       CNobi cnobi(&ninja.state_, parser_opts);
+      vector<string> targets;
+      if (!options.tool && CanonicalTargets(argc, argv, &targets))
+        cnobi.set_targets(targets);
       load_success = cnobi.Load(options.input_file, &err, nullptr);
-      auto load_end_time = chrono::high_resolution_clock::now();
-      auto load_duration = chrono::duration_cast<chrono::microseconds>(load_end_time - load_start_time).count();
-      fprintf(stderr, "Debug: CNobi Load duration: %ld us\n", load_duration);
     } else {
-      status->Info("Using ManifestParser for %s", options.input_file);
-      auto load_start_time = chrono::high_resolution_clock::now();
-      ManifestParser parser(&ninja.state_, &ninja.disk_interface_, parser_opts);
-      load_success = parser.Load(options.input_file, &err);
-      auto load_end_time = chrono::high_resolution_clock::now();
-      auto load_duration = chrono::duration_cast<chrono::microseconds>(load_end_time - load_start_time).count();
-      fprintf(stderr, "Debug: ManifestParser Load duration: %ld us\n", load_duration);
+      GraphSnapshot::LoadStatus snapshot = GraphSnapshot::STALE;
+      if (g_graph_snapshot) {
+        vector<string> targets;
+        bool lazy = !options.tool && CanonicalTargets(argc, argv, &targets);
+        snapshot = GraphSnapshot::Load(kGraphSnapshotPath, options.input_file,
+                                       parser_opts, lazy ? &targets : NULL,
+                                       &ninja.state_, &err);
+      }
+      if (snapshot == GraphSnapshot::FAILED) {
+        // The State holds part of the snapshot; start over without it.
+        status->Warning("%s: %s; parsing instead", kGraphSnapshotPath,
+                        err.c_str());
+        unlink(kGraphSnapshotPath);
+        continue;
+      }
+      if (snapshot == GraphSnapshot::LOADED) {
+        status->Info("Using %s for %s", kGraphSnapshotPath,
+                     options.input_file);
+        load_success = true;
+      } else {
+        status->Info("Using ManifestParser for %s", options.input_file);
+        GraphSnapshot::RecordingFileReader reader(&ninja.disk_interface_);
+        ManifestParser parser(&ninja.state_, &reader, parser_opts);
+        load_success = parser.Load(options.input_file, &err);
+        // Tools only look at the graph; leave the snapshot to builds.
+        if (load_success && g_graph_snapshot && !options.tool &&
+            !GraphSnapshot::Write(kGraphSnapshotPath, options.input_file,
+                                  parser_opts, reader.files(), ninja.state_,
+                                  &err)) {
+          // Only the next run is slower.
+          status->Warning("%s", err.c_str());
+          err.clear();
+        }
+      }
     }
 
-    fprintf(stderr, "Debug: Load success: %d\n", load_success);
-
     if (!load_success) {
       status->Error("%s", err.c_str());
+      ninja.JoinLogPrefetch();
       exit(1);
     }
 
     if (options.tool && options.tool->when == Tool::RUN_AFTER_LOAD)
       exit((ninja.*options.tool->func)(&options, argc, argv));
 
-    if (!ninja.EnsureBuildDirExists())
+    if (!ninja.EnsureBuildDirExists()) {
+      ninja.JoinLogPrefetch();
       exit(1);
+    }
 
-    if (!ninja.OpenBuildLog() || !ninja.OpenDepsLog())
+    if (!ninja.OpenBuildLog() || !ninja.OpenDepsLog()) {
+      ninja.CloseLogs();
       exit(1);
+    }
 
-    if (options.tool && options.tool->when == Tool::RUN_AFTER_LOGS)
-      exit((ninja.*options.tool->func)(&options, argc, argv));
+    if (options.tool && options.tool->when == Tool::RUN_AFTER_LOGS) {
+      int result = (ninja.*options.tool->func)(&options, argc, argv);
+      ninja.CloseLogs();
+      exit(result);
+    }
 
     // Attempt to rebuild the manifest before building anything else
     if (ninja.RebuildManifest(options.input_file, &err, status)) {
       // In dry_run mode the regeneration will succeed without changing the
       // manifest forever. Better to return immediately.
-      if (config.dry_run)
+      if (config.dry_run) {
+        ninja.CloseLogs();
         exit(0);
+      }
       // Start the build over with the new manifest.
       continue;
     } else if (!err.empty()) {
       status->Error("rebuilding '%s': %s", options.input_file, err.c_str());
+      ninja.CloseLogs();
       exit(1);
     }
 
     ninja.ParsePreviousElapsedTimes();
 
     int result = ninja.RunBuild(argc, argv, status);
+    ninja.CloseLogs();
     if (g_metrics)
       ninja.DumpMetrics();
     exit(result);
@@ -24,9 +24,9 @@ bool Parser::Load(const string& filename, string* err, Lexer* parent) {
   // Parser::Load() in our call stack. Do not start a new one here to avoid
   // over-counting parsing times.
   METRIC_RECORD_IF(".ninja parse", parent == NULL);
-  string contents;
+  FileContents contents;
   string read_err;
-  if (file_reader_->ReadFile(filename, &contents, &read_err) !=
+  if (file_reader_->MapFile(filename, &contents, &read_err) !=
       FileReader::Okay) {
     *err = "loading '" + filename + "': " + read_err;
     if (parent)
@@ -34,7 +34,7 @@ bool Parser::Load(const string& filename, string* err, Lexer* parent) {
     return false;
   }
 
-  return Parse(filename, contents, err);
+  return Parse(filename, contents.AsStringPiece(), err);
 }
 
 bool Parser::ExpectToken(Lexer::Token expected, string* err) {
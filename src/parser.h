@@ -26,6 +26,7 @@ struct State;
 struct Parser {
   Parser(State* state, FileReader* file_reader)
       : state_(state), file_reader_(file_reader) {}
+  virtual ~Parser() {}
 
   /// Load and parse a file.
   bool Load(const std::string& filename, std::string* err, Lexer* parent = NULL);
@@ -40,8 +41,8 @@ protected:
   Lexer lexer_;
 
 private:
-  /// Parse a file, given its contents as a string.
-  virtual bool Parse(const std::string& filename, const std::string& input,
+  /// Parse a file, given its contents, which are followed by a NUL.
+  virtual bool Parse(const std::string& filename, StringPiece input,
                      std::string* err) = 0;
 };
 
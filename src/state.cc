@@ -65,12 +65,23 @@ Pool State::kDefaultPool("", 0);
 Pool State::kConsolePool("console", 1);
 const Rule State::kPhonyRule("phony");
 
-State::State() {
+State::State() : partial_(false) {
   bindings_.AddRule(&kPhonyRule);
   AddPool(&kDefaultPool);
   AddPool(&kConsolePool);
 }
 
+State::~State() {
+  // Nodes and edges are leaked, like the rest of the graph; the images they
+  // point into are not, as they may be large mappings.
+  for (vector<Image*>::iterator i = images_.begin(); i != images_.end(); ++i)
+    delete *i;
+}
+
+void State::AddImage(Image* image) {
+  images_.push_back(image);
+}
+
 void State::AddPool(Pool* pool) {
   assert(LookupPool(pool->name()) == NULL);
   pools_[pool->name()] = pool;
@@ -102,6 +113,15 @@ Node* State::GetNode(StringPiece path, uint64_t slash_bits) {
   return node;
 }
 
+Node* State::GetNodeInImage(StringPiece path, uint64_t slash_bits) {
+  Node* node = LookupNode(path);
+  if (node)
+    return node;
+  node = new Node(path, slash_bits, Node::BorrowPath());
+  paths_[node->path()] = node;
+  return node;
+}
+
 Node* State::LookupNode(StringPiece path) const {
   Paths::const_iterator i = paths_.find(path);
   if (i != paths_.end())
@@ -127,7 +147,10 @@ Node* State::SpellcheckNode(const string& path) {
 }
 
 void State::AddIn(Edge* edge, StringPiece path, uint64_t slash_bits) {
-  Node* node = GetNode(path, slash_bits);
+  AddIn(edge, GetNode(path, slash_bits));
+}
+
+void State::AddIn(Edge* edge, Node* node) {
   node->set_generated_by_dep_loader(false);
   edge->inputs_.push_back(node);
   node->AddOutEdge(edge);
@@ -135,12 +158,16 @@ void State::AddIn(Edge* edge, StringPiece path, uint64_t slash_bits) {
 
 bool State::AddOut(Edge* edge, StringPiece path, uint64_t slash_bits,
                    std::string* err) {
-  Node* node = GetNode(path, slash_bits);
+  return AddOut(edge, GetNode(path, slash_bits), err);
+}
+
+bool State::AddOut(Edge* edge, Node* node, std::string* err) {
   if (Edge* other = node->in_edge()) {
     if (other == edge) {
-      *err = path.AsString() + " is defined as an output multiple times";
+      *err = node->path().AsString() +
+             " is defined as an output multiple times";
     } else {
-      *err = "multiple rules generate " + path.AsString();
+      *err = "multiple rules generate " + node->path().AsString();
     }
     return false;
   }
@@ -151,7 +178,10 @@ bool State::AddOut(Edge* edge, StringPiece path, uint64_t slash_bits,
 }
 
 void State::AddValidation(Edge* edge, StringPiece path, uint64_t slash_bits) {
-  Node* node = GetNode(path, slash_bits);
+  AddValidation(edge, GetNode(path, slash_bits));
+}
+
+void State::AddValidation(Edge* edge, Node* node) {
   edge->validations_.push_back(node);
   node->AddValidationOutEdge(edge);
   node->set_generated_by_dep_loader(false);
@@ -203,7 +233,7 @@ void State::Dump() {
   for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i) {
     Node* node = i->second;
     printf("%s %s [id:%d]\n",
-           node->path().c_str(),
+           node->path_c_str(),
            node->status_known() ? (node->dirty() ? "dirty" : "clean")
                                 : "unknown",
            node->id());
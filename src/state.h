@@ -98,6 +98,14 @@ struct State {
   static const Rule kPhonyRule;
 
   State();
+  ~State();
+
+  /// Memory that outlives every node, such as a mapped manifest whose
+  /// strings nodes use as their paths.  Released with the State.
+  struct Image {
+    virtual ~Image() {}
+  };
+  void AddImage(Image* image);
 
   void AddPool(Pool* pool);
   Pool* LookupPool(const std::string& pool_name);
@@ -105,6 +113,9 @@ struct State {
   Edge* AddEdge(const Rule* rule);
 
   Node* GetNode(StringPiece path, uint64_t slash_bits);
+  /// Like GetNode(), but a new node refers to \a path instead of copying
+  /// it, so \a path must live as long as the State, e.g. in an Image.
+  Node* GetNodeInImage(StringPiece path, uint64_t slash_bits);
   Node* LookupNode(StringPiece path) const;
   Node* SpellcheckNode(const std::string& path);
 
@@ -114,6 +125,10 @@ struct State {
   void AddIn(Edge* edge, StringPiece path, uint64_t slash_bits);
   bool AddOut(Edge* edge, StringPiece path, uint64_t slash_bits, std::string* err);
   void AddValidation(Edge* edge, StringPiece path, uint64_t slash_bits);
+  /// Variants for loaders that have already looked the nodes up.
+  void AddIn(Edge* edge, Node* node);
+  bool AddOut(Edge* edge, Node* node, std::string* err);
+  void AddValidation(Edge* edge, Node* node);
   bool AddDefault(StringPiece path, std::string* error);
 
   /// Reset state.  Keeps all nodes and edges, but restores them to the
@@ -140,6 +155,17 @@ struct State {
 
   BindingEnv bindings_;
   std::vector<Node*> defaults_;
+
+  /// Set by loaders that added only the edges some targets need (see
+  /// CNobi::set_targets()).  Outputs of the others then have no in-edge,
+  /// or no node at all, so nothing can be told about them.
+  bool partial_;
+
+ private:
+  std::vector<Image*> images_;
+
+  State(const State&);
+  void operator=(const State&);
 };
 
 #endif  // NINJA_STATE_H_
@@ -45,4 +45,54 @@ TEST(State, Basic) {
   EXPECT_FALSE(state.GetNode("out", 0)->dirty());
 }
 
+TEST(State, AddByNode) {
+  State state;
+  Rule* rule = new Rule("cat");
+  state.bindings_.AddRule(rule);
+
+  Node* in = state.GetNode("in", 0);
+  Node* out = state.GetNode("out", 0);
+  Edge* edge = state.AddEdge(rule);
+  state.AddIn(edge, in);
+  string err;
+  EXPECT_TRUE(state.AddOut(edge, out, &err));
+  state.AddValidation(edge, in);
+
+  ASSERT_EQ(1u, in->out_edges().size());
+  EXPECT_EQ(edge, in->out_edges()[0]);
+  EXPECT_EQ(edge, out->in_edge());
+  ASSERT_EQ(1u, in->validation_out_edges().size());
+
+  EXPECT_FALSE(state.AddOut(state.AddEdge(rule), out, &err));
+  EXPECT_EQ("multiple rules generate out", err);
+}
+
+TEST(State, NodeInImage) {
+  struct Strings : public State::Image {
+    Strings(bool* released) : released_(released) {}
+    ~Strings() { *released_ = true; }
+    char paths_[8] = "in\0out";
+    bool* released_;
+  };
+  bool released = false;
+  {
+    State state;
+    Strings* image = new Strings(&released);
+    state.AddImage(image);
+
+    Node* in = state.GetNodeInImage(image->paths_, 0);
+    EXPECT_EQ("in", in->path());
+    EXPECT_EQ(image->paths_, in->path_c_str());
+    EXPECT_EQ(in, state.LookupNode("in"));
+    EXPECT_EQ(in, state.GetNode("in", 0));
+
+    // A node created before keeps its own copy.
+    Node* out = state.GetNode("out", 0);
+    EXPECT_EQ(out, state.GetNodeInImage(image->paths_ + 3, 0));
+    EXPECT_NE(image->paths_ + 3, out->path_c_str());
+    EXPECT_FALSE(released);
+  }
+  EXPECT_TRUE(released);
+}
+
 }  // namespace
@@ -33,14 +33,6 @@ struct StringPiece {
 
   StringPiece(const char* str, size_t len) : str_(str), len_(len) {}
 
-  bool operator==(const StringPiece& other) const {
-    return len_ == other.len_ && memcmp(str_, other.str_, len_) == 0;
-  }
-
-  bool operator!=(const StringPiece& other) const {
-    return !(*this == other);
-  }
-
   /// Convert the slice into a full-fledged std::string, copying the
   /// data into a new string.
   std::string AsString() const {
@@ -67,4 +59,19 @@ struct StringPiece {
   size_t len_;
 };
 
+/// Comparisons are free functions so that either side may be a std::string
+/// or a C string.
+inline bool operator==(StringPiece a, StringPiece b) {
+  return a.len_ == b.len_ && memcmp(a.str_, b.str_, a.len_) == 0;
+}
+
+inline bool operator!=(StringPiece a, StringPiece b) {
+  return !(a == b);
+}
+
+inline bool operator<(StringPiece a, StringPiece b) {
+  int cmp = memcmp(a.str_, b.str_, a.len_ < b.len_ ? a.len_ : b.len_);
+  return cmp < 0 || (cmp == 0 && a.len_ < b.len_);
+}
+
 #endif  // NINJA_STRINGPIECE_H_
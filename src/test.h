@@ -16,6 +16,7 @@
 #define NINJA_TEST_H_
 
 #include <gtest/gtest.h>
+#include <mutex>
 
 #include "disk_interface.h"
 #include "manifest_parser.h"
@@ -76,6 +77,8 @@ struct VirtualFileSystem : public DiskInterface {
   };
 
   std::vector<std::string> directories_made_;
+  /// In the order read.  ManifestParser reads subninjas concurrently, so
+  /// reads are serialized by read_mutex_.
   std::vector<std::string> files_read_;
   typedef std::map<std::string, Entry> FileMap;
   FileMap files_;
@@ -84,6 +87,8 @@ struct VirtualFileSystem : public DiskInterface {
 
   /// A simple fake timestamp for file operations.
   int now_;
+
+  std::mutex read_mutex_;
 };
 
 struct ScopedTempDir {
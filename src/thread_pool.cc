@@ -0,0 +1,64 @@
+#include "thread_pool.h"
+
+#include <chrono>
+
+#include "util.h"
+
+using namespace std;
+
+void WaitFor(condition_variable* cond, unique_lock<mutex>* lock) {
+  cond->wait_until(*lock, chrono::steady_clock::now() + chrono::hours(1));
+}
+
+ThreadPool::ThreadPool(int num_threads) : pending_(0), stopping_(false) {
+  if (num_threads <= 0)
+    num_threads = GetProcessorCount();
+  if (num_threads <= 0)
+    num_threads = 1;
+  threads_.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i)
+    threads_.push_back(thread(&ThreadPool::Work, this));
+}
+
+ThreadPool::~ThreadPool() {
+  Wait();
+  {
+    lock_guard<mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_ready_.notify_all();
+  for (vector<thread>::iterator i = threads_.begin(); i != threads_.end(); ++i)
+    i->join();
+}
+
+void ThreadPool::Add(function<void()> task) {
+  {
+    lock_guard<mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+    ++pending_;
+  }
+  work_ready_.notify_one();
+}
+
+void ThreadPool::Wait() {
+  unique_lock<mutex> lock(mutex_);
+  while (pending_ > 0)
+    WaitFor(&all_done_, &lock);
+}
+
+void ThreadPool::Work() {
+  unique_lock<mutex> lock(mutex_);
+  for (;;) {
+    while (tasks_.empty() && !stopping_)
+      WaitFor(&work_ready_, &lock);
+    if (tasks_.empty())
+      return;
+    function<void()> task = std::move(tasks_.front());
+    tasks_.pop_front();
+    lock.unlock();
+    task();
+    lock.lock();
+    if (--pending_ == 0)
+      all_done_.notify_all();
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef NINJA_THREAD_POOL_H_
+#define NINJA_THREAD_POOL_H_
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Block on \a cond until notified (or spuriously woken).  This goes through
+/// wait_until() rather than wait(), since libstdc++ 12 re-versioned the
+/// latter and binaries using it no longer run against older runtimes.
+void WaitFor(std::condition_variable* cond, std::unique_lock<std::mutex>* lock);
+
+/// Runs tasks on a fixed set of worker threads.  Tasks may queue further
+/// tasks; Wait() returns once every queued task has run.
+struct ThreadPool {
+  /// Start \a num_threads workers, or one per processor if it is not
+  /// positive.
+  explicit ThreadPool(int num_threads = 0);
+  /// Runs the remaining tasks, then stops the workers.
+  ~ThreadPool();
+
+  /// Queue \a task to run on a worker thread.
+  void Add(std::function<void()> task);
+
+  /// Wait until every queued task, including those queued meanwhile, has
+  /// finished.
+  void Wait();
+
+ private:
+  void Work();
+
+  std::mutex mutex_;
+  /// Signalled when a task is queued or the pool is stopping.
+  std::condition_variable work_ready_;
+  /// Signalled when the last pending task finishes.
+  std::condition_variable all_done_;
+  std::deque<std::function<void()> > tasks_;
+  /// Tasks queued or running.
+  size_t pending_;
+  bool stopping_;
+  std::vector<std::thread> threads_;
+};
+
+#endif  // NINJA_THREAD_POOL_H_
@@ -0,0 +1,39 @@
+#include "thread_pool.h"
+
+#include <atomic>
+
+#include "test.h"
+
+TEST(ThreadPool, RunsAllTasks) {
+  std::atomic<int> sum(0);
+  ThreadPool pool(4);
+  for (int i = 1; i <= 100; ++i)
+    pool.Add([&sum, i]() { sum += i; });
+  pool.Wait();
+  EXPECT_EQ(5050, sum);
+}
+
+TEST(ThreadPool, TasksMayAddTasks) {
+  std::atomic<int> count(0);
+  ThreadPool pool(2);
+  std::function<void(int)> spawn = [&](int depth) {
+    ++count;
+    if (depth > 0) {
+      pool.Add([&spawn, depth]() { spawn(depth - 1); });
+      pool.Add([&spawn, depth]() { spawn(depth - 1); });
+    }
+  };
+  pool.Add([&spawn]() { spawn(5); });
+  pool.Wait();
+  EXPECT_EQ(63, count);
+}
+
+TEST(ThreadPool, DestructorWaits) {
+  std::atomic<int> count(0);
+  {
+    ThreadPool pool(3);
+    for (int i = 0; i < 10; ++i)
+      pool.Add([&count]() { ++count; });
+  }
+  EXPECT_EQ(10, count);
+}